@@ -171,21 +171,18 @@ void LSDBasin::create(int JunctionNumber, LSDFlowInfo& FlowInfo, LSDJunctionNetw
 // Calculate mean basin value.
 // SWDG 12/12/13
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-float LSDBasin::CalculateBasinMean(LSDFlowInfo& FlowInfo, LSDRaster Data){
+float LSDBasin::CalculateBasinMean(LSDFlowInfo& FlowInfo, LSDRaster& Data){
 
-  int i;
-  int j;
   float TotalData = 0;
   int CountNDV = 0;
   float BasinAverage;
 
-  for (int q = 0; q < int(BasinNodes.size()); ++q){
-    
-    FlowInfo.retrieve_current_row_and_col(BasinNodes[q], i, j);
+  vector<float> BasinData = FlowInfo.get_raster_values_for_nodes(Data, BasinNodes);
+  for (int q = 0; q < int(BasinData.size()); ++q){
     
     //exclude NDV from average
-    if (Data.get_data_element(i,j) != NoDataValue){
-      TotalData += Data.get_data_element(i,j);
+    if (BasinData[q] != NoDataValue){
+      TotalData += BasinData[q];
     }
     else {
       ++CountNDV;
@@ -202,19 +199,17 @@ float LSDBasin::CalculateBasinMean(LSDFlowInfo& FlowInfo, LSDRaster Data){
 // Calculate max basin value.
 // SWDG 12/12/13
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-float LSDBasin::CalculateBasinMax(LSDFlowInfo& FlowInfo, LSDRaster Data){
+float LSDBasin::CalculateBasinMax(LSDFlowInfo& FlowInfo, LSDRaster& Data){
 
   //could use max_element here? how would that cope with NDVs??
 
-  int i;
-  int j;
   float MaxData = -10000000;   //a very small number
   float CurrentData;
 
-  for (int q = 0; q < int(BasinNodes.size()); ++q){
+  vector<float> BasinData = FlowInfo.get_raster_values_for_nodes(Data, BasinNodes);
+  for (int q = 0; q < int(BasinData.size()); ++q){
     
-    FlowInfo.retrieve_current_row_and_col(BasinNodes[q], i, j);
-    CurrentData = Data.get_data_element(i,j);
+    CurrentData = BasinData[q];
     
     //exclude NDV
     if (CurrentData != NoDataValue && CurrentData > MaxData){
@@ -229,17 +224,15 @@ float LSDBasin::CalculateBasinMax(LSDFlowInfo& FlowInfo, LSDRaster Data){
 // Calculate min basin value.
 // SWDG 17/2/14
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-float LSDBasin::CalculateBasinMin(LSDFlowInfo& FlowInfo, LSDRaster Data){
+float LSDBasin::CalculateBasinMin(LSDFlowInfo& FlowInfo, LSDRaster& Data){
 
-  int i;
-  int j;
   float MinData = 100000000; // a large number
   float CurrentData;
 
-  for (int q = 0; q < int(BasinNodes.size()); ++q){
+  vector<float> BasinData = FlowInfo.get_raster_values_for_nodes(Data, BasinNodes);
+  for (int q = 0; q < int(BasinData.size()); ++q){
     
-    FlowInfo.retrieve_current_row_and_col(BasinNodes[q], i, j);
-    CurrentData = Data.get_data_element(i,j);
+    CurrentData = BasinData[q];
     
     //exclude NDV
     if (CurrentData != NoDataValue && CurrentData < MinData){
@@ -254,21 +247,19 @@ float LSDBasin::CalculateBasinMin(LSDFlowInfo& FlowInfo, LSDRaster Data){
 // Calculate median basin value.
 // SWDG 17/2/14
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-float LSDBasin::CalculateBasinMedian(LSDFlowInfo& FlowInfo, LSDRaster Data){
+float LSDBasin::CalculateBasinMedian(LSDFlowInfo& FlowInfo, LSDRaster& Data){
 
-  int i;
-  int j;
   vector<float> UnsortedData;
   vector<float> SortedData;
   vector<size_t> index_map;
   float Median;
 
-  for (int q = 0; q < int(BasinNodes.size()); ++q){
+  vector<float> BasinData = FlowInfo.get_raster_values_for_nodes(Data, BasinNodes);
+  for (int q = 0; q < int(BasinData.size()); ++q){
     
-    FlowInfo.retrieve_current_row_and_col(BasinNodes[q], i, j);
     //exclude NDV
-    if (Data.get_data_element(i,j) != NoDataValue){
-      UnsortedData.push_back(Data.get_data_element(i,j));     
+    if (BasinData[q] != NoDataValue){
+      UnsortedData.push_back(BasinData[q]);     
     }
   }
   
@@ -292,23 +283,21 @@ float LSDBasin::CalculateBasinMedian(LSDFlowInfo& FlowInfo, LSDRaster Data){
 // Calculate percentile basin value.
 // MDH 5/2/17
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-float LSDBasin::CalculateBasinPercentile(LSDFlowInfo& FlowInfo, LSDRaster Data, int Percentile) 
+float LSDBasin::CalculateBasinPercentile(LSDFlowInfo& FlowInfo, LSDRaster& Data, int Percentile) 
 {
 
-	int i;
-	int j;
 	vector<float> UnsortedData;
 	vector<float> SortedData;
 	vector<size_t> index_map;
 	float P, PercentileValue, Residual;
 
-	for (int q = 0; q < int(BasinNodes.size()); ++q)
+	vector<float> BasinData = FlowInfo.get_raster_values_for_nodes(Data, BasinNodes);
+	for (int q = 0; q < int(BasinData.size()); ++q)
 	{
-		FlowInfo.retrieve_current_row_and_col(BasinNodes[q], i, j);
 		//exclude NDV
-		if (Data.get_data_element(i,j) != NoDataValue)
+		if (BasinData[q] != NoDataValue)
 		{
-			UnsortedData.push_back(Data.get_data_element(i,j));     
+			UnsortedData.push_back(BasinData[q]);     
 		}
 	}
   
@@ -340,18 +329,16 @@ float LSDBasin::CalculateBasinPercentile(LSDFlowInfo& FlowInfo, LSDRaster Data,
 // Calculate Standard devaition of the basin values.
 // SWDG 17/2/14
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-float LSDBasin::CalculateBasinStdDev(LSDFlowInfo& FlowInfo, LSDRaster Data){
+float LSDBasin::CalculateBasinStdDev(LSDFlowInfo& FlowInfo, LSDRaster& Data){
 
-  int i;
-  int j;
   vector<float> DataValues;
 
-  for (int q = 0; q < int(BasinNodes.size()); ++q){
+  vector<float> BasinData = FlowInfo.get_raster_values_for_nodes(Data, BasinNodes);
+  for (int q = 0; q < int(BasinData.size()); ++q){
     
-    FlowInfo.retrieve_current_row_and_col(BasinNodes[q], i, j);
     //exclude NDV
-    if (Data.get_data_element(i,j) != NoDataValue){
-      DataValues.push_back(Data.get_data_element(i,j));     
+    if (BasinData[q] != NoDataValue){
+      DataValues.push_back(BasinData[q]);     
     }
   }
   
@@ -365,18 +352,16 @@ float LSDBasin::CalculateBasinStdDev(LSDFlowInfo& FlowInfo, LSDRaster Data){
 // Calculate Standard Error of the basin values.
 // SWDG 17/2/14
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-float LSDBasin::CalculateBasinStdError(LSDFlowInfo& FlowInfo, LSDRaster Data){
+float LSDBasin::CalculateBasinStdError(LSDFlowInfo& FlowInfo, LSDRaster& Data){
 
-  int i;
-  int j;
   vector<float> DataValues;
 
-  for (int q = 0; q < int(BasinNodes.size()); ++q){
+  vector<float> BasinData = FlowInfo.get_raster_values_for_nodes(Data, BasinNodes);
+  for (int q = 0; q < int(BasinData.size()); ++q){
     
-    FlowInfo.retrieve_current_row_and_col(BasinNodes[q], i, j);
     //exclude NDV
-    if (Data.get_data_element(i,j) != NoDataValue){
-      DataValues.push_back(Data.get_data_element(i,j));     
+    if (BasinData[q] != NoDataValue){
+      DataValues.push_back(BasinData[q]);     
     }
   }
   
@@ -391,18 +376,16 @@ float LSDBasin::CalculateBasinStdError(LSDFlowInfo& FlowInfo, LSDRaster Data){
 // Calculate basin range.
 // SWDG 17/2/14
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-float LSDBasin::CalculateBasinRange(LSDFlowInfo& FlowInfo, LSDRaster Data){
+float LSDBasin::CalculateBasinRange(LSDFlowInfo& FlowInfo, LSDRaster& Data){
 
-  int i;
-  int j;
   float MinData = 100000000; // a large number
   float MaxData = -100000000; // a small number
   float CurrentData;
 
-  for (int q = 0; q < int(BasinNodes.size()); ++q){
+  vector<float> BasinData = FlowInfo.get_raster_values_for_nodes(Data, BasinNodes);
+  for (int q = 0; q < int(BasinData.size()); ++q){
     
-    FlowInfo.retrieve_current_row_and_col(BasinNodes[q], i, j);
-    CurrentData = Data.get_data_element(i,j);
+    CurrentData = BasinData[q];
     
     //exclude NDV
     if (CurrentData != NoDataValue && CurrentData < MinData){
@@ -420,18 +403,15 @@ float LSDBasin::CalculateBasinRange(LSDFlowInfo& FlowInfo, LSDRaster Data){
 // Calculate basin range.
 // SWDG 17/2/14
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-int LSDBasin::CalculateNumDataPoints(LSDFlowInfo& FlowInfo, LSDRaster Data){
+int LSDBasin::CalculateNumDataPoints(LSDFlowInfo& FlowInfo, LSDRaster& Data){
 
-  int i;
-  int j;
   int count = 0;
   
-  for (int q = 0; q < int(BasinNodes.size()); ++q){
-    
-    FlowInfo.retrieve_current_row_and_col(BasinNodes[q], i, j);
+  vector<float> BasinData = FlowInfo.get_raster_values_for_nodes(Data, BasinNodes);
+  for (int q = 0; q < int(BasinData.size()); ++q){
         
     //exclude NDV
-    if (Data.get_data_element(i,j) != NoDataValue){
+    if (BasinData[q] != NoDataValue){
       ++count;     
     }
   }
@@ -629,23 +609,20 @@ void LSDBasin::Plot_Boomerang(LSDRaster& Slope, LSDRaster& DinfArea, LSDFlowInfo
 // Bug fixed in the average calculation when values wrapped around 0
 // SWDG 17/2/14
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-void LSDBasin::set_AspectMean(LSDFlowInfo& FlowInfo, LSDRaster Aspect){
+void LSDBasin::set_AspectMean(LSDFlowInfo& FlowInfo, LSDRaster& Aspect){
 
-  int i;
-  int j;
   float avg_r;
   float angle_r;
   float x_component = 0.0;
   float y_component = 0.0;
   int ndv_cell_count = 0;  
 
-  for (int q = 0; q < int(BasinNodes.size()); ++q){
-    
-    FlowInfo.retrieve_current_row_and_col(BasinNodes[q], i, j);
+  vector<float> BasinAspect = FlowInfo.get_raster_values_for_nodes(Aspect, BasinNodes);
+  for (int q = 0; q < int(BasinAspect.size()); ++q){
     
-    if (Aspect.get_data_element(i,j) != NoDataValue){
+    if (BasinAspect[q] != NoDataValue){
     
-      angle_r = rad(Aspect.get_data_element(i,j));
+      angle_r = rad(BasinAspect[q]);
       x_component += cos(angle_r);
       y_component += sin(angle_r);
   
@@ -843,7 +820,7 @@ void LSDBasin::set_All_Parameters(LSDRaster& Elevation, LSDFlowInfo& FlowInfo, L
 // Write integer basin parameters into the shape of the basin.
 // SWDG 12/12/13
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-void LSDBasin::set_HilltopPx(LSDFlowInfo& FlowInfo, LSDRaster Hilltops){
+void LSDBasin::set_HilltopPx(LSDFlowInfo& FlowInfo, LSDRaster& Hilltops){
 
   int i;
   int j;
@@ -867,7 +844,7 @@ void LSDBasin::set_HilltopPx(LSDFlowInfo& FlowInfo, LSDRaster Hilltops){
 // Write integer basin parameters into the shape of the basin.
 // SWDG 12/12/13
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-LSDIndexRaster LSDBasin::write_integer_data_to_LSDIndexRaster(int Param, LSDFlowInfo FlowInfo)
+LSDIndexRaster LSDBasin::write_integer_data_to_LSDIndexRaster(int Param, LSDFlowInfo& FlowInfo)
 {
   
   int i;
@@ -890,7 +867,7 @@ LSDIndexRaster LSDBasin::write_integer_data_to_LSDIndexRaster(int Param, LSDFlow
 // Write real basin parameters into the shape of the basin.
 // SWDG 12/12/13
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-LSDRaster LSDBasin::write_real_data_to_LSDRaster(float Param, LSDFlowInfo FlowInfo)
+LSDRaster LSDBasin::write_real_data_to_LSDRaster(float Param, LSDFlowInfo& FlowInfo)
 {
   
   int i;
@@ -913,7 +890,7 @@ LSDRaster LSDBasin::write_real_data_to_LSDRaster(float Param, LSDFlowInfo FlowIn
 // Cookie cut data from an LSDRaster into the shape of the basin.
 // SWDG 12/12/13
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-LSDRaster LSDBasin::write_raster_data_to_LSDRaster(LSDRaster Data, LSDFlowInfo FlowInfo)
+LSDRaster LSDBasin::write_raster_data_to_LSDRaster(LSDRaster& Data, LSDFlowInfo& FlowInfo)
 {
   
   int i;
@@ -937,7 +914,7 @@ LSDRaster LSDBasin::write_raster_data_to_LSDRaster(LSDRaster Data, LSDFlowInfo F
 // Cookie cut data from an LSDIndexRaster into the shape of the basin.
 // SWDG 12/12/13
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-LSDIndexRaster LSDBasin::write_raster_data_to_LSDIndexRaster(LSDIndexRaster Data, LSDFlowInfo FlowInfo){
+LSDIndexRaster LSDBasin::write_raster_data_to_LSDIndexRaster(LSDIndexRaster& Data, LSDFlowInfo& FlowInfo){
   
   int i;
   int j; 
@@ -1076,7 +1053,7 @@ void LSDBasin::set_AlternativeIndex(LSDFlowInfo& FlowInfo, LSDIndexRaster& AltIn
 // basin
 // FJC 19/03/15
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-LSDRaster LSDBasin::keep_only_internal_hilltop_curvature(LSDRaster hilltop_curvature, LSDFlowInfo FlowInfo)
+LSDRaster LSDBasin::keep_only_internal_hilltop_curvature(LSDRaster& hilltop_curvature, LSDFlowInfo& FlowInfo)
 {
   //Array2D<float> CHT_array(NRows, NCols, NoDataValue);
   //Array2D<int> perimeter(NRows, NCols, 0);
@@ -1127,11 +1104,25 @@ LSDRaster LSDBasin::keep_only_internal_hilltop_curvature(LSDRaster hilltop_curva
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 LSDRaster LSDBasin::TrimPaddedRasterToBasin(int padding_pixels, LSDFlowInfo& FlowInfo,
                                             LSDRaster& Raster_Data)
+{
+  int min_row, min_col;
+  return TrimPaddedRasterToBasin(padding_pixels, FlowInfo, Raster_Data, 
+                                 min_row, min_col);
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This function trims a padded raster to the basin and returns the row 
+// and column of the original raster where the trimmed raster starts
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+LSDRaster LSDBasin::TrimPaddedRasterToBasin(int padding_pixels, LSDFlowInfo& FlowInfo,
+                                            LSDRaster& Raster_Data, 
+                                            int& min_row, int& min_col)
 {
   int max_row = -1;
   int max_col = -1;
-  int min_row = 1e8;
-  int min_col = 1e8;
+  min_row = 1e8;
+  min_col = 1e8;
   
   int row,col;
   
@@ -1419,6 +1410,8 @@ void LSDCosmoBasin::create(int JunctionNumber, LSDFlowInfo& FlowInfo,
   Centroid_i = i_min + ((i_max - i_min)/2);
   Centroid_j = j_min + ((j_max - j_min)/2);   //how do these handle 0.5s ??
 
+  // no production table has been built yet
+  production_table_is_current = false;
 
   //finished setting all the instance variables
 
@@ -1428,22 +1421,17 @@ void LSDCosmoBasin::create(int JunctionNumber, LSDFlowInfo& FlowInfo,
 
 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-//  This function populates the topographic and production shielding
-// It sets the snow shielding to a default of 1
+// This gets the atmospheric pressure and production scaling of all the 
+// basin nodes. The valid nodes are gathered first so the coordinate 
+// conversion, the NCEP lookup and the Stone scaling each run as one batch.
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-void LSDCosmoBasin::populate_scaling_vectors(LSDFlowInfo& FlowInfo, 
-                                               LSDRaster& Elevation_Data,
-                                               LSDRaster& T_Shield,
-                                               string path_to_atmospheric_data)
+void LSDCosmoBasin::get_pressure_and_scaling_of_basin_nodes(LSDFlowInfo& FlowInfo,
+                                  LSDRaster& Elevation_Data,
+                                  string path_to_atmospheric_data,
+                                  vector<double>& pressure, vector<double>& scaling)
 {
   int row,col;
-  
-  // variables for converting location and elevation
-  double this_elevation, this_pressure, this_tshield;
-
-  vector<double> tshield_temp;
-  vector<double> prod_temp;
-  vector<double> snow_temp;
+  int n_nodes = int(BasinNodes.size());
   
   // now create the CRN parameters object
   LSDCRNParameters LSDCRNP;
@@ -1455,50 +1443,127 @@ void LSDCosmoBasin::populate_scaling_vectors(LSDFlowInfo& FlowInfo,
   // a function for scaling stone production, defaults to 1
   double Fsp = 1.0;
   
-  // the latitude and longitude
-  double lat,longitude;
+  // gather the nodes that have data
+  vector<int> valid_index;
+  vector<int> valid_rows;
+  vector<int> valid_cols;
+  vector<double> valid_elevations;
+  for (int q = 0; q < n_nodes; ++q)
+  {
+    FlowInfo.retrieve_current_row_and_col(BasinNodes[q], row, col);
+    
+    //exclude NDV from average
+    if (Elevation_Data.get_data_element(row,col) != NoDataValue)
+    {
+      valid_index.push_back(q);
+      valid_rows.push_back(row);
+      valid_cols.push_back(col);
+      valid_elevations.push_back(double(Elevation_Data.get_data_element(row,col)));
+    }
+  }
   
-  // decalre converter object
+  // get the lat and long, then the pressure, then the scaling
   LSDCoordinateConverterLLandUTM Converter;
+  vector<double> lat,longitude;
+  Elevation_Data.get_lat_and_long_locations(valid_rows, valid_cols, lat, longitude,
+                                            Converter);
+  vector<double> valid_pressure = LSDCRNP.NCEPatm_2(lat, longitude, valid_elevations);
+  vector<double> valid_scaling = LSDCRNP.stone2000sp(lat, valid_pressure, Fsp);
   
-  for (int q = 0; q < int(BasinNodes.size()); ++q)
+  // scatter back to the basin nodes
+  pressure.assign(n_nodes,double(NoDataValue));
+  scaling.assign(n_nodes,double(NoDataValue));
+  for (int v = 0; v < int(valid_index.size()); ++v)
+  {
+    pressure[valid_index[v]] = valid_pressure[v];
+    scaling[valid_index[v]] = valid_scaling[v];
+  }
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+//  This function populates the topographic and production shielding
+// It sets the snow shielding to a default of 1
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCosmoBasin::populate_scaling_vectors(LSDFlowInfo& FlowInfo, 
+                                               LSDRaster& Elevation_Data,
+                                               LSDRaster& T_Shield,
+                                               string path_to_atmospheric_data)
+{
+  int row,col;
+  int n_nodes = int(BasinNodes.size());
+  
+  // get the pressure and production scaling of all the nodes
+  vector<double> pressure_temp;
+  vector<double> prod_temp;
+  get_pressure_and_scaling_of_basin_nodes(FlowInfo, Elevation_Data, 
+                               path_to_atmospheric_data, pressure_temp, prod_temp);
+
+  vector<double> tshield_temp(n_nodes,double(NoDataValue));
+  vector<double> snow_temp(n_nodes,double(NoDataValue));
+  for (int q = 0; q < n_nodes; ++q)
   {
-    
     FlowInfo.retrieve_current_row_and_col(BasinNodes[q], row, col);
     
     //exclude NDV from average
     if (Elevation_Data.get_data_element(row,col) != NoDataValue)
     {
-      // To get pressure, first get the lat and long
-      Elevation_Data.get_lat_and_long_locations(row, col, lat, longitude, Converter);
-      //Elevation_Data.get_lat_and_long_locations(row, col, lat, longitude);
-      
-      // now the elevation
-      this_elevation = Elevation_Data.get_data_element(row,col);
-      
-      // now the pressure
-      this_pressure = LSDCRNP.NCEPatm_2(double(lat), double(longitude), 
-                                        double(this_elevation));
-
-      //cout << "r: " << row << " c: " << col << " lat: " << lat << " long: " << longitude
-      //     << " elevation: " << this_elevation << " pressure: " << this_pressure << endl;
-           
-      // now get the scaling
-      prod_temp.push_back(LSDCRNP.stone2000sp(lat,this_pressure, Fsp));
-      
       // Now get topographic shielding
-      this_tshield = double(T_Shield.get_data_element(row,col));
-      tshield_temp.push_back(this_tshield);
+      tshield_temp[q] = double(T_Shield.get_data_element(row,col));
       
       // now set the snow sheilding to 1
-      snow_temp.push_back(1.0);
-      
+      snow_temp[q] = 1.0;
     }
-    else 
+  }
+
+  // set the shielding vectors
+  topographic_shielding = tshield_temp;
+  production_scaling =  prod_temp;
+  snow_shielding = snow_temp;
+
+  // the production table depends on the scaling so has to be rebuilt
+  production_table_is_current = false;
+  
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+//  This function populates the topographic and production shielding
+//  The topographic shielding comes from a window around the basin, so 
+//  shielding never needs to be calculated for the whole DEM
+//  It sets the snow shielding to a default of 1
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCosmoBasin::populate_scaling_vectors(LSDFlowInfo& FlowInfo, 
+                                               LSDRaster& Elevation_Data,
+                                               LSDRaster& Topo_Shield_Window,
+                                               int window_min_row,
+                                               int window_min_col,
+                                               string path_to_atmospheric_data)
+{
+  int row,col;
+  int n_nodes = int(BasinNodes.size());
+  
+  // get the pressure and production scaling of all the nodes
+  vector<double> pressure_temp;
+  vector<double> prod_temp;
+  get_pressure_and_scaling_of_basin_nodes(FlowInfo, Elevation_Data, 
+                               path_to_atmospheric_data, pressure_temp, prod_temp);
+
+  vector<double> tshield_temp(n_nodes,double(NoDataValue));
+  vector<double> snow_temp(n_nodes,double(NoDataValue));
+  for (int q = 0; q < n_nodes; ++q)
+  {
+    FlowInfo.retrieve_current_row_and_col(BasinNodes[q], row, col);
+    
+    //exclude NDV from average
+    if (Elevation_Data.get_data_element(row,col) != NoDataValue)
     {
-      prod_temp.push_back(double(NoDataValue));
-      tshield_temp.push_back(double(NoDataValue));
-      snow_temp.push_back(double(NoDataValue));
+      // Now get topographic shielding from the window
+      tshield_temp[q] = double(Topo_Shield_Window.get_data_element(row-window_min_row,
+                                                                   col-window_min_col));
+      
+      // now set the snow sheilding to 1
+      snow_temp[q] = 1.0;
     }
   }
 
@@ -1506,6 +1571,9 @@ void LSDCosmoBasin::populate_scaling_vectors(LSDFlowInfo& FlowInfo,
   topographic_shielding = tshield_temp;
   production_scaling =  prod_temp;
   snow_shielding = snow_temp;
+
+  // the production table depends on the scaling so has to be rebuilt
+  production_table_is_current = false;
   
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
@@ -1521,70 +1589,28 @@ void LSDCosmoBasin::populate_scaling_vectors(LSDFlowInfo& FlowInfo,
                                                string path_to_atmospheric_data)
 {
   int row,col;
+  int n_nodes = int(BasinNodes.size());
   
-  // variables for converting location and elevation
-  double this_elevation, this_pressure, this_tshield, this_sshield;
-
-  vector<double> tshield_temp;
+  // get the pressure and production scaling of all the nodes
+  vector<double> pressure_temp;
   vector<double> prod_temp;
-  vector<double> snow_temp;
-  
-  // now create the CRN parameters object
-  LSDCRNParameters LSDCRNP;
-  
-  // get the atmospheric parameters
-  LSDCRNP.load_parameters_for_atmospheric_scaling(path_to_atmospheric_data);
-  LSDCRNP.set_CRONUS_data_maps();
-  
-  // a function for scaling stone production, defaults to 1
-  double Fsp = 1.0;
-  
-  // the latitude and longitude
-  double lat,longitude;
-  
-  // decalre converter object
-  LSDCoordinateConverterLLandUTM Converter;
-  
-  for (int q = 0; q < int(BasinNodes.size()); ++q)
+  get_pressure_and_scaling_of_basin_nodes(FlowInfo, Elevation_Data, 
+                               path_to_atmospheric_data, pressure_temp, prod_temp);
+
+  vector<double> tshield_temp(n_nodes,double(NoDataValue));
+  vector<double> snow_temp(n_nodes,double(NoDataValue));
+  for (int q = 0; q < n_nodes; ++q)
   {
-    
     FlowInfo.retrieve_current_row_and_col(BasinNodes[q], row, col);
     
     //exclude NDV from average
     if (Elevation_Data.get_data_element(row,col) != NoDataValue)
     {
-      // To get pressure, first get the lat and long
-      Elevation_Data.get_lat_and_long_locations(row, col, lat, longitude, Converter);
-      //Elevation_Data.get_lat_and_long_locations(row, col, lat, longitude);
-      
-      // now the elevation
-      this_elevation = Elevation_Data.get_data_element(row,col);
-      
-      // now the pressure
-      this_pressure = LSDCRNP.NCEPatm_2(double(lat), double(longitude), 
-                                        double(this_elevation));
-
-      //cout << "r: " << row << " c: " << col << " lat: " << lat << " long: " << longitude
-      //     << " elevation: " << this_elevation << " pressure: " << this_pressure << endl;
-           
-      
-      // now get the scaling
-      prod_temp.push_back(LSDCRNP.stone2000sp(lat,this_pressure, Fsp));
-      
       // Now get topographic shielding
-      this_tshield = double(T_Shield.get_data_element(row,col));
-      tshield_temp.push_back(this_tshield);
+      tshield_temp[q] = double(T_Shield.get_data_element(row,col));
       
       // now get the snow shielding
-      this_sshield = double(S_Shield.get_data_element(row,col));
-      snow_temp.push_back(this_sshield);
-      
-    }
-    else 
-    {
-      prod_temp.push_back(double(NoDataValue));
-      tshield_temp.push_back(double(NoDataValue));
-      snow_temp.push_back(double(NoDataValue));
+      snow_temp[q] = double(S_Shield.get_data_element(row,col));
     }
   }
 
@@ -1592,6 +1618,9 @@ void LSDCosmoBasin::populate_scaling_vectors(LSDFlowInfo& FlowInfo,
   topographic_shielding = tshield_temp;
   production_scaling =  prod_temp;
   snow_shielding = snow_temp;
+
+  // the production table depends on the scaling so has to be rebuilt
+  production_table_is_current = false;
   
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
@@ -1605,59 +1634,10 @@ void LSDCosmoBasin::populate_scaling_vectors(LSDFlowInfo& FlowInfo,
 void LSDCosmoBasin::get_atmospheric_pressure(LSDFlowInfo& FlowInfo, 
                     LSDRaster& Elevation_Data, string path_to_atmospheric_data)
 {
-  int row,col;
-  
-  // variables for converting location and elevation
-  double this_elevation, this_pressure;
-
   vector<double> pressure_temp;
-
-  
-  // now create the CRN parameters object
-  LSDCRNParameters LSDCRNP;
-  
-  // get the atmospheric parameters
-  LSDCRNP.load_parameters_for_atmospheric_scaling(path_to_atmospheric_data);
-  LSDCRNP.set_CRONUS_data_maps();
-  
-  // the latitude and longitude
-  double lat,longitude;
-  
-  // decalre converter object
-  LSDCoordinateConverterLLandUTM Converter;
-  
-  for (int q = 0; q < int(BasinNodes.size()); ++q)
-  {
-    
-    FlowInfo.retrieve_current_row_and_col(BasinNodes[q], row, col);
-    
-    //exclude NDV from average
-    if (Elevation_Data.get_data_element(row,col) != NoDataValue)
-    {
-      // To get pressure, first get the lat and long
-      Elevation_Data.get_lat_and_long_locations(row, col, lat, longitude, Converter);
-      //Elevation_Data.get_lat_and_long_locations(row, col, lat, longitude);
-      
-      // now the elevation
-      this_elevation = Elevation_Data.get_data_element(row,col);
-      
-      // now the pressure
-      this_pressure = LSDCRNP.NCEPatm_2(double(lat), double(longitude), 
-                                        double(this_elevation));
-
-      //cout << "r: " << row << " c: " << col << " lat: " << lat << " long: " << longitude
-      //     << " elevation: " << this_elevation << " pressure: " << this_pressure << endl;
-           
-      
-      // now get the scaling
-      pressure_temp.push_back(this_pressure);
-      
-    }
-    else 
-    {
-      pressure_temp.push_back(double(NoDataValue));
-    }
-  }
+  vector<double> prod_temp;
+  get_pressure_and_scaling_of_basin_nodes(FlowInfo, Elevation_Data, 
+                               path_to_atmospheric_data, pressure_temp, prod_temp);
 
   // set the pressure vector
   atmospheric_pressure = pressure_temp;
@@ -1707,6 +1687,9 @@ void LSDCosmoBasin::populate_snow_and_self_eff_depth_vectors(LSDFlowInfo& FlowIn
   // update the vectors in the basin object
   self_shield_eff_depth = self_temp;
   snow_shield_eff_depth = snow_temp;
+
+  // the production table depends on the shielding so has to be rebuilt
+  production_table_is_current = false;
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
@@ -1750,6 +1733,9 @@ void LSDCosmoBasin::populate_snow_and_self_eff_depth_vectors(LSDFlowInfo& FlowIn
   // update the vectors in the basin object
   self_shield_eff_depth = self_temp;
   snow_shield_eff_depth = snow_temp;
+
+  // the production table depends on the shielding so has to be rebuilt
+  production_table_is_current = false;
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
@@ -1798,6 +1784,9 @@ void LSDCosmoBasin::populate_snow_and_self_eff_depth_vectors(LSDFlowInfo& FlowIn
   // update the vectors in the basin object
   self_shield_eff_depth = self_temp;
   snow_shield_eff_depth = snow_temp;
+
+  // the production table depends on the shielding so has to be rebuilt
+  production_table_is_current = false;
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
@@ -1819,6 +1808,9 @@ void LSDCosmoBasin::populate_snow_and_self_eff_depth_vectors(double snow_eff_dep
   // update the vectors in the basin object
   self_shield_eff_depth = self_temp;
   snow_shield_eff_depth = snow_temp;
+
+  // the production table depends on the shielding so has to be rebuilt
+  production_table_is_current = false;
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
@@ -1834,6 +1826,9 @@ void LSDCosmoBasin::reset_snow_and_self_eff_depth_vectors()
   // update the vectors in the basin object
   self_shield_eff_depth = self_temp;
   snow_shield_eff_depth = snow_temp;
+
+  // the production table depends on the shielding so has to be rebuilt
+  production_table_is_current = false;
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
@@ -1893,27 +1888,31 @@ vector<double> LSDCosmoBasin::full_CRN_erosion_analysis(double Nuclide_conc, str
                               is_production_uncertainty_plus_on,
                               is_production_uncertainty_minus_on);
   
+  // The perturbed cases are grouped by production table so that each table
+  // is built once and shared by all the cases that use it. The central 
+  // erosion rate is the starting guess for each of them.
   double no_prod_uncert = 1.0;    // set the scheme to no production uncertainty
                                   // for the external uncertainty
-  // now get the external uncertainty                                        
-  erate_external_plus = predict_CRN_erosion(Nuclide_conc+Nuclide_conc_err, Nuclide, 
-                                             no_prod_uncert, Muon_scaling,
-                                             production_uncertainty,
-                                             average_production_rate,
-                                             is_production_uncertainty_plus_on,
-                                             is_production_uncertainty_minus_on);
-  erate_external_minus = predict_CRN_erosion(Nuclide_conc-Nuclide_conc_err, Nuclide, 
-                                             no_prod_uncert, Muon_scaling,
-                                             production_uncertainty,
-                                             average_production_rate,
-                                             is_production_uncertainty_plus_on,
-                                             is_production_uncertainty_minus_on); 
+  double no_multiplier = 1.0;
+  bool use_eff_depths = true;
+  if(self_shield_eff_depth.size() < 1 && snow_shield_eff_depth.size() < 1)
+  {
+    use_eff_depths = false;
+  }
+  bool data_from_outlet_only = false;
+  
+  // now get the external uncertainty
+  build_production_table(Nuclide, Muon_scaling, no_prod_uncert,
+                         is_production_uncertainty_plus_on,
+                         is_production_uncertainty_minus_on,
+                         use_eff_depths, data_from_outlet_only);
+  erate_external_plus = invert_production_table(Nuclide_conc+Nuclide_conc_err,
+                                                no_multiplier, erate);
+  erate_external_minus = invert_production_table(Nuclide_conc-Nuclide_conc_err,
+                                                 no_multiplier, erate);
   dEdExternal = (erate_external_plus-erate_external_minus)/(2*Nuclide_conc_err);
   External_uncert = fabs(dEdExternal*Nuclide_conc_err);
   
-  //cout << "LSDCosmoBasin, line 1160, erate: " << erate << " and uncertainty: " 
-  //     << External_uncert << endl;
-
   // now calculate uncertainty from different muon scaling schemes. 
   // The end members are Braucher and Schaller
   string braucher_string = "Braucher";
@@ -1940,118 +1939,47 @@ vector<double> LSDCosmoBasin::full_CRN_erosion_analysis(double Nuclide_conc, str
     this_muon_uncert_dif = muon_uncert_diff[0];
   }
   
-  // now get the muon uncertainty
-  erate_muon_scheme_schaller = predict_CRN_erosion(Nuclide_conc, Nuclide, 
-                                             no_prod_uncert, schaller_string,
-                                             production_uncertainty,
-                                             average_production_rate,
-                                             is_production_uncertainty_plus_on,
-                                             is_production_uncertainty_minus_on);
-  erate_muon_scheme_braucher = predict_CRN_erosion(Nuclide_conc, Nuclide, 
-                                             no_prod_uncert, braucher_string,
-                                             production_uncertainty,
-                                             average_production_rate,
-                                             is_production_uncertainty_plus_on,
-                                             is_production_uncertainty_minus_on);
+  // The production uncertainty only changes P0, which multiplies the 
+  // production of every pixel, so it is applied as a multiplier to the
+  // Schaller table rather than building two more tables.
+  // The production uncertainty is always calculated with Schaller scaling
+  LSDCRNP.set_Schaller_parameters();
+  double P0_ref = (Nuclide == "Al26") ? LSDCRNP.get_P0_26Al() : LSDCRNP.get_P0_10Be();
+  vector<double> prod = LSDCRNP.set_P0_CRONUS_uncertainty_plus();
+  double prod_plus = (Nuclide == "Al26") ? prod[1] : prod[0];
+  double plus_multiplier = ((Nuclide == "Al26") ? LSDCRNP.get_P0_26Al() : 
+                                                 LSDCRNP.get_P0_10Be())/P0_ref;
+  LSDCRNP.set_Schaller_parameters();
+  prod = LSDCRNP.set_P0_CRONUS_uncertainty_minus();
+  double prod_minus = (Nuclide == "Al26") ? prod[1] : prod[0];
+  double minus_multiplier = ((Nuclide == "Al26") ? LSDCRNP.get_P0_26Al() : 
+                                                  LSDCRNP.get_P0_10Be())/P0_ref;
+  this_prod_difference = prod_plus+prod_minus;
+  
+  // now the Schaller cases: the muon scheme and the production uncertainty
+  build_production_table(Nuclide, schaller_string, no_prod_uncert,
+                         is_production_uncertainty_plus_on,
+                         is_production_uncertainty_minus_on,
+                         use_eff_depths, data_from_outlet_only);
+  erate_muon_scheme_schaller = invert_production_table(Nuclide_conc, no_multiplier, erate);
+  erate_prod_plus = invert_production_table(Nuclide_conc, plus_multiplier, erate);
+  erate_prod_minus = invert_production_table(Nuclide_conc, minus_multiplier, erate);
+  
+  // and the Braucher case
+  build_production_table(Nuclide, braucher_string, no_prod_uncert,
+                         is_production_uncertainty_plus_on,
+                         is_production_uncertainty_minus_on,
+                         use_eff_depths, data_from_outlet_only);
+  erate_muon_scheme_braucher = invert_production_table(Nuclide_conc, no_multiplier, erate);
+  
   dEdMuonScheme = (erate_muon_scheme_schaller-erate_muon_scheme_braucher)/
                   this_muon_uncert_dif;
   Muon_uncert = fabs(dEdMuonScheme*this_muon_uncert_dif);
   
-  //cout << "LSDCosmoBasin, Line 1292, change in scaling production rate: " 
-  //     << this_muon_uncert_dif << " erate Schal: "
-  //     << erate_muon_scheme_schaller << " erate Braucher: " 
-  //     << erate_muon_scheme_braucher << " and erate uncert: " << Muon_uncert << endl;
-  
-  // now get the production uncertainty
-  // first set the scaling
-  // reset scaling parameters. This is necessary since the F values are
-  // reset for local scaling
-  if (Muon_scaling == "Schaller" )
-  {
-    LSDCRNP.set_Schaller_parameters();
-  }
-  else if (Muon_scaling == "Braucher" )
-  {
-    LSDCRNP.set_Braucher_parameters();
-  }
-  else if (Muon_scaling == "Granger" )
-  {
-    LSDCRNP.set_Granger_parameters();
-  }
-  else if (Muon_scaling == "newCRONUS" )
-  {
-    LSDCRNP.set_newCRONUS_parameters();
-  }
-  else
-  {
-    cout << "You didn't set the muon scaling." << endl
-         << "Options are Schaller, Braucher, newCRONUS, and Granger." << endl
-         << "You chose: " << Muon_scaling << endl
-         << "Defaulting to Braucher et al (2009) scaling" << endl;
-    LSDCRNP.set_Braucher_parameters();     
-  }
-  
-  // now get the uncertainty parameters
-  vector<double> prod;
-  double prod_plus,prod_minus;
-  // get the nuclide concentration from this node
-  if (Nuclide == "Be10")
-  {
-    prod = LSDCRNP.set_P0_CRONUS_uncertainty_plus();
-    prod_plus = prod[0];
-    prod = LSDCRNP.set_P0_CRONUS_uncertainty_minus();
-    prod_minus = prod[0];
-  }
-  else if (Nuclide == "Al26")
-  {
-    prod = LSDCRNP.set_P0_CRONUS_uncertainty_plus();
-    prod_plus = prod[1];
-    prod = LSDCRNP.set_P0_CRONUS_uncertainty_minus();
-    prod_minus = prod[1];
-  }
-  else
-  {
-    cout << "You didn't give a valid nuclide. You chose: " << Nuclide << endl;
-    cout << "Choices are 10Be, 26Al.  Note these case sensitive and cannot" << endl;
-    cout << "contain spaces or control characters. Defaulting to 10Be." << endl;
-    prod = LSDCRNP.set_P0_CRONUS_uncertainty_plus();
-    prod_plus = prod[0];
-    prod = LSDCRNP.set_P0_CRONUS_uncertainty_minus();
-    prod_minus = prod[0];
-  }
-  //cout << "Prod plus: " << prod_plus << " prod minus: " << prod_minus << endl;
-  this_prod_difference = prod_plus+prod_minus;     
-  
-  
-  is_production_uncertainty_plus_on = true;
-  is_production_uncertainty_minus_on = false;
-  erate_prod_plus = predict_CRN_erosion(Nuclide_conc, Nuclide, 
-                                             no_prod_uncert, schaller_string,
-                                             production_uncertainty,
-                                             average_production_rate,
-                                             is_production_uncertainty_plus_on,
-                                             is_production_uncertainty_minus_on);
-
-  is_production_uncertainty_plus_on = false;
-  is_production_uncertainty_minus_on = true;
-  erate_prod_minus = predict_CRN_erosion(Nuclide_conc, Nuclide, 
-                                             no_prod_uncert, schaller_string,
-                                             production_uncertainty,
-                                             average_production_rate,
-                                             is_production_uncertainty_plus_on,
-                                             is_production_uncertainty_minus_on);  
-  
   dEdProduction = (erate_prod_plus-erate_prod_minus)/
                    this_prod_difference;
   Prod_uncert = fabs(dEdProduction*this_prod_difference);
 
-  //cout << "LSDCosmoBasin, Line 1368, change in production rate for production uncertainty: " 
-  //     << this_prod_difference << " erate plus: "
-  //     << erate_prod_plus << " erate minus: " 
-  //     << erate_prod_minus << " and erate uncert: " << Prod_uncert << endl;
-
-
-
   // now calculate the total uncertainty
   double total_uncert = sqrt( External_uncert*External_uncert +
                               Muon_uncert*Muon_uncert +
@@ -2067,11 +1995,244 @@ vector<double> LSDCosmoBasin::full_CRN_erosion_analysis(double Nuclide_conc, str
 } 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This propagates the uncertainties of the erosion rate with a Monte Carlo
+// simulation. Each draw varies the concentration, the production, the 
+// weighting of the Schaller and Braucher muon schemes and the snow and self
+// shielding depths together. 
+// The production tables of the two muon schemes are built once. If the 
+// shielding depths vary the tables are also built with the depths multiplied
+// by 1-s and 1+s, and the column sums of each draw come from a quadratic 
+// through the three tables. Each draw then only needs the inversion of a 
+// sum of eight terms, so thousands of draws take less time than the tables.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+vector<double> LSDCosmoBasin::monte_carlo_CRN_erosion_analysis(double Nuclide_conc, 
+                            string Nuclide, double Nuclide_conc_err, 
+                            double shielding_depth_uncert, int n_draws, long seed,
+                            vector<double> quantiles)
+{
+  if (Nuclide_conc <= 0)
+  {
+    cout << "LSDCosmoBasin::monte_carlo_CRN_erosion_analysis, the concentration" << endl
+         << "must be positive. You gave: " << Nuclide_conc << endl;
+    exit(EXIT_FAILURE);
+  }
+  if (Nuclide != "Be10" && Nuclide != "Al26")
+  {
+    cout << "LSDCosmoBasin::monte_carlo_CRN_erosion_analysis, you did not supply" << endl
+         << "a valid nuclide, defaulting to 10Be" << endl;
+    Nuclide = "Be10";
+  }
+  if (n_draws < 1)
+  {
+    cout << "LSDCosmoBasin::monte_carlo_CRN_erosion_analysis, you need at least" << endl
+         << "one draw. Defaulting to 1000" << endl;
+    n_draws = 1000;
+  }
+  
+  // The production uncertainty only changes P0, so it is applied as a 
+  // multiplier on all production. Its standard deviation is half the
+  // difference between the CRONUS plus and minus cases
+  LSDCRNParameters LSDCRNP;
+  LSDCRNP.set_Schaller_parameters();
+  double P0_ref = (Nuclide == "Al26") ? LSDCRNP.get_P0_26Al() : LSDCRNP.get_P0_10Be();
+  LSDCRNP.set_P0_CRONUS_uncertainty_plus();
+  double plus_multiplier = ((Nuclide == "Al26") ? LSDCRNP.get_P0_26Al() : 
+                                                 LSDCRNP.get_P0_10Be())/P0_ref;
+  LSDCRNP.set_Schaller_parameters();
+  LSDCRNP.set_P0_CRONUS_uncertainty_minus();
+  double minus_multiplier = ((Nuclide == "Al26") ? LSDCRNP.get_P0_26Al() : 
+                                                  LSDCRNP.get_P0_10Be())/P0_ref;
+  double production_sigma = 0.5*(plus_multiplier-minus_multiplier);
+  
+  // the shielding depths can only vary if there are effective depths
+  bool use_eff_depths = true;
+  if(self_shield_eff_depth.size() < 1 && snow_shield_eff_depth.size() < 1)
+  {
+    use_eff_depths = false;
+  }
+  if (not use_eff_depths || shielding_depth_uncert < 0)
+  {
+    shielding_depth_uncert = 0;
+  }
+  if (shielding_depth_uncert > 0.9)
+  {
+    cout << "LSDCosmoBasin::monte_carlo_CRN_erosion_analysis, the shielding depth" << endl
+         << "uncertainty is too large, setting it to 0.9" << endl;
+    shielding_depth_uncert = 0.9;
+  }
+  
+  // now build the tables: [scheme][depth][term]. The depths are in the 
+  // order 1, 1-s, 1+s
+  int n_depths = (shielding_depth_uncert > 0) ? 3 : 1;
+  vector<double> depth_multipliers(3,1.0);
+  depth_multipliers[1] = 1.0-shielding_depth_uncert;
+  depth_multipliers[2] = 1.0+shielding_depth_uncert;
+  vector< vector< vector<double> > > column_sums(2, vector< vector<double> >(n_depths));
+  vector< vector<double> > decay_lengths(2);
+  vector<string> muon_schemes(2);
+  muon_schemes[0] = "Schaller";
+  muon_schemes[1] = "Braucher";
+  
+  vector<double> snow_depths = snow_shield_eff_depth;
+  vector<double> self_depths = self_shield_eff_depth;
+  double no_prod_uncert = 1.0;
+  bool is_production_uncertainty_on = false;
+  bool data_from_outlet_only = false;
+  for (int d = 0; d<n_depths; d++)
+  {
+    for (int i = 0; i< int(snow_depths.size()); i++)
+    {
+      snow_shield_eff_depth[i] = depth_multipliers[d]*snow_depths[i];
+    }
+    for (int i = 0; i< int(self_depths.size()); i++)
+    {
+      self_shield_eff_depth[i] = depth_multipliers[d]*self_depths[i];
+    }
+    for (int scheme = 0; scheme<2; scheme++)
+    {
+      // the table cache does not know about the depths
+      production_table_is_current = false;
+      build_production_table(Nuclide, muon_schemes[scheme], no_prod_uncert,
+                             is_production_uncertainty_on,
+                             is_production_uncertainty_on,
+                             use_eff_depths, data_from_outlet_only);
+      column_sums[scheme][d] = production_table_column_sums;
+      decay_lengths[scheme] = production_table_decay_lengths;
+    }
+  }
+  snow_shield_eff_depth = snow_depths;
+  self_shield_eff_depth = self_depths;
+  production_table_is_current = false;
+  double n_pixels = double(production_table_n_samples);
+  
+  // The random numbers are drawn here, in order, so the draws do not depend
+  // on the number of threads. The seed must be between 1 and 2147483646
+  long this_seed = seed % 2147483646;
+  if (this_seed < 0)
+  {
+    this_seed = -this_seed;
+  }
+  this_seed++;
+  vector<double> conc_draws(n_draws);
+  vector<double> production_draws(n_draws);
+  vector<double> weight_draws(n_draws);
+  vector<double> depth_draws(n_draws,1.0);
+  double min_depth = max(0.0, 1.0-3.0*shielding_depth_uncert);
+  double max_depth = 1.0+3.0*shielding_depth_uncert;
+  for (int n = 0; n<n_draws; n++)
+  {
+    do
+    {
+      conc_draws[n] = Nuclide_conc+Nuclide_conc_err*standard_normal_random(this_seed);
+    } while (conc_draws[n] <= 0);
+    do
+    {
+      production_draws[n] = 1.0+production_sigma*standard_normal_random(this_seed);
+    } while (production_draws[n] <= 0);
+    
+    // the weight of the Schaller scheme
+    weight_draws[n] = park_miller_uniform(this_seed);
+    
+    if (n_depths == 3)
+    {
+      double this_depth = 1.0+shielding_depth_uncert*standard_normal_random(this_seed);
+      depth_draws[n] = min(max(this_depth,min_depth),max_depth);
+    }
+  }
+  
+  // the central erosion rate, with equal weights on the muon schemes, is
+  // the starting guess for every draw
+  double coefficients[8];
+  double lengths[8];
+  for (int scheme = 0; scheme<2; scheme++)
+  {
+    for (int i = 0; i<4; i++)
+    {
+      coefficients[4*scheme+i] = 0.5*column_sums[scheme][0][i]/n_pixels;
+      lengths[4*scheme+i] = decay_lengths[scheme][i];
+    }
+  }
+  double central_erate = invert_production_sum(Nuclide_conc, coefficients, lengths,
+                                               8, 0.0);
+  
+  // now invert every draw
+  vector<double> erate_draws(n_draws);
+  #pragma omp parallel for schedule(static)
+  for (int n = 0; n<n_draws; n++)
+  {
+    double draw_coefficients[8];
+    double draw_lengths[8];
+    double dm = depth_draws[n]-1.0;
+    for (int scheme = 0; scheme<2; scheme++)
+    {
+      double weight = (scheme == 0) ? weight_draws[n] : 1.0-weight_draws[n];
+      for (int i = 0; i<4; i++)
+      {
+        double S = column_sums[scheme][0][i];
+        if (n_depths == 3)
+        {
+          double S_minus = column_sums[scheme][1][i];
+          double S_plus = column_sums[scheme][2][i];
+          double s = shielding_depth_uncert;
+          S += dm*(S_plus-S_minus)/(2*s)+dm*dm*(S_plus-2*S+S_minus)/(2*s*s);
+        }
+        draw_coefficients[4*scheme+i] = production_draws[n]*weight*S/n_pixels;
+        draw_lengths[4*scheme+i] = decay_lengths[scheme][i];
+      }
+    }
+    erate_draws[n] = invert_production_sum(conc_draws[n], draw_coefficients,
+                                           draw_lengths, 8, central_erate);
+  }
+  
+  // now the statistics of the draws
+  double sum_erate = 0;
+  for (int n = 0; n<n_draws; n++)
+  {
+    sum_erate += erate_draws[n];
+  }
+  double mean_erate = sum_erate/double(n_draws);
+  double sum_sq = 0;
+  for (int n = 0; n<n_draws; n++)
+  {
+    sum_sq += (erate_draws[n]-mean_erate)*(erate_draws[n]-mean_erate);
+  }
+  double sd_erate = (n_draws > 1) ? sqrt(sum_sq/double(n_draws-1)) : 0.0;
+  
+  vector<double> erate_stats;
+  erate_stats.push_back(mean_erate);
+  erate_stats.push_back(sd_erate);
+  
+  // the quantiles are interpolated between the sorted draws
+  sort(erate_draws.begin(), erate_draws.end());
+  for (int q = 0; q< int(quantiles.size()); q++)
+  {
+    double position = quantiles[q]*double(n_draws-1);
+    if (position <= 0)
+    {
+      erate_stats.push_back(erate_draws[0]);
+    }
+    else if (position >= double(n_draws-1))
+    {
+      erate_stats.push_back(erate_draws[n_draws-1]);
+    }
+    else
+    {
+      int k = int(floor(position));
+      double d = position-double(k);
+      erate_stats.push_back(erate_draws[k]+d*(erate_draws[k+1]-erate_draws[k]));
+    }
+  }
+  
+  return erate_stats;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 //
-// This function wraps the erosion rate calculations with formal error analysis
-// It is the version that includes basin nesting
-//
+// This function wraps the erosion rate calculations with formal error analysis
+// It is the version that includes basin nesting
+//
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=- 
 vector<double> LSDCosmoBasin::full_CRN_erosion_analysis_nested(LSDRaster& known_eff_erosion,
                               LSDFlowInfo& FlowInfo, double Nuclide_conc, string Nuclide, 
@@ -2126,29 +2287,16 @@ vector<double> LSDCosmoBasin::full_CRN_erosion_analysis_nested(LSDRaster& known_
                               
   cout << "Hey Bubba, I got the erosion rate!!!: " << erate << endl << endl << endl;
   
+  // The perturbed cases are grouped by production table so that each table
+  // is built once and shared by all the cases that use it. The central 
+  // erosion rate is the starting guess for each of them.
   double no_prod_uncert = 1.0;    // set the scheme to no production uncertainty
                                   // for the external uncertainty
-  // now get the external uncertainty                                        
-  erate_external_plus = predict_CRN_erosion_nested(Nuclide_conc+Nuclide_conc_err, Nuclide, 
-                                             no_prod_uncert, Muon_scaling,
-                                             production_uncertainty,
-                                             average_production_rate,
-                                             is_production_uncertainty_plus_on,
-                                             is_production_uncertainty_minus_on,
-                                             known_eff_erosion, FlowInfo);
-  erate_external_minus = predict_CRN_erosion_nested(Nuclide_conc-Nuclide_conc_err, Nuclide, 
-                                             no_prod_uncert, Muon_scaling,
-                                             production_uncertainty,
-                                             average_production_rate,
-                                             is_production_uncertainty_plus_on,
-                                             is_production_uncertainty_minus_on,
-                                             known_eff_erosion, FlowInfo); 
-  dEdExternal = (erate_external_plus-erate_external_minus)/(2*Nuclide_conc_err);
-  External_uncert = fabs(dEdExternal*Nuclide_conc_err);
+  double no_multiplier = 1.0;
+  
+  // if every erosion rate is known the perturbations do not change the result
+  bool there_are_unknowns = are_there_unknown_erosion_rates_in_basin(known_eff_erosion,FlowInfo);
   
-  //cout << "LSDCosmoBasin, line 1160, erate: " << erate << " and uncertainty: " 
-  //     << External_uncert << endl;
-
   // now calculate uncertainty from different muon scaling schemes. 
   // The end members are Braucher and Schaller
   string braucher_string = "Braucher";
@@ -2175,122 +2323,77 @@ vector<double> LSDCosmoBasin::full_CRN_erosion_analysis_nested(LSDRaster& known_
     this_muon_uncert_dif = muon_uncert_diff[0];
   }
   
-  // now get the muon uncertainty
-  erate_muon_scheme_schaller = predict_CRN_erosion_nested(Nuclide_conc, Nuclide, 
-                                             no_prod_uncert, schaller_string,
-                                             production_uncertainty,
-                                             average_production_rate,
-                                             is_production_uncertainty_plus_on,
-                                             is_production_uncertainty_minus_on,
-                                             known_eff_erosion, FlowInfo);
-  erate_muon_scheme_braucher = predict_CRN_erosion_nested(Nuclide_conc, Nuclide, 
-                                             no_prod_uncert, braucher_string,
-                                             production_uncertainty,
-                                             average_production_rate,
-                                             is_production_uncertainty_plus_on,
-                                             is_production_uncertainty_minus_on,
-                                             known_eff_erosion, FlowInfo);
-  dEdMuonScheme = (erate_muon_scheme_schaller-erate_muon_scheme_braucher)/
-                  this_muon_uncert_dif;
-  Muon_uncert = fabs(dEdMuonScheme*this_muon_uncert_dif);
-  
-  //cout << "LSDCosmoBasin, Line 1292, change in scaling production rate: " 
-  //     << this_muon_uncert_dif << " erate Schal: "
-  //     << erate_muon_scheme_schaller << " erate Braucher: " 
-  //     << erate_muon_scheme_braucher << " and erate uncert: " << Muon_uncert << endl;
-  
-  // now get the production uncertainty
-  // first set the scaling
-  // reset scaling parameters. This is necessary since the F values are
-  // reset for local scaling
-  if (Muon_scaling == "Schaller" )
-  {
-    LSDCRNP.set_Schaller_parameters();
-  }
-  else if (Muon_scaling == "Braucher" )
-  {
-    LSDCRNP.set_Braucher_parameters();
-  }
-  else if (Muon_scaling == "Granger" )
-  {
-    LSDCRNP.set_Granger_parameters();
-  }
-  else if (Muon_scaling == "newCRONUS" )
-  {
-    LSDCRNP.set_newCRONUS_parameters();
+  // The production uncertainty only changes P0, which multiplies the 
+  // production of every pixel, so it is applied as a multiplier to the
+  // Schaller table rather than building two more tables.
+  // The production uncertainty is always calculated with Schaller scaling
+  LSDCRNP.set_Schaller_parameters();
+  double P0_ref = (Nuclide == "Al26") ? LSDCRNP.get_P0_26Al() : LSDCRNP.get_P0_10Be();
+  vector<double> prod = LSDCRNP.set_P0_CRONUS_uncertainty_plus();
+  double prod_plus = (Nuclide == "Al26") ? prod[1] : prod[0];
+  double plus_multiplier = ((Nuclide == "Al26") ? LSDCRNP.get_P0_26Al() : 
+                                                 LSDCRNP.get_P0_10Be())/P0_ref;
+  LSDCRNP.set_Schaller_parameters();
+  prod = LSDCRNP.set_P0_CRONUS_uncertainty_minus();
+  double prod_minus = (Nuclide == "Al26") ? prod[1] : prod[0];
+  double minus_multiplier = ((Nuclide == "Al26") ? LSDCRNP.get_P0_26Al() : 
+                                                  LSDCRNP.get_P0_10Be())/P0_ref;
+  this_prod_difference = prod_plus+prod_minus;
+  
+  // Each table also records the contribution of the basin at the central 
+  // erosion rate, so that downstream nested basins can reuse it. 
+  if (there_are_unknowns)
+  {
+    // now get the external uncertainty
+    build_production_table_nested(Nuclide, Muon_scaling, no_prod_uncert,
+                                  is_production_uncertainty_plus_on,
+                                  is_production_uncertainty_minus_on,
+                                  known_eff_erosion, FlowInfo);
+    record_nested_contribution(erate);
+    erate_external_plus = invert_production_table(Nuclide_conc+Nuclide_conc_err,
+                                                  no_multiplier, erate);
+    erate_external_minus = invert_production_table(Nuclide_conc-Nuclide_conc_err,
+                                                   no_multiplier, erate);
+    
+    // now the Schaller cases: the muon scheme and the production uncertainty
+    build_production_table_nested(Nuclide, schaller_string, no_prod_uncert,
+                                  is_production_uncertainty_plus_on,
+                                  is_production_uncertainty_minus_on,
+                                  known_eff_erosion, FlowInfo);
+    record_nested_contribution(erate);
+    erate_muon_scheme_schaller = invert_production_table(Nuclide_conc, no_multiplier, erate);
+    erate_prod_plus = invert_production_table(Nuclide_conc, plus_multiplier, erate);
+    erate_prod_minus = invert_production_table(Nuclide_conc, minus_multiplier, erate);
+    
+    // and the Braucher case
+    build_production_table_nested(Nuclide, braucher_string, no_prod_uncert,
+                                  is_production_uncertainty_plus_on,
+                                  is_production_uncertainty_minus_on,
+                                  known_eff_erosion, FlowInfo);
+    record_nested_contribution(erate);
+    erate_muon_scheme_braucher = invert_production_table(Nuclide_conc, no_multiplier, erate);
   }
   else
   {
-    cout << "You didn't set the muon scaling." << endl
-         << "Options are Schaller, Braucher, newCRONUS, and Granger." << endl
-         << "You chose: " << Muon_scaling << endl
-         << "Defaulting to Braucher et al (2009) scaling" << endl;
-    LSDCRNP.set_Braucher_parameters();     
+    erate_external_plus = erate;
+    erate_external_minus = erate;
+    erate_muon_scheme_schaller = erate;
+    erate_muon_scheme_braucher = erate;
+    erate_prod_plus = erate;
+    erate_prod_minus = erate;
   }
   
-  // now get the uncertainty parameters
-  vector<double> prod;
-  double prod_plus,prod_minus;
-  // get the nuclide concentration from this node
-  if (Nuclide == "Be10")
-  {
-    prod = LSDCRNP.set_P0_CRONUS_uncertainty_plus();
-    prod_plus = prod[0];
-    prod = LSDCRNP.set_P0_CRONUS_uncertainty_minus();
-    prod_minus = prod[0];
-  }
-  else if (Nuclide == "Al26")
-  {
-    prod = LSDCRNP.set_P0_CRONUS_uncertainty_plus();
-    prod_plus = prod[1];
-    prod = LSDCRNP.set_P0_CRONUS_uncertainty_minus();
-    prod_minus = prod[1];
-  }
-  else
-  {
-    cout << "You didn't give a valid nuclide. You chose: " << Nuclide << endl;
-    cout << "Choices are 10Be, 26Al.  Note these case sensitive and cannot" << endl;
-    cout << "contain spaces or control characters. Defaulting to 10Be." << endl;
-    prod = LSDCRNP.set_P0_CRONUS_uncertainty_plus();
-    prod_plus = prod[0];
-    prod = LSDCRNP.set_P0_CRONUS_uncertainty_minus();
-    prod_minus = prod[0];
-  }
-  //cout << "Prod plus: " << prod_plus << " prod minus: " << prod_minus << endl;
-  this_prod_difference = prod_plus+prod_minus;     
-  
-  
-  is_production_uncertainty_plus_on = true;
-  is_production_uncertainty_minus_on = false;
-  erate_prod_plus = predict_CRN_erosion_nested(Nuclide_conc, Nuclide, 
-                                             no_prod_uncert, schaller_string,
-                                             production_uncertainty,
-                                             average_production_rate,
-                                             is_production_uncertainty_plus_on,
-                                             is_production_uncertainty_minus_on,
-                                             known_eff_erosion, FlowInfo);
-
-  is_production_uncertainty_plus_on = false;
-  is_production_uncertainty_minus_on = true;
-  erate_prod_minus = predict_CRN_erosion_nested(Nuclide_conc, Nuclide, 
-                                             no_prod_uncert, schaller_string,
-                                             production_uncertainty,
-                                             average_production_rate,
-                                             is_production_uncertainty_plus_on,
-                                             is_production_uncertainty_minus_on,
-                                             known_eff_erosion, FlowInfo); 
+  dEdExternal = (erate_external_plus-erate_external_minus)/(2*Nuclide_conc_err);
+  External_uncert = fabs(dEdExternal*Nuclide_conc_err);
+  
+  dEdMuonScheme = (erate_muon_scheme_schaller-erate_muon_scheme_braucher)/
+                  this_muon_uncert_dif;
+  Muon_uncert = fabs(dEdMuonScheme*this_muon_uncert_dif);
   
   dEdProduction = (erate_prod_plus-erate_prod_minus)/
                    this_prod_difference;
   Prod_uncert = fabs(dEdProduction*this_prod_difference);
 
-  //cout << "LSDCosmoBasin, Line 1368, change in production rate for production uncertainty: " 
-  //     << this_prod_difference << " erate plus: "
-  //     << erate_prod_plus << " erate minus: " 
-  //     << erate_prod_minus << " and erate uncert: " << Prod_uncert << endl;
-
-
-
   // now calculate the total uncertainty
   double total_uncert = sqrt( External_uncert*External_uncert +
                               Muon_uncert*Muon_uncert +
@@ -2498,98 +2601,27 @@ double LSDCosmoBasin::predict_CRN_erosion(double Nuclide_conc, string Nuclide,
   // convert to  g/cm^2/yr
   eff_erate_guess = 0.1*erate_guess*rho;
   
-  // now using this as the initial guess, use Newton-Raphson to zero in on the
-  // correct erosion rate
-  double eff_e_new = eff_erate_guess; // the erosion rate upon which we iterate
-  double eff_e_change;                // the change in erosion rate between iterations
-  double tolerance = 1e-10;           // tolerance for a change in the erosion rate
-                                      // between Newton-Raphson iterations
-  double eff_e_displace = 1e-6;       // A small displacment in the erosion rate used
-                                      // to calculate the derivative
-  double N_this_step;                 // the concentration of the nuclide reported this step
-  double N_displace;                  // the concentration at the displaced erosion rate
-  double N_derivative;                // dN/de derivative for Newton-Raphson
-  double f_x;                         // the function being tested by newton raphson
-  double f_x_displace;                // the displaced function (for calculating the derivative)
-  
-  double this_step_prod_uncert;       // the uncertainty in the production rate
-                                      // from this step
-  double displace_uncertainty;        // the uncertainty from the displaced calculations
-                                      // is not used so a dummy variable is used here
-  
-  double this_step_average_production;// the average production rate for this step
-  double displace_average_production; // aveage production for the displace step
-  
-  do
+  // the production table is built once for the solve and the erosion rate
+  // is found with a safeguarded Newton iteration on the table 
+  bool use_eff_depths = true;
+  if(self_shield_eff_depth.size() < 1 && snow_shield_eff_depth.size() < 1)
   {
-    // get the new values
-    //cout << "Taking a step, eff_e: " << eff_e_new << " data_outlet? " <<  data_from_outlet_only;
-    if(self_shield_eff_depth.size() < 1 && snow_shield_eff_depth.size() < 1)
-    {                                             
-      //cout << "LSDBasin line 1630, You are doing this wihout the effective depth driven shielding" << endl;
-      
-      N_this_step = predict_mean_CRN_conc(eff_e_new, Nuclide,prod_uncert_factor,
-                                        Muon_scaling,data_from_outlet_only,
-                                        this_step_prod_uncert,
-                                        this_step_average_production,
-                                        is_production_uncertainty_plus_on,
-                                        is_production_uncertainty_minus_on);
-
-      // now get the derivative
-      N_displace = predict_mean_CRN_conc(eff_e_new+eff_e_displace,Nuclide,
-                                       prod_uncert_factor,Muon_scaling, 
-                                       data_from_outlet_only,displace_uncertainty,
-                                       displace_average_production,
-                                       is_production_uncertainty_plus_on,
-                                       is_production_uncertainty_minus_on);
-    }
-    else   // if self and snow sheilding are caluclated based on effective depths
-    {
-      //cout << "LSDBasin line 1649 You are doing this wih the effective depth driven shielding" << endl;
-      
-      N_this_step = predict_mean_CRN_conc_with_snow_and_self(eff_e_new, Nuclide,
-                                        prod_uncert_factor,
-                                        Muon_scaling,data_from_outlet_only,
-                                        this_step_prod_uncert,
-                                        this_step_average_production,
-                                        is_production_uncertainty_plus_on,
-                                        is_production_uncertainty_minus_on);
-      //cout << " Conc: " << N_this_step << endl;
-
-      // now get the derivative
-      N_displace = predict_mean_CRN_conc_with_snow_and_self(eff_e_new+eff_e_displace,Nuclide,
-                                       prod_uncert_factor,Muon_scaling, 
-                                       data_from_outlet_only,displace_uncertainty,
-                                       displace_average_production,
-                                       is_production_uncertainty_plus_on,
-                                       is_production_uncertainty_minus_on);
-    }
-    
-    f_x =  N_this_step-Nuclide_conc;
-    f_x_displace =  N_displace-Nuclide_conc;
-    
-    N_derivative = (f_x_displace-f_x)/eff_e_displace;
-      
-    if(N_derivative != 0)
-    {
-      eff_e_new = eff_e_new-f_x/N_derivative;
-      
-      // check to see if the difference in erosion rates meet a tolerance
-      eff_e_change = f_x/N_derivative;
-      //cout << "Change is: " << eff_e_change << " and erosion rate is: " << eff_e_new << endl;
-    }
-    else
-    {
-      eff_e_change = 0;
-    }
-  
-  } while(fabs(eff_e_change) > tolerance);
+    use_eff_depths = false;
+  }
+  build_production_table(Nuclide, Muon_scaling, prod_uncert_factor,
+                         is_production_uncertainty_plus_on,
+                         is_production_uncertainty_minus_on,
+                         use_eff_depths, data_from_outlet_only);
+  double production_multiplier = 1.0;
+  double eff_e_new = invert_production_table(Nuclide_conc, production_multiplier,
+                                             eff_erate_guess);
 
   // replace the production uncertainty
-  production_uncertainty = this_step_prod_uncert;
+  production_uncertainty = production_table_average_production*
+                           fabs(1-production_table_uncert_factor);
   
   // replace the average production
-  average_production = this_step_average_production;
+  average_production = production_table_average_production;
   
   return eff_e_new;
 }
@@ -2779,27 +2811,10 @@ double LSDCosmoBasin::predict_CRN_erosion_nested(double Nuclide_conc, string Nuc
   // convert to  g/cm^2/yr
   eff_erate_guess = 0.1*erate_guess*rho;
   
-  // now using this as the initial guess, use Newton-Raphson to zero in on the
-  // correct erosion rate
+  // now using this as the initial guess, zero in on the correct erosion rate
   double eff_e_new = eff_erate_guess; // the erosion rate upon which we iterate
-  double eff_e_change;                // the change in erosion rate between iterations
-  double tolerance = 1e-10;           // tolerance for a change in the erosion rate
-                                      // between Newton-Raphson iterations
-  double eff_e_displace = 1e-6;       // A small displacment in the erosion rate used
-                                      // to calculate the derivative
-  double N_this_step;                 // the concentration of the nuclide reported this step
-  double N_displace;                  // the concentration at the displaced erosion rate
-  double N_derivative;                // dN/de derivative for Newton-Raphson
-  double f_x;                         // the function being tested by newton raphson
-  double f_x_displace;                // the displaced function (for calculating the derivative)
-  
-  double this_step_prod_uncert;       // the uncertainty in the production rate
-                                      // from this step
-  double displace_uncertainty;        // the uncertainty from the displaced calculations
-                                      // is not used so a dummy variable is used here
-  
-  double this_step_average_production;// the average production rate for this step
-  double displace_average_production; // aveage production for the displace step
+  double this_step_prod_uncert = 0;   // the uncertainty in the production rate
+  double this_step_average_production = 0; // the average production rate
 
   // now check if there are unknown erosion rates in basin
   bool there_are_unknowns = are_there_unknown_erosion_rates_in_basin(eff_erosion_raster,FlowInfo);
@@ -2822,47 +2837,17 @@ double LSDCosmoBasin::predict_CRN_erosion_nested(double Nuclide_conc, string Nuc
       populate_snow_and_self_eff_depth_vectors(snow_eff_depth, self_eff_depth);
     }
   
-    // now use newton iteration to get the correct cocentration
-    do
-    {
-      N_this_step = predict_mean_CRN_conc_with_snow_and_self_nested(eff_e_new, 
-                                        eff_erosion_raster,FlowInfo,
-                                        Nuclide,
-                                        prod_uncert_factor,
-                                        Muon_scaling,
-                                        this_step_prod_uncert,
-                                        this_step_average_production,
-                                        is_production_uncertainty_plus_on,
-                                        is_production_uncertainty_minus_on);
-      //cout << " Conc: " << N_this_step << endl;
-
-      // now get the derivative
-      N_displace = predict_mean_CRN_conc_with_snow_and_self_nested(eff_e_new+eff_e_displace,
-                                       eff_erosion_raster,FlowInfo,Nuclide,
-                                       prod_uncert_factor,Muon_scaling, 
-                                       displace_uncertainty,
-                                       displace_average_production,
-                                       is_production_uncertainty_plus_on,
-                                       is_production_uncertainty_minus_on);
-    
-      f_x =  N_this_step-Nuclide_conc;
-      f_x_displace =  N_displace-Nuclide_conc;
-    
-      N_derivative = (f_x_displace-f_x)/eff_e_displace;
-      
-      if(N_derivative != 0)
-      {
-        eff_e_new = eff_e_new-f_x/N_derivative;
-        
-        // check to see if the difference in erosion rates meet a tolerance
-        eff_e_change = f_x/N_derivative;
-        //cout << "Change is: " << eff_e_change << " and erosion rate is: " << eff_e_new << endl;
-      }
-      else
-      {
-        eff_e_change = 0;
-      }
-    } while(fabs(eff_e_change) > tolerance);
+    // the production table is built once for the solve
+    build_production_table_nested(Nuclide, Muon_scaling, prod_uncert_factor,
+                                  is_production_uncertainty_plus_on,
+                                  is_production_uncertainty_minus_on,
+                                  eff_erosion_raster, FlowInfo);
+    this_step_average_production = production_table_average_production;
+    this_step_prod_uncert = production_table_average_production*
+                            fabs(1-production_table_uncert_factor);
+    double production_multiplier = 1.0;
+    eff_e_new = invert_production_table(Nuclide_conc, production_multiplier,
+                                        eff_erate_guess);
   }
 
   // replace the production uncertainty
@@ -2886,91 +2871,73 @@ double LSDCosmoBasin::predict_CRN_erosion_nested(double Nuclide_conc, string Nuc
 
 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-// this function returns the concentration of a nuclide as  function of erosion rate
-// The erosion rate should be in g/cm^2/yr
+// This builds the production table of the basin: the scaled and shielded
+// production of every pixel folded into four coefficients, one for each
+// production mechanism. The concentration of a pixel eroding at e is then
+//   N = sum_i C_i/(e+Gamma_i*lambda)
+// so the resetting of the CRN parameters and the Newton iteration in
+// scale_F_values are done once per pixel rather than once per pixel for
+// every erosion rate that is tested.
+// If known_eff_erosion is not empty it holds the known erosion rate of each
+// basin node (NoDataValue where unknown). Pixels with known erosion are
+// folded into an erosion weighted constant and only the unknown pixels are
+// kept in the table.
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-double LSDCosmoBasin::predict_mean_CRN_conc(double eff_erosion_rate, string Nuclide,
-                                            double prod_uncert_factor, string Muon_scaling,
-                                            bool data_from_outlet_only, 
-                                            double& production_uncertainty, 
-                                            double& average_production,
-                                            bool is_production_uncertainty_plus_on,
-                                            bool is_production_uncertainty_minus_on)
+void LSDCosmoBasin::fill_production_table(string Nuclide, string Muon_scaling,
+                                     double prod_uncert_factor,
+                                     bool is_production_uncertainty_plus_on,
+                                     bool is_production_uncertainty_minus_on,
+                                     bool use_eff_depths, int end_node,
+                                     vector<double>& known_eff_erosion)
 {
-  // production uncertainty factor is a multiplier that sets the production 
-  // certainty. If it is 1.1, there is 10% production rate uncertainty, or
-  // if it is 0.9 there is -10% unvertainty. The reason why it is implemented
-  // like this is that this allows gaussian error propigation.
-  if (prod_uncert_factor <=0)
+  // set the scaling vector
+  vector<bool> nuclide_scaling_switches(4,false);
+  bool is_Al26 = false;
+  if (Nuclide == "Be10")
   {
-    cout << "You have set an unrealistic production uncertainty factor." << endl;
-    cout << "Defaulting to 1." << endl;
-    prod_uncert_factor = 1;
+    nuclide_scaling_switches[0] = true;
   }
-  
-  // these parameters give the average production rate of the entore basin, 
-  // along with the magnitude of the production uncertainty
-  double cumulative_production_rate = 0;
-  double average_production_rate;
-  double average_production_uncertainty;
-  
-  // the average atoms per gram of the nuclide
-  double BasinAverage;
-  
-  // the total shielding. A product of snow, topographic and production scaling
-  double total_shielding;
-  double total_shielding_no_uncert;
-  
-  // the total atomic concentration of the nuclude in question
-  double Total_N = 0;
-  
-  int count_samples = 0;
-  
-  // initiate a particle. We'll just repeatedly call this particle
-  // for the sample. 
-  int startType = 0; 
-  double Xloc = 0;
-  double Yloc = 0;
-  double  startdLoc = 0.0;
-  double  start_effdloc = 0.0;
-  double startzLoc = 0.0;
-  
-  // create a particle at zero depth
-  LSDCRNParticle eroded_particle(startType, Xloc, Yloc,
-                               startdLoc, start_effdloc, startzLoc);
-
-  // now create the CRN parameters object
-  LSDCRNParameters LSDCRNP;
-  
-  // set a special case if the outlet flag is true
-  int end_node;
-  if (data_from_outlet_only)
+  else if (Nuclide == "Al26")
   {
-    end_node = 1;
+    nuclide_scaling_switches[1] = true;
+    is_Al26 = true;
   }
   else
   {
-    end_node =  int(BasinNodes.size());
+    cout << "You didn't give a valid nuclide. You chose: " << Nuclide << endl;
+    cout << "Choices are 10Be, 26Al.  Note these case sensitive and cannot" << endl;
+    cout << "contain spaces or control characters. Defaulting to 10Be." << endl;
+    nuclide_scaling_switches[0] = true;
   }
-  
-  // set the scaling vector
-  vector<bool> nuclide_scaling_switches(4,false);
-  if (Nuclide == "Be10")
+
+  // get the muon scheme once rather than comparing strings at every pixel
+  // 0 = Schaller, 1 = Braucher, 2 = Granger, 3 = newCRONUS
+  int muon_scheme;
+  if (Muon_scaling == "Schaller" )
   {
-    nuclide_scaling_switches[0] = true;
+    muon_scheme = 0;
   }
-  else if (Nuclide == "Al26")
+  else if (Muon_scaling == "Braucher" )
   {
-    nuclide_scaling_switches[1] = true;
+    muon_scheme = 1;
+  }
+  else if (Muon_scaling == "Granger" )
+  {
+    muon_scheme = 2;
+  }
+  else if (Muon_scaling == "newCRONUS" )
+  {
+    muon_scheme = 3;
   }
   else
   {
-    cout << "LSDBasin line 1583, You didn't choos a valid nuclide. Defaulting"
-         << " to 10Be." << endl;
-    Nuclide = "Be10";
-    nuclide_scaling_switches[0] = true; 
+    cout << "You didn't set the muon scaling." << endl
+         << "Options are Schaller, Braucher, newCRONUS, and Granger." << endl
+         << "You chose: " << Muon_scaling << endl
+         << "Defaulting to Braucher et al (2009) scaling" << endl;
+    muon_scheme = 1;
   }
-  
+
   // check the production uncertainty bools
   if(is_production_uncertainty_plus_on)
   {
@@ -2981,658 +2948,791 @@ double LSDCosmoBasin::predict_mean_CRN_conc(double eff_erosion_rate, string Nucl
       is_production_uncertainty_minus_on = false;
     }
   }
-  
-  
-  // loop through the elevation data
-  for (int q = 0; q < end_node; ++q)
+
+  if(  production_scaling.size() < 1 )
   {
-    
-    //exclude NDV from average
-    if(topographic_shielding[q] != NoDataValue)
-    {
-      count_samples++;
-            
-      // reset scaling parameters. This is necessary since the F values are
-      // reset for local scaling
-      if (Muon_scaling == "Schaller" )
-      {
-        LSDCRNP.set_Schaller_parameters();
-      }
-      else if (Muon_scaling == "Braucher" )
+    cout << "LSDCosmoBasin, trying to precalculate erosion rate." << endl
+         << "Scaling vectors have not been set! You are about to get a seg fault" << endl;
+  }
+
+  // the decay lengths do not depend on the local scaling so are taken from
+  // a single parameter object
+  LSDCRNParameters Reference_params;
+  switch(muon_scheme)
+  {
+    case 0: Reference_params.set_Schaller_parameters(); break;
+    case 2: Reference_params.set_Granger_parameters(); break;
+    case 3: Reference_params.set_newCRONUS_parameters(); break;
+    default: Reference_params.set_Braucher_parameters(); break;
+  }
+  double lambda = (is_Al26) ? Reference_params.get_lambda_26Al() :
+                              Reference_params.get_lambda_10Be();
+  production_table_decay_lengths.assign(4,0.0);
+  for (int i = 0; i<4; i++)
+  {
+    production_table_decay_lengths[i] = Reference_params.get_Gamma(i)*lambda;
+  }
+
+  // the key of these settings, used to match the contributions of 
+  // sub-basins that have already been solved
+  string nested_key = (is_Al26) ? "Al26_" : "Be10_";
+  nested_key += Muon_scaling;
+  if(is_production_uncertainty_plus_on)
+  {
+    nested_key += "_plus";
+  }
+  else if(is_production_uncertainty_minus_on)
+  {
+    nested_key += "_minus";
+  }
+  production_table_nested_key = nested_key;
+
+  // pixels in solved sub-basins are replaced by the contribution recorded when
+  // the sub-basin was solved, if it was solved with the same settings
+  vector<bool> is_in_solved_subbasin;
+  double subbasin_known_N = 0;
+  double subbasin_known_mass = 0;
+  if (known_eff_erosion.size() > 0 && use_eff_depths)
+  {
+    for (int k = 0; k < int(solved_subbasin_start_nodes.size()); ++k)
+    {
+      map<string, vector<double> >::iterator contribution_iter = 
+                            solved_subbasin_contributions[k].find(nested_key);
+      if (contribution_iter != solved_subbasin_contributions[k].end() &&
+          contribution_iter->second[2] == prod_uncert_factor &&
+          solved_subbasin_end_nodes[k] <= end_node)
       {
-        LSDCRNP.set_Braucher_parameters();
+        if (is_in_solved_subbasin.size() == 0)
+        {
+          is_in_solved_subbasin.assign(end_node,false);
+        }
+        for (int q = solved_subbasin_start_nodes[k]; q < solved_subbasin_end_nodes[k]; ++q)
+        {
+          is_in_solved_subbasin[q] = true;
+        }
+        subbasin_known_N += contribution_iter->second[0];
+        subbasin_known_mass += contribution_iter->second[1];
       }
-      else if (Muon_scaling == "Granger" )
+    }
+  }
+  bool use_solved_subbasins = (is_in_solved_subbasin.size() > 0);
+
+  // get the pixels that have data
+  vector<int> valid_nodes;
+  int n_subbasin = 0;
+  double subbasin_production_rate = 0;
+  for (int q = 0; q < end_node; ++q)
+  {
+    if(topographic_shielding[q] != NoDataValue)
+    {
+      if (use_solved_subbasins && is_in_solved_subbasin[q])
       {
-        LSDCRNP.set_Granger_parameters();
+        subbasin_production_rate += production_scaling[q]*topographic_shielding[q];
+        n_subbasin++;
       }
-      else if (Muon_scaling == "newCRONUS" )
+      else
       {
-        LSDCRNP.set_newCRONUS_parameters();
+        valid_nodes.push_back(q);
       }
-      else
+    }
+  }
+  int n_valid = int(valid_nodes.size());
+
+  vector< vector<double> > coefficients(4, vector<double>(n_valid,0.0));
+  vector<double> shielding_no_uncert(n_valid,0.0);
+
+  // every pixel is independent so they are scaled in parallel, each
+  // thread with its own parameter object
+  #pragma omp parallel
+  {
+    LSDCRNParameters LSDCRNP;
+
+    #pragma omp for schedule(dynamic,256)
+    for (int j = 0; j < n_valid; ++j)
+    {
+      int q = valid_nodes[j];
+
+      // reset scaling parameters. This is necessary since the F values are
+      // reset for local scaling
+      switch(muon_scheme)
       {
-        cout << "You didn't set the muon scaling." << endl
-             << "Options are Schaller, Braucher, newCRONUS, and Granger." << endl
-             << "You chose: " << Muon_scaling << endl
-             << "Defaulting to Braucher et al (2009) scaling" << endl;
-        LSDCRNP.set_Braucher_parameters();     
+        case 0: LSDCRNP.set_Schaller_parameters(); break;
+        case 2: LSDCRNP.set_Granger_parameters(); break;
+        case 3: LSDCRNP.set_newCRONUS_parameters(); break;
+        default: LSDCRNP.set_Braucher_parameters(); break;
       }
-      
+
       // set the scaling to the correct production uncertainty
-      vector<double> test_uncert;
       if(is_production_uncertainty_plus_on)
       {
-        test_uncert = LSDCRNP.set_P0_CRONUS_uncertainty_plus();
+        LSDCRNP.set_P0_CRONUS_uncertainty_plus();
       }
       else if(is_production_uncertainty_minus_on)
       {
-        test_uncert = LSDCRNP.set_P0_CRONUS_uncertainty_minus();
+        LSDCRNP.set_P0_CRONUS_uncertainty_minus();
       }
-      
-      // the elevation, snow shielding, topographic shielding
-      // and production scaling are all independent of the erosion rate
-      // and are calculated seperately. 
-      if(  production_scaling.size() < 1 )
+
+      // with effective depths the snow and self shielding come from the
+      // depth integration rather than from shielding factors
+      double total_shielding_no_uncert;
+      if (use_eff_depths)
       {
-        cout << "LSDCosmoBasin, trying to precalculate erosion rate." << endl
-             << "Scaling vectors have not been set! You are about to get a seg fault" << endl;
+        total_shielding_no_uncert = production_scaling[q]*topographic_shielding[q];
       }
-      
-      // now you need logic to test if you are accounting for self shielding
-      if ( self_shielding.size() < 1 )
+      else if ( self_shielding.size() < 1 )
       {
         total_shielding_no_uncert = production_scaling[q]*topographic_shielding[q]*
-                                  snow_shielding[q];
-        total_shielding = prod_uncert_factor*total_shielding_no_uncert;
-        cumulative_production_rate += total_shielding_no_uncert;
+                                    snow_shielding[q];
       }
-      else 
+      else
       {
         total_shielding_no_uncert = production_scaling[q]*topographic_shielding[q]*
-                                  snow_shielding[q]*self_shielding[q];
-        total_shielding = prod_uncert_factor*total_shielding_no_uncert;
-        cumulative_production_rate += total_shielding_no_uncert;
+                                    snow_shielding[q]*self_shielding[q];
       }
-
-      LSDCRNP.scale_F_values(total_shielding,nuclide_scaling_switches);
-      
-      // get the nuclide concentration from this node
-      if (Nuclide == "Be10")
+      shielding_no_uncert[j] = total_shielding_no_uncert;
+      LSDCRNP.scale_F_values(prod_uncert_factor*total_shielding_no_uncert,
+                             nuclide_scaling_switches);
+
+      // get the top and bottom effective depths
+      double this_top_eff_depth = 0;
+      double this_bottom_eff_depth = 0;
+      if (use_eff_depths)
       {
+        if (snow_shield_eff_depth.size() == 1)
+        {
+          this_top_eff_depth = snow_shield_eff_depth[0];
+        }
+        else if (snow_shield_eff_depth.size() > 1)
+        {
+          this_top_eff_depth = snow_shield_eff_depth[q];
+        }
 
-        eroded_particle.update_10Be_SSfull(eff_erosion_rate,LSDCRNP);
-        Total_N+=eroded_particle.getConc_10Be();
+        if (self_shield_eff_depth.size() < 1)
+        {
+          this_bottom_eff_depth = this_top_eff_depth;
+        }
+        else if (self_shield_eff_depth.size() == 1)
+        {
+          this_bottom_eff_depth = this_top_eff_depth+self_shield_eff_depth[0];
+        }
+        else
+        {
+          this_bottom_eff_depth = this_top_eff_depth+self_shield_eff_depth[q];
+        }
+
+        if (this_top_eff_depth > this_bottom_eff_depth)
+        {
+          double temp_eff_depth = this_bottom_eff_depth;
+          this_bottom_eff_depth = this_top_eff_depth;
+          this_top_eff_depth = temp_eff_depth;
+        }
+      }
+
+      // fold the production, shielding and depth integration into the
+      // coefficients. This mirrors update_10Be_SSfull_depth_integrated
+      double P_ref = (is_Al26) ? LSDCRNP.get_S_t()*LSDCRNP.get_P0_26Al() :
+                                 LSDCRNP.get_S_t()*LSDCRNP.get_P0_10Be();
+      for (int i = 0; i<4; i++)
+      {
+        double G = LSDCRNP.get_Gamma(i);
+        double F = (is_Al26) ? LSDCRNP.get_F_26Al(i) : LSDCRNP.get_F_10Be(i);
+        if (this_top_eff_depth == this_bottom_eff_depth)
+        {
+          coefficients[i][j] = P_ref*exp(-this_top_eff_depth/G)*F*G;
+        }
+        else
+        {
+          coefficients[i][j] = P_ref*(exp(-this_top_eff_depth/G)-
+                                      exp(-this_bottom_eff_depth/G))*F*G*G/
+                                     (this_bottom_eff_depth-this_top_eff_depth);
+        }
       }
-      else if (Nuclide == "Al26")
+    }
+  }
+
+  // now sort the pixels into those with known and unknown erosion rates
+  bool is_erosion_weighted = (known_eff_erosion.size() > 0);
+  double cumulative_production_rate = 0;
+  double known_N = 0;
+  double known_mass = 0;
+  int n_free = 0;
+  production_table_nodes.clear();
+  for (int j = 0; j < n_valid; ++j)
+  {
+    cumulative_production_rate += shielding_no_uncert[j];
+    int q = valid_nodes[j];
+    if (is_erosion_weighted && known_eff_erosion[q] != NoDataValue)
+    {
+      double this_erosion_rate = known_eff_erosion[q];
+      double this_N = 0;
+      for (int i = 0; i<4; i++)
       {
-        eroded_particle.update_26Al_SSfull(eff_erosion_rate,LSDCRNP);
-        Total_N+=eroded_particle.getConc_26Al();
+        this_N += coefficients[i][j]/(this_erosion_rate+production_table_decay_lengths[i]);
       }
-      else
+      known_N += this_erosion_rate*this_N;
+      known_mass += this_erosion_rate;
+    }
+    else
+    {
+      for (int i = 0; i<4; i++)
       {
-        cout << "You didn't give a valid nuclide. You chose: " << Nuclide << endl;
-        cout << "Choices are 10Be, 26Al.  Note these case sensitive and cannot" << endl;
-        cout << "contain spaces or control characters. Defaulting to 10Be." << endl;
-        eroded_particle.update_10Be_SSfull(eff_erosion_rate,LSDCRNP);
-        Total_N+=eroded_particle.getConc_10Be();
+        coefficients[i][n_free] = coefficients[i][j];
       }
-      
-      //cout << endl << endl << "LINE 2052, total shield: " << total_shielding 
-      //     << " erosion: " << eff_erosion_rate << " erosion in cm/kyr with rho = 2650: "
-      //     << eff_erosion_rate*1e6/2650.0 << " and N: " << eroded_particle.getConc_10Be() << endl;
-      
-    }                    
+      production_table_nodes.push_back(q);
+      n_free++;
+    }
   }
 
-  BasinAverage = Total_N/double(count_samples);
-  average_production_rate = cumulative_production_rate/double(count_samples);
-  average_production_uncertainty = average_production_rate*fabs(1-prod_uncert_factor);
-  
-  // replace the production uncertanty
-  production_uncertainty = average_production_uncertainty;
-  
-  // replace the average production rate
-  average_production = average_production_rate;
-      
-  return BasinAverage;
+  // add the solved sub-basins
+  if (use_solved_subbasins)
+  {
+    known_N += subbasin_known_N;
+    known_mass += subbasin_known_mass;
+    cumulative_production_rate += subbasin_production_rate;
+  }
+
+  // the column sums are all that is needed for the basin mean
+  production_table_column_sums.assign(4,0.0);
+  for (int i = 0; i<4; i++)
+  {
+    coefficients[i].resize(n_free);
+    vector<double>& C = coefficients[i];
+    double column_sum = 0;
+    #pragma omp simd reduction(+:column_sum)
+    for (int j = 0; j < n_free; ++j)
+    {
+      column_sum += C[j];
+    }
+    production_table_column_sums[i] = column_sum;
+  }
+  production_table_coefficients.swap(coefficients);
+
+  production_table_is_erosion_weighted = is_erosion_weighted;
+  production_table_known_N = known_N;
+  production_table_known_mass = known_mass;
+  production_table_n_samples = n_valid+n_subbasin;
+  production_table_average_production = cumulative_production_rate/
+                                         double(n_valid+n_subbasin);
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
-
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-// this function returns the concentration of a nuclide as  function of erosion rate
-// The erosion rate should be in g/cm^2/yr
+// This builds the production table if the nuclide, muon scheme, production
+// uncertainty or shielding method have changed since it was last built
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-double LSDCosmoBasin::predict_mean_CRN_conc_with_snow_and_self(double eff_erosion_rate, 
-                                            string Nuclide,
-                                            double prod_uncert_factor, string Muon_scaling,
-                                            bool data_from_outlet_only, 
-                                            double& production_uncertainty, 
-                                            double& average_production,
-                                            bool is_production_uncertainty_plus_on,
-                                            bool is_production_uncertainty_minus_on)
+void LSDCosmoBasin::build_production_table(string Nuclide, string Muon_scaling,
+                                     double prod_uncert_factor,
+                                     bool is_production_uncertainty_plus_on,
+                                     bool is_production_uncertainty_minus_on,
+                                     bool use_eff_depths, bool data_from_outlet_only)
 {
   // production uncertainty factor is a multiplier that sets the production 
   // certainty. If it is 1.1, there is 10% production rate uncertainty, or
-  // if it is 0.9 there is -10% unvertainty. The reason why it is implemented
-  // like this is that this allows gaussian error propigation.
+  // if it is 0.9 there is -10% unvertainty. 
   if (prod_uncert_factor <=0)
   {
     cout << "You have set an unrealistic production uncertainty factor." << endl;
     cout << "Defaulting to 1." << endl;
     prod_uncert_factor = 1;
   }
+
+  // plus uncertainty overrides minus uncertainty
+  int uncert_switch = 0;
+  if(is_production_uncertainty_plus_on)
+  {
+    uncert_switch = 1;
+  }
+  else if(is_production_uncertainty_minus_on)
+  {
+    uncert_switch = -1;
+  }
+
+  int end_node = (data_from_outlet_only) ? 1 : int(BasinNodes.size());
+
+  if (production_table_is_current && production_table_nuclide == Nuclide &&
+      production_table_muon_scaling == Muon_scaling &&
+      production_table_uncert_factor == prod_uncert_factor &&
+      production_table_uncert_switch == uncert_switch &&
+      production_table_use_eff_depths == use_eff_depths &&
+      production_table_end_node == end_node)
+  {
+    return;
+  }
+
+  vector<double> no_known_erosion;
+  fill_production_table(Nuclide, Muon_scaling, prod_uncert_factor,
+                        is_production_uncertainty_plus_on,
+                        is_production_uncertainty_minus_on,
+                        use_eff_depths, end_node, no_known_erosion);
+
+  production_table_nuclide = Nuclide;
+  production_table_muon_scaling = Muon_scaling;
+  production_table_uncert_factor = prod_uncert_factor;
+  production_table_uncert_switch = uncert_switch;
+  production_table_use_eff_depths = use_eff_depths;
+  production_table_end_node = end_node;
+  production_table_is_current = true;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This builds the production table for a nested basin. Pixels where the
+// erosion rate raster has data are folded into a constant. 
+// The table is always rebuilt since it depends on the erosion rate raster.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCosmoBasin::build_production_table_nested(string Nuclide, string Muon_scaling,
+                                     double prod_uncert_factor,
+                                     bool is_production_uncertainty_plus_on,
+                                     bool is_production_uncertainty_minus_on,
+                                     LSDRaster& known_effective_erosion,
+                                     LSDFlowInfo& FlowInfo)
+{
+  if (prod_uncert_factor <=0)
+  {
+    cout << "You have set an unrealistic production uncertainty factor." << endl;
+    cout << "Defaulting to 1." << endl;
+    prod_uncert_factor = 1;
+  }
+
+  // get the known erosion rates of the basin nodes
+  int row,col;
+  int end_node = int(BasinNodes.size());
+  vector<double> known_eff_erosion(end_node);
+  for (int q = 0; q < end_node; ++q)
+  {
+    FlowInfo.retrieve_current_row_and_col(BasinNodes[q], row, col);
+    known_eff_erosion[q] = known_effective_erosion.get_data_element(row,col);
+  }
+
+  fill_production_table(Nuclide, Muon_scaling, prod_uncert_factor,
+                        is_production_uncertainty_plus_on,
+                        is_production_uncertainty_minus_on,
+                        true, end_node, known_eff_erosion);
+
+  production_table_uncert_factor = prod_uncert_factor;
+  production_table_is_current = false;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This records what the basin adds to the concentration of a downstream 
+// nested basin once its erosion rate is known: the erosion weighted 
+// concentration and the total erosion of all of its pixels. A downstream 
+// basin can then use these two numbers in place of every pixel of this basin.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCosmoBasin::record_nested_contribution(double eff_erosion_rate)
+{
+  double sum_N = 0;
+  for (int i = 0; i<4; i++)
+  {
+    sum_N += production_table_column_sums[i]/
+             (eff_erosion_rate+production_table_decay_lengths[i]);
+  }
   
-  // these parameters give the average production rate of the entore basin, 
-  // along with the magnitude of the production uncertainty
-  double cumulative_production_rate = 0;
-  double average_production_rate;
-  double average_production_uncertainty;
-  
-  // the average atoms per gram of the nuclide
-  double BasinAverage;
-  
-  // the total shielding. A product of snow, topographic and production scaling
-  double total_shielding;
-  double total_shielding_no_uncert;
-  
-  // the total atomic concentration of the nuclude in question
-  double Total_N = 0;
+  vector<double> contribution(3);
+  contribution[0] = production_table_known_N+eff_erosion_rate*sum_N;
+  contribution[1] = production_table_known_mass+
+                    double(production_table_nodes.size())*eff_erosion_rate;
+  contribution[2] = production_table_uncert_factor;
+  nested_contributions[production_table_nested_key] = contribution;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This stores a sub-basin that has already been solved.
+// The upslope nodes of a node are a contiguous block of the stack, so the 
+// sub-basin is a contiguous block of the basin nodes starting at its outlet.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCosmoBasin::add_solved_subbasin(LSDFlowInfo& FlowInfo, int subbasin_outlet_node,
+                                        map<string, vector<double> >& contributions)
+{
+  // if nothing was recorded the pixels are taken from the known erosion rates
+  if (contributions.size() == 0)
+  {
+    return;
+  }
   
-  int count_samples = 0;
+  int n_nodes = int(BasinNodes.size());
   
-  // initiate a particle. We'll just repeatedly call this particle
-  // for the sample. 
-  int startType = 0; 
-  double Xloc = 0;
-  double Yloc = 0;
-  double  startdLoc = 0.0;
-  double  start_effdloc = 0.0;
-  double startzLoc = 0.0;
+  // find the outlet of the sub-basin. The outlet of the basin itself is skipped
+  int start_node = 1;
+  while (start_node < n_nodes && BasinNodes[start_node] != subbasin_outlet_node)
+  {
+    start_node++;
+  }
+  if (start_node == n_nodes)
+  {
+    cout << "LSDCosmoBasin::add_solved_subbasin, the sub-basin outlet is not" << endl
+         << "upstream of this basin, ignoring it." << endl;
+    return;
+  }
   
-  // create a particle at zero depth
-  LSDCRNParticle eroded_particle(startType, Xloc, Yloc,
-                               startdLoc, start_effdloc, startzLoc);
+  solved_subbasin_start_nodes.push_back(start_node);
+  solved_subbasin_end_nodes.push_back(start_node+
+                   FlowInfo.retrieve_contributing_pixels_of_node(subbasin_outlet_node));
+  solved_subbasin_contributions.push_back(contributions);
+  production_table_is_current = false;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
-  // now create the CRN parameters object
-  LSDCRNParameters LSDCRNP;
-  
-  // set a special case if the outlet flag is true
-  int end_node;
-  if (data_from_outlet_only)
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This evaluates the basin mean concentration from the production table
+// along with its derivative with respect to the erosion rate. 
+// The erosion rate only enters through the four denominators so the basin 
+// sum is done once, on the column sums, when the table is built.
+// The erosion rate is in g/cm^2/yr
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+double LSDCosmoBasin::evaluate_production_table(double eff_erosion_rate, double& dN_de)
+{
+  double sum_N = 0;
+  double sum_dN = 0;
+  for (int i = 0; i<4; i++)
+  {
+    double denominator = eff_erosion_rate+production_table_decay_lengths[i];
+    sum_N += production_table_column_sums[i]/denominator;
+    sum_dN -= production_table_column_sums[i]/(denominator*denominator);
+  }
+
+  double BasinAverage;
+  if (production_table_is_erosion_weighted)
   {
-    end_node = 1;
+    // the concentration is weighted by the erosion rate of each pixel
+    double n_free = double(production_table_nodes.size());
+    double numerator = production_table_known_N+eff_erosion_rate*sum_N;
+    double denominator = production_table_known_mass+n_free*eff_erosion_rate;
+    BasinAverage = numerator/denominator;
+    dN_de = ((sum_N+eff_erosion_rate*sum_dN)*denominator-numerator*n_free)/
+            (denominator*denominator);
   }
   else
   {
-    end_node =  int(BasinNodes.size());
+    BasinAverage = sum_N/double(production_table_n_samples);
+    dN_de = sum_dN/double(production_table_n_samples);
   }
+  return BasinAverage;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This finds the erosion rate at which sum_k A_k/(e+L_k) equals the 
+// concentration. 
+// It only uses its arguments so it is safe to call from many threads.
+// The erosion rate is in g/cm^2/yr
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+double LSDCosmoBasin::invert_production_sum(double Nuclide_conc, 
+                                            const double* coefficients,
+                                            const double* decay_lengths, int n_terms,
+                                            double initial_guess) const
+{
+  return invert_production_sum(Nuclide_conc, coefficients, decay_lengths, n_terms,
+                               false, 0.0, 0.0, 0.0, initial_guess);
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This finds the erosion rate at which a sum of production terms reproduces
+// the concentration. The concentration is S(e) = sum_k A_k/(e+L_k), or, if it
+// is erosion weighted as in the nested basins, 
+// (known_N+e*S(e))/(known_mass+n_free*e).
+// Some muon schemes have negative coefficients so the sum need not be 
+// convex: the root is bracketed by stepping towards the pole and away from
+// it, and Newton steps that leave the bracket are replaced by bisection. 
+// If no bracket can be found it falls back to plain Newton iteration that 
+// is kept above the pole.
+// It only uses its arguments so it is safe to call from many threads.
+// The erosion rate is in g/cm^2/yr
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+double LSDCosmoBasin::invert_production_sum(double Nuclide_conc, 
+                                            const double* coefficients,
+                                            const double* decay_lengths, int n_terms,
+                                            bool is_erosion_weighted,
+                                            double known_N, double known_mass,
+                                            double n_free, double initial_guess) const
+{
+  double tolerance = 1e-10;     // tolerance for a change in the erosion rate
+  int max_iterations = 200;
+  int max_bracket_steps = 60;
   
-  // set the scaling vector
-  vector<bool> nuclide_scaling_switches(4,false);
-  if (Nuclide == "Be10")
+  // get the pole, where the sum goes to infinity
+  bool have_production = false;
+  double e_pole = 0;
+  for (int k = 0; k<n_terms; k++)
   {
-    nuclide_scaling_switches[0] = true;
+    if (coefficients[k] != 0 && (not have_production || -decay_lengths[k] > e_pole))
+    {
+      e_pole = -decay_lengths[k];
+      have_production = true;
+    }
   }
-  else if (Nuclide == "Al26")
+  if (not have_production)
   {
-    nuclide_scaling_switches[1] = true;
+    return NoDataValue;
   }
-  else
+  
+  // f is the misfit of the concentration, which falls as erosion increases
+  double e = (initial_guess > e_pole) ? initial_guess : e_pole+1e-4;
+  double df;
+  double f = evaluate_production_sum(e, coefficients, decay_lengths, n_terms,
+                                     is_erosion_weighted, known_N, known_mass, 
+                                     n_free, df)-Nuclide_conc;
+  if (f == 0)
   {
-    cout << "LSDBasin line 1583, You didn't choose a valid nuclide. Defaulting"
-         << " to 10Be." << endl;
-    Nuclide = "Be10";
-    nuclide_scaling_switches[0] = true; 
+    return e;
   }
   
-  // check the production uncertainty bools
-  if(is_production_uncertainty_plus_on)
+  // bracket the root: e_pos has a positive misfit and e_neg a negative one
+  double e_pos = e;
+  double e_neg = e;
+  double f_step = f;
+  double df_step;
+  int steps = 0;
+  if (f > 0)
   {
-    if(is_production_uncertainty_minus_on)
+    double step = fabs(e-e_pole);
+    while (f_step > 0 && steps < max_bracket_steps)
     {
-      cout << "You can't have both plus and minus production uncertainty on" << endl;
-      cout << "Setting minus uncertainty to false" << endl;
-      is_production_uncertainty_minus_on = false;
+      e_pos = e_neg;
+      e_neg += step;
+      step *= 2;
+      f_step = evaluate_production_sum(e_neg, coefficients, decay_lengths, n_terms,
+                                       is_erosion_weighted, known_N, known_mass, 
+                                       n_free, df_step)-Nuclide_conc;
+      steps++;
     }
   }
+  else
+  {
+    while (f_step < 0 && steps < max_bracket_steps)
+    {
+      e_neg = e_pos;
+      e_pos = e_pole+0.5*(e_pos-e_pole);
+      f_step = evaluate_production_sum(e_pos, coefficients, decay_lengths, n_terms,
+                                       is_erosion_weighted, known_N, known_mass, 
+                                       n_free, df_step)-Nuclide_conc;
+      steps++;
+    }
+  }
+  bool is_bracketed = (f > 0) ? (f_step <= 0) : (f_step >= 0);
   
-  // parameters for the shielding
-  double this_top_eff_depth;
-  double this_bottom_eff_depth;
-  
-  // loop through the elevation data
-  for (int q = 0; q < end_node; ++q)
+  // now Newton iteration, with bisection if a step leaves the bracket
+  double de;
+  int iterations = 0;
+  do
   {
-    
-    //exclude NDV from average
-    if(topographic_shielding[q] != NoDataValue)
+    de = (df != 0) ? -f/df : 0;
+    double e_new = e+de;
+    if (is_bracketed)
     {
-      count_samples++;
-            
-      // reset scaling parameters. This is necessary since the F values are
-      // reset for local scaling
-      if (Muon_scaling == "Schaller" )
-      {
-        LSDCRNP.set_Schaller_parameters();
-      }
-      else if (Muon_scaling == "Braucher" )
-      {
-        LSDCRNP.set_Braucher_parameters();
-      }
-      else if (Muon_scaling == "Granger" )
-      {
-        LSDCRNP.set_Granger_parameters();
-      }
-      else if (Muon_scaling == "newCRONUS" )
-      {
-        LSDCRNP.set_newCRONUS_parameters();
-      }
-      else
-      {
-        cout << "You didn't set the muon scaling." << endl
-             << "Options are Schaller, Braucher, newCRONUS, and Granger." << endl
-             << "You chose: " << Muon_scaling << endl
-             << "Defaulting to Braucher et al (2009) scaling" << endl;
-        LSDCRNP.set_Braucher_parameters();     
-      }
-      
-      // set the scaling to the correct production uncertainty
-      vector<double> test_uncert;
-      if(is_production_uncertainty_plus_on)
-      {
-        test_uncert = LSDCRNP.set_P0_CRONUS_uncertainty_plus();
-      }
-      else if(is_production_uncertainty_minus_on)
-      {
-        test_uncert = LSDCRNP.set_P0_CRONUS_uncertainty_minus();
-      }
-      
-      // the elevation, snow shielding, topographic shielding
-      // and production scaling are all independent of the erosion rate
-      // and are calculated seperately. 
-      if(  production_scaling.size() < 1 )
-      {
-        cout << "LSDCosmoBasin, trying to precalculate erosion rate." << endl
-             << "Scaling vectors have not been set! You are about to get a seg fault" << endl;
-      }
-      
-      // now you need logic to test if you are accounting for self shielding
-      total_shielding_no_uncert = production_scaling[q]*topographic_shielding[q];
-      total_shielding = prod_uncert_factor*total_shielding_no_uncert;
-      cumulative_production_rate += total_shielding_no_uncert;
-      
-      // scale the F values
-      LSDCRNP.scale_F_values(total_shielding,nuclide_scaling_switches);
-      
-      // check to see if the shielding data exist and if so get the top and bottom
-      // effective depths
-
-      
-      // first get snow shielding (as implemented by and effective depth of snow)
-      if (snow_shield_eff_depth.size() < 1)
-      {
-        this_top_eff_depth = 0;
-      }
-      else if (snow_shield_eff_depth.size() == 1)
-      {
-        this_top_eff_depth = snow_shield_eff_depth[0];
-        //cout << "\n\nSnow shield depth: " <<   this_top_eff_depth << endl;
-      }
-      else
-      {
-        this_top_eff_depth = snow_shield_eff_depth[q];
-        //cout << "\n\nSnow shield depth: " <<   this_top_eff_depth << endl;
-      }
-      
-      // now get the self shielding. This is the thickness of the removed
-      // layer
-      if (self_shield_eff_depth.size() < 1)
-      {
-        this_bottom_eff_depth = this_top_eff_depth;
-      }
-      else if (self_shield_eff_depth.size() == 1)
-      {
-        this_bottom_eff_depth = this_top_eff_depth+self_shield_eff_depth[0];
-        //cout << "\n\n Self shield depth: " << self_shield_eff_depth[0]  << endl;
-      }
-      else
+      if (df == 0 || e_new <= min(e_pos,e_neg) || e_new >= max(e_pos,e_neg))
       {
-        this_bottom_eff_depth = this_top_eff_depth+self_shield_eff_depth[q];
-        //cout << "\n\n Self shield depth: " << self_shield_eff_depth[q]  << endl;
+        e_new = 0.5*(e_pos+e_neg);
+        de = e_new-e;
       }
-      
-      // get the nuclide concentration from this node
-      if (Nuclide == "Be10")
-      {
-        //cout << "LInE 2271, 10Be" << endl;
-        eroded_particle.update_10Be_SSfull_depth_integrated(eff_erosion_rate,LSDCRNP,
-                                           this_top_eff_depth, this_bottom_eff_depth);
-        Total_N+=eroded_particle.getConc_10Be();
-      }
-      else if (Nuclide == "Al26")
-      {
-        //cout << "LINE 2278, 26Al" << endl;
-        eroded_particle.update_26Al_SSfull_depth_integrated(eff_erosion_rate,LSDCRNP,
-                                           this_top_eff_depth, this_bottom_eff_depth);
-        Total_N+=eroded_particle.getConc_26Al();
-      }
-      else
-      {
-        cout << "You didn't give a valid nuclide. You chose: " << Nuclide << endl;
-        cout << "Choices are 10Be, 26Al.  Note these case sensitive and cannot" << endl;
-        cout << "contain spaces or control characters. Defaulting to 10Be." << endl;
-        eroded_particle.update_10Be_SSfull_depth_integrated(eff_erosion_rate,LSDCRNP,
-                                           this_top_eff_depth, this_bottom_eff_depth);
-        Total_N+=eroded_particle.getConc_10Be();         
-      }
-      
-      //cout << endl << endl << "LINE 2052, total shield: " << total_shielding 
-      //     << " erosion: " << eff_erosion_rate << " erosion in cm/kyr with rho = 2650: "
-      //     << eff_erosion_rate*1e6/2650.0 << " and N: " << eroded_particle.getConc_10Be() << endl;      
-      
-    }                    
-  }
-
-  BasinAverage = Total_N/double(count_samples);
-  average_production_rate = cumulative_production_rate/double(count_samples);
-  average_production_uncertainty = average_production_rate*fabs(1-prod_uncert_factor);
-  
-  // replace the production uncertanty
-  production_uncertainty = average_production_uncertainty;
+    }
+    else if (e_new <= e_pole)
+    {
+      e_new = e-0.5*(e-e_pole);
+      de = e_new-e;
+    }
+    e = e_new;
+    
+    f = evaluate_production_sum(e, coefficients, decay_lengths, n_terms,
+                                is_erosion_weighted, known_N, known_mass, 
+                                n_free, df)-Nuclide_conc;
+    if (f > 0)
+    {
+      e_pos = e;
+    }
+    else
+    {
+      e_neg = e;
+    }
+    iterations++;
+  } while (fabs(de) > tolerance && f != 0 && iterations < max_iterations);
   
-  // replace the average production rate
-  average_production = average_production_rate;
-      
-  return BasinAverage;
+  return e;
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-// this function returns the concentration of a nuclide as  function of erosion rate
-// The erosion rate should be in g/cm^2/yr
+// This evaluates the concentration from a sum of production terms, and its
+// derivative with respect to the erosion rate, for invert_production_sum
+// The erosion rate is in g/cm^2/yr
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-double LSDCosmoBasin::predict_mean_CRN_conc_with_snow_and_self_nested(double eff_erosion_rate, 
-                                            LSDRaster& known_effective_erosion,
-                                            LSDFlowInfo& FlowInfo,
-                                            string Nuclide,
-                                            double prod_uncert_factor, string Muon_scaling,
-                                            double& production_uncertainty, 
-                                            double& average_production,
-                                            bool is_production_uncertainty_plus_on,
-                                            bool is_production_uncertainty_minus_on)
+double LSDCosmoBasin::evaluate_production_sum(double eff_erosion_rate,
+                                              const double* coefficients,
+                                              const double* decay_lengths, int n_terms,
+                                              bool is_erosion_weighted,
+                                              double known_N, double known_mass,
+                                              double n_free, double& dN_de) const
 {
-  // production uncertainty factor is a multiplier that sets the production 
-  // certainty. If it is 1.1, there is 10% production rate uncertainty, or
-  // if it is 0.9 there is -10% unvertainty. The reason why it is implemented
-  // like this is that this allows gaussian error propigation.
-  if (prod_uncert_factor <=0)
+  double sum_N = 0;
+  double sum_dN = 0;
+  for (int k = 0; k<n_terms; k++)
   {
-    cout << "You have set an unrealistic production uncertainty factor." << endl;
-    cout << "Defaulting to 1." << endl;
-    prod_uncert_factor = 1;
+    double denominator = eff_erosion_rate+decay_lengths[k];
+    sum_N += coefficients[k]/denominator;
+    sum_dN -= coefficients[k]/(denominator*denominator);
   }
   
-  int end_node;
-  end_node =  int(BasinNodes.size());
-  
-  
-  // these parameters give the average production rate of the entore basin, 
-  // along with the magnitude of the production uncertainty
-  double cumulative_production_rate = 0;
-  double average_production_rate;
-  double average_production_uncertainty;
-  
-  // the average atoms per gram of the nuclide
-  double BasinAverage;
-  
-  // the total shielding. A product of snow, topographic and production scaling
-  double total_shielding;
-  double total_shielding_no_uncert;
-  
-  // the total atomic concentration of the nuclude in question
-  double Total_N = 0;
-  double Total_Mass = 0;
-  
-  int count_samples = 0;
-  
-  // initiate a particle. We'll just repeatedly call this particle
-  // for the sample. 
-  int startType = 0; 
-  double Xloc = 0;
-  double Yloc = 0;
-  double  startdLoc = 0.0;
-  double  start_effdloc = 0.0;
-  double startzLoc = 0.0;
-  
-  int row,col;    // these are for getting the row and column from the know erosion rate raster
-  
-  // create a particle at zero depth
-  LSDCRNParticle eroded_particle(startType, Xloc, Yloc,
-                               startdLoc, start_effdloc, startzLoc);
-
-  // now create the CRN parameters object
-  LSDCRNParameters LSDCRNP;
-  
-  // set the scaling vector
-  vector<bool> nuclide_scaling_switches(4,false);
-  if (Nuclide == "Be10")
-  {
-    nuclide_scaling_switches[0] = true;
-  }
-  else if (Nuclide == "Al26")
+  if (not is_erosion_weighted)
   {
-    nuclide_scaling_switches[1] = true;
+    dN_de = sum_dN;
+    return sum_N;
   }
-  else
+  
+  double numerator = known_N+eff_erosion_rate*sum_N;
+  double denominator = known_mass+n_free*eff_erosion_rate;
+  dN_de = ((sum_N+eff_erosion_rate*sum_dN)*denominator-numerator*n_free)/
+          (denominator*denominator);
+  return numerator/denominator;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This finds the erosion rate that reproduces a nuclide concentration from
+// the production table. The production multiplier scales all production, 
+// so the production uncertainty cases can use the same table.
+// The column sums are turned into the terms of a production sum, which is
+// inverted by invert_production_sum.
+// The erosion rate is in g/cm^2/yr
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+double LSDCosmoBasin::invert_production_table(double Nuclide_conc,
+                                              double production_multiplier,
+                                              double initial_guess)
+{
+  // the mean is over the samples, or, for an erosion weighted table, the
+  // erosion weights of the free pixels are applied by the solver
+  double n_pixels = (production_table_is_erosion_weighted) ? 
+                     double(production_table_nodes.size()) :
+                     double(production_table_n_samples);
+  double term_scaling = (production_table_is_erosion_weighted) ? 
+                         production_multiplier : production_multiplier/n_pixels;
+  double coefficients[4];
+  for (int i = 0; i<4; i++)
   {
-    cout << "LSDBasin line 1583, You didn't choose a valid nuclide. Defaulting"
-         << " to 10Be." << endl;
-    Nuclide = "Be10";
-    nuclide_scaling_switches[0] = true; 
+    coefficients[i] = term_scaling*production_table_column_sums[i];
   }
-  
-  // check the production uncertainty bools
-  if(is_production_uncertainty_plus_on)
+
+  // if there is no guess use spallation alone, with the mean production
+  if (initial_guess <= 0)
   {
-    if(is_production_uncertainty_minus_on)
+    initial_guess = production_multiplier*production_table_column_sums[0]/
+                    (n_pixels*Nuclide_conc)-production_table_decay_lengths[0];
+    if (initial_guess <= 0)
     {
-      cout << "You can't have both plus and minus production uncertainty on" << endl;
-      cout << "Setting minus uncertainty to false" << endl;
-      is_production_uncertainty_minus_on = false;
+      initial_guess = 1e-4;
     }
   }
+
+  return invert_production_sum(Nuclide_conc, coefficients, 
+                               &production_table_decay_lengths[0], 4,
+                               production_table_is_erosion_weighted,
+                               production_multiplier*production_table_known_N,
+                               production_table_known_mass, n_pixels,
+                               initial_guess);
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// this function returns the concentration of a nuclide as  function of erosion rate
+// The erosion rate should be in g/cm^2/yr
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+double LSDCosmoBasin::predict_mean_CRN_conc(double eff_erosion_rate, string Nuclide,
+                                            double prod_uncert_factor, string Muon_scaling,
+                                            bool data_from_outlet_only, 
+                                            double& production_uncertainty, 
+                                            double& average_production,
+                                            bool is_production_uncertainty_plus_on,
+                                            bool is_production_uncertainty_minus_on)
+{
+  // the production table is only rebuilt if the nuclide, muon scheme or 
+  // production uncertainty have changed since the last call
+  build_production_table(Nuclide, Muon_scaling, prod_uncert_factor,
+                         is_production_uncertainty_plus_on,
+                         is_production_uncertainty_minus_on,
+                         false, data_from_outlet_only);
   
-  // parameters for the shielding
-  double this_top_eff_depth;
-  double this_bottom_eff_depth;
+  double dN_de;
+  double BasinAverage = evaluate_production_table(eff_erosion_rate, dN_de);
   
-  // loop through the elevation data
-  for (int q = 0; q < end_node; ++q)
-  {
-    
-    //exclude NDV from average
-    if(topographic_shielding[q] != NoDataValue)
-    {
-      count_samples++;
-            
-      // reset scaling parameters. This is necessary since the F values are
-      // reset for local scaling
-      if (Muon_scaling == "Schaller" )
-      {
-        LSDCRNP.set_Schaller_parameters();
-      }
-      else if (Muon_scaling == "Braucher" )
-      {
-        LSDCRNP.set_Braucher_parameters();
-      }
-      else if (Muon_scaling == "Granger" )
-      {
-        LSDCRNP.set_Granger_parameters();
-      }
-      else if (Muon_scaling == "newCRONUS" )
-      {
-        LSDCRNP.set_newCRONUS_parameters();
-      }
-      else
-      {
-        cout << "You didn't set the muon scaling." << endl
-             << "Options are Schaller, Braucher, newCRONUS, and Granger." << endl
-             << "You chose: " << Muon_scaling << endl
-             << "Defaulting to Braucher et al (2009) scaling" << endl;
-        LSDCRNP.set_Braucher_parameters();     
-      }
-      
-      // set the scaling to the correct production uncertainty
-      vector<double> test_uncert;
-      if(is_production_uncertainty_plus_on)
-      {
-        test_uncert = LSDCRNP.set_P0_CRONUS_uncertainty_plus();
-      }
-      else if(is_production_uncertainty_minus_on)
-      {
-        test_uncert = LSDCRNP.set_P0_CRONUS_uncertainty_minus();
-      }
-      
-      // the elevation, snow shielding, topographic shielding
-      // and production scaling are all independent of the erosion rate
-      // and are calculated seperately. 
-      if(  production_scaling.size() < 1 )
-      {
-        cout << "LSDCosmoBasin, trying to precalculate erosion rate." << endl
-             << "Scaling vectors have not been set! You are about to get a seg fault" << endl;
-      }
-      
-      // now you need logic to test if you are accounting for self shielding
-      total_shielding_no_uncert = production_scaling[q]*topographic_shielding[q];
-      total_shielding = prod_uncert_factor*total_shielding_no_uncert;
-      cumulative_production_rate += total_shielding_no_uncert;
-      
-      // scale the F values
-      LSDCRNP.scale_F_values(total_shielding,nuclide_scaling_switches);
-      
-      // check to see if the shielding data exist and if so get the top and bottom
-      // effective depths
-      // first get snow shielding (as implemented by and effective depth of snow)
-      if (snow_shield_eff_depth.size() < 1)
-      {
-        this_top_eff_depth = 0;
-      }
-      else if (snow_shield_eff_depth.size() == 1)
-      {
-        this_top_eff_depth = snow_shield_eff_depth[0];
-        //cout << "\n\nSnow shield depth: " <<   this_top_eff_depth << endl;
-      }
-      else
-      {
-        this_top_eff_depth = snow_shield_eff_depth[q];
-        //cout << "\n\nSnow shield depth: " <<   this_top_eff_depth << endl;
-      }
-      
-      // now get the self shielding. This is the thickness of the removed
-      // layer
-      if (self_shield_eff_depth.size() < 1)
-      {
-        this_bottom_eff_depth = this_top_eff_depth;
-      }
-      else if (self_shield_eff_depth.size() == 1)
-      {
-        this_bottom_eff_depth = this_top_eff_depth+self_shield_eff_depth[0];
-        //cout << "\n\n Self shield depth: " << self_shield_eff_depth[0]  << endl;
-      }
-      else
-      {
-        this_bottom_eff_depth = this_top_eff_depth+self_shield_eff_depth[q];
-        //cout << "\n\n Self shield depth: " << self_shield_eff_depth[q]  << endl;
-      }
-      
-      // get the nuclide concentration from this node
-      // get the row and column of the node
-      FlowInfo.retrieve_current_row_and_col(BasinNodes[q], row, col);
-    
-      // get the erosion rate from the raster
-      float this_erosion_rate = known_effective_erosion.get_data_element(row,col);
-    
-      // check if there is a data value in the raster, if this is the case then
-      // calculate the concentration based on the erosion from this raster 
-      if( this_erosion_rate != NoDataValue)
-      {
-        //cout << "This pixel at " << row << "," << col << " has an erate of: " << this_erosion_rate << endl;
-
-        if (Nuclide == "Be10")
-        {
-          //cout << "LInE 2271, 10Be" << endl;
-          eroded_particle.update_10Be_SSfull_depth_integrated(this_erosion_rate,LSDCRNP,
-                                             this_top_eff_depth, this_bottom_eff_depth);
-           Total_N+=this_erosion_rate*eroded_particle.getConc_10Be();
-           Total_Mass+=this_erosion_rate;
-        }
-        else if (Nuclide == "Al26")
-        {
-          //cout << "LINE 2278, 26Al" << endl;
-          eroded_particle.update_26Al_SSfull_depth_integrated(this_erosion_rate,LSDCRNP,
-                                             this_top_eff_depth, this_bottom_eff_depth);
-          Total_N+=this_erosion_rate*eroded_particle.getConc_26Al();
-          Total_Mass+=this_erosion_rate;
-        }
-        else
-        {
-          cout << "You didn't give a valid nuclide. You chose: " << Nuclide << endl;
-          cout << "Choices are 10Be, 26Al.  Note these case sensitive and cannot" << endl;
-          cout << "contain spaces or control characters. Defaulting to 10Be." << endl;
-          eroded_particle.update_10Be_SSfull_depth_integrated(this_erosion_rate,LSDCRNP,
-                                             this_top_eff_depth, this_bottom_eff_depth);
-          Total_N+=this_erosion_rate*eroded_particle.getConc_10Be();
-          Total_Mass+=this_erosion_rate;
-        }
-      }
-      else  // this is the erosion rate not previously calculated (i.e., not in the raster)
-      {
-        if (Nuclide == "Be10")
-        {
-          //cout << "LInE 2271, 10Be" << endl;
-          eroded_particle.update_10Be_SSfull_depth_integrated(eff_erosion_rate,LSDCRNP,
-                                             this_top_eff_depth, this_bottom_eff_depth);
-           Total_N+=eff_erosion_rate*eroded_particle.getConc_10Be();
-           Total_Mass+=eff_erosion_rate;
-        }
-        else if (Nuclide == "Al26")
-        {
-          //cout << "LINE 2278, 26Al" << endl;
-          eroded_particle.update_26Al_SSfull_depth_integrated(eff_erosion_rate,LSDCRNP,
-                                             this_top_eff_depth, this_bottom_eff_depth);
-          Total_N+=eff_erosion_rate*eroded_particle.getConc_26Al();
-          Total_Mass+=eff_erosion_rate;
-        }
-        else
-        {
-          cout << "You didn't give a valid nuclide. You chose: " << Nuclide << endl;
-          cout << "Choices are 10Be, 26Al.  Note these case sensitive and cannot" << endl;
-          cout << "contain spaces or control characters. Defaulting to 10Be." << endl;
-          eroded_particle.update_10Be_SSfull_depth_integrated(eff_erosion_rate,LSDCRNP,
-                                             this_top_eff_depth, this_bottom_eff_depth);
-          Total_N+=eff_erosion_rate*eroded_particle.getConc_10Be();
-          Total_Mass+=eff_erosion_rate;
-        }
-      }
+  // replace the production uncertanty
+  production_uncertainty = production_table_average_production*
+                           fabs(1-production_table_uncert_factor);
+  
+  // replace the average production rate
+  average_production = production_table_average_production;
       
-    }                    
-  }
+  return BasinAverage;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
 
-  BasinAverage = Total_N/Total_Mass;
-  average_production_rate = cumulative_production_rate/double(count_samples);
-  average_production_uncertainty = average_production_rate*fabs(1-prod_uncert_factor);
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// this function returns the concentration of a nuclide as  function of erosion rate
+// The erosion rate should be in g/cm^2/yr
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+double LSDCosmoBasin::predict_mean_CRN_conc_with_snow_and_self(double eff_erosion_rate, 
+                                            string Nuclide,
+                                            double prod_uncert_factor, string Muon_scaling,
+                                            bool data_from_outlet_only, 
+                                            double& production_uncertainty, 
+                                            double& average_production,
+                                            bool is_production_uncertainty_plus_on,
+                                            bool is_production_uncertainty_minus_on)
+{
+  // the production table is only rebuilt if the nuclide, muon scheme or 
+  // production uncertainty have changed since the last call
+  build_production_table(Nuclide, Muon_scaling, prod_uncert_factor,
+                         is_production_uncertainty_plus_on,
+                         is_production_uncertainty_minus_on,
+                         true, data_from_outlet_only);
+  
+  double dN_de;
+  double BasinAverage = evaluate_production_table(eff_erosion_rate, dN_de);
+  
+  // replace the production uncertanty
+  production_uncertainty = production_table_average_production*
+                           fabs(1-production_table_uncert_factor);
   
-  //cout << "Basin average is: " << BasinAverage << " and effective erosion: " << eff_erosion_rate << endl;
+  // replace the average production rate
+  average_production = production_table_average_production;
+      
+  return BasinAverage;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// this function returns the concentration of a nuclide as  function of erosion rate
+// The erosion rate should be in g/cm^2/yr
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+double LSDCosmoBasin::predict_mean_CRN_conc_with_snow_and_self_nested(double eff_erosion_rate, 
+                                            LSDRaster& known_effective_erosion,
+                                            LSDFlowInfo& FlowInfo,
+                                            string Nuclide,
+                                            double prod_uncert_factor, string Muon_scaling,
+                                            double& production_uncertainty, 
+                                            double& average_production,
+                                            bool is_production_uncertainty_plus_on,
+                                            bool is_production_uncertainty_minus_on)
+{
+  // the nested table depends on the erosion rate raster so it is rebuilt
+  // every call. predict_CRN_erosion_nested builds it once instead.
+  build_production_table_nested(Nuclide, Muon_scaling, prod_uncert_factor,
+                                is_production_uncertainty_plus_on,
+                                is_production_uncertainty_minus_on,
+                                known_effective_erosion, FlowInfo);
+  
+  double dN_de;
+  double BasinAverage = evaluate_production_table(eff_erosion_rate, dN_de);
   
   // replace the production uncertanty
-  production_uncertainty = average_production_uncertainty;
+  production_uncertainty = production_table_average_production*
+                           fabs(1-production_table_uncert_factor);
   
   // replace the average production rate
-  average_production = average_production_rate;
+  average_production = production_table_average_production;
       
   return BasinAverage;
 }
@@ -3882,7 +3982,7 @@ bool LSDCosmoBasin::are_there_unknown_erosion_rates_in_basin(LSDRaster& known_er
   
   // loop through the basin nodes. The logic stops as soon as it finds one unknown
   int q = 0;
-  while( are_there_unknowns == false && q <= end_node)
+  while( are_there_unknowns == false && q < end_node)
   {
     // get the row and column of the node
     FlowInfo.retrieve_current_row_and_col(BasinNodes[q], row, col);
@@ -4738,160 +4838,42 @@ void LSDCosmoBasin::print_CRN_conc_raster(string filename,
   // the row and col
   int row,col;
   
-  // initiate a particle. We'll just repeatedly call this particle
-  // for the sample. 
-  int startType = 0; 
-  double Xloc = 0;
-  double Yloc = 0;
-  double  startdLoc = 0.0;
-  double  start_effdloc = 0.0;
-  double startzLoc = 0.0;
-  
-  // create a particle at zero depth
-  LSDCRNParticle eroded_particle(startType, Xloc, Yloc,
-                               startdLoc, start_effdloc, startzLoc);
-
-  // now create the CRN parameters object
-  LSDCRNParameters LSDCRNP;
-  
-  double total_shielding;
+  // the concentrations come from the production table, which has the 
+  // scaling and effective depth shielding of every pixel
+  bool is_production_uncertainty_plus_on = false;
+  bool is_production_uncertainty_minus_on = false;
+  bool use_eff_depths = true;
+  bool data_from_outlet_only = false;
+  double prod_uncert_factor = 1;
+  build_production_table(Nuclide, Muon_scaling, prod_uncert_factor,
+                         is_production_uncertainty_plus_on,
+                         is_production_uncertainty_minus_on,
+                         use_eff_depths, data_from_outlet_only);
   
-  // set a special case if the outlet flag is true
-  int end_node =  int(BasinNodes.size());
-
-  // set the scaling vector
-  vector<bool> nuclide_scaling_switches(4,false);
-  if (Nuclide == "Be10")
-  {
-    nuclide_scaling_switches[0] = true;
-  }
-  else if (Nuclide == "Al26")
+  double inv_denominator[4];
+  for (int i = 0; i<4; i++)
   {
-    nuclide_scaling_switches[1] = true;
+    inv_denominator[i] = 1.0/(eff_erosion_rate+production_table_decay_lengths[i]);
   }
-  else
+  
+  int n_nodes = int(production_table_nodes.size());
+  vector<double> pixel_conc(n_nodes);
+  const vector<double>& C0 = production_table_coefficients[0];
+  const vector<double>& C1 = production_table_coefficients[1];
+  const vector<double>& C2 = production_table_coefficients[2];
+  const vector<double>& C3 = production_table_coefficients[3];
+  vector<double>& N = pixel_conc;
+  #pragma omp simd
+  for (int j = 0; j < n_nodes; ++j)
   {
-    cout << "LSDBasin line 1583, You didn't choose a valid nuclide. Defaulting"
-         << " to 10Be." << endl;
-    Nuclide = "Be10";
-    nuclide_scaling_switches[0] = true; 
+    N[j] = C0[j]*inv_denominator[0]+C1[j]*inv_denominator[1]+
+           C2[j]*inv_denominator[2]+C3[j]*inv_denominator[3];
   }
-
-  // parameters for the shielding
-  double this_top_eff_depth;
-  double this_bottom_eff_depth;
   
-  // loop through the elevation data
-  for (int q = 0; q < end_node; ++q)
+  for (int j = 0; j < n_nodes; ++j)
   {
-    
-    //exclude NDV from average
-    if(topographic_shielding[q] != NoDataValue)
-    {
-    
-      // get the row and column
-      FlowInfo.retrieve_current_row_and_col(BasinNodes[q], row, col);
-            
-      // reset scaling parameters. This is necessary since the F values are
-      // reset for local scaling
-      if (Muon_scaling == "Schaller" )
-      {
-        LSDCRNP.set_Schaller_parameters();
-      }
-      else if (Muon_scaling == "Braucher" )
-      {
-        LSDCRNP.set_Braucher_parameters();
-      }
-      else if (Muon_scaling == "Granger" )
-      {
-        LSDCRNP.set_Granger_parameters();
-      }
-      else if (Muon_scaling == "newCRONUS" )
-      {
-        LSDCRNP.set_newCRONUS_parameters();
-      }
-      else
-      {
-        cout << "You didn't set the muon scaling." << endl
-             << "Options are Schaller, Braucher, newCRONUS, and Granger." << endl
-             << "You chose: " << Muon_scaling << endl
-             << "Defaulting to Braucher et al (2009) scaling" << endl;
-        LSDCRNP.set_Braucher_parameters();     
-      }
-      
-      // the elevation, snow shielding, topographic shielding
-      // and production scaling are all independent of the erosion rate
-      // and are calculated seperately. 
-      if(  production_scaling.size() < 1 )
-      {
-        cout << "LSDCosmoBasin, trying to precalculate erosion rate." << endl
-             << "Scaling vectors have not been set! You are about to get a seg fault" << endl;
-      }
-      
-      // get the scaling
-      total_shielding = production_scaling[q]*topographic_shielding[q];
-      
-      // scale the F values
-      LSDCRNP.scale_F_values(total_shielding,nuclide_scaling_switches);
-      
-      // first get snow shielding (as implemented by and effective depth of snow)
-      if (snow_shield_eff_depth.size() < 1)
-      {
-        this_top_eff_depth = 0;
-      }
-      else if (snow_shield_eff_depth.size() == 1)
-      {
-        this_top_eff_depth = snow_shield_eff_depth[0];
-        //cout << "\n\nSnow shield depth: " <<   this_top_eff_depth << endl;
-      }
-      else
-      {
-        this_top_eff_depth = snow_shield_eff_depth[q];
-        //cout << "\n\nSnow shield depth: " <<   this_top_eff_depth << endl;
-      }
-      
-      // now get the self shielding. This is the thickness of the removed
-      // layer
-      if (self_shield_eff_depth.size() < 1)
-      {
-        this_bottom_eff_depth = this_top_eff_depth;
-      }
-      else if (self_shield_eff_depth.size() == 1)
-      {
-        this_bottom_eff_depth = this_top_eff_depth+self_shield_eff_depth[0];
-        //cout << "\n\n Self shield depth: " << self_shield_eff_depth[0]  << endl;
-      }
-      else
-      {
-        this_bottom_eff_depth = this_top_eff_depth+self_shield_eff_depth[q];
-        //cout << "\n\n Self shield depth: " << self_shield_eff_depth[q]  << endl;
-      }
-      
-      // get the nuclide concentration from this node
-      if (Nuclide == "Be10")
-      {
-        //cout << "LInE 2271, 10Be" << endl;
-        eroded_particle.update_10Be_SSfull_depth_integrated(eff_erosion_rate,LSDCRNP,
-                                           this_top_eff_depth, this_bottom_eff_depth);
-        Conc_Data[row][col] = eroded_particle.getConc_10Be();                                   
-      }
-      else if (Nuclide == "Al26")
-      {
-        //cout << "LINE 2278, 26Al" << endl;
-        eroded_particle.update_26Al_SSfull_depth_integrated(eff_erosion_rate,LSDCRNP,
-                                           this_top_eff_depth, this_bottom_eff_depth);
-        Conc_Data[row][col] = eroded_particle.getConc_26Al();
-      }
-      else
-      {
-        cout << "You didn't give a valid nuclide. You chose: " << Nuclide << endl;
-        cout << "Choices are 10Be, 26Al.  Note these case sensitive and cannot" << endl;
-        cout << "contain spaces or control characters. Defaulting to 10Be." << endl;
-        eroded_particle.update_10Be_SSfull_depth_integrated(eff_erosion_rate,LSDCRNP,
-                                           this_top_eff_depth, this_bottom_eff_depth);
-        Conc_Data[row][col] = eroded_particle.getConc_10Be();         
-      }
-    }                    
+    FlowInfo.retrieve_current_row_and_col(BasinNodes[production_table_nodes[j]], row, col);
+    Conc_Data[row][col] = pixel_conc[j];
   }
   
   // now write the raster
@@ -4933,40 +4915,40 @@ void LSDCosmoBasin::print_particle_csv(string path_to_file, string filename,
     populate_scaling_vectors(FlowInfo, Elevation_Data, T_Shield, path_to_atmospheric_data);
   }
 
-  // the latitude and longitude
-  double lat,longitude;
+  // the location and shielding of each node
   float Easting, Northing;
-  double this_pressure,this_elevation,this_SShield,this_TShield,this_PShield;
+  double this_elevation,this_SShield,this_TShield,this_PShield;
   int row,col;
   
-  // decalre converter object
-  LSDCoordinateConverterLLandUTM Converter;
-  
-  // get the CRN parameters
-  LSDCRNParameters LSDCRNP;
+  // get the pressure of every node in one go
+  vector<double> pressure;
+  vector<double> scaling;
+  get_pressure_and_scaling_of_basin_nodes(FlowInfo, Elevation_Data, 
+                               path_to_atmospheric_data, pressure, scaling);
   
-  // get the atmospheric parameters
-  LSDCRNP.load_parameters_for_atmospheric_scaling(path_to_atmospheric_data);
-  LSDCRNP.set_CRONUS_data_maps();
+  // and the lat and long
+  vector<int> node_rows(n_nodes);
+  vector<int> node_cols(n_nodes);
+  for(int n = 0; n < n_nodes; n++)
+  {
+    FlowInfo.retrieve_current_row_and_col(BasinNodes[n], node_rows[n], node_cols[n]);
+  }
+  LSDCoordinateConverterLLandUTM Converter;
+  vector<double> lat,longitude;
+  Elevation_Data.get_lat_and_long_locations(node_rows, node_cols, lat, longitude,
+                                            Converter);
   
   // now loop through nodes, printing the location and scaling
   for(int n = 0; n < n_nodes; n++)
   {
-    FlowInfo.retrieve_current_row_and_col(BasinNodes[n], row, col);
+    row = node_rows[n];
+    col = node_cols[n];
     
     //exclude NDV from average
     if (Elevation_Data.get_data_element(row,col) != NoDataValue)
     {
-      // To get pressure, first get the lat and long
-      Elevation_Data.get_lat_and_long_locations(row, col, lat, longitude, Converter);
       Elevation_Data.get_x_and_y_locations(row, col, Easting, Northing);
-      //Elevation_Data.get_lat_and_long_locations(row, col, lat, longitude);
-
-
-      // now the pressure
       this_elevation = Elevation_Data.get_data_element(row,col);
-      this_pressure = LSDCRNP.NCEPatm_2(double(lat), double(longitude), 
-                                        double(this_elevation));
 
       // get the shielding
       this_TShield = topographic_shielding[n];
@@ -4974,8 +4956,8 @@ void LSDCosmoBasin::print_particle_csv(string path_to_file, string filename,
       this_PShield = production_scaling[n];      
 
       // now print to file
-      cosmo_out << n+1 << ","<<Easting<<","<<Northing<<","<<lat<<","<<longitude
-                <<","<<this_elevation<<","<<this_pressure<<","<<this_TShield<<","
+      cosmo_out << n+1 << ","<<Easting<<","<<Northing<<","<<lat[n]<<","<<longitude[n]
+                <<","<<this_elevation<<","<<pressure[n]<<","<<this_TShield<<","
                 <<this_PShield<<","<<this_SShield<< endl;
     }
   }
@@ -8,6 +8,7 @@
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <map>
 #include "TNT/tnt.h"
 #include "LSDFlowInfo.hpp"
 #include "LSDRaster.hpp"
@@ -154,7 +155,7 @@ class LSDBasin
   /// @return Mean value.
   /// @author SWDG
   /// @date 11/12/13
-  float CalculateBasinMean(LSDFlowInfo& FlowInfo, LSDRaster Data);
+  float CalculateBasinMean(LSDFlowInfo& FlowInfo, LSDRaster& Data);
 
   /// @brief Calculate the max value of an LSDRaster which falls inside a basin.
   /// @param FlowInfo Flowinfo object.
@@ -162,7 +163,7 @@ class LSDBasin
   /// @return Max value.
   /// @author SWDG
   /// @date 11/12/13
-  float CalculateBasinMax(LSDFlowInfo& FlowInfo, LSDRaster Data);
+  float CalculateBasinMax(LSDFlowInfo& FlowInfo, LSDRaster& Data);
 
   /// @brief Calculate the min value of an LSDRaster which falls inside a basin.
   /// @param FlowInfo Flowinfo object.
@@ -170,7 +171,7 @@ class LSDBasin
   /// @return Min value.
   /// @author SWDG
   /// @date 17/2/14
-  float CalculateBasinMin(LSDFlowInfo& FlowInfo, LSDRaster Data);
+  float CalculateBasinMin(LSDFlowInfo& FlowInfo, LSDRaster& Data);
 
   /// @brief Calculate the median value of an LSDRaster which falls inside a basin.
   /// @param FlowInfo Flowinfo object.
@@ -178,7 +179,7 @@ class LSDBasin
   /// @return Median value.
   /// @author SWDG
   /// @date 17/2/14
-  float CalculateBasinMedian(LSDFlowInfo& FlowInfo, LSDRaster Data);
+  float CalculateBasinMedian(LSDFlowInfo& FlowInfo, LSDRaster& Data);
 
   /// @brief Calculate the percentile value of an LSDRaster which falls inside a basin.
   /// @param FlowInfo Flowinfo object.
@@ -186,7 +187,7 @@ class LSDBasin
   /// @return Percentile value.
   /// @author SWDG
   /// @date 5/2/17
-  float CalculateBasinPercentile(LSDFlowInfo& FlowInfo, LSDRaster Data, int Percentile); 
+  float CalculateBasinPercentile(LSDFlowInfo& FlowInfo, LSDRaster& Data, int Percentile); 
 
   /// @brief Calculate the Standard Deviation of values of an LSDRaster which falls inside a basin.
   /// @param FlowInfo Flowinfo object.
@@ -194,7 +195,7 @@ class LSDBasin
   /// @return Standard deviation value.
   /// @author SWDG
   /// @date 17/2/14
-  float CalculateBasinStdDev(LSDFlowInfo& FlowInfo, LSDRaster Data);
+  float CalculateBasinStdDev(LSDFlowInfo& FlowInfo, LSDRaster& Data);
 
   /// @brief Calculate the Standard error of values of an LSDRaster which falls inside a basin.
   /// @param FlowInfo Flowinfo object.
@@ -202,7 +203,7 @@ class LSDBasin
   /// @return Standard error value.
   /// @author SWDG
   /// @date 17/2/14
-  float CalculateBasinStdError(LSDFlowInfo& FlowInfo, LSDRaster Data);
+  float CalculateBasinStdError(LSDFlowInfo& FlowInfo, LSDRaster& Data);
 
   /// @brief Calculate the range of values of an LSDRaster which falls inside a basin.
   /// @param FlowInfo Flowinfo object.
@@ -210,7 +211,7 @@ class LSDBasin
   /// @return Range value.
   /// @author SWDG
   /// @date 17/2/14
-  float CalculateBasinRange(LSDFlowInfo& FlowInfo, LSDRaster Data);
+  float CalculateBasinRange(LSDFlowInfo& FlowInfo, LSDRaster& Data);
 
   /// @brief Calculate the number of data points of an LSDRaster which fall inside a basin.
   ///
@@ -220,77 +221,77 @@ class LSDBasin
   /// @return Number of data points.
   /// @author SWDG
   /// @date 17/2/14
-  int CalculateNumDataPoints(LSDFlowInfo& FlowInfo, LSDRaster Data);
+  int CalculateNumDataPoints(LSDFlowInfo& FlowInfo, LSDRaster& Data);
 
   /// @brief Set the mean slope of a basin.
   /// @param FlowInfo Flowinfo object.
   /// @param Slope Values to find the mean of.
   /// @author SWDG
   /// @date 11/12/13
-  void set_SlopeMean(LSDFlowInfo& FlowInfo, LSDRaster Slope){ SlopeMean = CalculateBasinMean(FlowInfo, Slope); }
+  void set_SlopeMean(LSDFlowInfo& FlowInfo, LSDRaster& Slope){ SlopeMean = CalculateBasinMean(FlowInfo, Slope); }
 
   /// @brief Set the mean Elevation of a basin.
   /// @param FlowInfo Flowinfo object.
   /// @param Elevation Values to find the mean of.
   /// @author SWDG
   /// @date 11/12/13
-  void set_ElevationMean(LSDFlowInfo& FlowInfo, LSDRaster Elevation) { ElevationMean = CalculateBasinMean(FlowInfo, Elevation); }
+  void set_ElevationMean(LSDFlowInfo& FlowInfo, LSDRaster& Elevation) { ElevationMean = CalculateBasinMean(FlowInfo, Elevation); }
 
   /// @brief Set the mean Relief of a basin.
   /// @param FlowInfo Flowinfo object.
   /// @param Relief Values to find the mean of.
   /// @author SWDG
   /// @date 11/12/13
-  void set_ReliefMean(LSDFlowInfo& FlowInfo, LSDRaster Relief) { ReliefMean = CalculateBasinMean(FlowInfo, Relief); }
+  void set_ReliefMean(LSDFlowInfo& FlowInfo, LSDRaster& Relief) { ReliefMean = CalculateBasinMean(FlowInfo, Relief); }
 
   /// @brief Set the mean PlanCurve of a basin.
   /// @param FlowInfo Flowinfo object.
   /// @param PlanCurv Values to find the mean of.
   /// @author SWDG
   /// @date 11/12/13
-  void set_PlanCurvMean(LSDFlowInfo& FlowInfo, LSDRaster PlanCurv) { PlanCurvMean = CalculateBasinMean(FlowInfo, PlanCurv); }
+  void set_PlanCurvMean(LSDFlowInfo& FlowInfo, LSDRaster& PlanCurv) { PlanCurvMean = CalculateBasinMean(FlowInfo, PlanCurv); }
 
   /// @brief Set the mean ProfCurv of a basin.
   /// @param FlowInfo Flowinfo object.
   /// @param ProfileCurv Values to find the mean of.
   /// @author SWDG
   /// @date 11/12/13
-  void set_ProfileCurvMean(LSDFlowInfo& FlowInfo, LSDRaster ProfileCurv) { ProfileCurvMean = CalculateBasinMean(FlowInfo, ProfileCurv); }
+  void set_ProfileCurvMean(LSDFlowInfo& FlowInfo, LSDRaster& ProfileCurv) { ProfileCurvMean = CalculateBasinMean(FlowInfo, ProfileCurv); }
 
   /// @brief Set the mean TotalCurv of a basin.
   /// @param FlowInfo Flowinfo object.
   /// @param TotalCurv Values to find the mean of.
   /// @author SWDG
   /// @date 11/12/13
-  void set_TotalCurvMean(LSDFlowInfo& FlowInfo, LSDRaster TotalCurv) { TotalCurvMean = CalculateBasinMean(FlowInfo, TotalCurv); }
+  void set_TotalCurvMean(LSDFlowInfo& FlowInfo, LSDRaster& TotalCurv) { TotalCurvMean = CalculateBasinMean(FlowInfo, TotalCurv); }
 
   /// @brief Set the max PlanCurve of a basin.
   /// @param FlowInfo Flowinfo object.
   /// @param PlanCurv Values to find the max of.
   /// @author SWDG
   /// @date 11/12/13
-  void set_PlanCurvMax(LSDFlowInfo& FlowInfo, LSDRaster PlanCurv) { PlanCurvMax = CalculateBasinMax(FlowInfo, PlanCurv); }
+  void set_PlanCurvMax(LSDFlowInfo& FlowInfo, LSDRaster& PlanCurv) { PlanCurvMax = CalculateBasinMax(FlowInfo, PlanCurv); }
 
   /// @brief Set the max ProfCurv of a basin.
   /// @param FlowInfo Flowinfo object.
   /// @param ProfileCurv Values to find the max of.
   /// @author SWDG
   /// @date 11/12/13
-  void set_ProfileCurvMax(LSDFlowInfo& FlowInfo, LSDRaster ProfileCurv) { ProfileCurvMax = CalculateBasinMax(FlowInfo, ProfileCurv); }
+  void set_ProfileCurvMax(LSDFlowInfo& FlowInfo, LSDRaster& ProfileCurv) { ProfileCurvMax = CalculateBasinMax(FlowInfo, ProfileCurv); }
 
   /// @brief Set the max TotalCurv of a basin.
   /// @param FlowInfo Flowinfo object.
   /// @param TotalCurv Values to find the max of.
   /// @author SWDG
   /// @date 11/12/13
-  void set_TotalCurvMax(LSDFlowInfo& FlowInfo, LSDRaster TotalCurv) { TotalCurvMax = CalculateBasinMax(FlowInfo, TotalCurv); }
+  void set_TotalCurvMax(LSDFlowInfo& FlowInfo, LSDRaster& TotalCurv) { TotalCurvMax = CalculateBasinMax(FlowInfo, TotalCurv); }
 
   /// @brief Set the mean hilltop curvature of a basin.
   /// @param FlowInfo Flowinfo object.
   /// @param CHT Values to find the mean of.
   /// @author SWDG
   /// @date 12/12/13
-  void set_CHTMean(LSDFlowInfo& FlowInfo, LSDRaster CHT) { CHTMean = CalculateBasinMean(FlowInfo, CHT); }
+  void set_CHTMean(LSDFlowInfo& FlowInfo, LSDRaster& CHT) { CHTMean = CalculateBasinMean(FlowInfo, CHT); }
 
   /// @brief Set the Cosmogenic erosion rate.
   /// @param ErosionRate Erosion rate - No sanity check on this value.
@@ -327,7 +328,7 @@ class LSDBasin
   /// @param HillslopeLengths Values to find the mean of.
   /// @author SWDG
   /// @date 12/12/13
-  void set_HillslopeLength_HFR(LSDFlowInfo& FlowInfo, LSDRaster HillslopeLengths) { HillslopeLength_HFR = CalculateBasinMean(FlowInfo, HillslopeLengths); }
+  void set_HillslopeLength_HFR(LSDFlowInfo& FlowInfo, LSDRaster& HillslopeLengths) { HillslopeLength_HFR = CalculateBasinMean(FlowInfo, HillslopeLengths); }
 
   /// @brief Set mean HillslopeLengths from boomerang plots from both splines and binned data.
   /// @param Slope LSDRaster of slope.
@@ -348,9 +349,9 @@ class LSDBasin
   /// @brief Set the Rock Exposure fraction of the basin
   /// @author DTM
   /// @date 14/07/15
-  void set_BedrockFraction(LSDFlowInfo& FlowInfo, LSDRaster RockExposure) { BedrockFraction = CalculateBasinMean(FlowInfo, RockExposure); }
+  void set_BedrockFraction(LSDFlowInfo& FlowInfo, LSDRaster& RockExposure) { BedrockFraction = CalculateBasinMean(FlowInfo, RockExposure); }
 
-  void set_Biomass(LSDFlowInfo& FlowInfo, LSDRaster BiomassRaster) { Biomass = CalculateBasinMean(FlowInfo, BiomassRaster); }
+  void set_Biomass(LSDFlowInfo& FlowInfo, LSDRaster& BiomassRaster) { Biomass = CalculateBasinMean(FlowInfo, BiomassRaster); }
 
   void set_AlternativeIndex(LSDFlowInfo& FlowInfo, LSDIndexRaster& AltIndex);
 
@@ -375,7 +376,7 @@ class LSDBasin
   /// @param Aspect Values to find the mean of.
   /// @author SWDG
   /// @date 17/2/14
-  void set_AspectMean(LSDFlowInfo& FlowInfo, LSDRaster Aspect);
+  void set_AspectMean(LSDFlowInfo& FlowInfo, LSDRaster& Aspect);
 
   /// @brief Set the perimeter pixels using a simple edge detection algorithm.
   ///
@@ -436,7 +437,7 @@ class LSDBasin
   /// @param Hilltops a raster of hilltop data.
   /// @author SWDG
   /// @date 18/6/15
-  void set_HilltopPx(LSDFlowInfo& FlowInfo, LSDRaster Hilltops);
+  void set_HilltopPx(LSDFlowInfo& FlowInfo, LSDRaster& Hilltops);
 
   /// @brief Cookie cut data from an LSDIndexRaster into the shape of the basin.
   /// @param Data LSDIndexRaster data to be written.
@@ -444,7 +445,7 @@ class LSDBasin
   /// @return LSDIndexRaster of the data in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDIndexRaster write_raster_data_to_LSDIndexRaster(LSDIndexRaster Data, LSDFlowInfo FlowInfo);
+  LSDIndexRaster write_raster_data_to_LSDIndexRaster(LSDIndexRaster& Data, LSDFlowInfo& FlowInfo);
 
   /// @brief Cookie cut data from an LSDRaster into the shape of the basin.
   /// @param Data LSDRaster data to be written.
@@ -452,7 +453,7 @@ class LSDBasin
   /// @return LSDRaster of the data in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_raster_data_to_LSDRaster(LSDRaster Data, LSDFlowInfo FlowInfo);
+  LSDRaster write_raster_data_to_LSDRaster(LSDRaster& Data, LSDFlowInfo& FlowInfo);
 
   /// @brief check whether a test node is in the basin or not
   /// @param test_node node to test
@@ -482,7 +483,7 @@ class LSDBasin
   /// @return LSDRaster of internal hilltop curvature values
   /// @author FJC
   /// @date 19/03/15
-  LSDRaster keep_only_internal_hilltop_curvature(LSDRaster hilltop_curvature, LSDFlowInfo FlowInfo);
+  LSDRaster keep_only_internal_hilltop_curvature(LSDRaster& hilltop_curvature, LSDFlowInfo& FlowInfo);
 
   /// @brief Write a real value to an LSDRaster in the shape of the basin.
   /// @param Param real value to be written
@@ -490,7 +491,7 @@ class LSDBasin
   /// @return LSDRaster of the data in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_real_data_to_LSDRaster(float Param, LSDFlowInfo FlowInfo);
+  LSDRaster write_real_data_to_LSDRaster(float Param, LSDFlowInfo& FlowInfo);
 
   /// @brief Write an integer value to an LSDIndexRaster in the shape of the basin.
   /// @param Param integer value to be written
@@ -498,7 +499,7 @@ class LSDBasin
   /// @return LSDIndexRaster of the data in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDIndexRaster write_integer_data_to_LSDIndexRaster(int Param, LSDFlowInfo FlowInfo);
+  LSDIndexRaster write_integer_data_to_LSDIndexRaster(int Param, LSDFlowInfo& FlowInfo);
 
 
   /// @brief This function is used to create a single LSDIndexRaster that
@@ -535,181 +536,195 @@ class LSDBasin
 LSDRaster TrimPaddedRasterToBasin(int padding_pixels, LSDFlowInfo& FlowInfo,
                                             LSDRaster& Raster_Data);
 
+  /// @brief This is the same as TrimPaddedRasterToBasin but also returns
+  ///  where the trimmed raster sits in the original raster
+  /// @details Used to map values calculated on the trimmed window back to
+  ///  the nodes of the original FlowInfo without writing the window to disk
+  /// @param padding_pixels the number of pixels with which to pad the raster
+  /// @param FlowInfo an LSDFlowInfo object
+  /// @param Raster_Data the raster that gets trimmed.
+  /// @param min_row the row of the original raster that is row 0 of the
+  ///  trimmed raster. Replaced by the function
+  /// @param min_col the col of the original raster that is col 0 of the
+  ///  trimmed raster. Replaced by the function
+LSDRaster TrimPaddedRasterToBasin(int padding_pixels, LSDFlowInfo& FlowInfo,
+                                  LSDRaster& Raster_Data, int& min_row, int& min_col);
+
 
   /// @brief Write Junction values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDIndexRaster of Junction values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDIndexRaster write_Junction(LSDFlowInfo FlowInfo) { return write_integer_data_to_LSDIndexRaster(Junction, FlowInfo); }
+  LSDIndexRaster write_Junction(LSDFlowInfo& FlowInfo) { return write_integer_data_to_LSDIndexRaster(Junction, FlowInfo); }
 
   /// @brief Write NumberOfCells values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDIndexRaster of NumberOfCells values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDIndexRaster write_NumberOfCells(LSDFlowInfo FlowInfo) { return write_integer_data_to_LSDIndexRaster(NumberOfCells, FlowInfo); }
+  LSDIndexRaster write_NumberOfCells(LSDFlowInfo& FlowInfo) { return write_integer_data_to_LSDIndexRaster(NumberOfCells, FlowInfo); }
 
   /// @brief Write BasinOrder values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDIndexRaster of BasinOrder values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDIndexRaster write_BasinOrder(LSDFlowInfo FlowInfo) { return write_integer_data_to_LSDIndexRaster(BasinOrder, FlowInfo); }
+  LSDIndexRaster write_BasinOrder(LSDFlowInfo& FlowInfo) { return write_integer_data_to_LSDIndexRaster(BasinOrder, FlowInfo); }
 
   /// @brief Write Area values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of Area values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_Area(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(Area, FlowInfo); }
+  LSDRaster write_Area(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(Area, FlowInfo); }
 
   /// @brief Write SlopeMean values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of SlopeMean values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_SlopeMean(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(SlopeMean, FlowInfo); }
+  LSDRaster write_SlopeMean(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(SlopeMean, FlowInfo); }
 
   /// @brief Write ElevationMean values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of ElevationMean values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_ElevationMean(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(ElevationMean, FlowInfo); }
+  LSDRaster write_ElevationMean(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(ElevationMean, FlowInfo); }
 
   /// @brief Write AspectMean values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of AspectMean values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_AspectMean(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(AspectMean, FlowInfo); }
+  LSDRaster write_AspectMean(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(AspectMean, FlowInfo); }
 
   /// @brief Write ReliefMean values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of ReliefMean values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_ReliefMean(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(ReliefMean, FlowInfo); }
+  LSDRaster write_ReliefMean(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(ReliefMean, FlowInfo); }
 
   /// @brief Write PlanCurvMean values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of PlanCurvMean values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_PlanCurvMean(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(PlanCurvMean, FlowInfo); }
+  LSDRaster write_PlanCurvMean(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(PlanCurvMean, FlowInfo); }
 
   /// @brief Write ProfileCurvMean values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of ProfileCurvMean values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_ProfileCurvMean(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(ProfileCurvMean, FlowInfo); }
+  LSDRaster write_ProfileCurvMean(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(ProfileCurvMean, FlowInfo); }
 
   /// @brief Write TotalCurvMean values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of TotalCurvMean values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_TotalCurvMean(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(TotalCurvMean, FlowInfo); }
+  LSDRaster write_TotalCurvMean(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(TotalCurvMean, FlowInfo); }
 
   /// @brief Write PlanCurvMax values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of PlanCurvMax values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_PlanCurvMax(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(PlanCurvMax, FlowInfo); }
+  LSDRaster write_PlanCurvMax(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(PlanCurvMax, FlowInfo); }
 
   /// @brief Write ProfileCurvMax values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of ProfileCurvMax values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_ProfileCurvMax(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(ProfileCurvMax, FlowInfo); }
+  LSDRaster write_ProfileCurvMax(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(ProfileCurvMax, FlowInfo); }
 
   /// @brief Write TotalCurvMax values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of TotalCurvMax values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_TotalCurvMax(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(TotalCurvMax, FlowInfo); }
+  LSDRaster write_TotalCurvMax(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(TotalCurvMax, FlowInfo); }
 
   /// @brief Write HillslopeLength_HFR values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of HillslopeLength_HFR values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_HillslopeLength_HFR(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(HillslopeLength_HFR, FlowInfo); }
+  LSDRaster write_HillslopeLength_HFR(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(HillslopeLength_HFR, FlowInfo); }
 
   /// @brief Write HillslopeLength_Binned values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of HillslopeLength_Binned values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_HillslopeLength_Binned(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(HillslopeLength_Binned, FlowInfo); }
+  LSDRaster write_HillslopeLength_Binned(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(HillslopeLength_Binned, FlowInfo); }
 
   /// @brief Write HillslopeLength_Spline values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of HillslopeLength_Spline values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_HillslopeLength_Spline(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(HillslopeLength_Spline, FlowInfo); }
+  LSDRaster write_HillslopeLength_Spline(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(HillslopeLength_Spline, FlowInfo); }
 
   /// @brief Write HillslopeLength_Density values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of HillslopeLength_Density values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_HillslopeLength_Density(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(HillslopeLength_Density, FlowInfo); }
+  LSDRaster write_HillslopeLength_Density(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(HillslopeLength_Density, FlowInfo); }
 
   /// @brief Write FlowLength values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of FlowLength values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_FlowLength(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(FlowLength, FlowInfo); }
+  LSDRaster write_FlowLength(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(FlowLength, FlowInfo); }
 
   /// @brief Write DrainageDensity values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of DrainageDensity values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_DrainageDensity(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(DrainageDensity, FlowInfo); }
+  LSDRaster write_DrainageDensity(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(DrainageDensity, FlowInfo); }
 
   /// @brief Write CosmoErosionRate values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of CosmoErosionRate values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_CosmoErosionRate(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(CosmoErosionRate, FlowInfo); }
+  LSDRaster write_CosmoErosionRate(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(CosmoErosionRate, FlowInfo); }
 
   /// @brief Write OtherErosionRate values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of OtherErosionRate values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_OtherErosionRate(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(OtherErosionRate, FlowInfo); }
+  LSDRaster write_OtherErosionRate(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(OtherErosionRate, FlowInfo); }
 
   /// @brief Write CHTMean values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of CHTMean values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_CHTMean(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(CHTMean, FlowInfo); }
+  LSDRaster write_CHTMean(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(CHTMean, FlowInfo); }
 
   /// @brief Write EStar values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of EStar values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_EStar(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(EStar, FlowInfo); }
+  LSDRaster write_EStar(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(EStar, FlowInfo); }
 
   /// @brief Write RStar values into the shape of the basin.
   /// @param FlowInfo Flowinfo object.
   /// @return LSDRaster of RStar values in the shape of the basin.
   /// @author SWDG
   /// @date 12/12/13
-  LSDRaster write_RStar(LSDFlowInfo FlowInfo) { return write_real_data_to_LSDRaster(RStar, FlowInfo); }
+  LSDRaster write_RStar(LSDFlowInfo& FlowInfo) { return write_real_data_to_LSDRaster(RStar, FlowInfo); }
 
   /// @brief Method to merge a vector of LSDRaster basins generated using LSDBasin into
   /// a single LSDRaster for visualisation.
@@ -868,6 +883,24 @@ class LSDCosmoBasin: public LSDBasin
     void populate_scaling_vectors(LSDFlowInfo& FlowInfo, LSDRaster& Elevation_Data,
                                   LSDRaster& Topo_Shield, string path_to_atmospheric_data);
 
+    /// @brief This function populates the scaling vectors when the topographic
+    ///  shielding has only been calculated on a window around the basin
+    ///
+    /// @details Same as the default version (no snow shielding) but the 
+    ///  topographic shielding of a node at (row,col) in the FlowInfo is read 
+    ///  from (row-window_min_row,col-window_min_col) in the window. The window
+    ///  is typically from TrimPaddedRasterToBasin.
+    /// @param FlowInfo the LSDFlowInfo object
+    /// @param Elevation_Data the DEM, with georeferencing information
+    /// @param Topo_Shield_Window an LSDRaster with the topographic shielding 
+    ///  of a window that contains the basin
+    /// @param window_min_row the row in the DEM of the first row of the window
+    /// @param window_min_col the col in the DEM of the first col of the window
+    /// @param path_to_atmospheric_data THis is a path to binary NCEP data.
+    void populate_scaling_vectors(LSDFlowInfo& FlowInfo, LSDRaster& Elevation_Data,
+                                  LSDRaster& Topo_Shield_Window, int window_min_row,
+                                  int window_min_col, string path_to_atmospheric_data);
+
     /// @brief This function populates the scaling vectors that are used to set
     ///  the production scaling, topographic shielding and snow shielding
     ///  for specific nodes.
@@ -977,6 +1010,22 @@ class LSDCosmoBasin: public LSDBasin
     void get_atmospheric_pressure(LSDFlowInfo& FlowInfo, LSDRaster& Elevation_Data,
                                   string path_to_atmospheric_data);
 
+    /// @brief Gets the atmospheric pressure and Stone (2000) production
+    ///  scaling of every node in the basin in one batch
+    ///
+    /// @details The lat-long conversion, the NCEP pressure lookup and the
+    ///  Stone scaling are all done with the batch (vector) overloads rather than
+    ///  node by node. Nodes with no elevation data get NoDataValue.
+    /// @param FlowInfo the LSDFlowInfo object
+    /// @param Elevation_Data the DEM, which needs georeferencing information
+    /// @param path_to_atmospheric_data the path to binary NCEP data.
+    /// @param pressure the pressure (hPa) of each basin node, replaced by function
+    /// @param scaling the production scaling of each basin node, replaced by function
+    void get_pressure_and_scaling_of_basin_nodes(LSDFlowInfo& FlowInfo,
+                                  LSDRaster& Elevation_Data,
+                                  string path_to_atmospheric_data,
+                                  vector<double>& pressure, vector<double>& scaling);
+
     /// @brief This function wraps the erosion rate calculator, and returns
     ///  both the erosion rate as well as the uncertainties
     /// @param Nuclide_conc Concetration of the nuclide
@@ -995,6 +1044,32 @@ class LSDCosmoBasin: public LSDBasin
                             double Nuclide_conc_err, double prod_uncert_factor,
                             string Muon_scaling);
 
+    /// @brief This propagates the uncertainty of the erosion rate with
+    ///  a Monte Carlo simulation rather than with perturbations combined in
+    ///  quadrature.
+    /// @detail Each draw takes a concentration from the measurement 
+    ///  uncertainty, a production multiplier from the CRONUS P0 uncertainty,
+    ///  a weight between the Schaller and Braucher muon schemes and a 
+    ///  multiplier on the snow and self shielding depths. The production 
+    ///  tables are built once, at three shielding depths if these vary, 
+    ///  so each draw only inverts a sum of eight terms. The random numbers
+    ///  are drawn in advance from the seed, so the results do not depend on
+    ///  the number of threads.
+    /// @param Nuclide_conc Concetration of the nuclide
+    /// @param Nuclide a string denoting the name of the nuclide (at the moment
+    ///  options are 10Be and 26Al)
+    /// @param Nuclide_conc_err The instrument error in the nuclide concentration
+    /// @param shielding_depth_uncert the fractional (one sigma) uncertainty of
+    ///  the snow and self shielding depths. If zero they are not varied.
+    /// @param n_draws the number of draws
+    /// @param seed the seed of the random numbers
+    /// @param quantiles the quantiles of the erosion rate to report, between 0 and 1
+    /// @return a vector with the mean and the standard deviation of the 
+    ///  erosion rate followed by the quantiles, all in g/cm^2/yr
+    vector<double> monte_carlo_CRN_erosion_analysis(double Nuclide_conc, string Nuclide,
+                            double Nuclide_conc_err, double shielding_depth_uncert,
+                            int n_draws, long seed, vector<double> quantiles);
+
     /// @brief This function wraps the erosion rate calculator, and returns
     ///  both the erosion rate as well as the uncertainties  ^
     /// @param known_eff_erosion a raster containing known effective erosion rates (g/cm2/yr)
@@ -1252,6 +1327,126 @@ class LSDCosmoBasin: public LSDBasin
                                     bool is_production_uncertainty_plus_on,
                                     bool is_production_uncertainty_minus_on);
 
+    /// @brief This builds the production table of the basin, which folds the
+    ///  production scaling and shielding of every pixel into four coefficients
+    ///  per pixel, one for each production mechanism.
+    ///
+    /// @details The table is only rebuilt if any of the arguments, or the
+    ///  scaling and shielding vectors, have changed since it was last built.
+    /// @param Nuclide a string with the nuclide name: Be10 or Al26
+    /// @param Muon_scaling a string that gives the muon scaling scheme.
+    ///  options are Schaller, Braucher, newCRONUS and Granger
+    /// @param prod_uncert_factor production uncertainty factor
+    /// @param is_production_uncertainty_plus_on a boolean that is true if the
+    ///  production rate uncertainty (+) is switched on
+    /// @param is_production_uncertainty_minus_on a boolean that is true if the
+    ///  production rate uncertainty (-) is switched on
+    /// @param use_eff_depths true if snow and self shielding come from the
+    ///  effective depth vectors rather than the shielding factors
+    /// @param data_from_outlet_only true if only the outlet is used
+    void build_production_table(string Nuclide, string Muon_scaling,
+                                double prod_uncert_factor,
+                                bool is_production_uncertainty_plus_on,
+                                bool is_production_uncertainty_minus_on,
+                                bool use_eff_depths, bool data_from_outlet_only);
+
+    /// @brief This builds the production table of a nested basin. Pixels
+    ///  with known erosion rates are folded into a constant.
+    ///
+    /// @details Snow and self shielding come from the effective depth vectors.
+    /// @param Nuclide a string with the nuclide name: Be10 or Al26
+    /// @param Muon_scaling a string that gives the muon scaling scheme.
+    /// @param prod_uncert_factor production uncertainty factor
+    /// @param is_production_uncertainty_plus_on a boolean that is true if the
+    ///  production rate uncertainty (+) is switched on
+    /// @param is_production_uncertainty_minus_on a boolean that is true if the
+    ///  production rate uncertainty (-) is switched on
+    /// @param known_effective_erosion a raster of known effective erosion rates (g/cm^2/yr)
+    /// @param FlowInfo the LSDFlowInfo object
+    void build_production_table_nested(string Nuclide, string Muon_scaling,
+                                       double prod_uncert_factor,
+                                       bool is_production_uncertainty_plus_on,
+                                       bool is_production_uncertainty_minus_on,
+                                       LSDRaster& known_effective_erosion,
+                                       LSDFlowInfo& FlowInfo);
+
+    /// @brief This evaluates the basin averaged concentration from the
+    ///  production table that was last built.
+    /// @param eff_erosion_rate The erosion rate in g/cm^2/yr
+    /// @param dN_de the derivative of the concentration with respect to the
+    ///  erosion rate. It is replaced by the function.
+    /// @return the concentration of the nuclide averaged across the basin
+    double evaluate_production_table(double eff_erosion_rate, double& dN_de);
+
+    /// @brief This finds the erosion rate that reproduces a nuclide
+    ///  concentration from the production table that was last built.
+    ///
+    /// @details The column sums are turned into production terms and the
+    ///  root is found by invert_production_sum.
+    /// @param Nuclide_conc Concetration of the nuclide (atoms/g)
+    /// @param production_multiplier a multiplier on all production. This is used
+    ///  for the production uncertainty, which only changes P0.
+    /// @param initial_guess the starting erosion rate in g/cm^2/yr. If it is
+    ///  not positive a guess is made from spallation alone.
+    /// @return The effective erosion rate in g/cm^-2/yr
+    double invert_production_table(double Nuclide_conc, double production_multiplier,
+                                   double initial_guess);
+
+    /// @brief This finds the erosion rate where a sum of production terms,
+    ///  sum_k A_k/(e+L_k), equals a nuclide concentration.
+    /// @details Uses Newton iteration safeguarded by bisection within a 
+    ///  bracket around the root. It does not use the data members so it can
+    ///  be called from many threads at once.
+    /// @param Nuclide_conc Concetration of the nuclide (atoms/g)
+    /// @param coefficients the production coefficients A_k
+    /// @param decay_lengths the decay lengths L_k in g/cm^2/yr
+    /// @param n_terms the number of terms
+    /// @param initial_guess the starting erosion rate in g/cm^2/yr
+    /// @return The effective erosion rate in g/cm^-2/yr
+    double invert_production_sum(double Nuclide_conc, const double* coefficients,
+                                 const double* decay_lengths, int n_terms,
+                                 double initial_guess) const;
+
+    /// @brief This finds the erosion rate where a sum of production terms
+    ///  reproduces a nuclide concentration. The concentration is either the
+    ///  sum S(e) = sum_k A_k/(e+L_k) or, for the erosion weighted mean of a 
+    ///  nested basin, (known_N+e*S(e))/(known_mass+n_free*e).
+    /// @details Uses Newton iteration safeguarded by bisection within a 
+    ///  bracket around the root, or plain Newton iteration kept above the 
+    ///  pole if no bracket can be found. It does not use the data members so
+    ///  it can be called from many threads at once.
+    /// @param Nuclide_conc Concetration of the nuclide (atoms/g)
+    /// @param coefficients the production coefficients A_k
+    /// @param decay_lengths the decay lengths L_k in g/cm^2/yr
+    /// @param n_terms the number of terms
+    /// @param is_erosion_weighted true if the concentration is the erosion
+    ///  weighted mean
+    /// @param known_N the erosion weighted concentration of the pixels with
+    ///  known erosion rates. Only used if is_erosion_weighted is true.
+    /// @param known_mass the summed erosion rate of those pixels. Only used if
+    ///  is_erosion_weighted is true.
+    /// @param n_free the number of pixels with unknown erosion rates. Only 
+    ///  used if is_erosion_weighted is true.
+    /// @param initial_guess the starting erosion rate in g/cm^2/yr
+    /// @return The effective erosion rate in g/cm^-2/yr
+    double invert_production_sum(double Nuclide_conc, const double* coefficients,
+                                 const double* decay_lengths, int n_terms,
+                                 bool is_erosion_weighted, double known_N,
+                                 double known_mass, double n_free,
+                                 double initial_guess) const;
+
+    /// @brief This evaluates the concentration from a sum of production terms
+    ///  along with its derivative with respect to the erosion rate. The
+    ///  arguments are those of invert_production_sum.
+    /// @param eff_erosion_rate the effective erosion rate in g/cm^2/yr
+    /// @param dN_de replaced with the derivative of the concentration
+    /// @return the concentration (atoms/g)
+    double evaluate_production_sum(double eff_erosion_rate, const double* coefficients,
+                                   const double* decay_lengths, int n_terms,
+                                   bool is_erosion_weighted, double known_N,
+                                   double known_mass, double n_free,
+                                   double& dN_de) const;
+
     /// @breif A function for testing if a known erosion rate raster contains any unknowns within a basin.
     /// @param known_erates a raster of known erosion rates
     /// @param FlowInfo a flow info object
@@ -1260,6 +1455,29 @@ class LSDCosmoBasin: public LSDBasin
     /// @date 10/02/2016
     bool are_there_unknown_erosion_rates_in_basin(LSDRaster& known_erates,LSDFlowInfo& FlowInfo);
 
+    /// @brief This marks an upstream sub-basin whose erosion rate has already
+    ///  been solved. Its pixels are left out of the nested production tables
+    ///  and replaced by the contribution recorded when it was solved.
+    /// @detail The sub-basin is only used for production tables whose settings 
+    ///  match one of its recorded contributions, otherwise its pixels are taken
+    ///  from the known erosion rate raster as usual, so that raster must also 
+    ///  hold the solved erosion rate of the sub-basin.
+    /// @param FlowInfo the LSDFlowInfo object
+    /// @param subbasin_outlet_node the node index of the sub-basin outlet. 
+    ///  Nodes that are not in this basin are ignored.
+    /// @param contributions the contributions of the sub-basin, from 
+    ///  get_nested_contributions
+    void add_solved_subbasin(LSDFlowInfo& FlowInfo, int subbasin_outlet_node,
+                             map<string, vector<double> >& contributions);
+
+    /// @brief This gets the contributions of the basin to a downstream
+    ///  nested basin, recorded by full_CRN_erosion_analysis_nested. 
+    /// @return a map keyed by the production table settings. Each element 
+    ///  holds the erosion weighted concentration, the total erosion and the
+    ///  production uncertainty factor of the basin.
+    map<string, vector<double> > get_nested_contributions() const 
+                                             { return nested_contributions; }
+
     /// @brief Prints a csv with information about the nodes in a basin that
     ///  relate to cosmogenic paramters.
     ///
@@ -1430,6 +1648,72 @@ class LSDCosmoBasin: public LSDBasin
     /// in g/cm^2
     vector<double> snow_shield_eff_depth;
 
+    /// @brief This fills the production table. It is called by the
+    ///  build_production_table functions.
+    /// @param known_eff_erosion the known erosion rate of each basin node,
+    ///  NoDataValue where unknown. Empty if the basin is not nested.
+    void fill_production_table(string Nuclide, string Muon_scaling,
+                               double prod_uncert_factor,
+                               bool is_production_uncertainty_plus_on,
+                               bool is_production_uncertainty_minus_on,
+                               bool use_eff_depths, int end_node,
+                               vector<double>& known_eff_erosion);
+
+    /// True if the production table matches the settings stored below
+    bool production_table_is_current;
+
+    /// The settings the production table was built with
+    string production_table_nuclide;
+    string production_table_muon_scaling;
+    double production_table_uncert_factor;
+    int production_table_uncert_switch;
+    bool production_table_use_eff_depths;
+    int production_table_end_node;
+
+    /// The production coefficients of the pixels with unknown erosion rates,
+    /// one vector for each of the four production mechanisms (atoms/g/yr * g/cm^2)
+    vector< vector<double> > production_table_coefficients;
+
+    /// The index into BasinNodes of each pixel in the production table
+    vector<int> production_table_nodes;
+
+    /// The coefficients summed over the pixels
+    vector<double> production_table_column_sums;
+
+    /// Gamma*lambda of each production mechanism, in g/cm^2/yr
+    vector<double> production_table_decay_lengths;
+
+    /// True if the basin is nested so the concentration is weighted by erosion
+    bool production_table_is_erosion_weighted;
+
+    /// The erosion weighted concentration and the total erosion of pixels
+    /// with known erosion rates
+    double production_table_known_N;
+    double production_table_known_mass;
+
+    /// The number of pixels with data and their average production scaling
+    int production_table_n_samples;
+    double production_table_average_production;
+
+    /// The key of the settings of the production table, used to match the
+    /// contributions of solved sub-basins
+    string production_table_nested_key;
+
+    /// @brief This records the contribution of the basin to a downstream
+    ///  nested basin from the production table that was last built.
+    /// @param eff_erosion_rate the solved erosion rate of the basin in g/cm^2/yr
+    void record_nested_contribution(double eff_erosion_rate);
+
+    /// The upstream sub-basins that have already been solved: the block of
+    /// basin nodes of each sub-basin and its contributions, keyed by the 
+    /// production table settings
+    vector<int> solved_subbasin_start_nodes;
+    vector<int> solved_subbasin_end_nodes;
+    vector< map<string, vector<double> > > solved_subbasin_contributions;
+
+    /// The contributions of this basin to downstream nested basins
+    map<string, vector<double> > nested_contributions;
+
   private:
     void create(int JunctionNumber, LSDFlowInfo& FlowInfo,
                            LSDJunctionNetwork& ChanNet,
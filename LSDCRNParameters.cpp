@@ -57,6 +57,7 @@
 #include <iostream>
 #include <vector>
 #include <map>
+#include <algorithm>
 #include "TNT/tnt.h"
 #include "LSDStatsTools.hpp"
 #include "LSDCRNParameters.hpp"
@@ -121,6 +122,16 @@ void LSDCRNParameters::create()
   F_36Cl[1] = 0.0447;
   F_36Cl[2] = 0.05023;
   F_36Cl[3] = 0.0;
+  
+  // the muon flux table has not been built
+  muon_table_pressure = -9999;
+  muon_table_H = 0;
+  
+  // no muon production has been calculated yet
+  for(int i = 0; i<n_CRONUS_muon_values; i++)
+  {
+    CRONUS_muon_data[i] = 0;
+  }
 }
 
 // this function gets the parameters used to convert elevation to 
@@ -275,8 +286,10 @@ void LSDCRNParameters::load_parameters_for_atmospheric_scaling(string path_to_da
 //
 // They are constants used in the CRONUS caluclator, and have been ported
 // from make_al_be_consts_v22.m written by Greg Balco
+//
+// The map is only built once, by get_CRONUS_data_map
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-void LSDCRNParameters::set_CRONUS_data_maps()
+static map<string,double> make_CRONUS_data_map()
 {
   //cout << "Line 278, creating the CRONUS data maps" << endl;
   
@@ -468,8 +481,53 @@ void LSDCRNParameters::set_CRONUS_data_maps()
   // al_be_consts.S = S; 
   // al_be_consts.SInf = 0.95; % Long-term mean S value;
 
-  // set the data member map
-  CRONUS_data_map = temp_map;
+  return temp_map;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// The CRONUS constants never change, so they are built once and shared by
+// every LSDCRNParameters object rather than being copied into a map in each
+// object. The constants used in the calculations are also kept in an array
+// indexed by CRONUS_constant_index so that the muon production routines,
+// which are called for every depth and every sample, do not look up strings.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCRNParameters::set_CRONUS_data_maps()
+{
+  get_CRONUS_constants();
+}
+
+const map<string,double>& LSDCRNParameters::get_CRONUS_data_map()
+{
+  static const map<string,double> CRONUS_data_map = make_CRONUS_data_map();
+  return CRONUS_data_map;
+}
+
+// the names of the constants in the order of CRONUS_constant_index
+static const char* CRONUS_constant_names[] = {"l10", "l26", "Lsp",
+                                              "Fsp10", "Fsp26",
+                                              "P10_ref_St", "P26_ref_St",
+                                              "Natoms10", "Natoms26",
+                                              "k_neg10", "delk_neg10",
+                                              "sigma190_10", "delsigma190_10",
+                                              "k_neg26", "delk_neg26",
+                                              "sigma190_26", "delsigma190_26"};
+
+static vector<double> make_CRONUS_constants()
+{
+  const map<string,double>& CRONUS_data_map = LSDCRNParameters::get_CRONUS_data_map();
+  vector<double> constants(LSDCRNParameters::n_CRONUS_constants,0.0);
+  for(int i = 0; i<LSDCRNParameters::n_CRONUS_constants; i++)
+  {
+    constants[i] = CRONUS_data_map.find(CRONUS_constant_names[i])->second;
+  }
+  return constants;
+}
+
+const double* LSDCRNParameters::get_CRONUS_constants()
+{
+  static const vector<double> constants = make_CRONUS_constants();
+  return &constants[0];
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
@@ -480,16 +538,11 @@ void LSDCRNParameters::set_CRONUS_data_maps()
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 vector<double> LSDCRNParameters::get_Stone_Pref()
 {
-  // first check to see if CRONUS data maps are set
-  if(CRONUS_data_map.find("l10") == CRONUS_data_map.end())
-  {
-    cout << "You haven't set the CRONUS data map. I'm doing that for you now!" << endl;
-    set_CRONUS_data_maps();
-  }
+  const double* CRONUS_constants = get_CRONUS_constants();
   
   vector<double> Stone_pref(2,0.0);
-  Stone_pref[0] = CRONUS_data_map["P10_ref_St"];
-  Stone_pref[1] = CRONUS_data_map["P26_ref_St"];  
+  Stone_pref[0] = CRONUS_constants[CRONUS_P10_ref_St];
+  Stone_pref[1] = CRONUS_constants[CRONUS_P26_ref_St];  
   
   return Stone_pref;
 
@@ -511,10 +564,10 @@ vector<double> LSDCRNParameters::calculate_muon_production_CRONUS(double z, doub
   P_mu_total(z,h);
   
   
-  Muon_production[0] = CRONUS_muon_data["P_fast_10Be"];
-  Muon_production[1] = CRONUS_muon_data["P_fast_26Al"];
-  Muon_production[2] = CRONUS_muon_data["P_neg_10Be"];
-  Muon_production[3] = CRONUS_muon_data["P_neg_26Al"];
+  Muon_production[0] = CRONUS_muon_data[CRONUS_P_fast_10Be];
+  Muon_production[1] = CRONUS_muon_data[CRONUS_P_fast_26Al];
+  Muon_production[2] = CRONUS_muon_data[CRONUS_P_neg_10Be];
+  Muon_production[3] = CRONUS_muon_data[CRONUS_P_neg_26Al];
 
   return Muon_production;
   
@@ -561,16 +614,9 @@ vector<double> LSDCRNParameters::calculate_muon_production_CRONUS(double z, doub
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 void LSDCRNParameters::P_mu_total(double z,double h)
 {
-  map<string,double> temp_data_map;
-
   //cout << "CHECKING MUON FLUX, Line 504 " << endl;
 
-  // first check to see if CRONUS data maps are set
-  if(CRONUS_data_map.find("l10") == CRONUS_data_map.end())
-  {
-    cout << "You haven't set the CRONUS data map. I'm doing that for you now!" << endl;
-    set_CRONUS_data_maps();
-  }
+  const double* CRONUS_constants = get_CRONUS_constants();
 
 
   // calculator the atmospheric depth in g/cm2
@@ -600,7 +646,8 @@ void LSDCRNParameters::P_mu_total(double z,double h)
   double R_vert_slhl = Rv0(z);
 
   // find the stopping rate of vertical muons at site
-  double R_vert_site = R_vert_slhl*exp(H/LZ(z));
+  double this_LZ = LZ(z);
+  double R_vert_site = R_vert_slhl*exp(H/this_LZ);
   //cout << "LZ(" << z << "): " << LZ(z) << endl;
   //cout << "R_vert_slhl: " << R_vert_slhl << " R_vert_site: " << R_vert_site << endl;
 
@@ -608,10 +655,12 @@ void LSDCRNParameters::P_mu_total(double z,double h)
   // integrate
   // ends at 200,001 g/cm2 to avoid being asked for an zero
   // range of integration -- 
-  // get integration tolerance -- want relative tolerance around
-  // 1 part in 10^4. 
-  double tol = phi_vert_slhl*1e-4;
-  double phi_vert_site = integrate_muon_flux(z, H, tol);
+  // This used to be an adaptive integration for every depth (see 
+  // integrate_muon_flux). The integral only depends on the depth once 
+  // the pressure is set, so it is now looked up in a table that is built
+  // once for each pressure.
+  build_muon_flux_table(h);
+  double phi_vert_site = interpolate_muon_flux(z);
   
   //=====================
   // I THINK below here is an error in Balco's code
@@ -659,14 +708,14 @@ void LSDCRNParameters::P_mu_total(double z,double h)
   // internally defined constants
   double aalpha = 0.75;
   
-  double sigma0_Be10 = CRONUS_data_map["sigma190_10"]/(pow(190.0,aalpha));
-  double sigma0_Al26 = CRONUS_data_map["sigma190_26"]/(pow(190.0,aalpha));
+  double sigma0_Be10 = CRONUS_constants[CRONUS_sigma190_10]/(pow(190.0,aalpha));
+  double sigma0_Al26 = CRONUS_constants[CRONUS_sigma190_26]/(pow(190.0,aalpha));
   
   // fast muon production
   double P_fast_Be10 = phi*Beta*(pow(Ebar,aalpha))
-                          *sigma0_Be10*CRONUS_data_map["Natoms10"];
+                          *sigma0_Be10*CRONUS_constants[CRONUS_Natoms10];
   double P_fast_Al26 = phi*Beta*(pow(Ebar,aalpha))
-                          *sigma0_Al26*CRONUS_data_map["Natoms26"];
+                          *sigma0_Al26*CRONUS_constants[CRONUS_Natoms26];
   
   //cout << "Phi: " << phi << " Beta " << Beta << " Ebar: " << Ebar << endl
   //     << "aalpha: " << aalpha << endl
@@ -683,27 +732,25 @@ void LSDCRNParameters::P_mu_total(double z,double h)
   //cout << "Pfast26Al: " << P_fast_Al26 << " P2: " << P2_26Al << endl;
   
   // negative muon capture
-  double P_neg_Be10 = R*CRONUS_data_map["k_neg10"];
-  double P_neg_Al26 = R*CRONUS_data_map["k_neg26"];
+  double P_neg_Be10 = R*CRONUS_constants[CRONUS_k_neg10];
+  double P_neg_Al26 = R*CRONUS_constants[CRONUS_k_neg26];
 
   //cout << "Sig0: " << sigma0_Be10 << " Pfast: " << P_fast_Be10 << " P_neg: " << P_neg_Be10 << endl;
 
-  temp_data_map["phi_vert_slhl"] = phi_vert_slhl;
-  temp_data_map["R_vert_slhl"] = R_vert_slhl;
-  temp_data_map["phi_vert_site"] = phi_vert_site;
-  temp_data_map["R_vert_site"] = R_vert_site;
-  temp_data_map["phi"] = phi;
-  temp_data_map["R"] = R;
-  temp_data_map["Beta"] = Beta;
-  temp_data_map["Ebar"] = Ebar;
-  temp_data_map["P_fast_10Be"] = P_fast_Be10;
-  temp_data_map["P_fast_26Al"] = P_fast_Al26;
-  temp_data_map["P_neg_10Be"] = P_neg_Be10;
-  temp_data_map["P_neg_26Al"] = P_neg_Al26;
-  temp_data_map["H"] = H;
-  temp_data_map["LZ"] = LZ(z);
-
-  CRONUS_muon_data = temp_data_map;
+  CRONUS_muon_data[CRONUS_phi_vert_slhl] = phi_vert_slhl;
+  CRONUS_muon_data[CRONUS_R_vert_slhl] = R_vert_slhl;
+  CRONUS_muon_data[CRONUS_phi_vert_site] = phi_vert_site;
+  CRONUS_muon_data[CRONUS_R_vert_site] = R_vert_site;
+  CRONUS_muon_data[CRONUS_phi] = phi;
+  CRONUS_muon_data[CRONUS_R] = R;
+  CRONUS_muon_data[CRONUS_Beta] = Beta;
+  CRONUS_muon_data[CRONUS_Ebar] = Ebar;
+  CRONUS_muon_data[CRONUS_P_fast_10Be] = P_fast_Be10;
+  CRONUS_muon_data[CRONUS_P_fast_26Al] = P_fast_Al26;
+  CRONUS_muon_data[CRONUS_P_neg_10Be] = P_neg_Be10;
+  CRONUS_muon_data[CRONUS_P_neg_26Al] = P_neg_Al26;
+  CRONUS_muon_data[CRONUS_H] = H;
+  CRONUS_muon_data[CRONUS_LZ] = this_LZ;
   
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
@@ -718,8 +765,8 @@ void LSDCRNParameters::P_mu_total_return_nuclides(double z,double h,
   // get the muon roduction
   P_mu_total(z,h);
   
-  double p10 = CRONUS_muon_data["P_fast_10Be"]+CRONUS_muon_data["P_neg_10Be"];
-  double p26 = CRONUS_muon_data["P_fast_26Al"]+CRONUS_muon_data["P_neg_26Al"];
+  double p10 = CRONUS_muon_data[CRONUS_P_fast_10Be]+CRONUS_muon_data[CRONUS_P_neg_10Be];
+  double p26 = CRONUS_muon_data[CRONUS_P_fast_26Al]+CRONUS_muon_data[CRONUS_P_neg_26Al];
   
   Be10_total_mu = p10;
   Al26_total_mu = p26;
@@ -824,6 +871,129 @@ double LSDCRNParameters::integrate_muon_flux(double z, double H, double toleranc
 }
 
 
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This builds a table of the integral of the muon stopping rate at a site,
+// Rv0(z)*exp(H/LZ(z)), from each depth node down to 2e5+1 g/cm^2. 
+// The integrand only depends on the pressure, so the table is built once
+// and reused for every depth at that pressure. 
+// The nodes are evenly spaced in log(1+z), so they are dense near the
+// surface where the stopping rate changes quickly. The ranges in the LZ
+// table are added as nodes because LZ has a kink at each of them.
+// Each interval is integrated with Simpson's rule.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCRNParameters::build_muon_flux_table(double h)
+{
+  // if the table has been built for this pressure there is nothing to do
+  if(h == muon_table_pressure && muon_table_z.size() != 0)
+  {
+    return;
+  }
+  
+  if(LZ_log_range.empty())
+  {
+    set_LZ_tables();
+  }
+  
+  // the atmospheric depth in g/cm^2
+  double H = (1013.25 - h)*1.019716;
+  
+  // the same lower limit as integrate_muon_flux
+  double end_z = 2.0e5+1.0;
+  
+  // get the nodes
+  int n_log_steps = 400;
+  double log_spacing = log(1.0+end_z)/double(n_log_steps);
+  vector<double> nodes;
+  for(int i = 0; i<n_log_steps; i++)
+  {
+    nodes.push_back(exp(double(i)*log_spacing)-1.0);
+  }
+  nodes.push_back(end_z);
+  
+  // LZ is clamped at z = 1 and is log-linear between its ranges
+  nodes.push_back(1.0);
+  for(int i = 0; i< int(LZ_range.size()); i++)
+  {
+    if(LZ_range[i] > 0 && LZ_range[i] < end_z)
+    {
+      nodes.push_back(LZ_range[i]);
+    }
+  }
+  sort(nodes.begin(),nodes.end());
+  nodes.erase(unique(nodes.begin(),nodes.end()),nodes.end());
+  
+  // now integrate from the bottom up
+  int n_nodes = int(nodes.size());
+  vector<double> stopping(n_nodes,0.0);
+  vector<double> cumulative(n_nodes,0.0);
+  for(int i = 0; i<n_nodes; i++)
+  {
+    stopping[i] = Rv0(nodes[i])*exp(H/LZ(nodes[i]));
+  }
+  double a,b,intermediate;
+  for(int i = n_nodes-2; i>=0; i--)
+  {
+    a = nodes[i];
+    b = nodes[i+1];
+    intermediate = 0.5*(a+b);
+    cumulative[i] = cumulative[i+1] + ((b-a)/6.0)*
+                    (stopping[i]+4.0*Rv0(intermediate)*exp(H/LZ(intermediate))+stopping[i+1]);
+  }
+  
+  muon_table_pressure = h;
+  muon_table_H = H;
+  muon_table_z = nodes;
+  muon_table_stopping = stopping;
+  muon_table_cumulative = cumulative;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This gets the integral of the muon stopping rate from a depth z down to
+// 2e5+1 g/cm^2 from the table made by build_muon_flux_table. 
+// The remaining part of the interval that z falls in is integrated with 
+// Simpson's rule, so only two new evaluations of the stopping rate are needed.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+double LSDCRNParameters::interpolate_muon_flux(double z)
+{
+  if(muon_table_z.size() == 0)
+  {
+    cout << "LSDCRNParameters::interpolate_muon_flux, you have not built the muon" << endl
+         << "flux table. Call build_muon_flux_table first." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // below the bottom of the table there is no flux
+  int n_nodes = int(muon_table_z.size());
+  if(z >= muon_table_z[n_nodes-1])
+  {
+    return 0.0;
+  }
+  
+  // the table starts at the surface, so depths above it get the surface flux
+  if(z <= muon_table_z[0])
+  {
+    return muon_table_cumulative[0];
+  }
+  
+  // find the first node below z
+  int upper = int(upper_bound(muon_table_z.begin(),muon_table_z.end(),z) 
+                   - muon_table_z.begin());
+  if (z == muon_table_z[upper-1])
+  {
+    return muon_table_cumulative[upper-1];
+  }
+  
+  double b = muon_table_z[upper];
+  double intermediate = 0.5*(z+b);
+  double fz = Rv0(z)*exp(muon_table_H/LZ(z));
+  double fi = Rv0(intermediate)*exp(muon_table_H/LZ(intermediate));
+  
+  return muon_table_cumulative[upper] + 
+         ((b-z)/6.0)*(fz+4.0*fi+muon_table_stopping[upper]);
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 // this subfunction returns the stopping rate of vertically traveling muons
 // as a function of depth z at sea level and high latitude.
@@ -865,7 +1035,41 @@ double LSDCRNParameters::Rv0(double z)
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 double LSDCRNParameters::LZ(double z)
 {
+  // the range/momentum table only needs to be logged once
+  if(LZ_log_range.empty())
+  {
+    set_LZ_tables();
+  }
 
+  // deal with zero situation
+  if(z < 1)
+  {
+    z = 1.0;
+  }
+
+  double log_z = log(z);
+  //cout << "z is:" << z << " and log z is: " << log_z << endl;
+
+  // obtain momenta
+  // use log-linear interpolation
+  double P_MeVc = exp(interp1D_ordered(LZ_log_range,LZ_log_momentum,log_z));
+  //cout << "log_z: " <<  log_z << " interp: " 
+  //     << interp1D_ordered(LZ_log_range,LZ_log_momentum,log_z) << " P_MeVc: " << P_MeVc << endl;
+
+  // obtain attenuation lengths
+  double out = 263.0 + 150*(P_MeVc/1000.0);
+  return out;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This sets the log range and log momentum tables used by LZ. They used to
+// be rebuilt every time LZ was called, which was millions of times in
+// a muon flux integration.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCRNParameters::set_LZ_tables()
+{
   //define range/momentum relation
   // table for muons in standard rock in Groom and others 2001
   // units are range in g cm-2 (column 2)
@@ -933,18 +1137,7 @@ double LSDCRNParameters::LZ(double z)
   data_for_LZ_momentum.push_back(8.001e5);
   data_for_LZ_range.push_back(2.129e5);
 
-  // deal with zero situation
-  if(z < 1)
-  {
-    z = 1.0;
-  }
-
-  double log_z = log(z);
-  //cout << "z is:" << z << " and log z is: " << log_z << endl;
-
-
-  // obtain momenta
-  // use log-linear interpolation
+  // the interpolation is done in log space
   int n_momentum_dpoints = int(data_for_LZ_momentum.size());
   vector<double> log_momentum;
   vector<double> log_range;
@@ -954,13 +1147,10 @@ double LSDCRNParameters::LZ(double z)
     log_range.push_back(log(data_for_LZ_range[i]));
     //cout << "Momentum: " << log_momentum[i] << " range: " << log_range[i] << endl;
   }
-  double P_MeVc = exp(interp1D_ordered(log_range,log_momentum,log_z));
-  //cout << "log_z: " <<  log_z << " interp: " 
-  //     << interp1D_ordered(log_range,log_momentum,log_z) << " P_MeVc: " << P_MeVc << endl;
-
-  // obtain attenuation lengths
-  double out = 263.0 + 150*(P_MeVc/1000.0);
-  return out;
+  
+  LZ_log_momentum = log_momentum;
+  LZ_log_range = log_range;
+  LZ_range = data_for_LZ_range;
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
@@ -1563,6 +1753,74 @@ double LSDCRNParameters::stone2000sp(double lat,double P, double Fsp)
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// Batch Stone 2000 scaling over a vector of points. Same constants and 
+// arithmetic as stone2000sp, but only the two index latitudes bracketing 
+// each point are evaluated and nothing is allocated inside the loop.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+vector<double> LSDCRNParameters::stone2000sp(vector<double>& lat, vector<double>& P,
+                                             double Fsp)
+{
+  if (Fsp > 1)
+  {
+    Fsp = 0.978;
+  }
+  double Fm = 1 - Fsp;
+
+  // constants from Table 1 of Stone (2000), index latitudes 0 to 60
+  static const double a[7] = {31.8518, 34.3699, 40.3153, 42.0983, 56.7733, 69.0720, 71.8733};
+  static const double b[7] = {250.3193, 258.4759, 308.9894, 512.6857, 649.1343, 832.4566, 863.1927};
+  static const double c[7] = {-0.083393, -0.089807, -0.106248, -0.120551, -0.160859, -0.199252, -0.207069};
+  static const double d[7] = {7.4260e-5, 7.9457e-5, 9.4508e-5, 1.1752e-4, 1.5463e-4, 1.9391e-4, 2.0127e-4};
+  static const double e[7] = {-2.2397e-8, -2.3697e-8, -2.8234e-8, -3.8809e-8, -5.0330e-8, -6.3653e-8, -6.6043e-8};
+  static const double mk[7] = {0.587, 0.600, 0.678, 0.833, 0.933, 1.000, 1.000};
+  static const double ilats[7] = {0, 10, 20, 30, 40, 50, 60};
+
+  int n_points = int(lat.size());
+  vector<double> out(n_points,0.0);
+  for(int i = 0; i<n_points; i++)
+  {
+    double this_lat = lat[i];
+    double this_P = P[i];
+    if (fabs(this_lat) > 90)
+    {
+      cout << "Your latitude is > 90! Defaulting to 45 degrees" << endl;
+      this_lat = 45;
+    }
+
+    //northernize southern-hemisphere inputs and set high lats to 60
+    this_lat = fabs(this_lat);
+    if(this_lat > 60)
+    {
+      this_lat = 60.0;
+    }
+
+    // the upper bracketing index latitude, as found by interp1D_ordered
+    int hi = 1 + int(this_lat > 10) + int(this_lat > 20) + int(this_lat > 30)
+               + int(this_lat > 40) + int(this_lat > 50);
+    int lo = hi-1;
+
+    // index latitudes at this P
+    double exp_P = exp(this_P/(-150.0));
+    double P2 = this_P*this_P;
+    double P3 = this_P*this_P*this_P;
+    double S_lo = a[lo] + (b[lo] * exp_P) + (c[lo]*this_P) + (d[lo]*P2) + (e[lo]*P3);
+    double S_hi = a[hi] + (b[hi] * exp_P) + (c[hi]*this_P) + (d[hi]*P2) + (e[hi]*P3);
+    double frac = (this_lat-ilats[lo])/(ilats[hi]-ilats[lo]);
+    double S = S_lo+(S_hi-S_lo)*frac;
+
+    // Production by muons
+    double exp_M = exp( (1013.25-this_P)/242.0);
+    double M_lo = mk[lo]*exp_M;
+    double M_hi = mk[hi]*exp_M;
+    double M = M_lo+(M_hi-M_lo)*frac;
+
+    out[i] = ((S * Fsp) + (M * Fm));
+  }
+  return out;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 // this function sets the total scaling value
@@ -2313,6 +2571,125 @@ double LSDCRNParameters::NCEPatm_2(double site_lat, double site_lon, double site
 }
 //-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// Batch NCEPatm_2 over a vector of points. The bilinear interpolation 
+// follows interp2D_bilinear exactly, but the grid axes are only put in 
+// ascending order once and the grid cell of the previous point is reused
+// when it still brackets the next one.
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+vector<double> LSDCRNParameters::NCEPatm_2(vector<double>& site_lat,
+                                           vector<double>& site_lon,
+                                           vector<double>& site_elev)
+{
+  // check to see if data is loaded:
+  if (int(gm_hgt.size()) != 8)
+  {
+    string path_to_data;
+    cout << "You didn't load the NCEP data. Doing that now. " << endl;
+    cout << "Enter path to data files: " << endl;
+    cin >> path_to_data;
+    load_parameters_for_atmospheric_scaling(path_to_data);
+  }
+
+  // get ascending copies of the grid axes
+  int n_lat = int(NCEPlat.size());
+  int n_lon = int(NCEPlon.size());
+  bool is_lat_reversed = (NCEPlat[0] > NCEPlat[1]);
+  bool is_lon_reversed = (NCEPlon[0] > NCEPlon[1]);
+  vector<double> asc_lat = NCEPlat;
+  vector<double> asc_lon = NCEPlon;
+  if(is_lat_reversed)
+  {
+    reverse(asc_lat.begin(),asc_lat.end());
+  }
+  if(is_lon_reversed)
+  {
+    reverse(asc_lon.begin(),asc_lon.end());
+  }
+
+  // Some More parameters
+  double gmr = -0.03417; // Assorted constants (this has come from Greg Balco's code)
+  double dtdz = 0.0065;  // Lapse rate from standard atmosphere
+
+  // the indices into the ascending axes of the last grid cell
+  int lat_i = 0;
+  int lon_i = 0;
+
+  int n_points = int(site_lat.size());
+  vector<double> pressure(n_points,-9999.0);
+  for(int p = 0; p<n_points; p++)
+  {
+    double x = site_lat[p];
+    double y = site_lon[p];
+
+    // deal with negative longitudes
+    if(y < 0)
+    {
+      y = y+360.0;
+    }
+
+    if(x < asc_lat[0] || x > asc_lat[n_lat-1])
+    {
+      cout << "Latitude " << x << " is outside the NCEP grid, defaulting to ndv" << endl;
+      continue;
+    }
+    if(y < asc_lon[0] || y > asc_lon[n_lon-1])
+    {
+      cout << "Longitude " << y << " is outside the NCEP grid, defaulting to ndv" << endl;
+      continue;
+    }
+
+    // find the first node at or above the point (never the first node),
+    // reusing the last cell if it still brackets the point
+    if( lat_i == 0 || x > asc_lat[lat_i] || (lat_i > 1 && x <= asc_lat[lat_i-1]) )
+    {
+      lat_i = int(lower_bound(asc_lat.begin(),asc_lat.end(),x)-asc_lat.begin());
+      if(lat_i < 1)
+      {
+        lat_i = 1;
+      }
+    }
+    if( lon_i == 0 || y > asc_lon[lon_i] || (lon_i > 1 && y <= asc_lon[lon_i-1]) )
+    {
+      lon_i = int(lower_bound(asc_lon.begin(),asc_lon.end(),y)-asc_lon.begin());
+      if(lon_i < 1)
+      {
+        lon_i = 1;
+      }
+    }
+
+    // indices into the data in its original order
+    int xib = (is_lat_reversed) ? n_lat-lat_i : lat_i;
+    int yib = (is_lon_reversed) ? n_lon-lon_i : lon_i;
+    int xis = xib-1;
+    int yis = yib-1;
+    double x1 = NCEPlat[xis];
+    double x2 = NCEPlat[xib];
+    double y1 = NCEPlon[yis];
+    double y2 = NCEPlon[yib];
+
+    // bilinear weights, shared by pressure and temperature
+    double wx1 = (x2-x)/(x2-x1);
+    double wx2 = (x-x1)/(x2-x1);
+    double wy1 = (y2-y)/(y2-y1);
+    double wy2 = (y-y1)/(y2-y1);
+
+    double R1 = wx1*meanslp[xis][yis] + wx2*meanslp[xib][yis];
+    double R2 = wx1*meanslp[xis][yib] + wx2*meanslp[xib][yib];
+    double site_slp = wy1*R1 + wy2*R2;
+
+    R1 = wx1*meant1000[xis][yis] + wx2*meant1000[xib][yis];
+    R2 = wx1*meant1000[xis][yib] + wx2*meant1000[xib][yib];
+    double site_T = wy1*R1 + wy2*R2;
+
+    double site_T_degK = site_T + 273.15;
+    pressure[p] = site_slp*exp( (gmr/dtdz)*( log(site_T_degK)
+                              - log(site_T_degK - (site_elev[p]*dtdz)) ) );
+  }
+  return pressure;
+}
+//-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
 //-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 // This function gets the spallation attenuation lenth in g/cm^2
 //-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
@@ -2322,13 +2699,7 @@ double LSDCRNParameters::get_spallation_attenuation_length(bool use_CRONUS)
   double att_length = 160;
   if(use_CRONUS == true)
   {
-    // first check to see if CRONUS data maps are set
-    if(CRONUS_data_map.find("l10") == CRONUS_data_map.end())
-    {
-      //cout << "You haven't set the CRONUS data map. I'm doing that for you now!" << endl;
-      set_CRONUS_data_maps();
-    }
-    att_length = CRONUS_data_map["Lsp"];    
+    att_length = get_CRONUS_constants()[CRONUS_Lsp];    
   
   }
   else
@@ -2351,16 +2722,9 @@ vector<double> LSDCRNParameters::get_decay_coefficients(bool use_CRONUS)
   vector<double> decay_constants(2,0.0);
   if(use_CRONUS == true)
   {
-    // first check to see if CRONUS data maps are set
-    if(CRONUS_data_map.find("l10") == CRONUS_data_map.end())
-    {
-      //cout << "You haven't set the CRONUS data map. I'm doing that for you now!" << endl;
-      set_CRONUS_data_maps();
-    }  
-    decay_constants[0] = CRONUS_data_map["l10"];
-    decay_constants[1] = CRONUS_data_map["l26"];
-      
-    //cout << "Getting lambda, it is for 10Be: " << CRONUS_data_map["l10"] << endl;
+    const double* CRONUS_constants = get_CRONUS_constants();
+    decay_constants[0] = CRONUS_constants[CRONUS_l10];
+    decay_constants[1] = CRONUS_constants[CRONUS_l26];
         
   
   }
@@ -2442,8 +2806,8 @@ void LSDCRNParameters::get_CRONUS_P_mu_vectors(double pressure, double sample_ef
 // Will need to work out why. 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 void LSDCRNParameters::integrate_muon_flux_for_erosion(double E, 
-                           vector<double> z_mu, vector<double> P_mu_10Be,
-                           vector<double> P_mu_26Al,
+                           const vector<double>& z_mu, const vector<double>& P_mu_10Be,
+                           const vector<double>& P_mu_26Al,
                            double& Be10_mu_N, double& Al26_mu_N)
 {                          
   
@@ -2456,17 +2820,13 @@ void LSDCRNParameters::integrate_muon_flux_for_erosion(double E,
   // get the decay coefficients
   bool use_CRONUS = true;
   vector<double> decay_coeff = get_decay_coefficients(use_CRONUS);
+  double lambda10 = decay_coeff[0];
+  double lambda26 = decay_coeff[1];
   
-  // get the time vector, given by dividing depth by erosion. 
+  // the time at each node is given by dividing depth by erosion. 
+  // It is calculated as it is needed rather than stored in a vector
   // !!IMPORTANT Erosion is in g/cm^2/yr!!
   int n_z_nodes = int(z_mu.size());
-  vector<double> t_mu(n_z_nodes,0.0);
-  for(int i = 0; i<n_z_nodes; i++)
-  {
-    t_mu[i] = z_mu[i]/E;
-    //cout << "t_mu["<<i+1<<"]: " << t_mu[i] << endl;
-  
-  }
 
   // now integrate over this vector using simpsons rule
   double a,b;
@@ -2512,22 +2872,22 @@ void LSDCRNParameters::integrate_muon_flux_for_erosion(double E,
   // but is used by CRONUS calculator
   double sum_trap10 = 0;
   double sum_trap26 = 0;
-  b = t_mu[0];
+  b = z_mu[0]/E;
   
-  fb10 = P_mu_10Be[0]*(exp(-decay_coeff[0]*t_mu[0]));
-  fb26 = P_mu_26Al[0]*(exp(-decay_coeff[1]*t_mu[0]));
+  fb10 = P_mu_10Be[0]*(exp(-lambda10*b));
+  fb26 = P_mu_26Al[0]*(exp(-lambda26*b));
   for(int i = 1; i< n_z_nodes; i++)
   {
     // locations of spacings
     a = b;
-    b = t_mu[i]; 
+    b = z_mu[i]/E; 
     
     // functions evaluated at spacings
     fa10 = fb10;
     fa26 = fb26;
     
-    fb10 = P_mu_10Be[i]*(exp(-decay_coeff[0]*b));
-    fb26 = P_mu_26Al[i]*(exp(-decay_coeff[1]*b));
+    fb10 = P_mu_10Be[i]*(exp(-lambda10*b));
+    fb26 = P_mu_26Al[i]*(exp(-lambda26*b));
     
     sum_trap10+= (b-a)*0.5*(fb10+fa10);
     sum_trap26+= (b-a)*0.5*(fb26+fa26);
@@ -2580,12 +2940,7 @@ void LSDCRNParameters::integrate_nonTD_spallation_flux_for_erosion(double E,
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 vector<double> LSDCRNParameters::CRONUS_get_muon_uncertainty_params(double pressure)
 {
-  // first check to see if CRONUS data maps are set
-  if(CRONUS_data_map.find("l10") == CRONUS_data_map.end())
-  {
-    cout << "You haven't set the CRONUS data map. I'm doing that for you now!" << endl;
-    set_CRONUS_data_maps();
-  }
+  const double* CRONUS_constants = get_CRONUS_constants();
   
   // now get the production parameters
   double test_elev = 0.0;
@@ -2593,14 +2948,14 @@ vector<double> LSDCRNParameters::CRONUS_get_muon_uncertainty_params(double press
              = calculate_muon_production_CRONUS(test_elev, pressure);
   
   // calculate the parameters
-  double delPfast_10 = muon_prod[0]*(CRONUS_data_map["delsigma190_10"]/
-                                     CRONUS_data_map["sigma190_10"]);
-  double delPfast_26 = muon_prod[1]*(CRONUS_data_map["delsigma190_26"]/
-                                     CRONUS_data_map["sigma190_26"]);
-  double delPneg_10 = muon_prod[2]*(CRONUS_data_map["delk_neg10"]/
-                                     CRONUS_data_map["k_neg10"]);
-  double delPneg_26 = muon_prod[3]*(CRONUS_data_map["delk_neg26"]/
-                                     CRONUS_data_map["k_neg26"]);;
+  double delPfast_10 = muon_prod[0]*(CRONUS_constants[CRONUS_delsigma190_10]/
+                                     CRONUS_constants[CRONUS_sigma190_10]);
+  double delPfast_26 = muon_prod[1]*(CRONUS_constants[CRONUS_delsigma190_26]/
+                                     CRONUS_constants[CRONUS_sigma190_26]);
+  double delPneg_10 = muon_prod[2]*(CRONUS_constants[CRONUS_delk_neg10]/
+                                     CRONUS_constants[CRONUS_k_neg10]);
+  double delPneg_26 = muon_prod[3]*(CRONUS_constants[CRONUS_delk_neg26]/
+                                     CRONUS_constants[CRONUS_k_neg26]);
   double delPmu0_10 = sqrt(delPfast_10*delPfast_10 + delPneg_10*delPneg_10);
   double delPmu0_26 = sqrt(delPfast_26*delPfast_26 + delPneg_26*delPneg_26);
   
@@ -2626,12 +2981,7 @@ vector<double> LSDCRNParameters::CRONUS_get_muon_uncertainty_params(double press
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 vector<double> LSDCRNParameters::CRONUS_get_uncert_production_ratios(string scaling_name)
 {
-  // first check to see if CRONUS data maps are set
-  if(CRONUS_data_map.find("l10") == CRONUS_data_map.end())
-  {
-    cout << "You haven't set the CRONUS data map. I'm doing that for you now!" << endl;
-    set_CRONUS_data_maps();
-  }
+  const map<string,double>& CRONUS_data_map = get_CRONUS_data_map();
 
   // vector to hold the uncertainty of relative production
   vector<double> rel_delP(2,0.0);
@@ -2644,8 +2994,10 @@ vector<double> LSDCRNParameters::CRONUS_get_uncert_production_ratios(string scal
   if (scaling_name == "St" || scaling_name == "Lm" || scaling_name == "Du" ||
       scaling_name == "Li" || scaling_name == "De")
   {
-    rel_delP[0] = CRONUS_data_map[delP10_map_string]/CRONUS_data_map[P10_map_string];
-    rel_delP[1] = CRONUS_data_map[delP26_map_string]/CRONUS_data_map[P26_map_string];
+    rel_delP[0] = CRONUS_data_map.find(delP10_map_string)->second/
+                  CRONUS_data_map.find(P10_map_string)->second;
+    rel_delP[1] = CRONUS_data_map.find(delP26_map_string)->second/
+                  CRONUS_data_map.find(P26_map_string)->second;
   }
   else
   {
@@ -2697,7 +3049,7 @@ void LSDCRNParameters::print_parameters_to_file(string fname, string muon_scalin
   CRNparams_out << "lambda_26Al: " << lambda_26Al << " yr^-1" << endl;
   CRNparams_out << "lambda_14C: " << lambda_14C << " yr^-1" << endl;
   CRNparams_out << "lambda_36Cl: " << lambda_36Cl << " yr^-1" << endl;
-  set_CRONUS_data_maps();
+  map<string,double> CRONUS_data_map = get_CRONUS_data_map();
 
   CRNparams_out << "P0_10Be: " << P0_10Be << " a/g/yr, delP0_10Be: " << CRONUS_data_map["delP10_ref_St"] << endl;
   CRNparams_out << "P0_26Al: " << P0_26Al << " a/g/yr, delP0_26Al: " << CRONUS_data_map["del26Al_ref_St"] << endl;
@@ -2742,7 +3094,7 @@ void LSDCRNParameters::Print_10Beproduction_csv(string filename, string path_to_
 
   // get the atmospheric parameters
   load_parameters_for_atmospheric_scaling(path_to_atmospheric_data);
-  set_CRONUS_data_maps();
+  map<string,double> CRONUS_data_map = get_CRONUS_data_map();
   double pressure = NCEPatm_2(site_lat, site_lon, site_elev);
   
   // calculate the scaling. We assume no topographic, self or snow shielding
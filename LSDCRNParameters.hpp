@@ -75,6 +75,9 @@ class LSDCRNParameters
   
   /// This is a friend class so that it can be called from the particle 
   friend class LSDCRNParticle;
+  
+  /// This is a friend class so that it can be called from the particle ensemble
+  friend class LSDCRNParticleEnsemble;
 
   /// @brief function for loading parameters that allow pressure calculation
   /// from elevation
@@ -82,8 +85,29 @@ class LSDCRNParameters
   /// @date 02/12/2014
   void load_parameters_for_atmospheric_scaling(string path_to_params);
   
-  /// @brief This function sets a numer of parameters that are used
-  /// to replicate the CRONUS calculator.
+  /// @brief Indices into the table of CRONUS constants returned by
+  ///  get_CRONUS_constants
+  enum CRONUS_constant_index { CRONUS_l10, CRONUS_l26, CRONUS_Lsp,
+                               CRONUS_Fsp10, CRONUS_Fsp26,
+                               CRONUS_P10_ref_St, CRONUS_P26_ref_St,
+                               CRONUS_Natoms10, CRONUS_Natoms26,
+                               CRONUS_k_neg10, CRONUS_delk_neg10,
+                               CRONUS_sigma190_10, CRONUS_delsigma190_10,
+                               CRONUS_k_neg26, CRONUS_delk_neg26,
+                               CRONUS_sigma190_26, CRONUS_delsigma190_26,
+                               n_CRONUS_constants };
+
+  /// @brief Indices into the muon production values set by P_mu_total
+  enum CRONUS_muon_index { CRONUS_phi_vert_slhl, CRONUS_R_vert_slhl,
+                           CRONUS_phi_vert_site, CRONUS_R_vert_site,
+                           CRONUS_phi, CRONUS_R, CRONUS_Beta, CRONUS_Ebar,
+                           CRONUS_P_fast_10Be, CRONUS_P_fast_26Al,
+                           CRONUS_P_neg_10Be, CRONUS_P_neg_26Al,
+                           CRONUS_H, CRONUS_LZ,
+                           n_CRONUS_muon_values };
+
+  /// @brief This function makes sure the parameters that are used
+  /// to replicate the CRONUS calculator have been built.
   /// @details the original parameters are derived from the 
   /// make_al_be_consts_v22
   /// Written by Greg Balco -- Berkeley Geochronology Center
@@ -91,10 +115,23 @@ class LSDCRNParameters
   ///  February, 2008
   ///  Part of the CRONUS-Earth online calculators: 
   ///     http://hess.ess.washington.edu/math
+  ///  The parameters are constants so they are built once and shared by
+  ///  all LSDCRNParameters objects. Calling this is no longer necessary.
   /// @author SMM
   /// @date 06/12/2014
   void set_CRONUS_data_maps();
 
+  /// @brief Gets the shared map of CRONUS constants, keyed by the names
+  ///  used in make_al_be_consts_v22. It is built the first time it is needed.
+  /// @return a constant reference to the map
+  static const map<string,double>& get_CRONUS_data_map();
+
+  /// @brief Gets the CRONUS constants used in the calculations as an
+  ///  array indexed by CRONUS_constant_index, so that no string lookups
+  ///  are needed in the muon production routines
+  /// @return a pointer to the shared array of constants
+  static const double* get_CRONUS_constants();
+
   /// @param This function returns the stone production prescalings
   ///  for 10Be and 26Al
   /// @return Prefs a vector<double> that holds:
@@ -188,6 +225,24 @@ class LSDCRNParameters
   /// @author SMM
   /// @date 07/12/2014
   double integrate_muon_flux(double z, double H, double tolerance);
+  
+  /// @brief This builds a table of the integrated muon stopping rate
+  ///  as a function of depth for a given pressure. It does nothing if the
+  ///  table has already been built for this pressure. 
+  /// @detail The table replaces the adaptive integration in 
+  ///  integrate_muon_flux, which was done for every depth. The
+  ///  nodes are evenly spaced in log(1+z) and include the ranges of the LZ
+  ///  table. 
+  /// @param h atmospheric pressure (hPa)
+  void build_muon_flux_table(double h);
+  
+  /// @brief This gets the integral of the muon stopping rate from depth z
+  ///  to 2e5+1 g/cm^2 using the table from build_muon_flux_table
+  /// @param z the depth of the sample in g/cm^2. Depths above the surface
+  ///  are treated as the surface
+  /// @return the integrated stopping rate (the vertical muon flux at site
+  ///  less the flux at 2e5 g/cm^2)
+  double interpolate_muon_flux(double z);
  
   // functions for altering the parameter values
   
@@ -314,6 +369,17 @@ class LSDCRNParameters
   /// @date 5/12/2014
   double stone2000sp(double lat,double P, double Fsp);
 
+  /// @brief Batch version of stone2000sp that scales a vector of points in one call
+  /// @details The index latitude polynomials are only evaluated for the two
+  ///  index latitudes that bracket each point and the coefficients live in
+  ///  static tables, so the loop over points allocates nothing.
+  ///  Gives the same values as calling stone2000sp point by point.
+  /// @param lat vector of latitudes in decimal degrees
+  /// @param P vector of pressures in hPa
+  /// @param Fsp the spallation fraction (see stone2000sp)
+  /// @return vector of scaling factors
+  vector<double> stone2000sp(vector<double>& lat, vector<double>& P, double Fsp);
+
   /// @brief this function takes a single scaling factor for
   /// elevation scaling, self shielding, snow shielding,
   /// and latitude scaling and produces scaling factors
@@ -378,6 +444,34 @@ class LSDCRNParameters
   /// @date 01/01/2010	
   void update_10Be_P0(double new_P0)			{ P0_10Be = new_P0; }
 
+  /// @brief Gets one of the attenuation lengths
+  /// @param i the production mechanism (0 is spallation, 1-3 are muons)
+  /// @return the attenuation length in g/cm^2
+  double get_Gamma(int i) const                { return Gamma[i]; }
+
+  /// @brief Gets one of the (possibly rescaled) F values of 10Be
+  /// @param i the production mechanism (0 is spallation, 1-3 are muons)
+  double get_F_10Be(int i) const               { return F_10Be[i]; }
+
+  /// @brief Gets one of the (possibly rescaled) F values of 26Al
+  /// @param i the production mechanism (0 is spallation, 1-3 are muons)
+  double get_F_26Al(int i) const               { return F_26Al[i]; }
+
+  /// @brief Gets the 10Be decay rate in yr^-1
+  double get_lambda_10Be() const               { return lambda_10Be; }
+
+  /// @brief Gets the 26Al decay rate in yr^-1
+  double get_lambda_26Al() const               { return lambda_26Al; }
+
+  /// @brief Gets the 10Be production rate in a/g/yr
+  double get_P0_10Be() const                   { return P0_10Be; }
+
+  /// @brief Gets the 26Al production rate in a/g/yr
+  double get_P0_26Al() const                   { return P0_26Al; }
+
+  /// @brief Gets the total scaling S_t that multiplies production
+  double get_S_t() const                       { return S_t; }
+
   /// @brief This calcualtes the atmospheric pressure given latidude, longitude
   /// and elevation
   /// @details Looks up surface pressure and 1000 mb temp from NCEP reanalysis
@@ -398,6 +492,21 @@ class LSDCRNParameters
   /// @author SMM
   /// @date 04/12/2014
   double NCEPatm_2(double site_lat, double site_lon, double site_elev);
+
+  /// @brief Batch version of NCEPatm_2 that gets the pressure of a vector
+  ///  of points in one call
+  /// @details The NCEP grid axes are put in ascending order once per call
+  ///  and the grid cell of the last point is reused whenever the next point
+  ///  falls in the same cell, which is nearly always the case for
+  ///  neighbouring pixels. Gives the same values as calling NCEPatm_2
+  ///  point by point.
+  /// @param site_lat vector of latitudes (DD)
+  /// @param site_lon vector of longitudes (DD)
+  /// @param site_elev vector of elevations (m)
+  /// @return vector of site pressures in hPa. Points outside the
+  ///  NCEP grid get -9999
+  vector<double> NCEPatm_2(vector<double>& site_lat, vector<double>& site_lon,
+                           vector<double>& site_elev);
   
   /// @brief This gets the attenuation depth in g/cm^2
   ///  You tell it if you want the CRONUS values
@@ -452,8 +561,8 @@ class LSDCRNParameters
   /// @param Al26_mu_N atoms produced of 26Al. Is replaced in the function
   /// @author SMM
   /// @date 15/12/2014
-  void integrate_muon_flux_for_erosion(double E, vector<double> z_mu,
-                           vector<double> P_mu_10Be, vector<double> P_mu_26Al,
+  void integrate_muon_flux_for_erosion(double E, const vector<double>& z_mu,
+                           const vector<double>& P_mu_10Be, const vector<double>& P_mu_26Al,
                            double& Be10_mu_N, double& Al26_mu_N);
   
   /// @brief this function calculates the total atoms from spallation
@@ -525,6 +634,9 @@ class LSDCRNParameters
   /// It is the only possible constructor
   void create();
   
+  /// @brief This sets the log range and log momentum tables used by LZ
+  void set_LZ_tables();
+  
   /// the version number of this CRNParameters object
   string version;
 
@@ -588,11 +700,9 @@ class LSDCRNParameters
   /// production rate for 3He in a/g/yr
   double P0_3He;			
   
-  /// This is a data map used for storing CRONUS calcluator parameters
-  map<string,double> CRONUS_data_map;
-  
-  /// This is a data map used for storing CRONUS muon parameters
-  map<string,double> CRONUS_muon_data;
+  /// The CRONUS muon parameters from the last call to P_mu_total,
+  /// indexed by CRONUS_muon_index
+  double CRONUS_muon_data[n_CRONUS_muon_values];
   
   /// levels: the levels for the atmospheric scaling of pressure
   vector<double> levels;
@@ -615,6 +725,30 @@ class LSDCRNParameters
   /// This is a vector of arrays holding something called gp_hgt;
   vector< Array2D<double> > gm_hgt;  
   
+  /// The log of the muon ranges (g/cm^2) in the LZ table
+  vector<double> LZ_log_range;
+  
+  /// The log of the muon momenta (MeV/c) in the LZ table
+  vector<double> LZ_log_momentum;
+  
+  /// The muon ranges (g/cm^2) in the LZ table
+  vector<double> LZ_range;
+  
+  /// The pressure (hPa) that the muon flux table was built for
+  double muon_table_pressure;
+  
+  /// The atmospheric depth (g/cm^2) that the muon flux table was built for
+  double muon_table_H;
+  
+  /// The depths (g/cm^2) of the nodes in the muon flux table
+  vector<double> muon_table_z;
+  
+  /// The muon stopping rate at site at each node in the muon flux table
+  vector<double> muon_table_stopping;
+  
+  /// The integral of the stopping rate from each node to 2e5+1 g/cm^2
+  vector<double> muon_table_cumulative;
+  
   
 };
 
@@ -226,10 +226,6 @@ void LSDChiNetwork::create(LSDFlowInfo& FlowInfo, int SourceNode, int OutletNode
   int row;
   int col;
 
-  float flow_dist;
-  float elev;
-  float drain_area;
-
   int last_cn = 0;    // this is 1 if this is the first node in a channel
   int last_receiver_node = -1;
   int last_receiver_channel = -1;
@@ -245,21 +241,11 @@ void LSDChiNetwork::create(LSDFlowInfo& FlowInfo, int SourceNode, int OutletNode
   vector<float> drain_area_vec;
   vector<float> chi_vec;
   
-  // we start from the top, accumulating data along the way
+  // we start from the top, accumulating the nodes along the way
   FlowInfo.retrieve_current_row_and_col(SourceNode,row,col);
-  flow_dist = FlowDistance.get_data_element(row,col);
-  elev = Elevation.get_data_element(row,col);
-  drain_area = DrainageArea.get_data_element(row,col);
-  
-  // now push back the data
   node_vec.push_back(SourceNode);
   row_vec.push_back(row);
   col_vec.push_back(col);
-  flow_dist_vec.push_back(flow_dist);
-  elev_vec.push_back(elev);
-  drain_area_vec.push_back(drain_area);
-  chi_vec.push_back(0.0);
-  
   
   current_node = SourceNode;
   
@@ -277,25 +263,29 @@ void LSDChiNetwork::create(LSDFlowInfo& FlowInfo, int SourceNode, int OutletNode
     }
     else
     {
-      // write the data to the vectors
-      flow_dist = FlowDistance.get_data_element(row,col);
-      elev = Elevation.get_data_element(row,col);
-      drain_area = DrainageArea.get_data_element(row,col);
-      
       node_vec.push_back(reciever_node);
       row_vec.push_back(row);
       col_vec.push_back(col);
-      flow_dist_vec.push_back(flow_dist);
-      elev_vec.push_back(elev);
-      drain_area_vec.push_back(drain_area);
-      chi_vec.push_back(0.0);         // in this version the chi vec is calculated seperately. 
-      
     }
     
     // set the current node to the reciever
     current_node = reciever_node;
   }
   
+  // now gather the raster data for the whole channel in one go
+  vector<LSDRaster> Rasters;
+  Rasters.push_back(FlowDistance);
+  Rasters.push_back(Elevation);
+  Rasters.push_back(DrainageArea);
+  vector< vector<float> > channel_data;
+  FlowInfo.get_raster_values_for_nodes(node_vec, Rasters, channel_data);
+  flow_dist_vec.swap(channel_data[0]);
+  elev_vec.swap(channel_data[1]);
+  drain_area_vec.swap(channel_data[2]);
+  
+  // in this version the chi vec is calculated seperately. 
+  chi_vec.assign(node_vec.size(),0.0);
+  
   // update the data elements
   node_indices.push_back(node_vec);
   row_indices.push_back(row_vec);
@@ -326,11 +316,6 @@ void LSDChiNetwork::create(LSDFlowInfo& FlowInfo, int SourceNode, int OutletNode
   int row;
   int col;
 
-  float flow_dist;
-  float elev;
-  float drain_area;
-  float chi;
-
   int last_cn = 0;    // this is 1 if this is the first node in a channel
   int last_receiver_node = -1;
   int last_receiver_channel = -1;
@@ -346,21 +331,11 @@ void LSDChiNetwork::create(LSDFlowInfo& FlowInfo, int SourceNode, int OutletNode
   vector<float> drain_area_vec;
   vector<float> chi_vec;
   
-  // we start from the top, accumulating data along the way
+  // we start from the top, accumulating the nodes along the way
   FlowInfo.retrieve_current_row_and_col(SourceNode,row,col);
-  flow_dist = FlowDistance.get_data_element(row,col);
-  elev = Elevation.get_data_element(row,col);
-  drain_area = DrainageArea.get_data_element(row,col);
-  chi = Chi.get_data_element(row,col);
-  
-  // now push back the data
   node_vec.push_back(SourceNode);
   row_vec.push_back(row);
   col_vec.push_back(col);
-  flow_dist_vec.push_back(flow_dist);
-  elev_vec.push_back(elev);
-  drain_area_vec.push_back(drain_area);
-  chi_vec.push_back(chi);
   
   current_node = SourceNode;
   
@@ -378,25 +353,28 @@ void LSDChiNetwork::create(LSDFlowInfo& FlowInfo, int SourceNode, int OutletNode
     }
     else
     {
-      // write the data to the vectors
-      flow_dist = FlowDistance.get_data_element(row,col);
-      elev = Elevation.get_data_element(row,col);
-      drain_area = DrainageArea.get_data_element(row,col);
-      chi = Chi.get_data_element(row,col);
-      
       node_vec.push_back(reciever_node);
       row_vec.push_back(row);
       col_vec.push_back(col);
-      flow_dist_vec.push_back(flow_dist);
-      elev_vec.push_back(elev);
-      drain_area_vec.push_back(drain_area);
-      chi_vec.push_back(chi);
     }
     
     // set the current node to the reciever
     current_node = reciever_node;
   }
   
+  // now gather the raster data for the whole channel in one go
+  vector<LSDRaster> Rasters;
+  Rasters.push_back(FlowDistance);
+  Rasters.push_back(Elevation);
+  Rasters.push_back(DrainageArea);
+  Rasters.push_back(Chi);
+  vector< vector<float> > channel_data;
+  FlowInfo.get_raster_values_for_nodes(node_vec, Rasters, channel_data);
+  flow_dist_vec.swap(channel_data[0]);
+  elev_vec.swap(channel_data[1]);
+  drain_area_vec.swap(channel_data[2]);
+  chi_vec.swap(channel_data[3]);
+  
   // update the data elements
   node_indices.push_back(node_vec);
   row_indices.push_back(row_vec);
@@ -317,14 +317,10 @@ void LSDChiTools::update_chi_data_map(LSDFlowInfo& FlowInfo, LSDRaster& Chi_coor
   else
   {
     int n_nodes = int(node_sequence.size());
-    int this_node,row,col;
-    float updated_chi;
+    vector<float> updated_chi = FlowInfo.get_raster_values_for_nodes(Chi_coord,node_sequence);
     for(int node = 0; node<n_nodes; node++)
     {
-      this_node = node_sequence[node];
-      FlowInfo.retrieve_current_row_and_col(this_node,row,col);
-      updated_chi = Chi_coord.get_data_element(row,col);
-      chi_data_map[this_node] = updated_chi;
+      chi_data_map[node_sequence[node]] = updated_chi[node];
     }
   }
 
@@ -346,14 +342,10 @@ void LSDChiTools::update_chi_data_map(LSDFlowInfo& FlowInfo, float A_0, float mo
     LSDRaster this_chi_coordinate = FlowInfo.get_upslope_chi_from_all_baselevel_nodes(movern,A_0,thresh_area_for_chi);
 
     int n_nodes = int(node_sequence.size());
-    int this_node,row,col;
-    float updated_chi;
+    vector<float> updated_chi = FlowInfo.get_raster_values_for_nodes(this_chi_coordinate,node_sequence);
     for(int node = 0; node<n_nodes; node++)
     {
-      this_node = node_sequence[node];
-      FlowInfo.retrieve_current_row_and_col(this_node,row,col);
-      updated_chi = this_chi_coordinate.get_data_element(row,col);
-      chi_data_map[this_node] = updated_chi;
+      chi_data_map[node_sequence[node]] = updated_chi[node];
     }
   }
 
@@ -529,9 +521,17 @@ void LSDChiTools::chi_map_automator_chi_only(LSDFlowInfo& FlowInfo,
   map<int,int> this_key_to_baselevel_map;
 
   // these are for working with the FlowInfo object
-  int this_node,row,col;
+  int this_node;
   int this_base_level, this_source_node;
 
+  // the rasters that are sampled along each channel. They are gathered in bulk
+  // for each channel: 0 is elevation, 1 is drainage area, 2 is flow distance
+  vector<LSDRaster> sampled_rasters;
+  sampled_rasters.push_back(Elevation);
+  sampled_rasters.push_back(DrainageArea);
+  sampled_rasters.push_back(FlowDistance);
+  vector< vector<float> > sampled_values;
+
   vector<int> empty_vec;
   ordered_baselevel_nodes = empty_vec;
   ordered_source_nodes = empty_vec;
@@ -604,6 +604,8 @@ void LSDChiTools::chi_map_automator_chi_only(LSDFlowInfo& FlowInfo,
     //cout << "I have " << these_chi_m_means.size() << " nodes." << endl;
 
 
+    FlowInfo.get_raster_values_for_nodes(these_chi_node_indices, sampled_rasters, sampled_values);
+
     int n_nodes_in_channel = int(these_chi_coordinates.size());
     for (int node = 0; node< n_nodes_in_channel; node++)
     {
@@ -614,13 +616,11 @@ void LSDChiTools::chi_map_automator_chi_only(LSDFlowInfo& FlowInfo,
       // only take the nodes that have not been found
       if (chi_coord_map.find(this_node) == chi_coord_map.end() )
       {
-        FlowInfo.retrieve_current_row_and_col(this_node,row,col);
-
         //cout << "This is a new node; " << this_node << endl;
         chi_coord_map[this_node] = these_chi_coordinates[node];
-        elev_map[this_node] = Elevation.get_data_element(row,col);
-        area_map[this_node] = DrainageArea.get_data_element(row,col);
-        flow_distance_map[this_node] = FlowDistance.get_data_element(row,col);
+        elev_map[this_node] = sampled_values[0][node];
+        area_map[this_node] = sampled_values[1][node];
+        flow_distance_map[this_node] = sampled_values[2][node];
         node_sequence_vec.push_back(this_node);
 
         these_source_keys[this_node] = source_node_tracker;
@@ -710,9 +710,17 @@ void LSDChiTools::chi_map_automator(LSDFlowInfo& FlowInfo,
   map<int,int> this_key_to_baselevel_map;
 
   // these are for working with the FlowInfo object
-  int this_node,row,col;
+  int this_node;
   int this_base_level, this_source_node;
 
+  // the rasters that are sampled along each channel. They are gathered in bulk
+  // for each channel: 0 is elevation, 1 is drainage area, 2 is flow distance
+  vector<LSDRaster> sampled_rasters;
+  sampled_rasters.push_back(Elevation);
+  sampled_rasters.push_back(DrainageArea);
+  sampled_rasters.push_back(FlowDistance);
+  vector< vector<float> > sampled_values;
+
   // get the number of channels
   int source_node_tracker = -1;
   int baselevel_tracker = -1;
@@ -790,6 +798,8 @@ void LSDChiTools::chi_map_automator(LSDFlowInfo& FlowInfo,
     //cout << "I have " << these_chi_m_means.size() << " nodes." << endl;
 
 
+    FlowInfo.get_raster_values_for_nodes(these_chi_node_indices, sampled_rasters, sampled_values);
+
     int n_nodes_in_channel = int(these_chi_m_means.size());
     for (int node = 0; node< n_nodes_in_channel; node++)
     {
@@ -800,15 +810,13 @@ void LSDChiTools::chi_map_automator(LSDFlowInfo& FlowInfo,
       // only take the nodes that have not been found
       if (m_means_map.find(this_node) == m_means_map.end() )
       {
-        FlowInfo.retrieve_current_row_and_col(this_node,row,col);
-
         //cout << "This is a new node; " << this_node << endl;
         m_means_map[this_node] = these_chi_m_means[node];
         b_means_map[this_node] = these_chi_b_means[node];
         chi_coord_map[this_node] = these_chi_coordinates[node];
-        elev_map[this_node] = Elevation.get_data_element(row,col);
-        area_map[this_node] = DrainageArea.get_data_element(row,col);
-        flow_distance_map[this_node] = FlowDistance.get_data_element(row,col);
+        elev_map[this_node] = sampled_values[0][node];
+        area_map[this_node] = sampled_values[1][node];
+        flow_distance_map[this_node] = sampled_values[2][node];
         node_sequence_vec.push_back(this_node);
 
         these_source_keys[this_node] = source_node_tracker;
@@ -78,6 +78,7 @@ using namespace TNT;
 void LSDCosmoData::create()
 {
   Muon_scaling = "Braucher";
+  UTM_zone_of_samples = -1;
 }
 
 void LSDCosmoData::create(string path_name, string param_name_prefix)
@@ -206,6 +207,18 @@ void LSDCosmoData::initiate_default_parameters()
   
   Muon_scaling = test_scaling;       // default muon scaling
 
+  // the Monte Carlo uncertainty analysis is off by default. The quantiles
+  // are the median and the one and two sigma bounds
+  monte_carlo_draws = 0;
+  monte_carlo_shielding_uncert = 0;
+  monte_carlo_seed = 1;
+  monte_carlo_quantiles.clear();
+  monte_carlo_quantiles.push_back(0.025);
+  monte_carlo_quantiles.push_back(0.16);
+  monte_carlo_quantiles.push_back(0.5);
+  monte_carlo_quantiles.push_back(0.84);
+  monte_carlo_quantiles.push_back(0.975);
+
   //cout << "default muon scaling: " << Muon_scaling << endl;
 
   // the atmospheric data is in the folder with the driver_functions
@@ -289,6 +302,9 @@ void LSDCosmoData::load_cosmogenic_data(string filename, string filetype)
   // now loop through the data, getting the standardised concentrations
   N_samples = int(sample_name.size());
   
+  // the samples have not been converted to UTM yet
+  UTM_zone_of_samples = -1;
+  
   // create the vec vec for holding sample results
   vector<double> empty_vec;
   vector< vector<double> > result_vecvec;
@@ -340,6 +356,7 @@ void LSDCosmoData::load_cosmogenic_data(string filename, string filetype)
 
   }
   erosion_rate_results = result_vecvec;
+  monte_carlo_results = result_vecvec;
 
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
@@ -715,6 +732,18 @@ void LSDCosmoData::load_parameters(string filename)
         cout << "You have not selected a valid scaling, defaulting to Braucher" << endl;
       }
     }
+    else if (lower == "monte_carlo_draws")
+    {
+      monte_carlo_draws = atoi(value.c_str());
+    }
+    else if (lower == "monte_carlo_shielding_uncert")
+    {
+      monte_carlo_shielding_uncert = atof(value.c_str());
+    }
+    else if (lower == "monte_carlo_seed")
+    {
+      monte_carlo_seed = atol(value.c_str());
+    }
     else if (lower == "write_toposhield_raster")
     {
       if(value.find("true") == 0 || value.find("True") == 0)
@@ -1244,6 +1273,18 @@ void LSDCosmoData::check_parameter_values()
     prod_uncert_factor = 1;
   }
   
+  if (monte_carlo_draws < 0)
+  {
+    cout << "Your monte_carlo_draws is negative! Changing to default 0" << endl;
+    monte_carlo_draws = 0;
+  }
+  
+  if (monte_carlo_shielding_uncert < 0)
+  {
+    cout << "Your monte_carlo_shielding_uncert is negative! Changing to default 0" << endl;
+    monte_carlo_shielding_uncert = 0;
+  }
+  
   // Check the atmospheric data files
   string filename = "NCEP2.bin";
   filename = path_to_atmospheric_data+filename;
@@ -1766,10 +1807,38 @@ LSDRaster LSDCosmoData::calculate_production_raster(LSDRaster& Elevation_Data,
   int NCols = Elevation_Data.get_NCols();
   float NDV =  Elevation_Data.get_NoDataValue();
   
+  Array2D<float> Pressure(NRows,NCols,NDV);
   Array2D<float> Production(NRows,NCols,NDV);
+  calculate_pressure_and_scaling_arrays(Elevation_Data, path_to_atmospheric_data,
+                                        Pressure, Production);
 
-  // variables for converting location and elevation
-  double this_elevation, this_pressure;
+  float XMinimum = Elevation_Data.get_XMinimum();
+  float YMinimum = Elevation_Data.get_YMinimum();
+  float DataResolution = Elevation_Data.get_DataResolution();
+  map<string,string> GeoReferencingStrings = Elevation_Data.get_GeoReferencingStrings();
+
+  LSDRaster Production_raster(NRows, NCols, XMinimum, YMinimum, DataResolution,
+                               NDV, Production,GeoReferencingStrings);
+  return Production_raster;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This function gets the pressure and production scaling of every pixel
+// in a raster. Each row is converted to lat-long, interpolated from the 
+// NCEP data and scaled in one batch.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCosmoData::calculate_pressure_and_scaling_arrays(LSDRaster& Elevation_Data,
+                                          string path_to_atmospheric_data,
+                                          Array2D<float>& Pressure,
+                                          Array2D<float>& Scaling)
+{
+  int NRows = Elevation_Data.get_NRows();
+  int NCols = Elevation_Data.get_NCols();
+  float NDV =  Elevation_Data.get_NoDataValue();
+  
+  Array2D<float> new_pressure(NRows,NCols,NDV);
+  Array2D<float> new_scaling(NRows,NCols,NDV);
 
   // now create the CRN parameters object
   LSDCRNParameters LSDCRNP;
@@ -1781,45 +1850,52 @@ LSDRaster LSDCosmoData::calculate_production_raster(LSDRaster& Elevation_Data,
   // a function for scaling stone production, defaults to 1
   double Fsp = 1.0;
   
-  // the latitude and longitude
-  double lat,longitude;
-  
   // decalre converter object
   LSDCoordinateConverterLLandUTM Converter;
   
+  // vectors holding the data of the row
+  vector<int> row_rows;
+  vector<int> row_cols;
+  vector<double> row_elevations;
+  vector<double> lat,longitude;
+  vector<double> row_pressure;
+  vector<double> row_scaling;
+  
   for (int row = 0; row < NRows; row++)
   {
+    // gather the pixels in this row that have data
+    row_rows.clear();
+    row_cols.clear();
+    row_elevations.clear();
     for(int col = 0; col<NCols; col++)
     {
-      
-      //exclude NDV from average
       if (Elevation_Data.get_data_element(row,col) != NDV)
       {
-        // To get pressure, first get the lat and long
-        Elevation_Data.get_lat_and_long_locations(row, col, lat, longitude, Converter);
-        //Elevation_Data.get_lat_and_long_locations(row, col, lat, longitude);
-      
-        // now the elevation
-        this_elevation = Elevation_Data.get_data_element(row,col);
-      
-        // now the pressure
-        this_pressure = LSDCRNP.NCEPatm_2(double(lat), double(longitude), 
-                                        double(this_elevation));
-
-        // get the production
-        Production[row][col] = LSDCRNP.stone2000sp(lat,this_pressure, Fsp);
+        row_rows.push_back(row);
+        row_cols.push_back(col);
+        row_elevations.push_back(double(Elevation_Data.get_data_element(row,col)));
       }
     }
+    if(row_cols.empty())
+    {
+      continue;
+    }
+    
+    // now the lat-long, the pressure and the production
+    Elevation_Data.get_lat_and_long_locations(row_rows, row_cols, lat, longitude,
+                                              Converter);
+    row_pressure = LSDCRNP.NCEPatm_2(lat, longitude, row_elevations);
+    row_scaling = LSDCRNP.stone2000sp(lat, row_pressure, Fsp);
+    
+    for(int i = 0; i< int(row_cols.size()); i++)
+    {
+      new_pressure[row][row_cols[i]] = row_pressure[i];
+      new_scaling[row][row_cols[i]] = row_scaling[i];
+    }
   }
-
-  float XMinimum = Elevation_Data.get_XMinimum();
-  float YMinimum = Elevation_Data.get_YMinimum();
-  float DataResolution = Elevation_Data.get_DataResolution();
-  map<string,string> GeoReferencingStrings = Elevation_Data.get_GeoReferencingStrings();
-
-  LSDRaster Production_raster(NRows, NCols, XMinimum, YMinimum, DataResolution,
-                               NDV, Production,GeoReferencingStrings);
-  return Production_raster;
+  
+  Pressure = new_pressure;
+  Scaling = new_scaling;
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
@@ -1897,6 +1973,9 @@ void LSDCosmoData::print_renamed_parameter_data(string path, string prefix)
   new_param_data << "theta_step: " << theta_step << endl;
   new_param_data << "phi_step: " << phi_step << endl; 
   new_param_data << "Muon_scaling: " << Muon_scaling << endl;
+  new_param_data << "monte_carlo_draws: " << monte_carlo_draws << endl;
+  new_param_data << "monte_carlo_shielding_uncert: " << monte_carlo_shielding_uncert << endl;
+  new_param_data << "monte_carlo_seed: " << monte_carlo_seed << endl;
   if (write_basin_index_raster)
   {
     new_param_data << "write_basin_index_raster: True" << endl;
@@ -1998,6 +2077,9 @@ void LSDCosmoData::print_all_data_parameters_and_filestructures(string outfilena
   outfile << "theta_step: " << theta_step << endl;
   outfile << "phi_step: " << phi_step << endl; 
   outfile << "Muon_scaling: " << Muon_scaling << endl;
+  outfile << "monte_carlo_draws: " << monte_carlo_draws << endl;
+  outfile << "monte_carlo_shielding_uncert: " << monte_carlo_shielding_uncert << endl;
+  outfile << "monte_carlo_seed: " << monte_carlo_seed << endl;
   outfile << "----------------------------------------------" << endl << endl;
   
   // now the file structures
@@ -2089,6 +2171,13 @@ void LSDCosmoData::print_simple_results_to_screen(double rho)
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 void LSDCosmoData::convert_to_UTM(int UTM_zone)
 {
+  // if the samples are already in this zone there is nothing to do. This is
+  // common since most of the DEMs in an analysis tend to share a zone
+  if(UTM_zone == UTM_zone_of_samples && int(UTM_easting.size()) == N_samples)
+  {
+    return;
+  }
+  
   // initilise the converter
   LSDCoordinateConverterLLandUTM Converter;
   
@@ -2101,9 +2190,9 @@ void LSDCosmoData::convert_to_UTM(int UTM_zone)
   
   // loop throught the samples collecting UTM information
   int eId = 22;             // defines the ellipsiod. This is WGS
+  cout << "Converting " << N_samples << " points to UTM zone " << UTM_zone << endl;
   for(int i = 0; i<N_samples; i++)
   {
-    cout << "Converting point " << i << " to UTM." << endl;
     Converter.LLtoUTM_ForceZone(eId, latitude[i], longitude[i], 
                       this_Northing, this_Easting, UTM_zone);
     this_UTMN[i] = this_Northing;
@@ -2112,6 +2201,7 @@ void LSDCosmoData::convert_to_UTM(int UTM_zone)
   
   UTM_easting = this_UTME;
   UTM_northing = this_UTMN;
+  UTM_zone_of_samples = UTM_zone;
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
@@ -2272,6 +2362,129 @@ void LSDCosmoData::basic_cosmogenic_analysis(string DEM_fname)
 
 
 
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This finds the nesting of the samples in a DEM and sorts them into levels
+// so that the samples upstream of a sample are all in earlier levels. 
+// The upslope nodes of a node follow it in the stack, so a sample is upstream
+// of another if its outlet is in the block of the stack that starts at the 
+// outlet of the other.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCosmoData::get_upstream_sample_order(LSDFlowInfo& FlowInfo, 
+                                   vector<int>& outlet_nodes,
+                                   vector<string>& nuclide_names,
+                                   vector< vector<int> >& upstream_samples,
+                                   vector< vector<int> >& level_samples)
+{
+  int n_samples = int(outlet_nodes.size());
+  
+  // get the position of each outlet in the stack
+  map<int,int> stack_position_of_outlet;
+  for(int samp = 0; samp<n_samples; samp++)
+  {
+    stack_position_of_outlet[ outlet_nodes[samp] ] = -1;
+  }
+  vector<int> SVector = FlowInfo.get_SVector();
+  map<int,int>::iterator outlet_iter;
+  for(int s = 0; s< int(SVector.size()); s++)
+  {
+    outlet_iter = stack_position_of_outlet.find(SVector[s]);
+    if (outlet_iter != stack_position_of_outlet.end())
+    {
+      outlet_iter->second = s;
+    }
+  }
+  vector<int> stack_start(n_samples);
+  vector<int> stack_end(n_samples);
+  for(int samp = 0; samp<n_samples; samp++)
+  {
+    stack_start[samp] = stack_position_of_outlet[ outlet_nodes[samp] ];
+    stack_end[samp] = stack_start[samp]+
+                 FlowInfo.retrieve_contributing_pixels_of_node(outlet_nodes[samp]);
+  }
+  
+  // The sample directly downstream of a sample is the nearest one that it 
+  // drains into, which is the one that is furthest along the stack.
+  // Samples that share an outlet are not nested in each other.
+  vector<int> downstream_start(n_samples,-1);
+  for(int samp = 0; samp<n_samples; samp++)
+  {
+    for(int other = 0; other<n_samples; other++)
+    {
+      if (stack_start[other] < stack_start[samp] && 
+          stack_start[samp] < stack_end[other] &&
+          stack_start[other] > downstream_start[samp])
+      {
+        downstream_start[samp] = stack_start[other];
+      }
+    }
+  }
+  
+  // now get the samples directly upstream. Samples that share an outlet 
+  // cover the same pixels, so only one of them is used
+  upstream_samples.assign(n_samples, vector<int>());
+  for(int samp = 0; samp<n_samples; samp++)
+  {
+    map<int,int> upstream_sample_of_outlet;
+    for(int up = 0; up<n_samples; up++)
+    {
+      if (downstream_start[up] == stack_start[samp])
+      {
+        outlet_iter = upstream_sample_of_outlet.find(outlet_nodes[up]);
+        if (outlet_iter == upstream_sample_of_outlet.end())
+        {
+          upstream_sample_of_outlet[ outlet_nodes[up] ] = up;
+        }
+        else if (nuclide_names[outlet_iter->second] != nuclide_names[samp] &&
+                 nuclide_names[up] == nuclide_names[samp])
+        {
+          outlet_iter->second = up;
+        }
+      }
+    }
+    for(outlet_iter = upstream_sample_of_outlet.begin(); 
+        outlet_iter != upstream_sample_of_outlet.end(); ++outlet_iter)
+    {
+      upstream_samples[samp].push_back(outlet_iter->second);
+    }
+  }
+  
+  // Get the levels, going up the stack so that every sample is reached 
+  // after all of the samples upstream of it. All samples that drain directly
+  // into a sample must be solved first, even the ones that are not used.
+  vector< pair<int,int> > samples_by_stack;
+  for(int samp = 0; samp<n_samples; samp++)
+  {
+    samples_by_stack.push_back( make_pair(stack_start[samp],samp) );
+  }
+  sort(samples_by_stack.begin(), samples_by_stack.end());
+  vector<int> sample_level(n_samples,0);
+  int max_level = 0;
+  for(int i = n_samples-1; i>=0; i--)
+  {
+    int samp = samples_by_stack[i].second;
+    for(int up = 0; up<n_samples; up++)
+    {
+      if (downstream_start[up] == stack_start[samp] && 
+          sample_level[up]+1 > sample_level[samp])
+      {
+        sample_level[samp] = sample_level[up]+1;
+      }
+    }
+    if (sample_level[samp] > max_level)
+    {
+      max_level = sample_level[samp];
+    }
+  }
+  
+  level_samples.assign(max_level+1, vector<int>());
+  for(int samp = 0; samp<n_samples; samp++)
+  {
+    level_samples[ sample_level[samp] ].push_back(samp);
+  }
+  cout << "The samples are nested " << max_level+1 << " levels deep." << endl;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 //
 // This function wraps the determination of cosmogenic erosion rates
@@ -2280,11 +2493,18 @@ void LSDCosmoData::basic_cosmogenic_analysis(string DEM_fname)
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 void LSDCosmoData::full_shielding_cosmogenic_analysis_nested(vector<string> Raster_names,
                             vector<double> CRN_params, 
-                            LSDRaster& known_eff_erosion)
+                            LSDRaster& known_eff_erosion,
+                            bool use_upstream_samples)
 {
 
   cout << endl << endl << "================================================" << endl;
   cout << "Looking for basins in raster: " << Raster_names[0] << endl << endl;
+  
+  // the Monte Carlo tables do not include the known erosion of upstream pixels
+  if (monte_carlo_draws > 0)
+  {
+    cout << "The Monte Carlo uncertainty is not calculated for nested basins." << endl;
+  }
 
   // some parameters for printing the basins, if that is called for
   int basin_number;
@@ -2450,157 +2670,239 @@ void LSDCosmoData::full_shielding_cosmogenic_analysis_nested(vector<string> Rast
       constant_self_depth = CRN_params[1];
     }
 
-    // some temporary doubles to hold the nuclide concentrations
-    double test_N10, test_dN10;   // concetration and uncertainty of 10Be in basin
-    double test_N26, test_dN26;   // concetration and uncertainty of 26Al in basin
-    double test_N, test_dN;       // concentration and uncertainty of the nuclide in basin  
-
     //========================
     // LOOPING THROUGH BASINS
     //========================
-    // now loop through the valid points, getting the cosmo data 
+    // The routing above is shared by every sample in this DEM, and once it
+    // exists each basin is independent of the others, so the basins are
+    // solved in parallel. The solutions are held in vectors indexed by sample
+    // and only copied into the data members afterwards, in sample order, 
+    // so the results do not depend on the number of threads. 
     cout << "-----------------------------------------------------------" << endl;
     cout << "I found " << n_valid_points << " valid CRN basins in this raster! " << endl;
+    
+    // first check the nuclide names. This is done before the parallel loop
+    // since the names are updated if they are not valid
     for(int samp = 0; samp<n_valid_points; samp++)
     {
-      if( valid_nuclide_names[samp] == "Be10")
-      {
-        test_N10 = valid_concentrations[samp];
-        test_dN10 = valid_concentration_uncertainties[samp];
-        test_N26 = 1e9;
-        test_dN26 = 0;
-        test_N = test_N10;
-        test_dN = test_dN10;
-      }
-      else if( valid_nuclide_names[samp] == "Al26")
-      {
-        test_N10 = 1e9;
-        test_dN10 = 0;
-        test_N26 = valid_concentrations[samp];
-        test_dN26 = valid_concentration_uncertainties[samp];
-        test_N = test_N26;
-        test_dN = test_dN26;
-      }
-      else
+      if( valid_nuclide_names[samp] != "Be10" && valid_nuclide_names[samp] != "Al26")
       {
         cout << "You did not select a valid nuclide name, options are Be10 and Al26" << endl;
         cout << "Defaulting to Be10" << endl;
         valid_nuclide_names[samp] = "Be10";
-        test_N10 = valid_concentrations[samp];
-        test_dN10 = valid_concentration_uncertainties[samp];
-        test_N26 = 1e9;
-        test_dN26 = 0;
-        test_N = test_N10;
-        test_dN = test_dN10;
       }
-      
-
-      cout << endl << "Valid point is: " << valid_cosmo_points[samp]
-           << " Sample name: " << sample_name[ valid_cosmo_points[samp] ] << " Easting: " 
-           << UTM_easting[valid_cosmo_points[samp]] << " Northing: "
-           << UTM_northing[valid_cosmo_points[samp]] << endl;
-      cout << "Node index is: " <<  snapped_node_indices[samp] << " and junction is: " 
-           << snapped_junction_indices[samp] << endl;
-      cout << "-  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -" << endl;
-      LSDCosmoBasin thisBasin(snapped_junction_indices[samp],FlowInfo, JNetwork,
-                              test_N10,test_dN10, test_N26,test_dN26);
-
-      // write the index basin if flag is set to true
-      if(write_basin_index_raster)
+    }
+    
+    // write the index basins if flag is set to true. The basins are added
+    // in sample order so that overlapping basins are resolved in the same way
+    // as they always have been
+    if(write_basin_index_raster)
+    {
+      cout << "I'm writing a basin index number for you" << endl;
+      for(int samp = 0; samp<n_valid_points; samp++)
       {
-        cout << "I'm writing a basin index number for you" << endl;
-      
+        // the concentrations are not needed to get the basin nodes
+        LSDCosmoBasin indexBasin(snapped_junction_indices[samp],FlowInfo, JNetwork,
+                                 1e9,0,1e9,0);
+        basin_number = valid_cosmo_points[samp];
         if (not written_inital_basin_index)
         {
-        
-          basin_number = valid_cosmo_points[samp];
-          basin_pixel_area = thisBasin.get_NumberOfCells();
+          basin_pixel_area = indexBasin.get_NumberOfCells();
           basin_area_map[basin_number] = basin_pixel_area;
           LSDIndexRaster NewBasinIndex = 
-             thisBasin.write_integer_data_to_LSDIndexRaster(basin_number, FlowInfo);
+             indexBasin.write_integer_data_to_LSDIndexRaster(basin_number, FlowInfo);
           BasinIndex = NewBasinIndex;
           written_inital_basin_index = true;
         }
         else
         {
-          basin_number = valid_cosmo_points[samp];
-          thisBasin.add_basin_to_LSDIndexRaster(BasinIndex, FlowInfo,
+          indexBasin.add_basin_to_LSDIndexRaster(BasinIndex, FlowInfo,
                                                 basin_area_map,basin_number);
         }
       }
-
-      // we need to scale the shielding parameters
-      // now do the snow and self shielding
-      if (have_snow_raster)
+    }
+    
+    // vectors for holding the results of each basin
+    vector< vector<double> > erate_analysis_vecvec(n_valid_points);
+    vector< vector<double> > param_for_calc_vecvec(n_valid_points);
+    vector<double> relief_vec(n_valid_points,0.0);
+    
+    // The erosion rates of solved samples are added to a copy of the known 
+    // erosion rates, so the rasters passed in are not changed. Copying an
+    // LSDRaster shares its data, so the data are copied explicitly.
+    LSDRaster working_eff_erosion(known_eff_erosion.get_NRows(),
+                                  known_eff_erosion.get_NCols(),
+                                  known_eff_erosion.get_XMinimum(),
+                                  known_eff_erosion.get_YMinimum(),
+                                  known_eff_erosion.get_DataResolution(),
+                                  known_eff_erosion.get_NoDataValue(),
+                                  known_eff_erosion.get_RasterData(),
+                                  known_eff_erosion.get_GeoReferencingStrings());
+    
+    // the samples directly upstream of each sample and the level of each 
+    // sample. Without nesting of samples every sample is in the first level
+    vector< vector<int> > upstream_samples(n_valid_points);
+    vector< vector<int> > level_samples(1);
+    vector< map<string, vector<double> > > nested_contributions(n_valid_points);
+    vector<int> outlet_nodes(n_valid_points);
+    for(int samp = 0; samp<n_valid_points; samp++)
+    {
+      outlet_nodes[samp] = JNetwork.get_Node_of_Junction(snapped_junction_indices[samp]);
+    }
+    if (use_upstream_samples)
+    {
+      get_upstream_sample_order(FlowInfo, outlet_nodes, valid_nuclide_names,
+                                upstream_samples, level_samples);
+    }
+    else
+    {
+      for(int samp = 0; samp<n_valid_points; samp++)
       {
-        cout << "I've got the snow raster" << endl;
+        level_samples[0].push_back(samp);
+      }
+    }
+    
+    // The levels are solved in turn, upstream first, and the basins within
+    // a level are independent of each other so are solved in parallel.
+    // Within a level the shared rasters (working_eff_erosion included) are
+    // only read, and only through references, since copying one changes
+    // the non-atomic reference count of its data. working_eff_erosion is
+    // written between levels, outside the parallel loop.
+    int n_levels = int(level_samples.size());
+    for(int level = 0; level<n_levels; level++)
+    {
+      int n_level_samples = int(level_samples[level].size());
+      #pragma omp parallel for schedule(dynamic)
+      for(int level_samp = 0; level_samp<n_level_samples; level_samp++)
+      {
+        int samp = level_samples[level][level_samp];
       
-        if(have_self_raster)
+        // some temporary doubles to hold the nuclide concentrations
+        double test_N10, test_dN10;   // concetration and uncertainty of 10Be in basin
+        double test_N26, test_dN26;   // concetration and uncertainty of 26Al in basin
+        double test_N, test_dN;       // concentration and uncertainty of the nuclide in basin  
+      
+        if( valid_nuclide_names[samp] == "Al26")
         {
-          cout << "I've also got the self raster." << endl;
-          thisBasin.populate_snow_and_self_eff_depth_vectors(FlowInfo, 
-                                Snow_shielding, Self_shielding);
-          cout << "Done with effective depths" << endl;                           
+          test_N10 = 1e9;
+          test_dN10 = 0;
+          test_N26 = valid_concentrations[samp];
+          test_dN26 = valid_concentration_uncertainties[samp];
+          test_N = test_N26;
+          test_dN = test_dN26;
         }
         else
         {
-          cout << "No self raster, but I'm getting the effective depths" << endl;
-          cout << "The constant self depth is: " <<  constant_self_depth << endl;
-          thisBasin.populate_snow_and_self_eff_depth_vectors(FlowInfo, 
-                                Snow_shielding, constant_self_depth);
-          cout << "Done with effective depths" << endl;        
+          test_N10 = valid_concentrations[samp];
+          test_dN10 = valid_concentration_uncertainties[samp];
+          test_N26 = 1e9;
+          test_dN26 = 0;
+          test_N = test_N10;
+          test_dN = test_dN10;
         }
-      }
-      else
-      {
-        if(have_self_raster)
+      
+        #pragma omp critical
         {
-          cout << "Getting effective depths" << endl;
-          thisBasin.populate_snow_and_self_eff_depth_vectors(FlowInfo, 
-                                constant_snow_depth, Self_shielding);
-          cout << "Done with effective depths" << endl;                                
+          cout << "Valid point is: " << valid_cosmo_points[samp]
+               << " Sample name: " << sample_name[ valid_cosmo_points[samp] ] << " Easting: " 
+               << UTM_easting[valid_cosmo_points[samp]] << " Northing: "
+               << UTM_northing[valid_cosmo_points[samp]] << " Node index is: " 
+               <<  snapped_node_indices[samp] << " and junction is: " 
+               << snapped_junction_indices[samp] << endl;
+        }
+      
+        LSDCosmoBasin thisBasin(snapped_junction_indices[samp],FlowInfo, JNetwork,
+                                test_N10,test_dN10, test_N26,test_dN26);
+
+        // we need to scale the shielding parameters
+        // now do the snow and self shielding
+        if (have_snow_raster)
+        {
+          if(have_self_raster)
+          {
+            thisBasin.populate_snow_and_self_eff_depth_vectors(FlowInfo, 
+                                  Snow_shielding, Self_shielding);
+          }
+          else
+          {
+            thisBasin.populate_snow_and_self_eff_depth_vectors(FlowInfo, 
+                                  Snow_shielding, constant_self_depth);
+          }
         }
         else
         {
-          cout << "Getting effective depths" << endl;
-          thisBasin.populate_snow_and_self_eff_depth_vectors(constant_snow_depth, 
-                                             constant_self_depth);
-          cout << "Done with effective depths" << endl;                                 
+          if(have_self_raster)
+          {
+            thisBasin.populate_snow_and_self_eff_depth_vectors(FlowInfo, 
+                                  constant_snow_depth, Self_shielding);
+          }
+          else
+          {
+            thisBasin.populate_snow_and_self_eff_depth_vectors(constant_snow_depth, 
+                                               constant_self_depth);
+          }
         }
-      }
 
+        // Now topographic shielding and production scaling
+        thisBasin.populate_scaling_vectors(FlowInfo, filled_raster, 
+                                           Topographic_shielding,
+                                           path_to_atmospheric_data);
 
-      cout << "Now I will populate the scaling vectors." << endl;
-      // Now topographic shielding and production scaling
-      thisBasin.populate_scaling_vectors(FlowInfo, filled_raster, 
-                                         Topographic_shielding,
-                                         path_to_atmospheric_data);
-      cout << "The scaling vectors are populated. I am moving on to the analysis" << endl;
+        // the samples upstream have been solved so their pixels are replaced
+        // by their contributions and only the rest of the basin is solved
+        for(int i = 0; i< int(upstream_samples[samp].size()); i++)
+        {
+          int up_samp = upstream_samples[samp][i];
+          thisBasin.add_solved_subbasin(FlowInfo, outlet_nodes[up_samp],
+                                        nested_contributions[up_samp]);
+        }
 
-      // now do the analysis
-      cout << "Line 2571, doing analysis" << endl;
-      vector<double> erate_analysis = thisBasin.full_CRN_erosion_analysis_nested(known_eff_erosion, FlowInfo, test_N, 
-                                          valid_nuclide_names[samp], test_dN, 
-                                          prod_uncert_factor, Muon_scaling);
-       cout << "erate: " << erate_analysis[0] << endl;
-      
+        // now do the analysis
+        erate_analysis_vecvec[samp] = thisBasin.full_CRN_erosion_analysis_nested(working_eff_erosion,
+                                            FlowInfo, test_N, valid_nuclide_names[samp], test_dN, 
+                                            prod_uncert_factor, Muon_scaling);
+        nested_contributions[samp] = thisBasin.get_nested_contributions();
     
+        // now get parameters for cosmogenic calculators
+        param_for_calc_vecvec[samp] = 
+            thisBasin.calculate_effective_pressures_for_calculators_nested(filled_raster,
+                                              FlowInfo, path_to_atmospheric_data, 
+                                              working_eff_erosion);
+
+        // get the relief of the basin
+        float R = thisBasin.CalculateBasinRange(FlowInfo, filled_raster);
+        relief_vec[samp] = double(R);
+      }  // finished looping thorough basins
     
-      // now get parameters for cosmogenic calculators
-      vector<double> param_for_calc = 
-          thisBasin.calculate_effective_pressures_for_calculators_nested(filled_raster,
-                                            FlowInfo, path_to_atmospheric_data, 
-                                            known_eff_erosion);
-
-      cout << "Paramforcalc size: " << param_for_calc.size() << endl;              
-      cout << "Getting pressures" << endl;
-
-
-      // get the relief of the basin
-      float R = thisBasin.CalculateBasinRange(FlowInfo, filled_raster);
-      double relief = double(R);
-
-      MapOfProdAndScaling["BasinRelief"][ valid_cosmo_points[samp] ] = relief;
+      // now add the erosion rates of this level to the unknown pixels of each
+      // basin, in sample order, so that they are known to the basins downstream
+      if (use_upstream_samples)
+      {
+        for(int level_samp = 0; level_samp<n_level_samples; level_samp++)
+        {
+          int samp = level_samples[level][level_samp];
+          float this_erate = float(erate_analysis_vecvec[samp][0]);
+          vector<int> sample_nodes = FlowInfo.get_upslope_nodes(outlet_nodes[samp]);
+          int row,col;
+          for(int q = 0; q< int(sample_nodes.size()); q++)
+          {
+            FlowInfo.retrieve_current_row_and_col(sample_nodes[q], row, col);
+            if (working_eff_erosion.get_data_element(row,col) == 
+                working_eff_erosion.get_NoDataValue())
+            {
+              working_eff_erosion.set_data_element(row,col,this_erate);
+            }
+          }
+        }
+      }
+    }  // finished looping through levels
+    
+    // now add the results to the data members, in sample order
+    for(int samp = 0; samp<n_valid_points; samp++)
+    {
+      vector<double>& param_for_calc = param_for_calc_vecvec[samp];
+      
+      MapOfProdAndScaling["BasinRelief"][ valid_cosmo_points[samp] ] = relief_vec[samp];
       MapOfProdAndScaling["AverageProdScaling"][ valid_cosmo_points[samp] ] = param_for_calc[0];
       MapOfProdAndScaling["AverageTopoShielding"][ valid_cosmo_points[samp] ] = param_for_calc[1];
       MapOfProdAndScaling["AverageSelfShielding"][ valid_cosmo_points[samp] ] = param_for_calc[2];
@@ -2615,11 +2917,8 @@ void LSDCosmoData::full_shielding_cosmogenic_analysis_nested(vector<string> Rast
       MapOfProdAndScaling["CentroidEffectivePressure"][ valid_cosmo_points[samp] ] = param_for_calc[10];
     
       // add the erosion rate results to the holding data member
-      erosion_rate_results[ valid_cosmo_points[samp] ] = erate_analysis;
-
-      //cout << "finished adding data" << endl;
-
-    }  // finished looping thorough basins
+      erosion_rate_results[ valid_cosmo_points[samp] ] = erate_analysis_vecvec[samp];
+    }
     
     // now print the basin LSDIndexRaster
     if(write_basin_index_raster)
@@ -2647,7 +2946,7 @@ void LSDCosmoData::full_shielding_cosmogenic_analysis_nested(vector<string> Rast
 // 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 void LSDCosmoData::full_shielding_cosmogenic_analysis(vector<string> Raster_names,
-                            vector<double> CRN_params)
+                            vector<double> CRN_params, int spawn_padding_pixels)
 {
 
   cout << endl << endl << "================================================" << endl;
@@ -2753,11 +3052,19 @@ void LSDCosmoData::full_shielding_cosmogenic_analysis(vector<string> Raster_name
     
     // first check if topographic shielding raster exists
     cout << "Looking for toposhield raster, name is: " << Raster_names[3] << endl;
+    bool shield_basin_windows = false;
     if( Raster_names[3] != "NULL")
     {
       LSDRaster T_shield(Raster_names[3], DEM_bil_extension);
       Topographic_shielding = T_shield;
     }
+    else if (spawn_padding_pixels >= 0)
+    {
+      // the shielding is done basin by basin, below
+      cout << "Topographic shielding will be calculated on windows around each basin, " 
+           << "padded by " << spawn_padding_pixels << " pixels" << endl;
+      shield_basin_windows = true;
+    }
     else
     {
       // get the topographic shielding
@@ -2807,29 +3114,77 @@ void LSDCosmoData::full_shielding_cosmogenic_analysis(vector<string> Raster_name
       constant_self_depth = CRN_params[1];
     }
 
-    // some temporary doubles to hold the nuclide concentrations
-    double test_N10, test_dN10;   // concetration and uncertainty of 10Be in basin
-    double test_N26, test_dN26;   // concetration and uncertainty of 26Al in basin
-    double test_N, test_dN;       // concentration and uncertainty of the nuclide in basin  
-
     //========================
     // LOOPING THROUGH BASINS
     //========================
-    // now loop through the valid points, getting the cosmo data 
+    // The routing above is shared by every sample in this DEM, and once it
+    // exists each basin is independent of the others, so the basins are
+    // solved in parallel. The solutions are held in vectors indexed by sample
+    // and only copied into the data members afterwards, in sample order, 
+    // so the results do not depend on the number of threads. 
     cout << "-----------------------------------------------------------" << endl;
     cout << "I found " << n_valid_points << " valid CRN basins in this raster! " << endl;
+    
+    // first check the nuclide names. This is done before the parallel loop
+    // since the names are updated if they are not valid
     for(int samp = 0; samp<n_valid_points; samp++)
     {
-      if( valid_nuclide_names[samp] == "Be10")
+      if( valid_nuclide_names[samp] != "Be10" && valid_nuclide_names[samp] != "Al26")
       {
-        test_N10 = valid_concentrations[samp];
-        test_dN10 = valid_concentration_uncertainties[samp];
-        test_N26 = 1e9;
-        test_dN26 = 0;
-        test_N = test_N10;
-        test_dN = test_dN10;
+        cout << "You did not select a valid nuclide name, options are Be10 and Al26" << endl;
+        cout << "Defaulting to Be10" << endl;
+        valid_nuclide_names[samp] = "Be10";
       }
-      else if( valid_nuclide_names[samp] == "Al26")
+    }
+    
+    // write the index basins if flag is set to true. The basins are added
+    // in sample order so that overlapping basins are resolved in the same way
+    // as they always have been
+    if(write_basin_index_raster)
+    {
+      cout << "I'm writing a basin index number for you" << endl;
+      for(int samp = 0; samp<n_valid_points; samp++)
+      {
+        // the concentrations are not needed to get the basin nodes
+        LSDCosmoBasin indexBasin(snapped_junction_indices[samp],FlowInfo, JNetwork,
+                                 1e9,0,1e9,0);
+        basin_number = valid_cosmo_points[samp];
+        if (not written_inital_basin_index)
+        {
+          basin_pixel_area = indexBasin.get_NumberOfCells();
+          basin_area_map[basin_number] = basin_pixel_area;
+          LSDIndexRaster NewBasinIndex = 
+             indexBasin.write_integer_data_to_LSDIndexRaster(basin_number, FlowInfo);
+          BasinIndex = NewBasinIndex;
+          written_inital_basin_index = true;
+        }
+        else
+        {
+          indexBasin.add_basin_to_LSDIndexRaster(BasinIndex, FlowInfo,
+                                                basin_area_map,basin_number);
+        }
+      }
+    }
+    
+    // vectors for holding the results of each basin
+    vector< vector<double> > erate_analysis_vecvec(n_valid_points);
+    vector< vector<double> > param_for_calc_vecvec(n_valid_points);
+    vector< vector<double> > monte_carlo_vecvec(n_valid_points);
+    vector<double> relief_vec(n_valid_points,0.0);
+    
+    // The basins are solved in parallel. Everything called in this loop must
+    // read the shared rasters, FlowInfo and JNetwork through references:
+    // copying one of them changes the reference count of its TNT data, and
+    // that count is not atomic.
+    #pragma omp parallel for schedule(dynamic)
+    for(int samp = 0; samp<n_valid_points; samp++)
+    {
+      // some temporary doubles to hold the nuclide concentrations
+      double test_N10, test_dN10;   // concetration and uncertainty of 10Be in basin
+      double test_N26, test_dN26;   // concetration and uncertainty of 26Al in basin
+      double test_N, test_dN;       // concentration and uncertainty of the nuclide in basin  
+      
+      if( valid_nuclide_names[samp] == "Al26")
       {
         test_N10 = 1e9;
         test_dN10 = 0;
@@ -2840,9 +3195,6 @@ void LSDCosmoData::full_shielding_cosmogenic_analysis(vector<string> Raster_name
       }
       else
       {
-        cout << "You did not select a valid nuclide name, options are Be10 and Al26" << endl;
-        cout << "Defaulting to Be10" << endl;
-        valid_nuclide_names[samp] = "Be10";
         test_N10 = valid_concentrations[samp];
         test_dN10 = valid_concentration_uncertainties[samp];
         test_N26 = 1e9;
@@ -2851,111 +3203,103 @@ void LSDCosmoData::full_shielding_cosmogenic_analysis(vector<string> Raster_name
         test_dN = test_dN10;
       }
       
-
-      cout << endl << "Valid point is: " << valid_cosmo_points[samp]
-           << " Sample name: " << sample_name[ valid_cosmo_points[samp] ] << " Easting: " 
-           << UTM_easting[valid_cosmo_points[samp]] << " Northing: "
-           << UTM_northing[valid_cosmo_points[samp]] << endl;
-      cout << "Node index is: " <<  snapped_node_indices[samp] << " and junction is: " 
-           << snapped_junction_indices[samp] << endl;
-      cout << "-  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -  -" << endl;
-      LSDCosmoBasin thisBasin(snapped_junction_indices[samp],FlowInfo, JNetwork,
-                              test_N10,test_dN10, test_N26,test_dN26);
-
-      // write the index basin if flag is set to true
-      if(write_basin_index_raster)
+      #pragma omp critical
       {
-        cout << "I'm writing a basin index number for you" << endl;
-      
-        if (not written_inital_basin_index)
-        {
-        
-          basin_number = valid_cosmo_points[samp];
-          basin_pixel_area = thisBasin.get_NumberOfCells();
-          basin_area_map[basin_number] = basin_pixel_area;
-          LSDIndexRaster NewBasinIndex = 
-             thisBasin.write_integer_data_to_LSDIndexRaster(basin_number, FlowInfo);
-          BasinIndex = NewBasinIndex;
-          written_inital_basin_index = true;
-        }
-        else
-        {
-          basin_number = valid_cosmo_points[samp];
-          thisBasin.add_basin_to_LSDIndexRaster(BasinIndex, FlowInfo,
-                                                basin_area_map,basin_number);
-        }
+        cout << "Valid point is: " << valid_cosmo_points[samp]
+             << " Sample name: " << sample_name[ valid_cosmo_points[samp] ] << " Easting: " 
+             << UTM_easting[valid_cosmo_points[samp]] << " Northing: "
+             << UTM_northing[valid_cosmo_points[samp]] << " Node index is: " 
+             <<  snapped_node_indices[samp] << " and junction is: " 
+             << snapped_junction_indices[samp] << endl;
       }
+      
+      LSDCosmoBasin thisBasin(snapped_junction_indices[samp],FlowInfo, JNetwork,
+                              test_N10,test_dN10, test_N26,test_dN26);
 
       // we need to scale the shielding parameters
       // now do the snow and self shielding
       if (have_snow_raster)
       {
-        cout << "I've got the snow raster" << endl;
-      
         if(have_self_raster)
         {
-          cout << "I've also got the self raster." << endl;
           thisBasin.populate_snow_and_self_eff_depth_vectors(FlowInfo, 
                                 Snow_shielding, Self_shielding);
-          cout << "Done with effective depths" << endl;                           
         }
         else
         {
-          cout << "No self raster, but I'm getting the effective depths" << endl;
-          cout << "The constant self depth is: " <<  constant_self_depth << endl;
           thisBasin.populate_snow_and_self_eff_depth_vectors(FlowInfo, 
                                 Snow_shielding, constant_self_depth);
-          cout << "Done with effective depths" << endl;        
         }
       }
       else
       {
         if(have_self_raster)
         {
-          cout << "Getting effective depths" << endl;
           thisBasin.populate_snow_and_self_eff_depth_vectors(FlowInfo, 
                                 constant_snow_depth, Self_shielding);
-          cout << "Done with effective depths" << endl;                                
         }
         else
         {
-          cout << "Getting effective depths" << endl;
           thisBasin.populate_snow_and_self_eff_depth_vectors(constant_snow_depth, 
                                              constant_self_depth);
-          cout << "Done with effective depths" << endl;                                 
         }
       }
 
-
-      cout << "Now I will populate the scaling vectors." << endl;
       // Now topographic shielding and production scaling
-      thisBasin.populate_scaling_vectors(FlowInfo, filled_raster, 
-                                         Topographic_shielding,
-                                         path_to_atmospheric_data);
-      cout << "Done populating the scaling vectors. " << endl;
+      if (shield_basin_windows)
+      {
+        // the shielding only needs the basin and the surrounding peaks, so
+        // it is calculated on a padded window around the basin. The window 
+        // is drawn around the same junction basin that spawn_clipped_basins 
+        // uses, so the shielding matches the spawned analysis
+        int window_min_row, window_min_col;
+        LSDBasin spawnBasin(snapped_junction_indices[samp],FlowInfo, JNetwork);
+        LSDRaster BasinWindow = spawnBasin.TrimPaddedRasterToBasin(spawn_padding_pixels,
+                                        FlowInfo, filled_raster, 
+                                        window_min_row, window_min_col);
+        LSDRaster WindowShield = BasinWindow.TopographicShielding(theta_step, phi_step);
+        thisBasin.populate_scaling_vectors(FlowInfo, filled_raster, WindowShield,
+                                           window_min_row, window_min_col,
+                                           path_to_atmospheric_data);
+      }
+      else
+      {
+        thisBasin.populate_scaling_vectors(FlowInfo, filled_raster, 
+                                           Topographic_shielding,
+                                           path_to_atmospheric_data);
+      }
 
       // now do the analysis
-      vector<double> erate_analysis = thisBasin.full_CRN_erosion_analysis(test_N, 
+      erate_analysis_vecvec[samp] = thisBasin.full_CRN_erosion_analysis(test_N, 
                                           valid_nuclide_names[samp], test_dN, 
                                           prod_uncert_factor, Muon_scaling);
-    
-      cout << "Line 2205, doing analysis" << endl;
-    
+      
+      // the Monte Carlo seed depends on the sample, not on the thread
+      if (monte_carlo_draws > 0)
+      {
+        monte_carlo_vecvec[samp] = thisBasin.monte_carlo_CRN_erosion_analysis(test_N,
+                                          valid_nuclide_names[samp], test_dN,
+                                          monte_carlo_shielding_uncert, monte_carlo_draws,
+                                          monte_carlo_seed+valid_cosmo_points[samp],
+                                          monte_carlo_quantiles);
+      }
     
       // now get parameters for cosmogenic calculators
-      vector<double> param_for_calc = 
+      param_for_calc_vecvec[samp] = 
           thisBasin.calculate_effective_pressures_for_calculators(filled_raster,
                                             FlowInfo, path_to_atmospheric_data);
-        
-      cout << "Paramforcalc size: " << param_for_calc.size() << endl;              
-      cout << "Getting pressures" << endl;
-
 
       // get the relief of the basin
       float R = thisBasin.CalculateBasinRange(FlowInfo, filled_raster);
-      double relief = double(R);
-
-      MapOfProdAndScaling["BasinRelief"][ valid_cosmo_points[samp] ] = relief;
+      relief_vec[samp] = double(R);
+    }  // finished looping thorough basins
+    
+    // now add the results to the data members, in sample order
+    for(int samp = 0; samp<n_valid_points; samp++)
+    {
+      vector<double>& param_for_calc = param_for_calc_vecvec[samp];
+      
+      MapOfProdAndScaling["BasinRelief"][ valid_cosmo_points[samp] ] = relief_vec[samp];
       MapOfProdAndScaling["AverageProdScaling"][ valid_cosmo_points[samp] ] = param_for_calc[0];
       MapOfProdAndScaling["AverageTopoShielding"][ valid_cosmo_points[samp] ] = param_for_calc[1];
       MapOfProdAndScaling["AverageSelfShielding"][ valid_cosmo_points[samp] ] = param_for_calc[2];
@@ -2970,11 +3314,9 @@ void LSDCosmoData::full_shielding_cosmogenic_analysis(vector<string> Raster_name
       MapOfProdAndScaling["CentroidEffectivePressure"][ valid_cosmo_points[samp] ] = param_for_calc[10];
     
       // add the erosion rate results to the holding data member
-      erosion_rate_results[ valid_cosmo_points[samp] ] = erate_analysis;
-
-      //cout << "finished adding data" << endl;
-
-    }  // finished looping thorough basins
+      erosion_rate_results[ valid_cosmo_points[samp] ] = erate_analysis_vecvec[samp];
+      monte_carlo_results[ valid_cosmo_points[samp] ] = monte_carlo_vecvec[samp];
+    }
     
     // now print the basin LSDIndexRaster
     if(write_basin_index_raster)
@@ -3370,6 +3712,18 @@ void LSDCosmoData::full_shielding_cosmogenic_analysis_for_spawned(vector<string>
                                           valid_nuclide_names[samp], test_dN, 
                                           prod_uncert_factor, Muon_scaling);
       cout << "Done with the erosion rate analysis" << endl;
+      
+      if (monte_carlo_draws > 0)
+      {
+        cout << "Now propagating the uncertainty with " << monte_carlo_draws 
+             << " Monte Carlo draws." << endl;
+        monte_carlo_results[ valid_samp ] = 
+          thisBasin.monte_carlo_CRN_erosion_analysis(test_N, 
+                                          valid_nuclide_names[samp], test_dN,
+                                          monte_carlo_shielding_uncert, monte_carlo_draws,
+                                          monte_carlo_seed+valid_samp,
+                                          monte_carlo_quantiles);
+      }
     
       //cout << "Line 1493, doing analysis" << endl;
     
@@ -3440,6 +3794,12 @@ void LSDCosmoData::full_shielding_cosmogenic_analysis_for_spawned(vector<string>
 void LSDCosmoData::Soil_sample_calculator(vector<string> Raster_names,
                             vector<double> CRN_params)
 {
+  
+  // the Monte Carlo works on basins, not on point samples
+  if (monte_carlo_draws > 0)
+  {
+    cout << "The Monte Carlo uncertainty is not calculated for soil samples." << endl;
+  }
 
   // Load the DEM
   string DEM_bil_extension = "bil";
@@ -3595,6 +3955,12 @@ void LSDCosmoData::Soil_sample_calculator(vector<string> Raster_names,
       constant_self_depth = CRN_params[1];
     }
     
+    // now create the CRN parameters object. The atmospheric data are the
+    // same for every sample so they are only loaded once for the DEM
+    LSDCRNParameters LSDCRNP;
+    LSDCRNP.load_parameters_for_atmospheric_scaling(path_to_atmospheric_data);
+    LSDCRNP.set_CRONUS_data_maps();
+    
     // now get the snow depth and topo and self shielding from the point
     // we need to scale the sheilding parameters
     // now do the snow and self sheilding
@@ -3624,14 +3990,8 @@ void LSDCosmoData::Soil_sample_calculator(vector<string> Raster_names,
       }
       
       // now get the scalings
-      // now create the CRN parameters object
-      LSDCRNParameters LSDCRNP;
       double this_elevation, this_pressure;
   
-      // get the atmospheric parameters
-      LSDCRNP.load_parameters_for_atmospheric_scaling(path_to_atmospheric_data);
-      LSDCRNP.set_CRONUS_data_maps();
-  
       // a function for scaling stone production, defaults to 1
       double Fsp = 1.0;
       
@@ -4688,6 +5048,24 @@ void LSDCosmoData::calculate_erosion_rates(int method_flag)
     this_Raster_names = DEM_names_vecvec[iDEM];
     this_Param_names = snow_self_topo_shielding_params[iDEM];
     
+    // The routing and the basins for every sample in a DEM are done in a single 
+    // pass, so a DEM that is listed more than once with the same rasters
+    // and parameters would only repeat the work. Skip it.
+    bool is_duplicate = false;
+    for (int prev = 0; prev< iDEM; prev++)
+    {
+      if (DEM_names_vecvec[prev] == this_Raster_names && 
+          snow_self_topo_shielding_params[prev] == this_Param_names)
+      {
+        is_duplicate = true;
+      }
+    }
+    if (is_duplicate)
+    {
+      cout << "The DEM " << this_Raster_names[0] << " has already been analysed, skipping it." << endl;
+      continue;
+    }
+    
     if (method_flag == 0)
     {
       basic_cosmogenic_analysis(this_Raster_names[0]);
@@ -4716,15 +5094,67 @@ void LSDCosmoData::calculate_erosion_rates(int method_flag)
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
 
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+//
+// This function loops though the DEMs calculating erosion rates in the same 
+// way as the spawned basins, but the padded basin windows used for 
+// topographic shielding are kept in memory and the routing of the full
+// DEM is reused, so nothing is written to disk or rerouted.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCosmoData::calculate_erosion_rates_spawned_in_memory(int padding_pixels)
+{
+  if (padding_pixels < 0)
+  {
+    cout << "Warning, the padding cannot be negative. Setting it to 0" << endl;
+    padding_pixels = 0;
+  }
+
+  // find out how many DEMs there are:
+  int n_DEMS = int(DEM_names_vecvec.size());
+
+  vector<string> this_Raster_names;
+  vector<double> this_Param_names;
+  
+  // now loop through the DEMs
+  for (int iDEM = 0; iDEM< n_DEMS; iDEM++)
+  {
+    this_Raster_names = DEM_names_vecvec[iDEM];
+    this_Param_names = snow_self_topo_shielding_params[iDEM];
+    
+    // skip DEMs that have already been analysed
+    bool is_duplicate = false;
+    for (int prev = 0; prev< iDEM; prev++)
+    {
+      if (DEM_names_vecvec[prev] == this_Raster_names && 
+          snow_self_topo_shielding_params[prev] == this_Param_names)
+      {
+        is_duplicate = true;
+      }
+    }
+    if (is_duplicate)
+    {
+      cout << "The DEM " << this_Raster_names[0] << " has already been analysed, skipping it." << endl;
+      continue;
+    }
+    
+    full_shielding_cosmogenic_analysis(this_Raster_names,this_Param_names,
+                                       padding_pixels);
+  }
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 //
 // This function loops though the file structures calculating 
 // cosmogenic-derived denudation rates and uncertainties
 // This version uses nesting: it points to rasters with known erosion rates
 // in order to calculate the nested erosion rate. 
+// If use_upstream_samples is true the samples are also used for the nesting,
+// and a DEM without known erosion rates gets an empty known erosion raster.
 //
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-void LSDCosmoData::calculate_nested_erosion_rates()
+void LSDCosmoData::calculate_nested_erosion_rates(bool use_upstream_samples)
 {
 
   // find out how many DEMs there are:
@@ -4747,7 +5177,23 @@ void LSDCosmoData::calculate_nested_erosion_rates()
     // see if the known erate file exists
     // make sure the filename works
     ifstream ifs(known_erate_header.c_str());
-    if( ifs.fail() )
+    if( ifs.fail() && use_upstream_samples)
+    {
+      cout << "\nThere is no known erosion rate raster for this DEM." << endl;
+      cout << "Only the samples will be used for nesting." << endl;
+      string bil_ext = "bil";
+      LSDRasterInfo RI_DEM(this_Raster_names[0],bil_ext);
+      Array2D<float> no_known_rates(RI_DEM.get_NRows(),RI_DEM.get_NCols(),
+                                    float(RI_DEM.get_NoDataValue()));
+      LSDRaster known_rate_raster(RI_DEM.get_NRows(),RI_DEM.get_NCols(),
+                                  RI_DEM.get_XMinimum(),RI_DEM.get_YMinimum(),
+                                  RI_DEM.get_DataResolution(),
+                                  float(RI_DEM.get_NoDataValue()),no_known_rates,
+                                  RI_DEM.get_GeoReferencingStrings());
+      full_shielding_cosmogenic_analysis_nested(this_Raster_names,this_Param_names, 
+                          known_rate_raster, use_upstream_samples);
+    }
+    else if( ifs.fail() )
     {
       cout << "\nThere is no known erosion rate raster for this DEM." << endl;
     }
@@ -4761,7 +5207,7 @@ void LSDCosmoData::calculate_nested_erosion_rates()
       {
         LSDRaster known_rate_raster(known_erate_name,bil_ext);
         full_shielding_cosmogenic_analysis_nested(this_Raster_names,this_Param_names, 
-                            known_rate_raster);
+                            known_rate_raster, use_upstream_samples);
       }
       else
       {
@@ -5127,6 +5573,51 @@ void LSDCosmoData::print_results()
   }
   results_out.close();
   CRONUS_out.close();
+  
+  // the Monte Carlo results go in their own file so the results file
+  // keeps its columns
+  if (monte_carlo_draws > 0)
+  {
+    string MC_ext = "_CRNMonteCarlo.csv";
+    string MC_results_fname = path+param_name+MC_ext;
+    ofstream MC_out;
+    MC_out.open(MC_results_fname.c_str());
+    MC_out.precision(8);
+    
+    int n_quantiles = int(monte_carlo_quantiles.size());
+    MC_out << "basin_ID,sample_name,nuclide,n_draws,shielding_depth_uncert,"
+           << "erate_mean_g_percm2_peryr,erate_sd_g_percm2_peryr";
+    for (int q = 0; q<n_quantiles; q++)
+    {
+      MC_out << ",erate_q" << monte_carlo_quantiles[q] << "_g_percm2_peryr";
+    }
+    MC_out << ",erate_mean_mmperkyr_rho2650,erate_sd_mmperkyr_rho2650";
+    for (int q = 0; q<n_quantiles; q++)
+    {
+      MC_out << ",erate_q" << monte_carlo_quantiles[q] << "_mmperkyr_rho2650";
+    }
+    MC_out << endl;
+    
+    for (int i = 0; i<N_samples; i++)
+    {
+      vector<double>& MC_analysis = monte_carlo_results[i];
+      if (int(MC_analysis.size()) > 0)
+      {
+        MC_out << i << "," << sample_name[i] << "," << nuclide[i] << ","
+               << monte_carlo_draws << "," << monte_carlo_shielding_uncert;
+        for (int j = 0; j< int(MC_analysis.size()); j++)
+        {
+          MC_out << "," << MC_analysis[j];
+        }
+        for (int j = 0; j< int(MC_analysis.size()); j++)
+        {
+          MC_out << "," << MC_analysis[j]*1e7/rho;
+        }
+        MC_out << endl;
+      }
+    }
+    MC_out.close();
+  }
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
@@ -5213,27 +5704,15 @@ void LSDCosmoData::print_scaling_and_shielding_complete_rasters()
       Topographic_shielding = T_shield;
     }
 
-    // now create the CRN parameters object
-    LSDCRNParameters LSDCRNP;
     double gamma_spallation = 160;      // in g/cm^2: spallation attentuation depth
 
-    // get the atmospheric parameters
-    LSDCRNP.load_parameters_for_atmospheric_scaling(path_to_atmospheric_data);
-    LSDCRNP.set_CRONUS_data_maps();
-  
-    // a function for scaling stone production, defaults to 1
-    double Fsp = 1.0;
-  
-    // the latitude and longitude
-    double lat,longitude;
-  
-    // decalre converter object
-    LSDCoordinateConverterLLandUTM Converter;
+    // get the pressure and production scaling of the whole DEM
+    calculate_pressure_and_scaling_arrays(filled_raster, path_to_atmospheric_data,
+                                          NewPressure, NewScaling);
     
     // Get some temporary variables for holding the data. These will get printed
     // to and array.
     float this_elevation;
-    float this_pressure;
     float this_scaling;
     float this_shielding;
     float this_combined_scaling;
@@ -5254,19 +5733,8 @@ void LSDCosmoData::print_scaling_and_shielding_complete_rasters()
         // Only do something if there is data
         if(this_elevation != NoDataValue)
         {
-          // To get pressure, first get the lat and long
-          filled_raster.get_lat_and_long_locations(row, col, lat, longitude, Converter);
-
-          // now the pressure
-          this_pressure = LSDCRNP.NCEPatm_2(double(lat), double(longitude), 
-                                        double(this_elevation));
-
-          // now get the scaling
-          this_scaling = LSDCRNP.stone2000sp(lat,this_pressure, Fsp);
-        
-          // update the scaling array
-          NewScaling[row][col] = this_scaling;
-          NewPressure[row][col] = this_pressure;
+          // the scaling was calculated for the whole DEM above
+          this_scaling = NewScaling[row][col];
           
           // now get combined shielding and scaling
           // first topographic shielding
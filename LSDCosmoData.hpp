@@ -196,6 +196,8 @@ class LSDCosmoData
     vector<string> spawn_clipped_basins(string DEM_fname, int basin_padding_px);
 
     /// @brief This dirves the spawning of basins
+    /// @detail calculate_erosion_rates_spawned_in_memory does the same analysis 
+    ///  without writing the spawned rasters to disk
     /// @param path This is a string containing the path to the data files (needs / at the end)
     /// @param prefix the prefix of the data files
     /// @param padding_pixels the number of pixels with which to pad the basins
@@ -220,8 +222,24 @@ class LSDCosmoData
     LSDRaster calculate_production_raster(LSDRaster& Elevation_Data,
                                           string path_to_atmospheric_data);
 
+    /// @brief This function calculates the atmospheric pressure and the 
+    ///  Stone (2000) production scaling of every pixel in a DEM
+    /// @detail Works a row at a time: the lat-long conversion, the NCEP 
+    ///  pressure lookup and the scaling are each done for the whole row 
+    ///  with the batch (vector) overloads. Used by calculate_production_raster
+    ///  and print_scaling_and_shielding_complete_rasters
+    /// @param Elevation_data a raster holding the elevations
+    /// @param path_to_atmospheric_data a string that holds the path of the atmospheric data
+    /// @param Pressure an array holding pressure in hPa. Replaced by function
+    /// @param Scaling an array holding the production scaling. Replaced by function
+    void calculate_pressure_and_scaling_arrays(LSDRaster& Elevation_Data,
+                                          string path_to_atmospheric_data,
+                                          Array2D<float>& Pressure,
+                                          Array2D<float>& Scaling);
+
     /// @brief this function calculates the UTM coordinates of all the sample
-    ///  points for a given UTM zone. 
+    ///  points for a given UTM zone. If the samples are already in this
+    ///  zone the stored coordinates are kept.
     /// @param UTM_zone the UTM zone
     /// @author SMM
     /// @date 06/02/2015
@@ -258,7 +276,23 @@ class LSDCosmoData
     /// @author SMM
     /// @date 28/02/2015
     void full_shielding_cosmogenic_analysis(vector<string> Raster_names,
-                            vector<double> CRN_params);
+                            vector<double> CRN_params)
+          { full_shielding_cosmogenic_analysis(Raster_names, CRN_params, -1); }
+
+    /// @brief This is the same as full_shielding_cosmogenic_analysis but can
+    ///  calculate topographic shielding basin by basin
+    /// @detail If there is no toposhield raster and spawn_padding_pixels is
+    ///  zero or more, topographic shielding is calculated on a padded window
+    ///  around each basin rather than on the whole DEM. The window is trimmed 
+    ///  from the filled DEM in memory, and the basin uses the routing of the 
+    ///  whole DEM, so this gives the spawned analysis without writing or 
+    ///  rerouting any spawned rasters.
+    /// @param Raster_names a vector of strings with 4 elements (see above)
+    /// @param CRN_params the single shielding depths for snow and self shielding
+    /// @param spawn_padding_pixels the padding of the shielding windows. 
+    ///  If negative the shielding is calculated for the whole DEM
+    void full_shielding_cosmogenic_analysis(vector<string> Raster_names,
+                            vector<double> CRN_params, int spawn_padding_pixels);
 
     /// @brief This function computes erosion rates and uncertainties for 
     ///  a given DEM. It is wrapped by a function that goes through
@@ -278,7 +312,28 @@ class LSDCosmoData
     /// @date 12/02/2016
     void full_shielding_cosmogenic_analysis_nested(vector<string> Raster_names,
                             vector<double> CRN_params, 
-                            LSDRaster& known_eff_erosion);
+                            LSDRaster& known_eff_erosion)
+          { full_shielding_cosmogenic_analysis_nested(Raster_names, CRN_params,
+                                                      known_eff_erosion, false); }
+
+    /// @brief This is the same as full_shielding_cosmogenic_analysis_nested
+    ///  but can also use the samples themselves for the nesting
+    /// @detail If use_upstream_samples is true the samples are solved upstream
+    ///  first. Once a sample is solved its erosion rate is known for the part 
+    ///  of its basin with no known erosion rate, and a downstream sample uses 
+    ///  the concentration and erosion recorded for the whole upstream basin 
+    ///  rather than evaluating its pixels again, so only the area between 
+    ///  the samples is solved for.
+    /// @param Raster_names a vector of strings with 4 elements (see above)
+    /// @param CRN_params the single shielding depths for snow and self shielding
+    /// @param known_eff_erosion an LSDRaster with known erosion rates in g/cm^2/yr
+    ///  It is not changed.
+    /// @param use_upstream_samples if true the erosion rates of upstream 
+    ///  samples are used in the downstream samples
+    void full_shielding_cosmogenic_analysis_nested(vector<string> Raster_names,
+                            vector<double> CRN_params, 
+                            LSDRaster& known_eff_erosion,
+                            bool use_upstream_samples);
 
     /// @brief This function computes erosion rates and uncertainties for 
     ///  a given DEM. It is wrapped by a function that goes through
@@ -433,6 +488,15 @@ class LSDCosmoData
     /// @date 28/02/2015
     void calculate_erosion_rates(int method_flag);
 
+    /// @brief This calculates erosion rates as if the basins had been spawned,
+    ///  but without writing any spawned rasters
+    /// @detail Replaces the BasinSpawnerMaster, RunShielding and 
+    ///  calculate_erosion_rates(2) sequence. Each DEM is filled and routed
+    ///  once; topographic shielding (if there is no toposhield raster) is 
+    ///  calculated on a padded window around each basin, in memory.
+    /// @param padding_pixels the number of pixels with which to pad the basins
+    void calculate_erosion_rates_spawned_in_memory(int padding_pixels);
+
 
     /// @brief This function wraps the cosmogenic rate calculators. THis one is used with
     /// nested basins.
@@ -443,7 +507,19 @@ class LSDCosmoData
     ///   base DEM with the extension _ERKnown
     /// @author SMM
     /// @date 23/02/2016    
-    void calculate_nested_erosion_rates();
+    void calculate_nested_erosion_rates()
+                         { calculate_nested_erosion_rates(false); }
+
+    /// @brief This is the same as calculate_nested_erosion_rates but can 
+    ///  also use the samples themselves for the nesting
+    /// @detail If use_upstream_samples is true the erosion rates of samples 
+    ///  upstream are used in the samples downstream (see
+    ///  full_shielding_cosmogenic_analysis_nested). DEMs without a
+    ///  known erosion rate raster are then also analysed, with the samples 
+    ///  as the only source of known erosion rates.
+    /// @param use_upstream_samples if true the erosion rates of upstream 
+    ///  samples are used in the downstream samples
+    void calculate_nested_erosion_rates(bool use_upstream_samples);
 
     /// @brief This function prints sevear rasters to file:
     ///  1) Pixel-by-pixel production scaling
@@ -635,6 +711,10 @@ class LSDCosmoData
     /// a vector holding the UTM northing of the samples
     vector<double> UTM_northing;
     
+    /// the UTM zone that UTM_easting and UTM_northing are in. It is -1 
+    /// if the samples have not been converted
+    int UTM_zone_of_samples;
+    
     /// the nuclide. Only options are Be10 and 26Al. 
     vector<string> nuclide;
     
@@ -658,6 +738,15 @@ class LSDCosmoData
     /// a vector of vectors holding the results of the cosmogenic analysis
     vector< vector<double> > erosion_rate_results;
     
+    /// a vector of vectors holding the Monte Carlo results of each sample:
+    /// the mean and standard deviation of the erosion rate followed by the
+    /// quantiles in monte_carlo_quantiles, all in g/cm^2/yr. Empty if the
+    /// Monte Carlo was not run for the sample
+    vector< vector<double> > monte_carlo_results;
+    
+    /// The quantiles of the erosion rate reported by the Monte Carlo
+    vector<double> monte_carlo_quantiles;
+    
     /// a standardisation map for Be10
     map<string,double> standards_Be10;
     
@@ -702,6 +791,17 @@ class LSDCosmoData
     /// The muon production scaling. Options are "Braucher", "Granger" and "Schaller"
     string Muon_scaling;       
 
+    /// The number of Monte Carlo draws used to propagate the uncertainty
+    /// of the erosion rate. If zero (the default) no Monte Carlo is run
+    int monte_carlo_draws;
+    
+    /// The fractional (one sigma) uncertainty of the snow and self shielding
+    /// depths used in the Monte Carlo
+    double monte_carlo_shielding_uncert;
+    
+    /// The seed of the Monte Carlo. Each sample adds its index to it
+    long monte_carlo_seed;
+
     /// the atmospheric data is in the folder with the driver_functions, 
     /// but can be changed if necessary.
     string path_to_atmospheric_data;
@@ -739,6 +839,22 @@ class LSDCosmoData
     /// @author SMM
     /// @date 02/02/2015
     void create(string path, string file_prefix);
+
+    /// @brief This finds the nesting of the samples in a DEM and the order
+    ///  in which they can be solved so that every sample upstream of 
+    ///  a sample is solved first.
+    /// @param FlowInfo the LSDFlowInfo object
+    /// @param outlet_nodes the node index of the outlet of each sample
+    /// @param nuclide_names the nuclide of each sample
+    /// @param upstream_samples replaced with the samples directly upstream of 
+    ///  each sample. Of the samples that share an outlet only one is listed, 
+    ///  one of the same nuclide if there is one.
+    /// @param level_samples replaced with the samples in each level. All
+    ///  the samples upstream of a sample are in earlier levels.
+    void get_upstream_sample_order(LSDFlowInfo& FlowInfo, vector<int>& outlet_nodes,
+                                   vector<string>& nuclide_names,
+                                   vector< vector<int> >& upstream_samples,
+                                   vector< vector<int> >& level_samples);
     
     /// @brief This loads data from a text file
     /// @detail The data columns are:
@@ -3158,6 +3158,226 @@ LSDRaster LSDFlowInfo::calculate_d8_slope(LSDRaster& Elevation)
 
 }
 
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+//
+// This calculates a number of flow metrics in a single pass through the
+// stack. The metrics are stored in node indexed vectors. The user selects
+// which metrics to calculate using a vector with 5 elements, 1 means calculate
+// and 0 means skip:
+//  0 -> contributing pixels
+//  1 -> drainage area
+//  2 -> flow distance from the outlet
+//  3 -> d8 slope
+//  4 -> chi, calculated from drainage area, with nodata below area_threshold
+// Vectors that are not selected are returned empty.
+// The values are identical to those from write_NContributingNodes_to_LSDIndexRaster,
+// write_DrainageArea_to_LSDRaster, distance_from_outlet, calculate_d8_slope
+// and get_upslope_chi_from_all_baselevel_nodes, but the stack and the 
+// flow length codes are only read once.
+//
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+vector< vector<float> > LSDFlowInfo::calculate_flow_metrics(LSDRaster& Elevation, 
+                                 float m_over_n, float A_0, float area_threshold,
+                                 vector<int> metric_selection)
+{
+  int N_metrics = 5;
+  if (int(metric_selection.size()) != N_metrics)
+  {
+    cout << "LSDFlowInfo::calculate_flow_metrics, the metric selection vector needs " 
+         << N_metrics << " elements" << endl;
+    exit(EXIT_FAILURE);
+  }
+  bool do_CP = (metric_selection[0] == 1);
+  bool do_DA = (metric_selection[1] == 1);
+  bool do_FD = (metric_selection[2] == 1);
+  bool do_slope = (metric_selection[3] == 1);
+  bool do_chi = (metric_selection[4] == 1);
+
+  float ndv = float(NoDataValue);
+  vector<float> empty_vec;
+  vector<float> contributing_pixels = empty_vec;
+  vector<float> drainage_area = empty_vec;
+  vector<float> flow_distance = empty_vec;
+  vector<float> d8_slope = empty_vec;
+  vector<float> chi = empty_vec;
+  if (do_CP)
+  {
+    contributing_pixels.resize(NDataNodes);
+  }
+  if (do_DA)
+  {
+    drainage_area.resize(NDataNodes);
+  }
+  if (do_FD)
+  {
+    flow_distance.resize(NDataNodes);
+  }
+  if (do_slope)
+  {
+    d8_slope.resize(NDataNodes);
+  }
+  // chi is accumulated for all nodes and masked afterwards
+  vector<float> chi_accumulated;
+  if (do_chi)
+  {
+    chi_accumulated.resize(NDataNodes);
+    chi.resize(NDataNodes);
+  }
+
+  // these are the same constants used in the individual functions so the 
+  // results are bitwise identical
+  float root2 = 1.41421356;
+  float diag_length = root2*DataResolution;
+  float root_2 = pow(2, 0.5);
+  float dx_root2 = root_2*DataResolution;
+  float pixel_area = DataResolution*DataResolution;
+
+  int node, receiver_node, row, col, flow_length_code;
+  float dx;
+
+  // go through the stack. Receivers always come before their donors
+  for (int s_node = 0; s_node<NDataNodes; s_node++)
+  {
+    node = SVector[s_node];
+    receiver_node = ReceiverVector[node];
+    row = RowIndex[node];
+    col = ColIndex[node];
+    flow_length_code = FlowLengthCode[row][col];
+
+    if (do_CP)
+    {
+      contributing_pixels[node] = float(NContributingNodes[node]);
+    }
+    if (do_DA)
+    {
+      drainage_area[node] = float(NContributingNodes[node])*DataResolution*DataResolution;
+    }
+
+    if (receiver_node == node)
+    {
+      // base level node
+      if (do_FD)
+      {
+        flow_distance[node] = 0;
+      }
+      if (do_slope)
+      {
+        d8_slope[node] = 0;
+      }
+      if (do_chi)
+      {
+        chi_accumulated[node] = 0;
+      }
+    }
+    else
+    {
+      if (do_FD)
+      {
+        if (flow_length_code == 1)
+        {
+          flow_distance[node] = flow_distance[receiver_node]+DataResolution;
+        }
+        else if (flow_length_code == 2)
+        {
+          flow_distance[node] = flow_distance[receiver_node]+diag_length;
+        }
+        else
+        {
+          flow_distance[node] = ndv;
+        }
+      }
+
+      if (do_slope)
+      {
+        dx = (flow_length_code == 2) ? dx_root2 : ((flow_length_code == 1) ? DataResolution : -99);
+        d8_slope[node] = (1/dx)*(Elevation.get_data_element(row,col)
+                         -Elevation.get_data_element(RowIndex[receiver_node],ColIndex[receiver_node]));
+      }
+
+      if (do_chi)
+      {
+        dx = (flow_length_code == 2) ? diag_length : DataResolution;
+        chi_accumulated[node] = dx*(pow( (A_0/ (float(NContributingNodes[node])*pixel_area) ),m_over_n))
+                                + chi_accumulated[receiver_node];
+      }
+    }
+
+    if (do_chi)
+    {
+      chi[node] = (pixel_area*NContributingNodes[node] > area_threshold) ? chi_accumulated[node] : ndv;
+    }
+  }
+
+  vector< vector<float> > flow_metrics;
+  flow_metrics.push_back(contributing_pixels);
+  flow_metrics.push_back(drainage_area);
+  flow_metrics.push_back(flow_distance);
+  flow_metrics.push_back(d8_slope);
+  flow_metrics.push_back(chi);
+  return flow_metrics;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+//
+// This wraps calculate_flow_metrics and writes the selected metrics to 
+// rasters. Metrics that are not selected are returned as a 1x1 raster 
+// housing a NoDataValue
+//
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+vector<LSDRaster> LSDFlowInfo::calculate_flow_metric_rasters(LSDRaster& Elevation, 
+                                 float m_over_n, float A_0, float area_threshold,
+                                 vector<int> metric_selection)
+{
+  vector< vector<float> > flow_metrics = calculate_flow_metrics(Elevation, m_over_n, A_0,
+                                                  area_threshold, metric_selection);
+
+  float ndv = float(NoDataValue);
+  Array2D<float> void_array(1,1,ndv);
+  LSDRaster VOID(1,1,ndv,ndv,ndv,ndv,void_array,GeoReferencingStrings);
+
+  vector<LSDRaster> raster_output;
+  int N_metrics = int(flow_metrics.size());
+  for (int metric = 0; metric<N_metrics; metric++)
+  {
+    if (metric_selection[metric] == 1)
+    {
+      raster_output.push_back(write_node_vector_to_LSDRaster(flow_metrics[metric]));
+    }
+    else
+    {
+      raster_output.push_back(VOID);
+    }
+  }
+  return raster_output;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This takes a vector of values indexed by node and writes it to a raster.
+// Pixels that are not nodes are nodata
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+LSDRaster LSDFlowInfo::write_node_vector_to_LSDRaster(vector<float>& node_values)
+{
+  if (int(node_values.size()) != NDataNodes)
+  {
+    cout << "LSDFlowInfo::write_node_vector_to_LSDRaster, the vector needs one " 
+         << "value for each of the " << NDataNodes << " nodes" << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  float ndv = float(NoDataValue);
+  Array2D<float> node_data(NRows,NCols,ndv);
+  for (int node = 0; node<NDataNodes; node++)
+  {
+    node_data[ RowIndex[node] ][ ColIndex[node] ] = node_values[node];
+  }
+
+  LSDRaster node_raster(NRows,NCols,XMinimum,YMinimum,DataResolution,ndv,
+                        node_data,GeoReferencingStrings);
+  return node_raster;
+}
+
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 //
@@ -3405,7 +3625,7 @@ void LSDFlowInfo::get_nodeindices_from_csv(string csv_filename, vector<int>& NIs
 float LSDFlowInfo::snap_RasterData_to_Node(int NodeIndex, LSDRaster& InputRaster, int search_radius)
 {
   float RasterValue_at_Node;
-  Array2D<float> InputRasterData = InputRaster.get_RasterData();
+  const Array2D<float>& InputRasterData = InputRaster.get_RasterData_ref();
   int i,j;
   retrieve_current_row_and_col(NodeIndex,i,j);
   if (InputRasterData[i][j] != NoDataValue)
@@ -3657,7 +3877,7 @@ vector<int> LSDFlowInfo::get_sources_from_mapped_channel_heads(vector<float>& X_
 //trace and the final pixel coordinates of the trace.
 // SWDG 20/1/14
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-void LSDFlowInfo::D8_Trace(int i, int j, LSDIndexRaster StreamNetwork, float& length, int& receiver_row, int& receiver_col, Array2D<int>& Path){
+void LSDFlowInfo::D8_Trace(int i, int j, LSDIndexRaster& StreamNetwork, float& length, int& receiver_row, int& receiver_col, Array2D<int>& Path){
 
   float root_2 = 1.4142135623;
 
@@ -3735,13 +3955,13 @@ void LSDFlowInfo::MoveChannelHeadDown(vector<int> Sources, float MoveDist, vecto
 // Move the location of the channel head upslope by a user defined distance.
 // Returns A vector of node indexes pointing to the moved heads.
 // SWDG 27/11/15
-void LSDFlowInfo::MoveChannelHeadUp(vector<int> Sources, float MoveDist, LSDRaster DEM, vector<int>& UpslopeSources, vector<int>& FinalHeads){
+void LSDFlowInfo::MoveChannelHeadUp(vector<int> Sources, float MoveDist, LSDRaster& DEM, vector<int>& UpslopeSources, vector<int>& FinalHeads){
 
   float root_2 = 1.4142135623;
 
   float length;
 
-  Array2D<float> Elevation = DEM.get_RasterData();
+  const Array2D<float>& Elevation = DEM.get_RasterData_ref();
 
   int new_node;
 
@@ -3855,7 +4075,7 @@ void LSDFlowInfo::MoveChannelHeadUp(vector<int> Sources, float MoveDist, LSDRast
 
 }
 
-void LSDFlowInfo::HilltopFlowRoutingOriginal(LSDRaster Elevation, LSDRaster Hilltops, LSDRaster Slope, LSDRaster Aspect, LSDIndexRaster StreamNetwork)
+void LSDFlowInfo::HilltopFlowRoutingOriginal(LSDRaster& Elevation, LSDRaster& Hilltops, LSDRaster& Slope, LSDRaster& Aspect, LSDIndexRaster& StreamNetwork)
 {
   //Declare parameters
   int i,j,a,b;
@@ -3879,11 +4099,10 @@ void LSDFlowInfo::HilltopFlowRoutingOriginal(LSDRaster Elevation, LSDRaster Hill
 
   //Declare Arrays
   //Get data arrays from LSDRasters
-  Array2D<float> zeta = Elevation.get_RasterData(); //elevation
   Array2D<int> stnet = StreamNetwork.get_RasterData(); // stream network
-  Array2D<float> aspect = Aspect.get_RasterData(); //aspect
-  Array2D<float> hilltops = Hilltops.get_RasterData(); //hilltops
-  Array2D<float> slope = Slope.get_RasterData(); //hilltops
+  const Array2D<float>& aspect = Aspect.get_RasterData_ref(); //aspect
+  const Array2D<float>& hilltops = Hilltops.get_RasterData_ref(); //hilltops
+  const Array2D<float>& slope = Slope.get_RasterData_ref(); //hilltops
   Array2D<float> rads(NRows,NCols);
   Array2D<float> path(NRows, NCols);
   Array2D<float> blank(NRows,NCols,NoDataValue);
@@ -4307,8 +4526,8 @@ void LSDFlowInfo::HilltopFlowRoutingOriginal(LSDRaster Elevation, LSDRaster Hill
 //
 // SWDG 12/2/14
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-vector< Array2D<float> > LSDFlowInfo::HilltopFlowRouting(LSDRaster Elevation, LSDRaster Hilltops, LSDRaster Slope,
-                                                         LSDIndexRaster StreamNetwork, LSDRaster Aspect, string Prefix, LSDIndexRaster Basins, LSDRaster PlanCurvature,
+vector< Array2D<float> > LSDFlowInfo::HilltopFlowRouting(LSDRaster& Elevation, LSDRaster& Hilltops, LSDRaster& Slope,
+                                                         LSDIndexRaster& StreamNetwork, LSDRaster& Aspect, string Prefix, LSDIndexRaster& Basins, LSDRaster& PlanCurvature,
                                                          bool print_paths_switch, int thinning, string trace_path, bool basin_filter_switch,
                                                          vector<int> Target_Basin_Vector){
 
@@ -4345,11 +4564,11 @@ vector< Array2D<float> > LSDFlowInfo::HilltopFlowRouting(LSDRaster Elevation, LS
   float ymax = YMinimum + NRows*DataResolution;
 
   //Get data arrays from LSDRasters
-  Array2D<float> zeta = Elevation.get_RasterData(); //elevation
+  const Array2D<float>& zeta = Elevation.get_RasterData_ref(); //elevation
   Array2D<int> stnet = StreamNetwork.get_RasterData(); // stream network
-  Array2D<float> aspect = Aspect.get_RasterData(); //aspect
-  Array2D<float> hilltops = Hilltops.get_RasterData(); //hilltops
-  Array2D<float> slope = Slope.get_RasterData(); //hilltops
+  const Array2D<float>& aspect = Aspect.get_RasterData_ref(); //aspect
+  const Array2D<float>& hilltops = Hilltops.get_RasterData_ref(); //hilltops
+  const Array2D<float>& slope = Slope.get_RasterData_ref(); //hilltops
   Array2D<int> basin = Basins.get_RasterData(); //basins
 
   //empty arrays for data to be stored in
@@ -4861,8 +5080,8 @@ vector< Array2D<float> > LSDFlowInfo::HilltopFlowRouting(LSDRaster Elevation, LS
 //
 // SWDG 12/2/14
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-vector< Array2D<float> > LSDFlowInfo::HilltopFlowRouting_RAW(LSDRaster Elevation, LSDRaster Hilltops, LSDRaster Slope,
-                   LSDIndexRaster StreamNetwork, LSDRaster D_inf_Flowdir, string Prefix, LSDIndexRaster Basins, LSDRaster PlanCurvature,
+vector< Array2D<float> > LSDFlowInfo::HilltopFlowRouting_RAW(LSDRaster& Elevation, LSDRaster& Hilltops, LSDRaster& Slope,
+                   LSDIndexRaster& StreamNetwork, LSDRaster& D_inf_Flowdir, string Prefix, LSDIndexRaster& Basins, LSDRaster& PlanCurvature,
                    bool print_paths_switch, int thinning, string trace_path, bool basin_filter_switch,
                    vector<int> Target_Basin_Vector){
 
@@ -4899,11 +5118,11 @@ vector< Array2D<float> > LSDFlowInfo::HilltopFlowRouting_RAW(LSDRaster Elevation
   float ymax = YMinimum + NRows*DataResolution;
 
   //Get data arrays from LSDRasters
-  Array2D<float> zeta = Elevation.get_RasterData(); //elevation
+  const Array2D<float>& zeta = Elevation.get_RasterData_ref(); //elevation
   Array2D<int> stnet = StreamNetwork.get_RasterData(); // stream network
-  Array2D<float> aspect = D_inf_Flowdir.get_RasterData(); //aspect
-  Array2D<float> hilltops = Hilltops.get_RasterData(); //hilltops
-  Array2D<float> slope = Slope.get_RasterData(); //hilltops
+  const Array2D<float>& aspect = D_inf_Flowdir.get_RasterData_ref(); //aspect
+  const Array2D<float>& hilltops = Hilltops.get_RasterData_ref(); //hilltops
+  const Array2D<float>& slope = Slope.get_RasterData_ref(); //hilltops
   Array2D<int> basin = Basins.get_RasterData(); //basins
 
   //empty arrays for data to be stored in
@@ -5540,8 +5759,8 @@ vector< Array2D<float> > LSDFlowInfo::HilltopFlowRouting_RAW(LSDRaster Elevation
 //
 // SWDG 25/3/15
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-vector< Array2D<float> > LSDFlowInfo::HilltopFlowRouting_Profile(LSDRaster Elevation, LSDRaster Hilltops, LSDRaster Slope,
-                 LSDIndexRaster StreamNetwork, LSDRaster D_inf_Flowdir, string Prefix, LSDIndexRaster Basins,
+vector< Array2D<float> > LSDFlowInfo::HilltopFlowRouting_Profile(LSDRaster& Elevation, LSDRaster& Hilltops, LSDRaster& Slope,
+                 LSDIndexRaster& StreamNetwork, LSDRaster& D_inf_Flowdir, string Prefix, LSDIndexRaster& Basins,
                  bool print_paths_switch, int thinning, string trace_path, bool basin_filter_switch,
                  vector<int> Target_Basin_Vector){
 
@@ -5574,11 +5793,11 @@ vector< Array2D<float> > LSDFlowInfo::HilltopFlowRouting_Profile(LSDRaster Eleva
   float ymax = YMinimum + NRows*DataResolution;
 
   //Get data arrays from LSDRasters
-  Array2D<float> zeta = Elevation.get_RasterData(); //elevation
+  const Array2D<float>& zeta = Elevation.get_RasterData_ref(); //elevation
   Array2D<int> stnet = StreamNetwork.get_RasterData(); // stream network
-  Array2D<float> aspect = D_inf_Flowdir.get_RasterData(); //aspect
-  Array2D<float> hilltops = Hilltops.get_RasterData(); //hilltops
-  Array2D<float> slope = Slope.get_RasterData(); //hilltops
+  const Array2D<float>& aspect = D_inf_Flowdir.get_RasterData_ref(); //aspect
+  const Array2D<float>& hilltops = Hilltops.get_RasterData_ref(); //hilltops
+  const Array2D<float>& slope = Slope.get_RasterData_ref(); //hilltops
   Array2D<int> basin = Basins.get_RasterData(); //basins
 
   //empty arrays for data to be stored in
@@ -6244,78 +6463,51 @@ vector<int> LSDFlowInfo::basin_edge_extractor(int outlet_node, LSDRaster& Topogr
 // This function makes a mask of all the pixels that recieve flow (d8)
 // from a pixel that is either nodata or is on the boundary of the DEM
 //
+// The bordered pixels are flagged and then the flags are passed to the
+// receivers in a single sweep up the stack
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 LSDIndexRaster LSDFlowInfo::find_cells_influenced_by_nodata(LSDIndexRaster& Bordered_mask,
                   LSDRaster& Topography)
 {
-
   // set up the array
   Array2D<int> influenced_mask(NRows,NCols,int(NoDataValue));
   for(int row = 0; row <NRows; row++)
-    {
-      for(int col = 0; col<NCols; col++)
   {
-    if(Topography.get_data_element(row,col) != NoDataValue)
+    for(int col = 0; col<NCols; col++)
+    {
+      if(Topography.get_data_element(row,col) != NoDataValue)
       {
         influenced_mask[row][col] = 0;
       }
-  }
     }
+  }
 
-
-  int curr_node;
-  int next_node;
-  int next_row,next_col;
-
-  // now loop through every node in the array
-  for(int row = 0; row <NRows; row++)
-    {
-      for(int col = 0; col<NCols; col++)
+  // flag the nodes with data that are bordered by nodata
+  vector<bool> influenced_nodes(NDataNodes,false);
+  int row,col;
+  for(int node = 0; node<NDataNodes; node++)
   {
-    if(Topography.get_data_element(row,col) != NoDataValue)
-      {
-        // this node has data.
-        // first see if it has already been tagged
-        if(influenced_mask[row][col] != 1)
+    row = RowIndex[node];
+    col = ColIndex[node];
+    if(Topography.get_data_element(row,col) != NoDataValue &&
+       Bordered_mask.get_data_element(row,col) == 1)
     {
-
-      //See if it is borderd by a NDV
-      if(Bordered_mask.get_data_element(row,col) == 1)
-        {
-          // it is bordered by nodata. Work your way down the node list
-          curr_node = retrieve_node_from_row_and_column(row, col);
-          next_node = ReceiverVector[curr_node];
-
-          influenced_mask[row][col] = 1;
-          retrieve_current_row_and_col(next_node, next_row, next_col);
-
-          //cout << "I am bordered by NDV, entering search loop" << endl;
-          //cout << "Row: " << row <<  " col: " << col << " node: " << curr_node
-          //     << " receiver: " << next_node << " next infl mask: "
-          //     << influenced_mask[next_row][next_col] << endl;
-
-          // loop until you hit another influenced node or a baselevel node
-          while(next_node != curr_node && influenced_mask[next_row][next_col] != 1 )
-      {
-        curr_node = next_node;
-        next_node = ReceiverVector[curr_node];
-
-        // the index here say next row and column but actually this is
-        // preserved from the previous loop so is the current node.
-        influenced_mask[next_row][next_col] = 1;
-
-        // get the row and column of the receiver
-        retrieve_current_row_and_col(next_node, next_row, next_col);
-
-        //cout << "Looping thought influence, next influenced is: "
-        //     << influenced_mask[next_row][next_col] << endl;
-
-      }
-        }
+      influenced_nodes[node] = true;
     }
-      }
   }
+
+  // now pass the flags downstream. The SVector lists donors after their
+  // receivers so we go through it backwards
+  int this_node;
+  for(int SV_index = NDataNodes-1; SV_index>=0; SV_index--)
+  {
+    this_node = SVector[SV_index];
+    if(influenced_nodes[this_node])
+    {
+      influenced_nodes[ ReceiverVector[this_node] ] = true;
+      influenced_mask[ RowIndex[this_node] ][ ColIndex[this_node] ] = 1;
     }
+  }
 
   // now write the mask as an LSDIndexRaster
   LSDIndexRaster Influence_by_NDV(NRows,NCols,XMinimum,YMinimum,
@@ -6325,48 +6517,86 @@ LSDIndexRaster LSDFlowInfo::find_cells_influenced_by_nodata(LSDIndexRaster& Bord
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This function looks at all the upslope nodes of a node and checks to see if
+// any are on the edge of the DEM or bordered by nodata. 
+// If you need to test many nodes use get_nodes_influenced_by_nodata instead
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 bool LSDFlowInfo::is_upstream_influenced_by_nodata(int nodeindex, LSDRaster& test_raster)
 {
   // get all the upslope nodes of this node. 
   vector<int> upslope_node_list = get_upslope_nodes(nodeindex);
   
-  int i,j;
-  
   bool flag = false;
-  float raster_value;
-  float NDV = test_raster.get_NoDataValue();
   
   // now loop through all these nodes, seeing if any of them is bounded by nodata
   for (int node = 0; node < int(upslope_node_list.size()); node++)
   {
-    retrieve_current_row_and_col( upslope_node_list[node] ,i,j);
-
-    //check for edges of the file
-    if (i == 0 || i == (NRows - 1) || j == 0 || j == (NCols - 1))
+    if (is_node_bordered_by_nodata(upslope_node_list[node], test_raster))
     {
       flag = true;
       return flag;
     }
-    else
+  }
+
+  return flag;
+}
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This checks if a node is on the edge of the DEM or if any of its
+// neighbours are nodata
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+bool LSDFlowInfo::is_node_bordered_by_nodata(int nodeindex, LSDRaster& test_raster)
+{
+  int i = RowIndex[nodeindex];
+  int j = ColIndex[nodeindex];
+  float NDV = test_raster.get_NoDataValue();
+
+  //check for edges of the file
+  if (i == 0 || i == (NRows - 1) || j == 0 || j == (NCols - 1))
+  {
+    return true;
+  }
+
+  for(int ii = -1; ii<=1; ii++)
+  {
+    for(int jj = -1; jj<=1; jj++)
     {
-      for(int ii = -1; ii<=1; ii++)
+      if (test_raster.get_data_element(i+ii,j+jj) == NDV)
       {
-        for(int jj = -1; jj<=1; jj++)
-        {
-          raster_value = test_raster.get_data_element(i+ii,j+jj);
-          if (raster_value == NDV)
-          {
-            flag = true;
-            return flag;
-          }
-          
-        }
+        return true;
       }
     }
   }
+  return false;
+}
 
-  return flag;
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This returns a vector of bools, indexed by node, that is true if any of the
+// nodes upslope of the node (including itself) are on the edge of the DEM
+// or bordered by nodata. The flags are set in one sweep up the stack so this 
+// gives the same answer as is_upstream_influenced_by_nodata for every node
+// at the cost of a single pass.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+vector<bool> LSDFlowInfo::get_nodes_influenced_by_nodata(LSDRaster& test_raster)
+{
+  vector<bool> influenced_nodes(NDataNodes,false);
+  for(int node = 0; node<NDataNodes; node++)
+  {
+    influenced_nodes[node] = is_node_bordered_by_nodata(node, test_raster);
+  }
+
+  // The SVector lists donors after their receivers so we go through it backwards
+  int this_node;
+  for(int SV_index = NDataNodes-1; SV_index>=0; SV_index--)
+  {
+    this_node = SVector[SV_index];
+    if(influenced_nodes[this_node])
+    {
+      influenced_nodes[ ReceiverVector[this_node] ] = true;
+    }
+  }
+  return influenced_nodes;
 }
 
 
@@ -6374,25 +6604,101 @@ bool LSDFlowInfo::is_upstream_influenced_by_nodata(int nodeindex, LSDRaster& tes
 // get_raster_values_for_nodes
 //----------------------------------------------------------------------------------------
 // This function gets the values from a raster corresponding to the given nodes.
+// It now goes through the bulk gather so the values are pulled straight from
+// the contiguous raster storage. The raster is read through the reference and
+// never copied: copying an LSDRaster changes the reference count of its data,
+// which is not thread safe, and this is called on shared rasters from
+// inside parallel loops.
 vector<float> LSDFlowInfo::get_raster_values_for_nodes(LSDRaster& Raster, vector<int>& node_indices)
 {
-  int N_nodes = node_indices.size();
-  vector<float> return_values(N_nodes,float(NoDataValue));
-  int row=0;
-  int col=0;
+  vector<int> linear_indices = get_linear_index_of_nodes(node_indices);
+  vector<float> values;
+  gather_raster_values_from_linear_indices(linear_indices, Raster, values);
+  return values;
+}
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// This gets the linear index (row*NCols+col) of each node so that rasters
+// can be sampled without repeating the node lookups
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+vector<int> LSDFlowInfo::get_linear_index_of_nodes(vector<int>& node_indices)
+{
+  int N_nodes = int(node_indices.size());
+  vector<int> linear_indices(N_nodes,NoDataValue);
+  int this_node;
   for(int i = 0; i < N_nodes; ++i)
-    {
-      if(node_indices[i] == NoDataValue)
   {
-    return_values[i] = NoDataValue;
+    this_node = node_indices[i];
+    if(this_node >= 0 && this_node < NDataNodes)
+    {
+      linear_indices[i] = RowIndex[this_node]*NCols+ColIndex[this_node];
+    }
   }
-      else
+  return linear_indices;
+}
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// This gathers values from a raster at precomputed linear indices. The raster
+// is read through its contiguous storage, so the output vector is filled in a
+// single tight loop.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+void LSDFlowInfo::gather_raster_values_from_linear_indices(vector<int>& linear_indices,
+                                 LSDRaster& Raster, vector<float>& values)
+{
+  int N_nodes = int(linear_indices.size());
+  vector<float> this_values(N_nodes,float(NoDataValue));
+  if(Raster.NRows == NRows && Raster.NCols == NCols)
   {
-    retrieve_current_row_and_col(node_indices[i],row,col);
-    return_values[i] = Raster.get_data_element(row,col);
+    const float* data = &Raster.RasterData[0][0];
+    for(int i = 0; i < N_nodes; ++i)
+    {
+      if(linear_indices[i] != NoDataValue)
+      {
+        this_values[i] = data[linear_indices[i]];
+      }
+    }
   }
+  else
+  {
+    // a raster with different dimensions is sampled at the FlowInfo row
+    // and column, as the per-node lookups did
+    for(int i = 0; i < N_nodes; ++i)
+    {
+      if(linear_indices[i] != NoDataValue)
+      {
+        this_values[i] = Raster.get_data_element(linear_indices[i]/NCols,
+                                                 linear_indices[i]%NCols);
+      }
     }
-  return return_values;
+  }
+  values.swap(this_values);
+}
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// This gathers values from a number of rasters at precomputed linear indices,
+// one raster at a time
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+void LSDFlowInfo::gather_raster_values_from_linear_indices(vector<int>& linear_indices,
+                                 vector<LSDRaster>& Rasters,
+                                 vector< vector<float> >& values)
+{
+  int N_rasters = int(Rasters.size());
+  vector< vector<float> > gathered(N_rasters);
+  for(int r = 0; r < N_rasters; ++r)
+  {
+    gather_raster_values_from_linear_indices(linear_indices, Rasters[r], gathered[r]);
+  }
+  values.swap(gathered);
+}
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// This gets the values of several rasters for a vector of nodes
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+void LSDFlowInfo::get_raster_values_for_nodes(vector<int>& node_indices, vector<LSDRaster>& Rasters,
+                                   vector< vector<float> >& values)
+{
+  vector<int> linear_indices = get_linear_index_of_nodes(node_indices);
+  gather_raster_values_from_linear_indices(linear_indices, Rasters, values);
 }
 
 
@@ -6436,7 +6742,7 @@ vector<float> LSDFlowInfo::get_raster_values_for_nodes(LSDRaster& Raster, vector
 //
 // SWDG (adapted by DTM) 23/3/15
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-void LSDFlowInfo::D_Inf_single_trace_to_channel(LSDRaster Elevation, int start_node, LSDIndexRaster StreamNetwork, LSDRaster D_inf_Flowdir,
+void LSDFlowInfo::D_Inf_single_trace_to_channel(LSDRaster& Elevation, int start_node, LSDIndexRaster& StreamNetwork, LSDRaster& D_inf_Flowdir,
             vector< vector<float> >& output_trace_coordinates, vector<float>& output_trace_metrics,
             int& output_channel_node, bool& skip_trace)
 {
@@ -6470,9 +6776,9 @@ void LSDFlowInfo::D_Inf_single_trace_to_channel(LSDRaster Elevation, int start_n
   float ymax = YMinimum + NRows*DataResolution;
 
   //Get data arrays from LSDRasters
-  Array2D<float> zeta = Elevation.get_RasterData(); //elevation
+  const Array2D<float>& zeta = Elevation.get_RasterData_ref(); //elevation
   Array2D<int> stnet = StreamNetwork.get_RasterData(); // stream network
-  Array2D<float> aspect = D_inf_Flowdir.get_RasterData(); //aspect
+  const Array2D<float>& aspect = D_inf_Flowdir.get_RasterData_ref(); //aspect
   //   Array2D<float> slope = Slope.get_RasterData(); //slope
 
   Array2D<float> rads(NRows,NCols,NoDataValue);
@@ -7144,10 +7450,10 @@ void LSDFlowInfo::D_Inf_single_trace_to_channel(LSDRaster Elevation, int start_n
 //
 // SWDG 12/2/14
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-vector< Array2D<float> > LSDFlowInfo::HilltopFlowRoutingBedrock(LSDRaster Elevation, LSDRaster Hilltops, LSDRaster Slope,
-                LSDIndexRaster StreamNetwork, LSDRaster Aspect, string Prefix, LSDIndexRaster Basins, LSDRaster PlanCurvature,
+vector< Array2D<float> > LSDFlowInfo::HilltopFlowRoutingBedrock(LSDRaster& Elevation, LSDRaster& Hilltops, LSDRaster& Slope,
+                LSDIndexRaster& StreamNetwork, LSDRaster& Aspect, string Prefix, LSDIndexRaster& Basins, LSDRaster& PlanCurvature,
                 bool print_paths_switch, int thinning, string trace_path, bool basin_filter_switch,
-                vector<int> Target_Basin_Vector, LSDRaster RockExposure){
+                vector<int> Target_Basin_Vector, LSDRaster& RockExposure){
 
   //Declare parameters
   int i,j;
@@ -7183,13 +7489,13 @@ vector< Array2D<float> > LSDFlowInfo::HilltopFlowRoutingBedrock(LSDRaster Elevat
   float ymax = YMinimum + NRows*DataResolution;
 
   //Get data arrays from LSDRasters
-  Array2D<float> zeta = Elevation.get_RasterData(); //elevation
+  const Array2D<float>& zeta = Elevation.get_RasterData_ref(); //elevation
   Array2D<int> stnet = StreamNetwork.get_RasterData(); // stream network
-  Array2D<float> aspect = Aspect.get_RasterData(); //aspect
-  Array2D<float> hilltops = Hilltops.get_RasterData(); //hilltops
-  Array2D<float> slope = Slope.get_RasterData(); //hilltops
+  const Array2D<float>& aspect = Aspect.get_RasterData_ref(); //aspect
+  const Array2D<float>& hilltops = Hilltops.get_RasterData_ref(); //hilltops
+  const Array2D<float>& slope = Slope.get_RasterData_ref(); //hilltops
   Array2D<int> basin = Basins.get_RasterData(); //basins
-  Array2D<float> rock = RockExposure.get_RasterData(); // Rock Exposure
+  const Array2D<float>& rock = RockExposure.get_RasterData_ref(); // Rock Exposure
 
   //empty arrays for data to be stored in
   Array2D<float> rads(NRows,NCols);
@@ -7665,7 +7971,7 @@ vector< Array2D<float> > LSDFlowInfo::HilltopFlowRoutingBedrock(LSDRaster Elevat
 // This method removes end nodes which are not the uppermost extent of the channel network.
 // SWDG 23/7/15
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-vector<int> LSDFlowInfo::ProcessEndPointsToChannelHeads(LSDIndexRaster Ends){
+vector<int> LSDFlowInfo::ProcessEndPointsToChannelHeads(LSDIndexRaster& Ends){
 
   Array2D<int> EndArray = Ends.get_RasterData();
   vector<int> Sources;
@@ -7738,7 +8044,7 @@ vector<int> LSDFlowInfo::ProcessEndPointsToChannelHeads(LSDIndexRaster Ends){
 // This method removes single pixel channels from a channel network.
 // SWDG 23/7/15
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-vector<int> LSDFlowInfo::RemoveSinglePxChannels(LSDIndexRaster StreamNetwork, vector<int> Sources){
+vector<int> LSDFlowInfo::RemoveSinglePxChannels(LSDIndexRaster& StreamNetwork, vector<int> Sources){
 
   for (int q = 0; q < int(Sources.size());++q){
 
@@ -7826,6 +8132,45 @@ int LSDFlowInfo::get_downslope_node_after_fixed_visited_nodes(int source_node,
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This function starts from a given node index and then goes downstream
+// until it either hits a baselevel node or until it has accumulated a
+// number of visited pixels.
+// This version keeps track of visited nodes in a node-indexed bitset
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+int LSDFlowInfo::get_downslope_node_after_fixed_visited_nodes(int source_node,
+                 int outlet_node, int n_nodes_to_visit, vector<bool>& VisitedNodes)
+{
+  int n_visited = 0;
+  int current_node = source_node;
+  int receiver_node = ReceiverVector[current_node];
+
+  // you start from the source node and work your way downstream
+  while (current_node != receiver_node && receiver_node != outlet_node)
+  {
+    // check to see if this node has been visited, if so increment the n_visited
+    // iterator
+    if (VisitedNodes[receiver_node])
+    {
+      n_visited++;
+    }
+    else
+    {
+      VisitedNodes[receiver_node] = true;
+    }
+
+    // see if we have collected enough nodes to visit
+    if (n_visited >= n_nodes_to_visit)
+    {
+      break;
+    }
+
+    current_node = receiver_node;
+    receiver_node = ReceiverVector[current_node];
+  }
+  return receiver_node;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 // This function gets the flow length between two nodes.
 // FJC 29/09/16
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
@@ -726,6 +726,45 @@ class LSDFlowInfo
   /// @date 21/09/2014
   LSDRaster calculate_d8_slope(LSDRaster& Elevation);
 
+  /// @brief This calculates several flow metrics in a single pass through the
+  ///  stack, storing them in node indexed vectors.
+  /// @detail The user selects the metrics with a vector of 5 elements
+  ///  (1 to calculate, 0 to skip):
+  ///        0 -> Contributing pixels
+  ///        1 -> Drainage area
+  ///        2 -> Flow distance from the outlet
+  ///        3 -> D8 slope
+  ///        4 -> Chi (based on drainage area), nodata below area_threshold
+  ///  The values are the same as those from the individual functions
+  ///  (e.g., distance_from_outlet, calculate_d8_slope).
+  /// @param Elevation the elevation raster, used for the slope
+  /// @param m_over_n the m/n ratio for chi
+  /// @param A_0 the reference drainage area for chi
+  /// @param area_threshold the drainage area above which chi is recorded
+  /// @param metric_selection a vector of 5 ints selecting the metrics
+  /// @return a vector of 5 node indexed vectors. Those not selected are empty.
+  vector< vector<float> > calculate_flow_metrics(LSDRaster& Elevation, 
+                                 float m_over_n, float A_0, float area_threshold,
+                                 vector<int> metric_selection);
+
+  /// @brief This is a wrapper for calculate_flow_metrics that returns rasters.
+  /// @param Elevation the elevation raster, used for the slope
+  /// @param m_over_n the m/n ratio for chi
+  /// @param A_0 the reference drainage area for chi
+  /// @param area_threshold the drainage area above which chi is recorded
+  /// @param metric_selection a vector of 5 ints selecting the metrics
+  ///  (see calculate_flow_metrics)
+  /// @return A vector of LSDRaster objects. Those that you have not asked to
+  ///  be calculated are returned as a 1x1 Raster housing a NoDataValue
+  vector<LSDRaster> calculate_flow_metric_rasters(LSDRaster& Elevation, 
+                                 float m_over_n, float A_0, float area_threshold,
+                                 vector<int> metric_selection);
+
+  /// @brief This writes a vector of values indexed by node to a raster
+  /// @param node_values a vector with one value for each node
+  /// @return an LSDRaster with the values, nodata where there are no nodes
+  LSDRaster write_node_vector_to_LSDRaster(vector<float>& node_values);
+
   /// @brief This returns the node index of the pixel farthest upslope from the input node.
   /// @param node the node from which you want to find the farthest upslope pixel.
   /// @param DistFromOutlet an LSDRaster containing the distance from the outlet.
@@ -822,7 +861,7 @@ void get_nodeindices_from_csv(string csv_filename, vector<int>& NIs, vector<floa
   /// @param Path Empty raster to store the final trace path.
   /// @author SWDG
   /// @date 20/1/14
-  void D8_Trace(int i, int j, LSDIndexRaster StreamNetwork, float& length,
+  void D8_Trace(int i, int j, LSDIndexRaster& StreamNetwork, float& length,
                    int& receiver_row, int& receiver_col, Array2D<int>& Path);
 
   /// @brief Move the location of the channel head downslope by a user defined distance.
@@ -842,9 +881,9 @@ void get_nodeindices_from_csv(string csv_filename, vector<int>& NIs, vector<floa
   /// @param FinalHeads A vector containing a subset of the original channel heads which corresponds to the moved heads.
   /// @author SWDG
   /// @date 27/11/15
-  void MoveChannelHeadUp(vector<int> Sources, float MoveDist, LSDRaster DEM, vector<int>& UpslopeSources, vector<int>& FinalHeads);
+  void MoveChannelHeadUp(vector<int> Sources, float MoveDist, LSDRaster& DEM, vector<int>& UpslopeSources, vector<int>& FinalHeads);
 
-  void HilltopFlowRoutingOriginal(LSDRaster Elevation, LSDRaster Hilltops, LSDRaster Slope, LSDRaster Aspect, LSDIndexRaster StreamNetwork);
+  void HilltopFlowRoutingOriginal(LSDRaster& Elevation, LSDRaster& Hilltops, LSDRaster& Slope, LSDRaster& Aspect, LSDIndexRaster& StreamNetwork);
 
   /// @brief Hilltop flow routing.
   ///
@@ -894,8 +933,8 @@ void get_nodeindices_from_csv(string csv_filename, vector<int>& NIs, vector<floa
   /// @return Vector of Array2D<float> containing hillslope metrics.
   /// @author SWDG
   /// @date 12/2/14
-  vector< Array2D<float> > HilltopFlowRouting(LSDRaster Elevation, LSDRaster Hilltops, LSDRaster Slope,
-               LSDIndexRaster StreamNetwork, LSDRaster Aspect, string Prefix, LSDIndexRaster Basins, LSDRaster PlanCurvature,
+  vector< Array2D<float> > HilltopFlowRouting(LSDRaster& Elevation, LSDRaster& Hilltops, LSDRaster& Slope,
+               LSDIndexRaster& StreamNetwork, LSDRaster& Aspect, string Prefix, LSDIndexRaster& Basins, LSDRaster& PlanCurvature,
                bool print_paths_switch, int thinning, string trace_path, bool basin_filter_switch,
                vector<int> Target_Basin_Vector);
 
@@ -951,8 +990,8 @@ void get_nodeindices_from_csv(string csv_filename, vector<int>& NIs, vector<floa
   /// @return Vector of Array2D<float> containing hillslope metrics.
   /// @author SWDG
   /// @date 12/2/14
-  vector< Array2D<float> > HilltopFlowRouting_RAW(LSDRaster Elevation, LSDRaster Hilltops, LSDRaster Slope,
-               LSDIndexRaster StreamNetwork, LSDRaster D_inf_Flowdir, string Prefix, LSDIndexRaster Basins, LSDRaster PlanCurvature,
+  vector< Array2D<float> > HilltopFlowRouting_RAW(LSDRaster& Elevation, LSDRaster& Hilltops, LSDRaster& Slope,
+               LSDIndexRaster& StreamNetwork, LSDRaster& D_inf_Flowdir, string Prefix, LSDIndexRaster& Basins, LSDRaster& PlanCurvature,
                bool print_paths_switch, int thinning, string trace_path, bool basin_filter_switch,
                vector<int> Target_Basin_Vector);
 
@@ -1007,8 +1046,8 @@ void get_nodeindices_from_csv(string csv_filename, vector<int>& NIs, vector<floa
   /// @return Vector of Array2D<float> containing hillslope metrics.
   /// @author SWDG
   /// @date 25/03/15
-  vector< Array2D<float> > HilltopFlowRouting_Profile(LSDRaster Elevation, LSDRaster Hilltops, LSDRaster Slope,
-                                                         LSDIndexRaster StreamNetwork, LSDRaster D_inf_Flowdir, string Prefix, LSDIndexRaster Basins,
+  vector< Array2D<float> > HilltopFlowRouting_Profile(LSDRaster& Elevation, LSDRaster& Hilltops, LSDRaster& Slope,
+                                                         LSDIndexRaster& StreamNetwork, LSDRaster& D_inf_Flowdir, string Prefix, LSDIndexRaster& Basins,
                                                          bool print_paths_switch, int thinning, string trace_path, bool basin_filter_switch,
                                                          vector<int> Target_Basin_Vector);
 
@@ -1035,6 +1074,21 @@ void get_nodeindices_from_csv(string csv_filename, vector<int>& NIs, vector<floa
   /// @date 29/05/2017
   bool is_upstream_influenced_by_nodata(int nodeindex, LSDRaster& test_raster);
 
+  /// @brief This checks if a node is on the edge of the DEM or has a nodata
+  ///  neighbour
+  /// @param nodeindex The node index of the node in question
+  /// @param test_raster and LSDRaster that is to be tested
+  /// @return true if the node is bordered by nodata
+  bool is_node_bordered_by_nodata(int nodeindex, LSDRaster& test_raster);
+
+  /// @brief This gets a flag for every node that is true if the node has
+  ///  any upslope node on the edge of the DEM or bordered by nodata.
+  /// @detail The flags are computed with a single pass up the stack, so
+  ///  is_upstream_influenced_by_nodata for every node is a lookup
+  /// @param test_raster and LSDRaster that is to be tested
+  /// @return a vector of bools indexed by node
+  vector<bool> get_nodes_influenced_by_nodata(LSDRaster& test_raster);
+
   /// @brief This function gets nodes that are possibly on basin edge by
   ///  removing those that do not border NoData. Intended to be passed
   ///  to function for finding concave hull of basin
@@ -1053,23 +1107,71 @@ void get_nodeindices_from_csv(string csv_filename, vector<int>& NIs, vector<floa
   /// @param vector<float> - the node indices for which you want the values
   vector<float> get_raster_values_for_nodes(LSDRaster& Raster, vector<int>& node_indices);
 
-  void D_Inf_single_trace_to_channel(LSDRaster Elevation, int start_node, LSDIndexRaster StreamNetwork, LSDRaster D_inf_Flowdir,
+  /// @brief This gets the linear (row major) index into the raster grid of each
+  ///  node in a vector of nodes. The linear index is row*NCols+col, so the
+  ///  index can be reused to gather from any raster with the same dimensions
+  ///  as the LSDFlowInfo object without going back through the node lookups.
+  /// @param node_indices the node indices. NoDataValue entries are allowed.
+  /// @return a vector of linear indices. Nodes that are NoDataValue or out of
+  ///  range get NoDataValue.
+  vector<int> get_linear_index_of_nodes(vector<int>& node_indices);
+
+  /// @brief This gathers the values of a raster for a vector of precomputed
+  ///  linear indices (see get_linear_index_of_nodes).
+  /// @details The raster is read through the reference and is not copied, so
+  ///  this is safe to call on a shared raster from several threads. Copying an
+  ///  LSDRaster would change the reference count of its data, which is not
+  ///  atomic.
+  /// @param linear_indices the linear indices of the nodes
+  /// @param Raster the raster to sample. A raster with the same dimensions as
+  ///  the LSDFlowInfo object is read from its contiguous storage; any other
+  ///  raster is read at the row and column of each node.
+  /// @param values the gathered values, replaced by this function. NoDataValue
+  ///  indices give NoDataValue.
+  void gather_raster_values_from_linear_indices(vector<int>& linear_indices,
+                                 LSDRaster& Raster, vector<float>& values);
+
+  /// @brief This gathers values from several rasters at once for a vector of
+  ///  precomputed linear indices (see get_linear_index_of_nodes). Values are
+  ///  read straight out of the contiguous raster storage and written into one
+  ///  contiguous output vector per raster.
+  /// @param linear_indices the linear indices of the nodes
+  /// @param Rasters the rasters to sample. Rasters with the same dimensions as
+  ///  the LSDFlowInfo object are read from their contiguous storage; any other
+  ///  raster is read at the row and column of each node.
+  /// @param values the gathered values, replaced by this function. values[r][i]
+  ///  is the value of Rasters[r] at linear_indices[i]; NoDataValue indices give
+  ///  NoDataValue.
+  void gather_raster_values_from_linear_indices(vector<int>& linear_indices,
+                                 vector<LSDRaster>& Rasters,
+                                 vector< vector<float> >& values);
+
+  /// @brief This gets the values of several rasters for a vector of nodes in
+  ///  one pass. It computes the linear indices once and then gathers from
+  ///  every raster.
+  /// @param node_indices the node indices. NoDataValue entries are allowed.
+  /// @param Rasters the rasters to sample
+  /// @param values the gathered values, one vector per raster
+  void get_raster_values_for_nodes(vector<int>& node_indices, vector<LSDRaster>& Rasters,
+                                   vector< vector<float> >& values);
+
+  void D_Inf_single_trace_to_channel(LSDRaster& Elevation, int start_node, LSDIndexRaster& StreamNetwork, LSDRaster& D_inf_Flowdir,
                                                           vector< vector<float> >& output_trace_coordinates, vector<float>& output_trace_metrics,
                                                           int& output_channel_node, bool& skip_trace);
 
 
 
-  vector< Array2D<float> > HilltopFlowRoutingBedrock(LSDRaster Elevation, LSDRaster Hilltops, LSDRaster Slope,
-               LSDIndexRaster StreamNetwork, LSDRaster Aspect, string Prefix, LSDIndexRaster Basins, LSDRaster PlanCurvature,
+  vector< Array2D<float> > HilltopFlowRoutingBedrock(LSDRaster& Elevation, LSDRaster& Hilltops, LSDRaster& Slope,
+               LSDIndexRaster& StreamNetwork, LSDRaster& Aspect, string Prefix, LSDIndexRaster& Basins, LSDRaster& PlanCurvature,
                bool print_paths_switch, int thinning, string trace_path, bool basin_filter_switch,
-               vector<int> Target_Basin_Vector, LSDRaster RockExposure);
+               vector<int> Target_Basin_Vector, LSDRaster& RockExposure);
 
   /// @brief This method removes end nodes which are not the uppermost extent of the channel network.
   /// @param Ends an LSDIndexRaster of the end points to be processed.
   /// @return A vector of source nodes
   /// @author SWDG
   /// @date 23/7/15
-  vector<int> ProcessEndPointsToChannelHeads(LSDIndexRaster Ends);
+  vector<int> ProcessEndPointsToChannelHeads(LSDIndexRaster& Ends);
 
   /// @brief This method removes single pixel channels from a channel network.
   /// @param StreamNetwork an LSDIndexRaster of the channel network generated from Sources.
@@ -1077,7 +1179,7 @@ void get_nodeindices_from_csv(string csv_filename, vector<int>& NIs, vector<floa
   /// @return A vector of source nodes
   /// @author SWDG
   /// @date 23/7/15
-  vector<int> RemoveSinglePxChannels(LSDIndexRaster StreamNetwork, vector<int> Sources);
+  vector<int> RemoveSinglePxChannels(LSDIndexRaster& StreamNetwork, vector<int> Sources);
 
   /// @brief This function starts from a source and goes downstream until it
   ///  either accumulates n_nodes_to_visit or hits a base level node
@@ -1095,6 +1197,21 @@ void get_nodeindices_from_csv(string csv_filename, vector<int>& NIs, vector<floa
   int get_downslope_node_after_fixed_visited_nodes(int source_node,
                  int outlet_node, int n_nodes_to_visit, LSDIndexRaster& VisitedRaster);
 
+  /// @brief This function starts from a source and goes downstream until it
+  ///  either accumulates n_nodes_to_visit or hits a base level node
+  /// @detail Overloaded version that uses a node-indexed bitset rather than a
+  ///  raster to record visited nodes
+  /// @param source_node The starting node
+  /// @param outlet_node A node that serves as an end to the channel before
+  ///  the base level.
+  /// @param n_nodes_to_visit the number of visited pixels the flow function will
+  ///   travese before it stops
+  /// @param VisitedNodes A vector of length NDataNodes that is true where a
+  ///  node has been visited. Updated by the function.
+  /// @return outlet_nde the node at the end of the flow path
+  int get_downslope_node_after_fixed_visited_nodes(int source_node,
+                 int outlet_node, int n_nodes_to_visit, vector<bool>& VisitedNodes);
+
 	/// @brief This function gets the flow distance between two nodes
   /// @param UpstreamNode the upstream node
   /// @param Downstreamnode the downstream node
@@ -114,6 +114,23 @@ LSDIndexRaster& LSDIndexRaster::operator=(const LSDIndexRaster& rhs)
   return *this;
  }
 
+// Swaps the contents of two rasters. The data arrays are reference counted so
+// swapping them only exchanges pointers.
+void LSDIndexRaster::swap(LSDIndexRaster& Other)
+{
+  std::swap(NRows, Other.NRows);
+  std::swap(NCols, Other.NCols);
+  std::swap(XMinimum, Other.XMinimum);
+  std::swap(YMinimum, Other.YMinimum);
+  std::swap(DataResolution, Other.DataResolution);
+  std::swap(NoDataValue, Other.NoDataValue);
+  GeoReferencingStrings.swap(Other.GeoReferencingStrings);
+
+  Array2D<int> temp_data = RasterData;
+  RasterData = Other.RasterData;
+  Other.RasterData = temp_data;
+}
+
 // the create function. This is default and throws an error
 // SMM 2012
 void LSDIndexRaster::create()
@@ -240,7 +257,7 @@ void LSDIndexRaster::create(LSDRaster& NonIntLSDRaster)
   DataResolution = NonIntLSDRaster.get_DataResolution();
   NoDataValue = NonIntLSDRaster.get_NoDataValue();
   GeoReferencingStrings = NonIntLSDRaster.get_GeoReferencingStrings();
-  Array2D<float> RasterDataFloat = NonIntLSDRaster.get_RasterData();
+  const Array2D<float>& RasterDataFloat = NonIntLSDRaster.get_RasterData_ref();
 
   //Declarations
   Array2D<int> RasterDataInt(NRows,NCols,NoDataValue);
@@ -2269,7 +2286,7 @@ LSDIndexRaster LSDIndexRaster::CombineBinaryNetwork(LSDIndexRaster& Network1, LS
 // LSDIndexRaster which is coded channel == input channel index, floodplain == 500, NDV == hillslopes.
 // SWDG 05/03/15
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-LSDIndexRaster LSDIndexRaster::MergeChannelWithFloodplain(LSDIndexRaster FloodPlain){
+LSDIndexRaster LSDIndexRaster::MergeChannelWithFloodplain(LSDIndexRaster& FloodPlain){
 
   //get the Channel network data as an array
   Array2D<int> ChannelArray = RasterData.copy();
@@ -2551,7 +2568,7 @@ LSDIndexRaster LSDIndexRaster::find_end_points()
   return Ends;
 }
 
-void LSDIndexRaster::remove_downstream_endpoints(LSDIndexRaster CC, LSDRaster Topo)
+void LSDIndexRaster::remove_downstream_endpoints(LSDIndexRaster& CC, LSDRaster& Topo)
 {
   //first loop through the array to find the number of different components to check
   int max_segment_ID = 0;
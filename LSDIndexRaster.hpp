@@ -187,12 +187,22 @@ class LSDIndexRaster
   int get_NoDataValue() const           { return NoDataValue; }
   /// @return Raster values as a 2D Array.
   Array2D<int> get_RasterData() const { return RasterData; }
+
+  /// @brief Get a read only view of the raster values without copying them.
+  /// @return const reference to the raster values.
+  const Array2D<int>& get_RasterData_ref() const { return RasterData; }
+
   /// @return Map of strings containing georeferencing information
   map<string,string> get_GeoReferencingStrings() const { return GeoReferencingStrings; }
 
   /// Assignment operator.
   LSDIndexRaster& operator=(const LSDIndexRaster& LSDIR);
 
+  /// @brief Swaps the contents of this raster with another raster without
+  /// copying any data.
+  /// @param Other the raster to swap with.
+  void swap(LSDIndexRaster& Other);
+
   /// @brief Read a raster into memory from a file.
   ///
   /// The supported formats are .asc and .flt which are
@@ -236,7 +246,7 @@ class LSDIndexRaster
   /// @return The raster value at the position (row, column).
   /// @author SMM
   /// @date 01/01/12
-  int get_data_element(int row, int column)  { return RasterData[row][column]; }
+  int get_data_element(int row, int column) const { return RasterData[row][column]; }
 
   /// @brief Sets the raster data at a specified location.
   /// @param row An integer, the X coordinate of the target cell.
@@ -496,7 +506,7 @@ class LSDIndexRaster
   /// @return An LSDIndexRaster of the merged channels and floodplains.
   /// @author SWDG
   /// @date 05/03/15
-  LSDIndexRaster MergeChannelWithFloodplain(LSDIndexRaster FloodPlain);
+  LSDIndexRaster MergeChannelWithFloodplain(LSDIndexRaster& FloodPlain);
 
 
   /// @brief Method to identify connected components using a two pass method
@@ -531,7 +541,7 @@ class LSDIndexRaster
   void thinningIteration(Array2D<int>& binary, int iter);
 
   LSDIndexRaster find_end_points();
-  void remove_downstream_endpoints(LSDIndexRaster CC, LSDRaster Topo);
+  void remove_downstream_endpoints(LSDIndexRaster& CC, LSDRaster& Topo);
 
   /// @brief Method to convert all values in an LSDIndexRaster to a single value.
   /// @param Value, an integer value that will be assigned to every non NDV cell in the raster.
@@ -125,6 +125,9 @@ LSDJunctionNetwork& LSDJunctionNetwork::operator=(const LSDJunctionNetwork& rhs)
     SVector  = rhs.SVector;
     SVectorIndex  = rhs.SVectorIndex;
     NContributingJunctions  = rhs.NContributingJunctions;
+    SVectorSourceJunctions = rhs.SVectorSourceJunctions;
+    NSourcesBeforeSVectorIndex = rhs.NSourcesBeforeSVectorIndex;
+    JunctionOfNodeVector = rhs.JunctionOfNodeVector;
 
     StreamOrderArray = rhs.StreamOrderArray.copy();
     JunctionArray = rhs.JunctionArray.copy();
@@ -156,6 +159,9 @@ void LSDJunctionNetwork::create( void )
   SVector  = emptyvec;
   SVectorIndex  = emptyvec;
   NContributingJunctions  = emptyvec;
+  SVectorSourceJunctions = emptyvec;
+  NSourcesBeforeSVectorIndex = emptyvec;
+  JunctionOfNodeVector = emptyvec;
 
   Array2D<int> emptyarray(0,0);
   StreamOrderArray = emptyarray.copy();
@@ -694,6 +700,9 @@ void LSDJunctionNetwork::create(vector<int> Sources, LSDFlowInfo& FlowInfo)
   //cout << "LINE 525 did area calcs " << endl;
 
   NContributingJunctions = vectorized_contributing_pixels;
+
+  // now build the index that is used for fast upstream queries
+  build_junction_tree_index(FlowInfo);
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 
@@ -908,6 +917,49 @@ void LSDJunctionNetwork::add_to_stack(int lm_index, int& j_index, int bl_node)
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//
+// This builds the index used for fast upstream queries on the junction tree.
+//
+// The SVector is built depth first, so the junctions upslope of junction j
+// occupy the interval [SVectorIndex[j], SVectorIndex[j]+NContributingJunctions[j])
+// of the SVector. Upstream and nesting tests are therefore interval comparisons.
+// Here we add a running count of the sources along the SVector so that the
+// sources of any junction are a contiguous slice of SVectorSourceJunctions,
+// and a node indexed lookup table of the junction numbers.
+//
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+void LSDJunctionNetwork::build_junction_tree_index(LSDFlowInfo& FlowInfo)
+{
+  vector<int> empty_vec;
+  SVectorSourceJunctions = empty_vec;
+  vector<int> n_sources_vec(NJunctions+1,0);
+
+  int this_junction;
+  for(int SV_index = 0; SV_index<NJunctions; SV_index++)
+  {
+    this_junction = SVector[SV_index];
+    n_sources_vec[SV_index+1] = n_sources_vec[SV_index];
+
+    // if the junction has no donors, it is a source
+    if (NDonorsVector[this_junction] == 0)
+    {
+      SVectorSourceJunctions.push_back(this_junction);
+      n_sources_vec[SV_index+1]++;
+    }
+  }
+  NSourcesBeforeSVectorIndex = n_sources_vec;
+
+  // now the lookup table from nodes to junctions
+  vector<int> junction_of_node(FlowInfo.NDataNodes,NoDataValue);
+  for(int junc = 0; junc<NJunctions; junc++)
+  {
+    junction_of_node[ JunctionVector[junc] ] = junc;
+  }
+  JunctionOfNodeVector = junction_of_node;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 //
@@ -928,13 +980,12 @@ vector<int> LSDJunctionNetwork::get_upslope_junctions(int junction_number_outlet
     exit(0);
   }
 
+  // the upslope junctions are a contiguous slice of the SVector
   int start_SVector_junction = SVectorIndex[junction_number_outlet];
   int end_SVector_junction = start_SVector_junction+NContributingJunctions[junction_number_outlet];
 
-  for(int junction = start_SVector_junction; junction < end_SVector_junction; junction++)
-  {
-    us_junctions.push_back(SVector[junction]);
-  }
+  us_junctions.assign(SVector.begin()+start_SVector_junction,
+                      SVector.begin()+end_SVector_junction);
 
   return us_junctions;
 }
@@ -944,21 +995,22 @@ vector<int> LSDJunctionNetwork::get_upslope_junctions(int junction_number_outlet
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 // This function takes a junction and finds all the source junction upstream of the
 // junction.
+// The sources are a contiguous slice of the SVectorSourceJunctions
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 vector<int> LSDJunctionNetwork::get_all_source_junctions_of_an_outlet_junction(int junction_number_outlet)
 {
-  vector<int> us_junctions = get_upslope_junctions(junction_number_outlet);
-  vector<int> source_junctions;
-
-  int n_upslope_junctions = int(us_junctions.size());
-  for (int j = 0; j<n_upslope_junctions; j++)
+  if(junction_number_outlet < 0 || junction_number_outlet > NJunctions-1)
   {
-    // if the junction has no donors, it is a source
-    if (NDonorsVector[ us_junctions[j] ] == 0)
-    {
-      source_junctions.push_back(us_junctions[j]);
-    }
+    cout << "Tried LSDJunctionNetwork::get_all_source_junctions_of_an_outlet_junction but the"
+         << "  junction number does not exist" << endl;
+    exit(0);
   }
+
+  int start_SVector_junction = SVectorIndex[junction_number_outlet];
+  int end_SVector_junction = start_SVector_junction+NContributingJunctions[junction_number_outlet];
+
+  vector<int> source_junctions(SVectorSourceJunctions.begin()+NSourcesBeforeSVectorIndex[start_SVector_junction],
+                               SVectorSourceJunctions.begin()+NSourcesBeforeSVectorIndex[end_SVector_junction]);
   return source_junctions;
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
@@ -970,17 +1022,13 @@ vector<int> LSDJunctionNetwork::get_all_source_junctions_of_an_outlet_junction(i
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 vector<int> LSDJunctionNetwork::get_all_source_nodes_of_an_outlet_junction(int junction_number_outlet)
 {
-  vector<int> us_junctions = get_upslope_junctions(junction_number_outlet);
-  vector<int> source_nodes;
+  vector<int> source_junctions = get_all_source_junctions_of_an_outlet_junction(junction_number_outlet);
 
-  int n_upslope_junctions = int(us_junctions.size());
-  for (int j = 0; j<n_upslope_junctions; j++)
+  int n_sources = int(source_junctions.size());
+  vector<int> source_nodes(n_sources);
+  for (int j = 0; j<n_sources; j++)
   {
-    // if the junction has no donors, it is a source
-    if (NDonorsVector[ us_junctions[j] ] == 0)
-    {
-      source_nodes.push_back(JunctionVector[ us_junctions[j] ]);
-    }
+    source_nodes[j] = JunctionVector[ source_junctions[j] ];
   }
   return source_nodes;
 }
@@ -1387,12 +1435,8 @@ int LSDJunctionNetwork::calculate_basin_averages_from_junction_list(vector<int>&
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 int LSDJunctionNetwork::get_Junction_of_Node(int Node, LSDFlowInfo& FlowInfo)
 {
-  int JunctionNumber, Row, Col;
-
-  FlowInfo.retrieve_current_row_and_col(Node, Row, Col);
-  JunctionNumber = JunctionIndexArray[Row][Col];
-
-  return JunctionNumber;
+  // this uses the node indexed lookup table built with the junction network
+  return JunctionOfNodeVector[Node];
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
@@ -2144,26 +2188,19 @@ int LSDJunctionNetwork::get_Next_StreamOrder_Junction(int junction)
 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=--=-=-=-=-=-=-=-=-=-=-=-=
 // This function checks whether a junction is upsream of another junction
+// The upslope junctions occupy a contiguous interval of the SVector so this
+// is just an interval comparison
 // SMM
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=--=-=-=-=-=-=-=-=-=-=-=-=
 bool LSDJunctionNetwork::is_junction_upstream(int current_junction, int test_junction)
 {
-  bool i = false;
-
   int start_SVector_junction = SVectorIndex[current_junction];
   int end_SVector_junction = start_SVector_junction+NContributingJunctions[current_junction];
 
   int SVector_test_junction = SVectorIndex[test_junction];
 
-  for(int junction = start_SVector_junction; junction < end_SVector_junction; junction++)
-  {
-    if (junction == SVector_test_junction)
-    {
-      i = true;
-    }
-  }
-
-  return i;
+  return (SVector_test_junction >= start_SVector_junction &&
+          SVector_test_junction < end_SVector_junction);
 }
 
 
@@ -2982,7 +3019,7 @@ Array2D<int> LSDJunctionNetwork::GetChannelHeadsChiMethodAllPixels(int JunctionN
   //get the chi and elevation values of each upslope node
   vector<int> upslope_nodes = FlowInfo.get_upslope_nodes(starting_node);
   vector<float> upslope_chi = FlowInfo.get_upslope_chi(starting_node, m_over_n, A_0);
-  vector<float> elevation;
+  vector<float> elevation = FlowInfo.get_raster_values_for_nodes(ElevationRaster, upslope_nodes);
   int row,col;
 
   string string_filename_all;
@@ -2996,10 +3033,7 @@ Array2D<int> LSDJunctionNetwork::GetChannelHeadsChiMethodAllPixels(int JunctionN
 
   for (int node=0; node < int(upslope_nodes.size()); node++)
   {
-    FlowInfo.retrieve_current_row_and_col(upslope_nodes[node], row, col);
-    float elev = ElevationRaster.get_data_element(row,col);
-    elevation.push_back(elev);
-    chi_profile_all << upslope_chi[node] << " " << elev << endl;
+    chi_profile_all << upslope_chi[node] << " " << elevation[node] << endl;
   }
 
   string string_filename;
@@ -3168,16 +3202,9 @@ vector<int> LSDJunctionNetwork::GetSourceNodesChiMethodAllPixels(int JunctionNum
   //get the chi and elevation values of each upslope node
   vector<int> upslope_nodes = FlowInfo.get_upslope_nodes(starting_node);
   vector<float> upslope_chi = FlowInfo.get_upslope_chi(starting_node, m_over_n, A_0);
-  vector<float> elevation;
+  vector<float> elevation = FlowInfo.get_raster_values_for_nodes(ElevationRaster, upslope_nodes);
   int row,col;
 
-  for (int node=0; node < int(upslope_nodes.size()); node++)
-  {
-    FlowInfo.retrieve_current_row_and_col(upslope_nodes[node], row, col);
-    float elev = ElevationRaster.get_data_element(row,col);
-    elevation.push_back(elev);
-  }
-
   float lower_limit = 0;
   vector<float> mean_chi;
   vector<float> mean_elev;
@@ -6010,7 +6037,9 @@ LSDIndexRaster LSDJunctionNetwork::GetStreams(int min_order, int max_order)
 bool LSDJunctionNetwork::node_tester(LSDFlowInfo& FlowInfo, int input_junction)
 {
 
-  Array2D<int> FlowDirection = FlowInfo.get_FlowDirection();  //used as a proxy of the elevation data
+  // The flow direction is used as a proxy of the elevation data. It is read
+  // element by element rather than copied so that basins can be built
+  // from several threads at once (the TNT reference count is not atomic)
   bool flag = false;
 
   //get reciever junction of the input junction
@@ -6058,21 +6087,21 @@ bool LSDJunctionNetwork::node_tester(LSDFlowInfo& FlowInfo, int input_junction)
     return flag;}
 
     // check surrounding cells for NoDataValue
-    else if (FlowDirection[i+1][j+1] == NoDataValue){flag = true;
+    else if (FlowInfo.get_LocalFlowDirection(i+1,j+1) == NoDataValue){flag = true;
     return flag;}
-    else if (FlowDirection[i+1][j] == NoDataValue){flag = true;
+    else if (FlowInfo.get_LocalFlowDirection(i+1,j) == NoDataValue){flag = true;
     return flag;}
-    else if (FlowDirection[i+1][j-1] == NoDataValue){flag = true;
+    else if (FlowInfo.get_LocalFlowDirection(i+1,j-1) == NoDataValue){flag = true;
     return flag;}
-    else if (FlowDirection[i][j+1] == NoDataValue){flag = true;
+    else if (FlowInfo.get_LocalFlowDirection(i,j+1) == NoDataValue){flag = true;
     return flag;}
-    else if (FlowDirection[i][j-1] == NoDataValue){flag = true;
+    else if (FlowInfo.get_LocalFlowDirection(i,j-1) == NoDataValue){flag = true;
     return flag;}
-    else if (FlowDirection[i-1][j+1] == NoDataValue){flag = true;
+    else if (FlowInfo.get_LocalFlowDirection(i-1,j+1) == NoDataValue){flag = true;
     return flag;}
-    else if (FlowDirection[i-1][j] == NoDataValue){flag = true;
+    else if (FlowInfo.get_LocalFlowDirection(i-1,j) == NoDataValue){flag = true;
     return flag;}
-    else if (FlowDirection[i-1][j-1] == NoDataValue){flag = true;
+    else if (FlowInfo.get_LocalFlowDirection(i-1,j-1) == NoDataValue){flag = true;
     return flag;}
   }
   return flag;
@@ -6195,6 +6224,9 @@ vector<int> LSDJunctionNetwork::Prune_Junctions_Edge_Ignore_Outlet_Reach(vector<
   int N_BaseLevelJuncs = int(BaseLevelJunctions_Initial.size());
   cout << endl << endl << "I am going to remove any basins draining to the edge, ignoring the outlet reach." << endl;
 
+  // get the nodes influenced by nodata in one pass
+  vector<bool> influenced_by_nodata = FlowInfo.get_nodes_influenced_by_nodata(TestRaster);
+
   for(int i = 0; i < N_BaseLevelJuncs; ++i)
   {
     //cout << "I'm checking node " << i << " to see if it is truncated." << endl;
@@ -6223,8 +6255,7 @@ vector<int> LSDJunctionNetwork::Prune_Junctions_Edge_Ignore_Outlet_Reach(vector<
         if(DonorJunctions[i_donor] != BaseLevelJunctions_Initial[i])
         {
           int this_NI = JunctionVector[ DonorJunctions[i_donor] ];
-          bool is_influenced_by_nodata = FlowInfo.is_upstream_influenced_by_nodata(this_NI, TestRaster);
-          if (is_influenced_by_nodata)
+          if (influenced_by_nodata[this_NI])
           {
             //cout << "This node has a NoData influence upslope." << endl;
             keep_base_level_node = false;
@@ -6259,6 +6290,9 @@ vector<int> LSDJunctionNetwork::Prune_To_Largest_Complete_Basins(vector<int>& Ba
   vector<int> pruned_basin_list;
   int this_pruned_basin;
   int N_BL_Nodes = int(BaseLevelJunctions_Initial.size());
+
+  // get the nodes influenced by nodata in one pass
+  vector<bool> influenced_by_nodata = FlowInfo.get_nodes_influenced_by_nodata(TestRaster);
   for(int BLJ = 0; BLJ<N_BL_Nodes; BLJ++)
   {
     // get all the donor junctions. We need to have the baselevel junction
@@ -6284,10 +6318,9 @@ vector<int> LSDJunctionNetwork::Prune_To_Largest_Complete_Basins(vector<int>& Ba
     {
       // get the current node index
       int this_NI = JunctionVector[ upslope_juncs[this_junc_index] ];
-      bool is_influenced_by_nodata = FlowInfo.is_upstream_influenced_by_nodata(this_NI, TestRaster);
       
       // only record data if it is not influenced by nodata
-      if (not is_influenced_by_nodata)
+      if (not influenced_by_nodata[this_NI])
       {
         // only record data if it is bigger than the previous biggest node
         if( contributing_pixels_junctions[this_junc_index] > max_contributing_pixels)
@@ -6375,23 +6408,22 @@ vector<int> LSDJunctionNetwork::Prune_Junctions_By_Contributing_Pixel_Window_Rem
   cout << "Right, I've pruned those and have " << first_pruning.size() << " junctions left." << endl;
 
   // So now we need to prune the basins bounded by nodata, and prune the nested
-  // basins. Which to do first? The nodata pruning is computationally expensive:
-  // it requires a search of all the pixels in a basin. But the problem is
-  // that if we prune by nesting we might remove a load of basins in a large
-  // basin that are nested, only for that large basin to be removed later by the 
-  // nodata pruning. So even though it will be slow we need to prune by
-  // nodata first.
+  // basins. Which to do first? If we prune by nesting we might remove a load 
+  // of basins in a large basin that are nested, only for that large basin to 
+  // be removed later by the nodata pruning. So we need to prune by
+  // nodata first. The nodata influence of every node is calculated in a single
+  // pass so this is not expensive.
   cout << "Now I am going to see if any are draining to the edge. " << endl;
+  vector<bool> influenced_by_nodata = FlowInfo.get_nodes_influenced_by_nodata(TestRaster);
   int N_total_juncs = int(first_pruning.size());
   vector<int> second_pruning;
   for(int this_junc_index = 0; this_junc_index< N_total_juncs; this_junc_index++)
   {
     // get the current node index
     int this_NI = JunctionVector[ first_pruning[this_junc_index] ];
-    bool is_influenced_by_nodata = FlowInfo.is_upstream_influenced_by_nodata(this_NI, TestRaster);
       
     // only record data if it is not influenced by nodata
-    if (not is_influenced_by_nodata)
+    if (not influenced_by_nodata[this_NI])
     {
       second_pruning.push_back( first_pruning[this_junc_index] );
     }
@@ -6409,88 +6441,63 @@ vector<int> LSDJunctionNetwork::Prune_Junctions_By_Contributing_Pixel_Window_Rem
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 // This function takes a list of junctions and then prunes them on the basis
 // of whether they are nested. Nested junctions are eliminated. 
+//
+// Rather than testing every pair of junctions this sorts the junctions
+// by their position in the SVector. Because the upslope junctions of any
+// junction form a contiguous interval of the SVector, and these intervals
+// are either nested or disjoint, a junction is nested if it lies before the
+// furthest interval end of the junctions that precede it.
+// If a junction appears more than once in the list only the last copy is kept.
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 vector<int> LSDJunctionNetwork::Prune_Junctions_If_Nested(vector<int>& Junctions_Initial,
                                       LSDFlowInfo& FlowInfo, LSDIndexRaster& FlowAcc)
 {
   // Find out how many junctions there are
   int N_Juncs = int(Junctions_Initial.size());
-  //cout << "There are " << N_Juncs << " Junctions, from which I'll compare" << endl;
   
-  // get the contributing pixels of these junctions
-  // get the flow accumulation (in pixels) from each of these basins
-  vector<int> contributing_pixels_junctions = get_contributing_pixels_from_specified_junctions(Junctions_Initial,
-                                                     FlowInfo, FlowAcc);
-
-
-  // now get all the possible two pair combinations of these junctions
-  bool zero_indexed = true;   // this is just because the junction indices are numbered from zero
-  int k = 2;                  // We want combinations of 2 junctions
-
-  // the vec vec holds a vector of each possible combination of channels
-  // each vector has two elements in it: the first and second channel in the comibination
-  vector< vector<int> > combo_vecvec = combinations(N_Juncs, k, zero_indexed);
-  
-  //cout << "The combo vecvec has: " << combo_vecvec.size() << " elements" << endl;
-  
-  //vector<int> combo_first = combo_vecvec[0];
-  //vector<int> combo_second = combo_vecvec[1];
-  //cout << "Running through combinations, of which there are: " << combo_first.size() << endl;
-  
-  
-  // get the number of combinations
-  int N_combinations = int(combo_vecvec.size());
-  
-  // loop through all the combinations. There is always a bigger and smaller junction 
-  // in the combination. We store these in bigger smaller 
-  vector<int> bigger;
-  vector<int> smaller;
-  
-  int first_index; 
-  int second_index;
+  // pair up the SVector position of each junction with its index in the
+  // list, and sort. Ties (repeated junctions) are ordered by index
+  vector< pair<int,int> > SV_position_and_index(N_Juncs);
+  for (int i = 0; i<N_Juncs; i++)
+  {
+    SV_position_and_index[i] = make_pair(SVectorIndex[ Junctions_Initial[i] ], i);
+  }
+  sort(SV_position_and_index.begin(), SV_position_and_index.end());
   
-  for (int i = 0; i<N_combinations; i++)
+  // now sweep through the junctions in SVector order
+  vector<bool> is_nested(N_Juncs,false);
+  int furthest_interval_end = -1;
+  int this_position, this_index, this_interval_end;
+  for (int i = 0; i<N_Juncs; i++)
   {
+    this_position = SV_position_and_index[i].first;
+    this_index = SV_position_and_index[i].second;
     
-    // get the indices into the junction vector of all the combinations
-    first_index = combo_vecvec[i][0];
-    second_index = combo_vecvec[i][1];
-    if ( contributing_pixels_junctions[ first_index ] > contributing_pixels_junctions[ second_index ])
+    // a repeated junction is nested within its later copy
+    if (i < N_Juncs-1 && SV_position_and_index[i+1].first == this_position)
     {
-      bigger.push_back(first_index);
-      smaller.push_back(second_index);
+      is_nested[this_index] = true;
     }
     else
     {
-      bigger.push_back(second_index);
-      smaller.push_back(first_index);
-    }
-  }
-  
-  map<int,int> Nested_Junctions;
-  bool is_upstream;
-  // now we loop through all combos, looking for  nested basins
-  for (int i = 0; i<N_combinations; i++)
-  {
-    // Only check if the junction has not already been found to be nested
-    if ( Nested_Junctions.find( smaller[i] ) == Nested_Junctions.end() ) 
-    {
+      if (this_position < furthest_interval_end)
+      {
+        is_nested[this_index] = true;
+      }
       
-      // If it is upstream, add it to the nested map
-      is_upstream = is_junction_upstream(Junctions_Initial[ bigger[i] ], Junctions_Initial[ smaller[i] ]);
-      if(is_upstream)
+      this_interval_end = this_position+NContributingJunctions[ Junctions_Initial[this_index] ];
+      if (this_interval_end > furthest_interval_end)
       {
-        Nested_Junctions[ smaller[i] ] = 1;
+        furthest_interval_end = this_interval_end;
       }
     }
   }
   
-  // Now loop thrugh all the junctions, checking to see if they are nested
+  // Now loop thrugh all the junctions, keeping those that are not nested
   vector<int> non_nested_junctions;
   for (int i = 0; i<N_Juncs; i++)
   {
-    // keep the junctions that are not in the nested junctions map
-    if ( Nested_Junctions.find( i ) == Nested_Junctions.end() )
+    if (not is_nested[i])
     {
       non_nested_junctions.push_back( Junctions_Initial[i]);
     } 
@@ -7171,14 +7178,8 @@ void LSDJunctionNetwork::couple_hillslope_nodes_to_channel_nodes(LSDRaster& Elev
   // option to clip all rasters to basin here//
   //-----------------------------------------//
   // Step 2: sort basin nodes by elevation
-  vector<float> ElevationValues(N_BasinNodes,float(NoDataValue));
+  vector<float> ElevationValues = FlowInfo.get_raster_values_for_nodes(Elevation, BasinNodes);
   vector<size_t> index_map;
-  for(int i = 0; i<N_BasinNodes; ++i)
-  {
-    int row,col;
-    FlowInfo.retrieve_current_row_and_col(BasinNodes[i],row,col);
-    ElevationValues[i]=Elevation.get_data_element(row,col);
-  }
   cout << "\t\t sorting values" << endl;
   matlab_float_sort_descending(ElevationValues,ElevationValues,index_map);
   matlab_int_reorder(BasinNodes,index_map,BasinNodes);
@@ -7769,7 +7770,6 @@ void LSDJunctionNetwork::print_junctions_to_csv(LSDFlowInfo& FlowInfo, vector<in
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 
-
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 // This function is for calculating a bonehead version of the chi slope
 // and the chi intercept
@@ -7781,55 +7781,11 @@ void LSDJunctionNetwork::get_overlapping_channels(LSDFlowInfo& FlowInfo,
                                     vector<int>& outlet_nodes,
                                     int n_nodes_to_visit)
 {
-  // Get the number of baselevel nodes
-  int N_baselevel_nodes = int(BaseLevel_Junctions.size());
-
-  // create the visited array
-  int not_visited = 0;
-  LSDIndexRaster VisitedRaster(NRows,NCols, XMinimum, YMinimum, DataResolution, NoDataValue, GeoReferencingStrings,not_visited);
-
-  vector<int> NewSources;
-  vector<int> NewOutlets;
-  int thisOutlet;
-
-  // loop through these nodes
-  for (int BL = 0; BL < N_baselevel_nodes; BL++)
-  {
-    int outlet_node = JunctionVector[BaseLevel_Junctions[BL] ];
-    //cout << "The outlet node is: " << outlet_node << endl;
-
-    // get all the source nodes of the base level
-    vector<int> source_nodes = get_all_source_nodes_of_an_outlet_junction(BaseLevel_Junctions[BL]);
-    //cout << "The number of sources is: " << source_nodes.size() << endl;
-
-
-    // sort the nodes by flow distance in ascending order
-    vector<int> SortedSources = FlowInfo.sort_node_list_based_on_raster(source_nodes, DistanceFromOutlet);
-
-    // get them in descending order
-    reverse(SortedSources.begin(),SortedSources.end());
-
-    // now loop through the sorted sources
-    int n_sources = int(SortedSources.size());
-
-    for(int s = 0; s<n_sources; s++)
-    {
-      // get the channel from this source and mark up the covered raster
-      thisOutlet = FlowInfo.get_downslope_node_after_fixed_visited_nodes(SortedSources[s],
-                  outlet_node, n_nodes_to_visit, VisitedRaster);
-
-      //cout << "Source number " << s << " source node is: " << SortedSources[s] << " BL node: " << outlet_node
-      //     << " and new outlet: " << thisOutlet << endl;
-
-
-      NewSources.push_back(SortedSources[s]);
-      NewOutlets.push_back(thisOutlet);
-    }
-
-  }
-
-  outlet_nodes = NewOutlets;
-  source_nodes = NewSources;
+  vector<int> baselevel_nodes;
+  bool to_downstream_outlets = false;
+  get_overlapping_channels_engine(FlowInfo, BaseLevel_Junctions, DistanceFromOutlet,
+                                  source_nodes, outlet_nodes, baselevel_nodes,
+                                  n_nodes_to_visit, to_downstream_outlets);
 }
 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
@@ -7845,58 +7801,10 @@ void LSDJunctionNetwork::get_overlapping_channels(LSDFlowInfo& FlowInfo,
                                     vector<int>& baselevel_nodes,
                                     int n_nodes_to_visit)
 {
-  // Get the number of baselevel nodes
-  int N_baselevel_nodes = int(BaseLevel_Junctions.size());
-
-  // create the visited array
-  int not_visited = 0;
-  LSDIndexRaster VisitedRaster(NRows,NCols, XMinimum, YMinimum, DataResolution, NoDataValue, GeoReferencingStrings,not_visited);
-
-  vector<int> NewSources;
-  vector<int> NewOutlets;
-  vector<int> NewBaselevelNodes;
-  int thisOutlet;
-
-  // loop through these nodes
-  for (int BL = 0; BL < N_baselevel_nodes; BL++)
-  {
-    int outlet_node = JunctionVector[BaseLevel_Junctions[BL] ];
-    //cout << "The outlet node is: " << outlet_node << endl;
-
-    // get all the source nodes of the base level
-    vector<int> source_nodes = get_all_source_nodes_of_an_outlet_junction(BaseLevel_Junctions[BL]);
-    //cout << "The number of sources is: " << source_nodes.size() << endl;
-
-
-    // sort the nodes by flow distance in ascending order
-    vector<int> SortedSources = FlowInfo.sort_node_list_based_on_raster(source_nodes, DistanceFromOutlet);
-
-    // get them in descending order
-    reverse(SortedSources.begin(),SortedSources.end());
-
-    // now loop through the sorted sources
-    int n_sources = int(SortedSources.size());
-
-    for(int s = 0; s<n_sources; s++)
-    {
-      // get the channel from this source and mark up the covered raster
-      thisOutlet = FlowInfo.get_downslope_node_after_fixed_visited_nodes(SortedSources[s],
-                  outlet_node, n_nodes_to_visit, VisitedRaster);
-
-      //cout << "Source number " << s << " source node is: " << SortedSources[s] << " BL node: " << outlet_node
-      //     << " and new outlet: " << thisOutlet << endl;
-
-
-      NewSources.push_back(SortedSources[s]);
-      NewOutlets.push_back(thisOutlet);
-      NewBaselevelNodes.push_back(outlet_node);
-    }
-
-  }
-
-  outlet_nodes = NewOutlets;
-  source_nodes = NewSources;
-  baselevel_nodes = NewBaselevelNodes;
+  bool to_downstream_outlets = false;
+  get_overlapping_channels_engine(FlowInfo, BaseLevel_Junctions, DistanceFromOutlet,
+                                  source_nodes, outlet_nodes, baselevel_nodes,
+                                  n_nodes_to_visit, to_downstream_outlets);
 }
 
 
@@ -7914,55 +7822,11 @@ void LSDJunctionNetwork::get_overlapping_channels_to_downstream_outlets(LSDFlowI
                                     vector<int>& outlet_nodes,
                                     int n_nodes_to_visit)
 {
-  // Get the number of baselevel nodes
-  int N_baselevel_nodes = int(BaseLevel_Junctions.size());
-
-  // create the visited array
-  int not_visited = 0;
-  LSDIndexRaster VisitedRaster(NRows,NCols, XMinimum, YMinimum, DataResolution, NoDataValue, GeoReferencingStrings,not_visited);
-
-  vector<int> NewSources;
-  vector<int> NewOutlets;
-  int thisOutlet;
-
-  // loop through these nodes
-  for (int BL = 0; BL < N_baselevel_nodes; BL++)
-  {
-    int outlet_node = get_penultimate_node_from_stream_link(BaseLevel_Junctions[BL],FlowInfo);
-    cout << "The outlet node is: " << outlet_node << endl;
-
-    // get all the source nodes of the base level
-    vector<int> source_nodes = get_all_source_nodes_of_an_outlet_junction(BaseLevel_Junctions[BL]);
-    cout << "The number of sources is: " << source_nodes.size() << endl;
-
-
-    // sort the nodes by flow distance in ascending order
-    vector<int> SortedSources = FlowInfo.sort_node_list_based_on_raster(source_nodes, DistanceFromOutlet);
-
-    // get them in descending order
-    reverse(SortedSources.begin(),SortedSources.end());
-
-    // now loop through the sorted sources
-    int n_sources = int(SortedSources.size());
-
-    for(int s = 0; s<n_sources; s++)
-    {
-      // get the channel from this source and mark up the covered raster
-      thisOutlet = FlowInfo.get_downslope_node_after_fixed_visited_nodes(SortedSources[s],
-                  outlet_node, n_nodes_to_visit, VisitedRaster);
-
-      cout << "Source number " << s << " source node is: " << SortedSources[s] << " BL node: " << outlet_node
-           << " and new outlet: " << thisOutlet << endl;
-
-
-      NewSources.push_back(SortedSources[s]);
-      NewOutlets.push_back(thisOutlet);
-    }
-
-  }
-
-  outlet_nodes = NewOutlets;
-  source_nodes = NewSources;
+  vector<int> baselevel_nodes;
+  bool to_downstream_outlets = true;
+  get_overlapping_channels_engine(FlowInfo, BaseLevel_Junctions, DistanceFromOutlet,
+                                  source_nodes, outlet_nodes, baselevel_nodes,
+                                  n_nodes_to_visit, to_downstream_outlets);
 }
 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
@@ -7981,62 +7845,106 @@ void LSDJunctionNetwork::get_overlapping_channels_to_downstream_outlets(LSDFlowI
                                     LSDRaster& DistanceFromOutlet,
                                     vector<int>& source_nodes,
                                     vector<int>& outlet_nodes,
-                                    vector<int>& baselevel_nodes,
+                                    vector<int>& baselevel_nodes, 
                                     int n_nodes_to_visit)
+{
+  bool to_downstream_outlets = true;
+  get_overlapping_channels_engine(FlowInfo, BaseLevel_Junctions, DistanceFromOutlet,
+                                  source_nodes, outlet_nodes, baselevel_nodes,
+                                  n_nodes_to_visit, to_downstream_outlets);
+}
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This is the workhorse behind the get_overlapping_channels functions.
+//
+// Rather than allocating a full raster to keep track of visited pixels it uses
+// a bitset indexed by node. The visited nodes always form a downstream-closed
+// tree (each channel is marked from its source down to the point where it
+// joins an already visited channel), so every node in the network is marked
+// at most once and each source only walks n_nodes_to_visit nodes beyond its
+// confluence. The whole thing is therefore linear in the size of the channel
+// network rather than scaling with sources times raster size.
+//
+// Sources are sorted on flow distance gathered directly from the node
+// row and column vectors, using the same sort as
+// LSDFlowInfo::sort_node_list_based_on_raster so the ordering of the output
+// is identical to the original implementation.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDJunctionNetwork::get_overlapping_channels_engine(LSDFlowInfo& FlowInfo,
+                                    vector<int>& BaseLevel_Junctions,
+                                    LSDRaster& DistanceFromOutlet,
+                                    vector<int>& source_nodes,
+                                    vector<int>& outlet_nodes,
+                                    vector<int>& baselevel_nodes,
+                                    int n_nodes_to_visit,
+                                    bool to_downstream_outlets)
 {
   // Get the number of baselevel nodes
   int N_baselevel_nodes = int(BaseLevel_Junctions.size());
 
-  // create the visited array
-  int not_visited = 0;
-  LSDIndexRaster VisitedRaster(NRows,NCols, XMinimum, YMinimum, DataResolution, NoDataValue, GeoReferencingStrings,not_visited);
+  // create the visited bitset. This is shared between baselevel junctions
+  // so nested outlets behave in the same way as they did with a visited raster
+  vector<bool> VisitedNodes(FlowInfo.NDataNodes,false);
 
   vector<int> NewSources;
   vector<int> NewOutlets;
   vector<int> NewBaselevelNodes;
-  int thisOutlet;
-  //int outlet_junction;
+
+  // these are reused for every baselevel junction
+  vector<float> FlowDistances;
+  vector<float> SortedFlowDistances;
+  vector<int> SortedSources;
+  vector<size_t> index_map;
+
+  int outlet_node, baselevel_node, this_node, thisOutlet;
 
   // loop through these nodes
   for (int BL = 0; BL < N_baselevel_nodes; BL++)
   {
-    int outlet_node = get_penultimate_node_from_stream_link(BaseLevel_Junctions[BL],FlowInfo);
-    int outlet_junction_node = JunctionVector[BaseLevel_Junctions[BL] ];
-    cout << "The outlet node is: " << outlet_node << endl;
+    baselevel_node = JunctionVector[BaseLevel_Junctions[BL] ];
+    if (to_downstream_outlets)
+    {
+      outlet_node = get_penultimate_node_from_stream_link(BaseLevel_Junctions[BL],FlowInfo);
+      cout << "The outlet node is: " << outlet_node << endl;
+    }
+    else
+    {
+      outlet_node = baselevel_node;
+    }
 
     // get all the source nodes of the base level
-    vector<int> source_nodes = get_all_source_nodes_of_an_outlet_junction(BaseLevel_Junctions[BL]);
-    cout << "The number of sources is: " << source_nodes.size() << endl;
+    vector<int> these_sources = get_all_source_nodes_of_an_outlet_junction(BaseLevel_Junctions[BL]);
+    int n_sources = int(these_sources.size());
+    if (to_downstream_outlets)
+    {
+      cout << "The number of sources is: " << n_sources << endl;
+    }
 
+    // gather the flow distance of each source
+    FlowDistances.resize(n_sources);
+    for(int s = 0; s<n_sources; s++)
+    {
+      this_node = these_sources[s];
+      FlowDistances[s] = DistanceFromOutlet.get_data_element(FlowInfo.RowIndex[this_node],
+                                                             FlowInfo.ColIndex[this_node]);
+    }
 
     // sort the nodes by flow distance in ascending order
-    vector<int> SortedSources = FlowInfo.sort_node_list_based_on_raster(source_nodes, DistanceFromOutlet);
+    matlab_float_sort(FlowDistances, SortedFlowDistances, index_map);
+    matlab_int_reorder(these_sources, index_map, SortedSources);
 
-    // get them in descending order
-    reverse(SortedSources.begin(),SortedSources.end());
-
-    // now loop through the sorted sources
-    int n_sources = int(SortedSources.size());
-
-    for(int s = 0; s<n_sources; s++)
+    // now loop through the sorted sources in descending order, so the longest
+    // channel is laid down first
+    for(int s = n_sources-1; s>=0; s--)
     {
-      // get the channel from this source and mark up the covered raster
+      // get the channel from this source and mark up the visited nodes
       thisOutlet = FlowInfo.get_downslope_node_after_fixed_visited_nodes(SortedSources[s],
-                  outlet_node, n_nodes_to_visit, VisitedRaster);
-
-      cout << "Source number " << s << " source node is: " << SortedSources[s] << " BL node: " << outlet_node
-           << " and new outlet: " << thisOutlet << endl;
-
+                  outlet_node, n_nodes_to_visit, VisitedNodes);
 
       NewSources.push_back(SortedSources[s]);
       NewOutlets.push_back(thisOutlet);
-      
-      
-      //cout << "Search for Heybubba: This will probably cause a segfault. It needs to be a junction!" << endl;
-      NewBaselevelNodes.push_back(outlet_junction_node);
-      
+      NewBaselevelNodes.push_back(baselevel_node);
     }
-
   }
 
   outlet_nodes = NewOutlets;
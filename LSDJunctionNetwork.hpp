@@ -174,6 +174,16 @@ class LSDJunctionNetwork
   /// @date 01/09/12
   void add_to_stack(int lm_index, int& j_index, int bl_node);
 
+  /// @brief This builds the junction tree index used for fast upstream queries.
+  /// @detail The SVector is a depth first ordering of the junction tree, so
+  ///  the junctions upstream of any junction occupy the contiguous interval
+  ///  [SVectorIndex, SVectorIndex+NContributingJunctions) of the SVector.
+  ///  This function adds a prefix count of the source junctions along the
+  ///  SVector, so source sets become contiguous slices, and a node indexed
+  ///  lookup table of junction numbers.
+  /// @param FlowInfo the LSDFlowInfo object used to build the network
+  void build_junction_tree_index(LSDFlowInfo& FlowInfo);
+
   // this returns all the upstream junction of a junction_number_outlet
   /// @brief This returns all the upstream junction of a junction_number_outlet.
   /// @param junction_number_outlet Integer of junction of interest.
@@ -452,11 +462,12 @@ class LSDJunctionNetwork
 
     /// @brief This function removes basins that are nested within any other 
     ///  basin in the list
+    /// @detail Uses the junction tree index so runs in n log n time
     /// @param Junctions_Initial a vector of integers containg an inital
     ///  list of junctions
     /// @param FlowInfo The LSDFlowInfo object
-    /// @param TestRaster A raster that is just used to look for nodata
-    /// @param FlowAcc an LSDIndexRaster with the number of pixels for flow accumulation
+    /// @param FlowAcc an LSDIndexRaster with the number of pixels for flow accumulation.
+    ///  No longer used since nesting is determined from the junction tree.
     /// @return a pruned list of base level nodes
     /// @author SMM
     /// @date 26/06/17
@@ -1702,6 +1713,31 @@ vector<int> GetChannelHeadsChiMethodFromValleys(vector<int> ValleyNodes,
                                     vector<int>& baselevel_nodes, 
                                     int n_nodes_to_visit);
 
+  /// @brief This is the engine behind the get_overlapping_channels functions.
+  /// @detail It marks visited nodes in a node-indexed bitset rather than a
+  ///  raster, so each node of the channel network is marked at most once and
+  ///  the cost is linear in the size of the network.
+  /// @param FlowInfo an LSDFlowInfo object
+  /// @param BaseLevel_Junctions an integer vector that contains the base level junctions
+  /// @param DistanceFromOutlet an LSDRaster with the flow distance
+  /// @param source_nodes a vector continaing the sorted sorce nodes (by flow distance)
+  ///  THIS GETS OVERWRITTEN
+  /// @param outlet_nodes a vector continaing the outlet nodes
+  ///  THIS GETS OVERWRITTEN
+  /// @param baselevel_nodes a vector continaing the baselevel nodes
+  ///  THIS GETS OVERWRITTEN
+  /// @param n_nodes_to_visit the number of visited nodes a channel traverses before it stops
+  /// @param to_downstream_outlets if true the channels end at the penultimate
+  ///  node of the stream link below each baselevel junction
+  void get_overlapping_channels_engine(LSDFlowInfo& FlowInfo,
+                                    vector<int>& BaseLevel_Junctions,
+                                    LSDRaster& DistanceFromOutlet,
+                                    vector<int>& source_nodes,
+                                    vector<int>& outlet_nodes,
+                                    vector<int>& baselevel_nodes,
+                                    int n_nodes_to_visit,
+                                    bool to_downstream_outlets);
+
 /// @detail This function gets all the pixels along a line defined by a series of points and finds the pixels greater than a specified stream order.
 /// @param Points PointData object with the points
 /// @param ElevationRaster raster of elevations
@@ -1786,6 +1822,20 @@ vector<int> get_channel_pixels_along_line(vector<int> line_rows, vector<int> lin
   /// upslope of any and all nodes in the junction list.
   vector<int> NContributingJunctions;
 
+  /// @brief The source junctions, listed in the order they appear in the SVector.
+  vector<int> SVectorSourceJunctions;
+
+  /// @brief The number of source junctions that appear in the SVector before
+  /// a given position in the SVector. It has NJunctions+1 elements, so the
+  /// sources upstream of junction j are elements
+  /// [NSourcesBeforeSVectorIndex[SVectorIndex[j]], NSourcesBeforeSVectorIndex[SVectorIndex[j]+NContributingJunctions[j]])
+  /// of SVectorSourceJunctions.
+  vector<int> NSourcesBeforeSVectorIndex;
+
+  /// @brief A lookup table, indexed by node, of the junction number at each
+  /// node. Nodes that are not junctions have the NoDataValue.
+  vector<int> JunctionOfNodeVector;
+
   // the following arrays are for keeping track of the junctions. For large DEMs this will be quite memory intensive
   // it might be sensible to try to devise a less data intensive method in the future.
   // one could do it with much less memory but that would involve searching
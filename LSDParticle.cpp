@@ -1426,8 +1426,15 @@ void LSDCRNParticle::update_21Ne_SSfull(double erosion_rate, LSDCRNParameters& C
 void LSDCRNParticle::update_3He_conc(double dt,double erosion_rate, LSDCRNParameters& CRNp)
 {
   double Gamma_neutron = CRNp.Gamma[0];	// in g/cm^2
-  Conc_3He = Conc_3He +  CRNp.S_t*exp(-effective_dLoc/Gamma_neutron)*Gamma_neutron*CRNp.P0_3He*
+  if (erosion_rate == 0)
+  {
+    Conc_3He = Conc_3He +  CRNp.S_t*exp(-effective_dLoc/Gamma_neutron)*CRNp.P0_3He*dt;
+  }
+  else
+  {
+    Conc_3He = Conc_3He +  CRNp.S_t*exp(-effective_dLoc/Gamma_neutron)*Gamma_neutron*CRNp.P0_3He*
                (exp(dt*erosion_rate/Gamma_neutron) - 1)/erosion_rate;
+  }
 }
 
 
@@ -3057,6 +3064,329 @@ double LSDCRNParticle::CRONUS_simple_N_forward(double eff_eros, double Psp, doub
   return N;            
 
 }                                      
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// LSDCRNParticleEnsemble
+// A struct of arrays holding many CRN particles
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCRNParticleEnsemble::create()
+{
+  clear();
+}
+
+void LSDCRNParticleEnsemble::create(vector<LSDCRNParticle>& particles)
+{
+  clear();
+  int n_particles = int(particles.size());
+  reserve(n_particles);
+  for(int i = 0; i<n_particles; i++)
+  {
+    add_particle(particles[i]);
+  }
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// Memory management
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCRNParticleEnsemble::reserve(int n_particles)
+{
+  Type.reserve(n_particles);
+  GSDType.reserve(n_particles);
+  CellIndex.reserve(n_particles);
+  Age.reserve(n_particles);
+  OSLage.reserve(n_particles);
+  xLoc.reserve(n_particles);
+  yLoc.reserve(n_particles);
+  dLoc.reserve(n_particles);
+  effective_dLoc.reserve(n_particles);
+  zetaLoc.reserve(n_particles);
+  Conc_10Be.reserve(n_particles);
+  Conc_26Al.reserve(n_particles);
+  Conc_36Cl.reserve(n_particles);
+  Conc_14C.reserve(n_particles);
+  Conc_21Ne.reserve(n_particles);
+  Conc_3He.reserve(n_particles);
+  Conc_f7Be.reserve(n_particles);
+  Conc_f10Be.reserve(n_particles);
+  Conc_f210Pb.reserve(n_particles);
+  Conc_f137Cs.reserve(n_particles);
+  Mass.reserve(n_particles);
+  StartingMass.reserve(n_particles);
+  SurfaceArea.reserve(n_particles);
+}
+
+void LSDCRNParticleEnsemble::clear()
+{
+  Type.clear();
+  GSDType.clear();
+  CellIndex.clear();
+  Age.clear();
+  OSLage.clear();
+  xLoc.clear();
+  yLoc.clear();
+  dLoc.clear();
+  effective_dLoc.clear();
+  zetaLoc.clear();
+  Conc_10Be.clear();
+  Conc_26Al.clear();
+  Conc_36Cl.clear();
+  Conc_14C.clear();
+  Conc_21Ne.clear();
+  Conc_3He.clear();
+  Conc_f7Be.clear();
+  Conc_f10Be.clear();
+  Conc_f210Pb.clear();
+  Conc_f137Cs.clear();
+  Mass.clear();
+  StartingMass.clear();
+  SurfaceArea.clear();
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// Moving particles in and out of the ensemble
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCRNParticleEnsemble::add_particle(const LSDCRNParticle& tP)
+{
+  Type.push_back(tP.getType());
+  GSDType.push_back(tP.getGSDType());
+  CellIndex.push_back(tP.getCellIndex());
+  Age.push_back(tP.getAge());
+  OSLage.push_back(tP.getOSLage());
+  xLoc.push_back(tP.getxLoc());
+  yLoc.push_back(tP.getyLoc());
+  dLoc.push_back(tP.getdLoc());
+  effective_dLoc.push_back(tP.geteffective_dLoc());
+  zetaLoc.push_back(tP.get_zetaLoc());
+  Conc_10Be.push_back(tP.getConc_10Be());
+  Conc_26Al.push_back(tP.getConc_26Al());
+  Conc_36Cl.push_back(tP.getConc_36Cl());
+  Conc_14C.push_back(tP.getConc_14C());
+  Conc_21Ne.push_back(tP.getConc_21Ne());
+  Conc_3He.push_back(tP.getConc_3He());
+  Conc_f7Be.push_back(tP.getConc_f7Be());
+  Conc_f10Be.push_back(tP.getConc_f10Be());
+  Conc_f210Pb.push_back(tP.getConc_f210Pb());
+  Conc_f137Cs.push_back(tP.getConc_f137Cs());
+  Mass.push_back(tP.getMass());
+  StartingMass.push_back(tP.getStartingMass());
+  SurfaceArea.push_back(tP.getSurfaceArea());
+}
+
+LSDCRNParticle LSDCRNParticleEnsemble::get_particle(int i) const
+{
+  LSDCRNParticle tP(Type[i], GSDType[i], CellIndex[i], Age[i], OSLage[i],
+                    xLoc[i], yLoc[i], dLoc[i], effective_dLoc[i],
+                    zetaLoc[i], Conc_10Be[i], Conc_26Al[i],
+                    Conc_36Cl[i], Conc_14C[i],
+                    Conc_21Ne[i], Conc_3He[i],
+                    Conc_f7Be[i], Conc_f10Be[i],
+                    Conc_f210Pb[i], Conc_f137Cs[i],
+                    Mass[i], StartingMass[i], SurfaceArea[i]);
+  return tP;
+}
+
+vector<LSDCRNParticle> LSDCRNParticleEnsemble::get_particles() const
+{
+  vector<LSDCRNParticle> particles;
+  int n_particles = size();
+  particles.reserve(n_particles);
+  for(int i = 0; i<n_particles; i++)
+  {
+    particles.push_back(get_particle(i));
+  }
+  return particles;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// Ages and depths of all the particles
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCRNParticleEnsemble::incrementAge(double dt)
+{
+  int n_particles = size();
+  for(int i = 0; i<n_particles; i++)
+  {
+    if (Age[i] < 0)
+      Age[i] = dt;
+    else
+      Age[i] += dt;
+    if (OSLage[i] > 0)
+      OSLage[i] += dt;
+  }
+}
+
+void LSDCRNParticleEnsemble::update_depths(const vector<double>& new_dLoc,
+                                           const vector<double>& new_effective_dLoc)
+{
+  if(int(new_dLoc.size()) != size() || int(new_effective_dLoc.size()) != size())
+  {
+    cout << "LSDCRNParticleEnsemble::update_depths, the depth vectors need one" << endl
+         << "entry per particle. Exiting." << endl;
+    exit(EXIT_FAILURE);
+  }
+  dLoc = new_dLoc;
+  effective_dLoc = new_effective_dLoc;
+}
+
+void LSDCRNParticleEnsemble::erode_depths(double delta_d, double delta_ed)
+{
+  int n_particles = size();
+  for(int i = 0; i<n_particles; i++)
+  {
+    dLoc[i] -= delta_d;
+    effective_dLoc[i] -= delta_ed;
+  }
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This updates the concentrations of all the nuclides using all four production
+// pathways. The particle versions compute the whole production integral for
+// every particle, but only the depth attenuation exp(-ed/Gamma) depends on the
+// particle. Everything else is folded into one coefficient per pathway and
+// nuclide here, so each particle only needs four exponentials for all six
+// nuclides.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCRNParticleEnsemble::update_all_CRN(double dt, double erosion_rate,
+                                            LSDCRNParameters& CRNp)
+{
+  double lambdas[4] = {CRNp.lambda_10Be, CRNp.lambda_26Al,
+                       CRNp.lambda_36Cl, CRNp.lambda_14C};
+  double P0s[4] = {CRNp.P0_10Be, CRNp.P0_26Al, CRNp.P0_36Cl, CRNp.P0_14C};
+  double* Fs[4] = {CRNp.F_10Be, CRNp.F_26Al, CRNp.F_36Cl, CRNp.F_14C};
+
+  double coefficients[24];
+  double decay_factors[6];
+  for(int n = 0; n<4; n++)
+  {
+    decay_factors[n] = exp(-dt*lambdas[n]);
+
+    // the 10Be update in LSDCRNParticle does not decay the atoms
+    // produced during the timestep, the other nuclides do
+    double prefactor = CRNp.S_t*P0s[n];
+    if(n != 0)
+    {
+      prefactor *= decay_factors[n];
+    }
+    for(int j = 0; j<4; j++)
+    {
+      coefficients[n*4+j] = prefactor*Fs[n][j]*CRNp.Gamma[j]*
+                            (exp(dt*erosion_rate/CRNp.Gamma[j])-decay_factors[n])/
+                            (erosion_rate+CRNp.Gamma[j]*lambdas[n]);
+    }
+  }
+
+  // 21Ne and 3He are stable and only produced by neutrons. At zero erosion
+  // both use the limit of the production integral, as the particle updates do
+  double stable_term;
+  if (erosion_rate == 0)
+  {
+    stable_term = dt;
+  }
+  else
+  {
+    stable_term = CRNp.Gamma[0]*(exp(dt*erosion_rate/CRNp.Gamma[0]) - 1)/erosion_rate;
+  }
+  for(int j = 0; j<4; j++)
+  {
+    coefficients[16+j] = 0;
+    coefficients[20+j] = 0;
+  }
+  coefficients[16] = CRNp.S_t*CRNp.P0_21Ne*stable_term;
+  coefficients[20] = CRNp.S_t*CRNp.P0_3He*stable_term;
+  decay_factors[4] = 1;
+  decay_factors[5] = 1;
+
+  update_concentrations(coefficients, decay_factors, CRNp.Gamma, 4);
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This updates the concentrations of all the nuclides using only neutron
+// production, so one exponential per particle.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCRNParticleEnsemble::update_all_CRN_neutron_only(double dt, double erosion_rate,
+                                                         LSDCRNParameters& CRNp)
+{
+  double Gamma_neutron = CRNp.Gamma[0];
+  double lambdas[4] = {CRNp.lambda_10Be, CRNp.lambda_26Al,
+                       CRNp.lambda_36Cl, CRNp.lambda_14C};
+  double P0s[4] = {CRNp.P0_10Be, CRNp.P0_26Al, CRNp.P0_36Cl, CRNp.P0_14C};
+
+  double coefficients[24];
+  double decay_factors[6];
+  for(int j = 0; j<24; j++)
+  {
+    coefficients[j] = 0;
+  }
+  for(int n = 0; n<4; n++)
+  {
+    decay_factors[n] = exp(-dt*lambdas[n]);
+    coefficients[n*4] = CRNp.S_t*decay_factors[n]*P0s[n]*Gamma_neutron*
+                        (exp(dt*erosion_rate/Gamma_neutron)-decay_factors[n])/
+                        (erosion_rate+Gamma_neutron*lambdas[n]);
+  }
+
+  double stable_term;
+  if (erosion_rate == 0)
+  {
+    stable_term = dt;
+  }
+  else
+  {
+    stable_term = Gamma_neutron*(exp(dt*erosion_rate/Gamma_neutron) - 1)/erosion_rate;
+  }
+  coefficients[16] = CRNp.S_t*CRNp.P0_21Ne*stable_term;
+  coefficients[20] = CRNp.S_t*CRNp.P0_3He*stable_term;
+  decay_factors[4] = 1;
+  decay_factors[5] = 1;
+
+  update_concentrations(coefficients, decay_factors, CRNp.Gamma, 1);
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// The loop over the particles. The arrays are contiguous so the loop runs
+// over raw pointers and is split between threads.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCRNParticleEnsemble::update_concentrations(const double* coefficients,
+                                                   const double* decay_factors,
+                                                   const double* Gamma, int n_terms)
+{
+  int n_particles = size();
+  if(n_particles == 0)
+  {
+    return;
+  }
+
+  const double* ed = &effective_dLoc[0];
+  double* concs[6] = {&Conc_10Be[0], &Conc_26Al[0], &Conc_36Cl[0],
+                      &Conc_14C[0], &Conc_21Ne[0], &Conc_3He[0]};
+
+  #pragma omp parallel for schedule(static)
+  for(int i = 0; i<n_particles; i++)
+  {
+    double attenuation[4];
+    for(int j = 0; j<n_terms; j++)
+    {
+      attenuation[j] = exp(-ed[i]/Gamma[j]);
+    }
+    for(int n = 0; n<6; n++)
+    {
+      double produced = 0;
+      for(int j = 0; j<n_terms; j++)
+      {
+        produced += coefficients[n*4+j]*attenuation[j];
+      }
+      concs[n][i] = concs[n][i]*decay_factors[n] + produced;
+    }
+  }
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
 #endif
 
 
@@ -1325,6 +1325,169 @@ void update_10Be_SSfull_depth_integrated(double erosion_rate, LSDCRNParameters&
 
    
 
+};
+
+
+/// @brief A struct-of-arrays container for large ensembles of CRN particles
+/// @detail Each particle field is stored in its own contiguous vector so that
+///  the nuclide concentrations of every particle can be updated in a single
+///  pass per timestep. The time and erosion dependent terms of the production
+///  integrals are shared by all particles, so they are computed once per
+///  timestep and only the depth attenuation is evaluated for each particle.
+///  Particles can be moved in and out of the ensemble as LSDCRNParticle objects.
+class LSDCRNParticleEnsemble
+{
+  public:
+  /// @brief The default constructor, creates an empty ensemble
+  LSDCRNParticleEnsemble()                    { create(); }
+
+  /// @brief Creates an ensemble from a vector of particles
+  /// @param particles a vector of LSDCRNParticle objects
+  LSDCRNParticleEnsemble(vector<LSDCRNParticle>& particles)
+                                              { create(particles); }
+
+  /// @return the number of particles in the ensemble
+  int size() const                            { return int(Type.size()); }
+
+  /// @brief Reserves memory for a number of particles
+  /// @param n_particles the number of particles
+  void reserve(int n_particles);
+
+  /// @brief Removes all the particles from the ensemble
+  void clear();
+
+  /// @brief Adds a particle to the end of the ensemble
+  /// @param tP the particle to add
+  void add_particle(const LSDCRNParticle& tP);
+
+  /// @brief Gets a single particle from the ensemble
+  /// @param i the index of the particle
+  /// @return an LSDCRNParticle carrying all the data of particle i
+  LSDCRNParticle get_particle(int i) const;
+
+  /// @brief Gets all the particles in the ensemble
+  /// @return a vector of LSDCRNParticle objects
+  vector<LSDCRNParticle> get_particles() const;
+
+  /// @brief Increments the age of every particle. Follows the
+  ///  LSDParticle::incrementAge logic
+  /// @param dt the time increment
+  void incrementAge(double dt);
+
+  /// @brief Resets the depth and effective depth of every particle
+  /// @param new_dLoc the new depths, one per particle
+  /// @param new_effective_dLoc the new effective depths, one per particle
+  void update_depths(const vector<double>& new_dLoc,
+                     const vector<double>& new_effective_dLoc);
+
+  /// @brief Moves every particle closer to the surface by the same amount,
+  ///  as happens when the surface is lowered by steady erosion
+  /// @param delta_d the change in depth (positive values bring particles up)
+  /// @param delta_ed the change in effective depth
+  void erode_depths(double delta_d, double delta_ed);
+
+  /// @brief Updates the 10Be, 26Al, 36Cl, 14C, 21Ne and 3He concentrations
+  ///  of every particle. Gives the same result as calling
+  ///  LSDCRNParticle::update_all_CRN on each particle
+  /// @param dt the timestep in years
+  /// @param erosion_rate the erosion rate in g/cm^2/yr
+  /// @param CRNp an LSDCRNParameters object
+  void update_all_CRN(double dt, double erosion_rate, LSDCRNParameters& CRNp);
+
+  /// @brief Updates the concentrations of every particle using only neutron
+  ///  production. Gives the same result as calling
+  ///  LSDCRNParticle::update_all_CRN_neutron_only on each particle
+  /// @param dt the timestep in years
+  /// @param erosion_rate the erosion rate in g/cm^2/yr
+  /// @param CRNp an LSDCRNParameters object
+  void update_all_CRN_neutron_only(double dt, double erosion_rate,
+                                   LSDCRNParameters& CRNp);
+
+  /// @return the depths of the particles
+  vector<double>& get_dLoc()                  { return dLoc; }
+  /// @return the effective depths of the particles in g/cm^2
+  vector<double>& get_effective_dLoc()        { return effective_dLoc; }
+  /// @return the 10Be concentrations in atoms/g
+  vector<double>& get_Conc_10Be()             { return Conc_10Be; }
+  /// @return the 26Al concentrations in atoms/g
+  vector<double>& get_Conc_26Al()             { return Conc_26Al; }
+  /// @return the 36Cl concentrations in atoms/g
+  vector<double>& get_Conc_36Cl()             { return Conc_36Cl; }
+  /// @return the 14C concentrations in atoms/g
+  vector<double>& get_Conc_14C()              { return Conc_14C; }
+  /// @return the 21Ne concentrations in atoms/g
+  vector<double>& get_Conc_21Ne()             { return Conc_21Ne; }
+  /// @return the 3He concentrations in atoms/g
+  vector<double>& get_Conc_3He()              { return Conc_3He; }
+
+  protected:
+
+  /// @brief Updates the in situ nuclide concentrations of all particles
+  /// @detail Particle i gains sum_j coefficients[n*4+j]*exp(-ed_i/Gamma[j])
+  ///  atoms of nuclide n after its existing atoms are multiplied by
+  ///  decay_factors[n]. The nuclides are ordered 10Be, 26Al, 36Cl, 14C, 21Ne, 3He
+  /// @param coefficients the production coefficients, 4 per nuclide
+  /// @param decay_factors the fraction of atoms of each nuclide left after
+  ///  the timestep
+  /// @param Gamma the attenuation lengths in g/cm^2
+  /// @param n_terms the number of production pathways used (1 or 4)
+  void update_concentrations(const double* coefficients,
+                             const double* decay_factors,
+                             const double* Gamma, int n_terms);
+
+  /// The particle types
+  vector<int> Type;
+  /// The grain size distribution types
+  vector<int> GSDType;
+  /// The cell indices
+  vector<int> CellIndex;
+  /// The particle ages
+  vector<double> Age;
+  /// The OSL ages
+  vector<double> OSLage;
+  /// The x locations
+  vector<double> xLoc;
+  /// The y locations
+  vector<double> yLoc;
+  /// The depths
+  vector<double> dLoc;
+  /// The effective depths in g/cm^2
+  vector<double> effective_dLoc;
+  /// The elevations
+  vector<double> zetaLoc;
+  /// Concentrations of 10Be in atoms/g
+  vector<double> Conc_10Be;
+  /// Concentrations of 26Al in atoms/g
+  vector<double> Conc_26Al;
+  /// Concentrations of 36Cl in atoms/g
+  vector<double> Conc_36Cl;
+  /// Concentrations of 14C in atoms/g
+  vector<double> Conc_14C;
+  /// Concentrations of 21Ne in atoms/g
+  vector<double> Conc_21Ne;
+  /// Concentrations of 3He in atoms/g
+  vector<double> Conc_3He;
+  /// Concentrations of fallout 7Be
+  vector<double> Conc_f7Be;
+  /// Concentrations of fallout 10Be in atoms/g
+  vector<double> Conc_f10Be;
+  /// Concentrations of fallout 210Pb
+  vector<double> Conc_f210Pb;
+  /// Concentrations of fallout 137Cs
+  vector<double> Conc_f137Cs;
+  /// The particle masses in kg
+  vector<double> Mass;
+  /// The starting masses in kg
+  vector<double> StartingMass;
+  /// The surface areas in m^2
+  vector<double> SurfaceArea;
+
+  private:
+  /// @brief creates an empty ensemble
+  void create();
+
+  /// @brief creates an ensemble from a vector of particles
+  void create(vector<LSDCRNParticle>& particles);
 };
 
 
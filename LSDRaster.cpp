@@ -97,7 +97,9 @@
 #include <map>
 #include <math.h>
 #include <string.h>
+#ifdef _OPENMP
 #include <omp.h>
+#endif
 #include <ctime>
 #include <sys/stat.h>
 #include "TNT/tnt.h"
@@ -120,12 +122,39 @@ LSDRaster& LSDRaster::operator=(const LSDRaster& rhs)
   if (&rhs != this)
    {
     create(rhs.get_NRows(),rhs.get_NCols(),rhs.get_XMinimum(),rhs.get_YMinimum(),
-           rhs.get_DataResolution(),rhs.get_NoDataValue(),rhs.get_RasterData(),
+           rhs.get_DataResolution(),rhs.get_NoDataValue(),rhs.RasterData,
            rhs.get_GeoReferencingStrings());
    }
   return *this;
  }
 
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// Swaps the contents of two rasters. The data arrays are reference counted so
+// swapping them only exchanges pointers.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+void LSDRaster::swap(LSDRaster& Other)
+{
+  std::swap(NRows, Other.NRows);
+  std::swap(NCols, Other.NCols);
+  std::swap(XMinimum, Other.XMinimum);
+  std::swap(YMinimum, Other.YMinimum);
+  std::swap(DataResolution, Other.DataResolution);
+  std::swap(NoDataValue, Other.NoDataValue);
+  GeoReferencingStrings.swap(Other.GeoReferencingStrings);
+
+  Array2D<float> temp_data = RasterData;
+  RasterData = Other.RasterData;
+  Other.RasterData = temp_data;
+
+  Array2D<double> temp_data_dbl = RasterData_dbl;
+  RasterData_dbl = Other.RasterData_dbl;
+  Other.RasterData_dbl = temp_data_dbl;
+
+  Array2D<int> temp_data_int = RasterData_int;
+  RasterData_int = Other.RasterData_int;
+  Other.RasterData_int = temp_data_int;
+}
+
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 // the create function. This is default and throws an error
 // SMM 2012
@@ -1647,6 +1676,101 @@ void LSDRaster::get_lat_and_long_locations(int row, int col, double& lat,
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// Batch version of get_lat_and_long_locations. The georeferencing is parsed
+// once and the nodes are grouped by row so each row is sent to the converter
+// in one go. If the rows are not already in order they are bucketed by row
+// first.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDRaster::get_lat_and_long_locations(vector<int>& rows, vector<int>& cols,
+                  vector<double>& lats, vector<double>& longitudes,
+                  LSDCoordinateConverterLLandUTM& Converter)
+{
+  int n_nodes = int(rows.size());
+  lats.assign(n_nodes,double(NoDataValue));
+  longitudes.assign(n_nodes,double(NoDataValue));
+  if(n_nodes == 0)
+  {
+    return;
+  }
+
+  // get the UTM zone of the raster
+  int UTM_zone;
+  bool is_North;
+  get_UTM_information(UTM_zone, is_North);
+  if(UTM_zone == NoDataValue)
+  {
+    return;
+  }
+
+  // set the default ellipsoid to WGS84
+  int eId = 22;
+
+  // see if the nodes are already in row order. If not, bucket them by row
+  vector<int> order(n_nodes);
+  bool is_sorted = true;
+  for(int i = 1; i<n_nodes; i++)
+  {
+    if(rows[i] < rows[i-1])
+    {
+      is_sorted = false;
+      break;
+    }
+  }
+  if(is_sorted)
+  {
+    for(int i = 0; i<n_nodes; i++)
+    {
+      order[i] = i;
+    }
+  }
+  else
+  {
+    vector<int> row_start(NRows+1,0);
+    for(int i = 0; i<n_nodes; i++)
+    {
+      row_start[rows[i]+1]++;
+    }
+    for(int row = 0; row<NRows; row++)
+    {
+      row_start[row+1] += row_start[row];
+    }
+    for(int i = 0; i<n_nodes; i++)
+    {
+      order[row_start[rows[i]]++] = i;
+    }
+  }
+
+  // now convert one row at a time
+  double x_loc = 0;
+  double y_loc = 0;
+  vector<double> row_eastings;
+  vector<double> row_lats;
+  vector<double> row_longs;
+  int start = 0;
+  while(start < n_nodes)
+  {
+    int this_row = rows[order[start]];
+    int end = start;
+    row_eastings.clear();
+    while(end < n_nodes && rows[order[end]] == this_row)
+    {
+      get_x_and_y_locations(this_row, cols[order[end]], x_loc, y_loc);
+      row_eastings.push_back(x_loc);
+      end++;
+    }
+
+    Converter.UTMtoLL(eId, y_loc, row_eastings, UTM_zone, is_North, row_lats, row_longs);
+    for(int i = start; i<end; i++)
+    {
+      lats[order[i]] = row_lats[i-start];
+      longitudes[order[i]] = row_longs[i-start];
+    }
+    start = end;
+  }
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 // Gets the x and y vectors (used for interpolation)
@@ -2036,12 +2160,12 @@ LSDRaster LSDRaster::create_raster_nodata()
 // Written by JAJ 6-6-2014
 // Inserted into trunk by SMM 9-6-2014
 // Modified to better deal with nodata SMM 15/12/2016
+// Uses calculate_window_extrema
 //
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 LSDRaster LSDRaster::calculate_relief(float kernelWidth, int kernelType)
 {
   int kr = ((kernelWidth/DataResolution))/2-1;
-  float max, min;
   Array2D <float> reliefMap(NRows, NCols, 0.0);
   if (kr < 1)
   {
@@ -2049,50 +2173,39 @@ LSDRaster LSDRaster::calculate_relief(float kernelWidth, int kernelType)
     kr = 1;
   }
 
+  // the window always includes the central cell
+  int kw = 2*kr+1;
+  Array2D<int> mask(kw,kw,0);
+  for (int sub_i = -kr; sub_i<=kr; ++sub_i)
+  {
+    for (int sub_j = -kr; sub_j<=kr; ++sub_j)
+    {
+      if (kernelType == 1)  //circular
+      {
+        if ((pow(sub_i,2) + pow(sub_j,2))*DataResolution > kernelWidth/2
+            || (sub_i == 0 && sub_j == 0))
+        {
+          mask[sub_i+kr][sub_j+kr] = 1;
+        }
+      }
+      else
+      {
+        mask[sub_i+kr][sub_j+kr] = 1;
+      }
+    }
+  }
+
+  // windows are clipped at the edge of the map and skip nodata
+  Array2D<float> WindowMin, WindowMax;
+  calculate_window_extrema(mask, WindowMin, WindowMax);
+
   for (int i=0; i<NRows; ++i)
   {
     for (int j=0; j<NCols; ++j)
     {
       if (RasterData[i][j] != NoDataValue)
       {
-        max = RasterData[i][j];
-        min = RasterData[i][j];
-        for (int sub_i = i-kr; sub_i<=i+kr; ++sub_i)
-        {
-          // don't exend past the end of map
-          if (sub_i>=0 && sub_i<NRows)
-          {
-            for (int sub_j = j-kr; sub_j<=j+kr; ++sub_j)
-            {
-              // don't extend past end of map
-              if (sub_j>=0 && sub_j<NCols)
-              {
-                // make sure the data exists
-                if (RasterData[sub_i][sub_j] != NoDataValue)
-                {
-                  if (kernelType == 1)  //circular
-                  {
-                    if ((pow(sub_i-i,2) + pow(sub_j-j,2))*DataResolution > kernelWidth/2)
-                    {
-                      if (RasterData[sub_i][sub_j] > max)
-                        max = RasterData[sub_i][sub_j];
-                      if (RasterData[sub_i][sub_j] < min)
-                        min = RasterData[sub_i][sub_j];
-                    }
-                  }
-                  else
-                  {
-                    if (RasterData[sub_i][sub_j] > max)
-                      max = RasterData[sub_i][sub_j];
-                    if (RasterData[sub_i][sub_j] < min)
-                      min = RasterData[sub_i][sub_j];
-                  }
-                }
-              }
-            }
-          }
-        }
-        reliefMap[i][j] = max-min;
+        reliefMap[i][j] = WindowMax[i][j]-WindowMin[i][j];
       }
       else
       {
@@ -2268,28 +2381,8 @@ LSDRaster LSDRaster::MapAlgebra_multiply(LSDRaster& M_raster)
   // first check if rasters are the same size
   if( does_raster_have_same_dimensions(M_raster) )
   {
-    //create an array
-    Array2D<float> New_array(NRows,NCols,NoDataValue);
-
-    for(int row = 0; row< NRows; row++)
-    {
-      for(int col = 0; col<NCols; col++)
-      {
-        if (RasterData[row][col] != NoDataValue)
-        {
-          float this_element = M_raster.get_data_element(row,col);
-          if(this_element != NoDataValue)
-          {
-            New_array[row][col] = RasterData[row][col]*this_element;
-          }
-
-        }
-      }
-    }
-    //create LSDRaster object
-    LSDRaster NewRaster(NRows, NCols, XMinimum, YMinimum, DataResolution,
-                               NoDataValue, New_array, GeoReferencingStrings);
-    return NewRaster;
+    LSDRasterExpression Expression(*this);
+    return Expression.multiply(M_raster).evaluate();
   }
   else
   {
@@ -2306,27 +2399,8 @@ LSDRaster LSDRaster::MapAlgebra_divide(LSDRaster& M_raster)
   // first check if rasters are the same size
   if( does_raster_have_same_dimensions(M_raster) )
   {
-    //create an array
-    Array2D<float> New_array(NRows,NCols,NoDataValue);
-
-    for(int row = 0; row< NRows; row++)
-    {
-      for(int col = 0; col<NCols; col++)
-      {
-        if (RasterData[row][col] != NoDataValue)
-        {
-          float this_element = M_raster.get_data_element(row,col);
-          if(this_element != NoDataValue && this_element != 0)
-          {
-            New_array[row][col] = RasterData[row][col]/this_element;
-          }
-        }
-      }
-    }
-    //create LSDRaster object
-    LSDRaster NewRaster(NRows, NCols, XMinimum, YMinimum, DataResolution,
-                               NoDataValue, New_array, GeoReferencingStrings);
-    return NewRaster;
+    LSDRasterExpression Expression(*this);
+    return Expression.divide(M_raster).evaluate();
   }
   else
   {
@@ -2343,27 +2417,8 @@ LSDRaster LSDRaster::MapAlgebra_add(LSDRaster& M_raster)
   // first check if rasters are the same size
   if( does_raster_have_same_dimensions(M_raster) )
   {
-    //create an array
-    Array2D<float> New_array(NRows,NCols,NoDataValue);
-
-    for(int row = 0; row< NRows; row++)
-    {
-      for(int col = 0; col<NCols; col++)
-      {
-        if (RasterData[row][col] != NoDataValue)
-        {
-          float this_element = M_raster.get_data_element(row,col);
-          if(this_element != NoDataValue)
-          {
-            New_array[row][col] = RasterData[row][col]+this_element;
-          }
-        }
-      }
-    }
-    //create LSDRaster object
-    LSDRaster NewRaster(NRows, NCols, XMinimum, YMinimum, DataResolution,
-                               NoDataValue, New_array, GeoReferencingStrings);
-    return NewRaster;
+    LSDRasterExpression Expression(*this);
+    return Expression.add(M_raster).evaluate();
   }
   else
   {
@@ -2379,27 +2434,8 @@ LSDRaster LSDRaster::MapAlgebra_subtract(LSDRaster& M_raster)
   // first check if rasters are the same size
   if( does_raster_have_same_dimensions(M_raster) )
   {
-    //create an array
-    Array2D<float> New_array(NRows,NCols,NoDataValue);
-
-    for(int row = 0; row< NRows; row++)
-    {
-      for(int col = 0; col<NCols; col++)
-      {
-        if (RasterData[row][col] != NoDataValue)
-        {
-          float this_element = M_raster.get_data_element(row,col);
-          if(this_element != NoDataValue)
-          {
-            New_array[row][col] = RasterData[row][col]-this_element;
-          }
-        }
-      }
-    }
-    //create LSDRaster object
-    LSDRaster NewRaster(NRows, NCols, XMinimum, YMinimum, DataResolution,
-                               NoDataValue, New_array, GeoReferencingStrings);
-    return NewRaster;
+    LSDRasterExpression Expression(*this);
+    return Expression.subtract(M_raster).evaluate();
   }
   else
   {
@@ -2764,55 +2800,201 @@ LSDRaster LSDRaster::hillshade(float altitude, float azimuth, float z_factor)
     cout << "Hillshading with altitude: " << altitude
     << ", azimuth: " << azimuth << " and z-factor: " << z_factor << endl;
 
-    //create output array
-    Array2D<float> hillshade(NRows,NCols,NoDataValue);
+    // the hillshade is computed by the fused terrain derivative kernel
+    vector<int> raster_selection(4,0);
+    raster_selection[3] = 1;
+    vector<float> hs_altitudes(1,altitude);
+    vector<float> hs_azimuths(1,azimuth);
+    vector<LSDRaster> derivatives = calculate_terrain_derivatives(raster_selection,
+                                           hs_altitudes, hs_azimuths, z_factor);
+    return derivatives[3];
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 
-    //convert zenith and azimuth into radians for calculation
-    float zenith_rad = (90 - altitude) * M_PI / 180.0;
-    float azimuth_math = 360-azimuth + 90;
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// Fused 3x3 terrain derivatives
+//
+// This computes slope, aspect, curvature and any number of hillshades in one
+// pass over the DEM. The first derivatives use the Horn (1981) 3x3 kernel.
+// The curvature is the Laplacian of the Zevenbergen and
+// Thorne (1987) surface, 2(D+E), which matches the 2a+2b of the polyfit
+// curvature.
+//
+// The hillshade does not need atan, atan2 or cos in the inner loop. With
+// slope angle s and aspect A, sin(s)cos(Az-A) reduces to
+// z_factor*(dzdy*sin(Az) - dzdx*cos(Az))*cos(s), and cos(s) = 1/sqrt(1+g^2)
+// where g is the scaled gradient. So each illumination costs one multiply-add
+// per cell and all illuminations share a single sqrt.
+//
+// raster_selection:
+//        0 -> Slope (gradient)
+//        1 -> Aspect (degrees clockwise from north)
+//        2 -> Curvature
+//        3 -> Hillshade (one per altitude/azimuth pair, appended from index 3)
+// Products that are not selected are returned as a 1x1 VOID raster.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+vector<LSDRaster> LSDRaster::calculate_terrain_derivatives(vector<int> raster_selection,
+                                                  vector<float> hs_altitudes,
+                                                  vector<float> hs_azimuths,
+                                                  float z_factor)
+{
+  Array2D<float> void_array(1,1,NoDataValue);
+  LSDRaster VOID(1,1,NoDataValue,NoDataValue,NoDataValue,NoDataValue,void_array,GeoReferencingStrings);
+
+  if (hs_altitudes.size() != hs_azimuths.size())
+  {
+    cout << "LSDRaster::calculate_terrain_derivatives: you need the same number of" << endl
+         << "hillshade altitudes and azimuths." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // missing entries in the selection are treated as not wanted
+  while (raster_selection.size() < 4)
+  {
+    raster_selection.push_back(0);
+  }
+  bool do_slope = (raster_selection[0] == 1);
+  bool do_aspect = (raster_selection[1] == 1);
+  bool do_curvature = (raster_selection[2] == 1);
+  bool do_hillshade = (raster_selection[3] == 1);
+  int N_illuminations = int(hs_altitudes.size());
+  int N_hillshades = (do_hillshade) ? N_illuminations : 0;
+
+  // the hillshade of each illumination is (hs_a + hs_b*dzdy + hs_c*dzdx)*cos(slope)
+  vector<float> hs_a(N_hillshades);
+  vector<float> hs_b(N_hillshades);
+  vector<float> hs_c(N_hillshades);
+  for (int h = 0; h < N_hillshades; ++h)
+  {
+    float zenith_rad = (90 - hs_altitudes[h]) * M_PI / 180.0;
+    float azimuth_math = 360-hs_azimuths[h] + 90;
     if (azimuth_math >= 360.0) azimuth_math = azimuth_math - 360;
     float azimuth_rad = azimuth_math * M_PI /180.0;
 
-    //calculate hillshade value for every non nodata value in the input raster
-    for (int i = 1; i < NRows-1; ++i){
-        for (int j = 1; j < NCols-1; ++j){
-            float slope_rad = 0;
-            float aspect_rad = 0;
-            float dzdx = 0;
-            float dzdy = 0;
+    hs_a[h] = 255.0*cos(zenith_rad);
+    hs_b[h] = 255.0*sin(zenith_rad)*z_factor*sin(azimuth_rad);
+    hs_c[h] = -255.0*sin(zenith_rad)*z_factor*cos(azimuth_rad);
+  }
 
-            if (RasterData[i][j] != NoDataValue){
-                dzdx = ((RasterData[i][j+1] + 2*RasterData[i+1][j] + RasterData[i+1][j+1]) -
-                       (RasterData[i-1][j-1] + 2*RasterData[i-1][j] + RasterData[i-1][j+1]))
-                        / (8 * DataResolution);
-                dzdy = ((RasterData[i-1][j+1] + 2*RasterData[i][j+1] + RasterData[i+1][j+1]) -
-                       (RasterData[i-1][j-1] + 2*RasterData[i][j-1] + RasterData[i+1][j-1]))
-                       / (8 * DataResolution);
+  // only allocate full size arrays for the products we want
+  Array2D<float> slope_data((do_slope) ? NRows : 1, (do_slope) ? NCols : 1, NoDataValue);
+  Array2D<float> aspect_data((do_aspect) ? NRows : 1, (do_aspect) ? NCols : 1, NoDataValue);
+  Array2D<float> curvature_data((do_curvature) ? NRows : 1, (do_curvature) ? NCols : 1, NoDataValue);
+  vector< Array2D<float> > hillshade_data;
+  for (int h = 0; h < N_hillshades; ++h)
+  {
+    Array2D<float> this_hillshade(NRows,NCols,NoDataValue);
+    hillshade_data.push_back(this_hillshade);
+  }
 
-                slope_rad = atan(z_factor * sqrt((dzdx*dzdx) + (dzdy*dzdy)));
+  float grad_denom = 8*DataResolution;
+  float curv_denom = DataResolution*DataResolution;
+  float rad_to_deg = 180.0/M_PI;
 
-                if (dzdx != 0){
-                    aspect_rad = atan2(dzdy, (dzdx*-1));
-                    if (aspect_rad < 0) aspect_rad = 2*M_PI + aspect_rad;
-                }
-                else{
-                    if (dzdy > 0) aspect_rad = M_PI/2;
-                    else if (dzdy < 0) aspect_rad = 2 * M_PI - M_PI/2;
-                    else aspect_rad = aspect_rad;
-                }
-                hillshade[i][j] = 255.0 * ((cos(zenith_rad) * cos(slope_rad)) +
-                                  (sin(zenith_rad) * sin(slope_rad) *
-                                  cos(azimuth_rad - aspect_rad)));
+  #pragma omp parallel for schedule(static)
+  for (int i = 1; i < NRows-1; ++i)
+  {
+    // row pointers so the stencil does not go through the 2D indexing
+    const float* up = RasterData[i-1];
+    const float* mid = RasterData[i];
+    const float* down = RasterData[i+1];
 
-                if (hillshade[i][j] < 0) hillshade[i][j] = 0;
-            }
+    float dzdx, dzdy, gradient, cos_slope, aspect, shade;
+    for (int j = 1; j < NCols-1; ++j)
+    {
+      if (mid[j] == NoDataValue) continue;
+
+      dzdx = ((down[j-1] + 2*down[j] + down[j+1]) -
+              (up[j-1] + 2*up[j] + up[j+1])) / grad_denom;
+      dzdy = ((up[j+1] + 2*mid[j+1] + down[j+1]) -
+              (up[j-1] + 2*mid[j-1] + down[j-1])) / grad_denom;
+      gradient = z_factor*sqrt(dzdx*dzdx + dzdy*dzdy);
+
+      if (do_slope)
+      {
+        slope_data[i][j] = gradient;
+      }
+
+      if (do_aspect)
+      {
+        // flat cells have no aspect
+        if (dzdx != 0 || dzdy != 0)
+        {
+          // In this stencil dzdx is the gradient toward the south and dzdy
+          // the gradient toward the east, so the downslope bearing is
+          // atan2(-dzdy, dzdx)
+          aspect = rad_to_deg*atan2(-dzdy, dzdx);
+          if (aspect < 0) aspect += 360.0;
+          aspect_data[i][j] = aspect;
+        }
+      }
+
+      if (do_curvature)
+      {
+        curvature_data[i][j] = z_factor*(mid[j-1] + mid[j+1] + up[j] + down[j] - 4*mid[j])
+                                / curv_denom;
+      }
+
+      if (N_hillshades > 0)
+      {
+        cos_slope = 1.0/sqrt(1.0+gradient*gradient);
+        for (int h = 0; h < N_hillshades; ++h)
+        {
+          shade = (hs_a[h] + hs_b[h]*dzdy + hs_c[h]*dzdx)*cos_slope;
+          hillshade_data[h][i][j] = (shade < 0) ? 0 : shade;
         }
+      }
     }
-    //create LSDRaster hillshade object
-    LSDRaster hillshade_raster(NRows, NCols, XMinimum, YMinimum, DataResolution,
-                               NoDataValue, hillshade,GeoReferencingStrings);
+  }
+
+  // package the products
+  vector<LSDRaster> derivatives;
+  if (do_slope)
+  {
+    LSDRaster Slope(NRows,NCols,XMinimum,YMinimum,DataResolution,NoDataValue,
+                    slope_data,GeoReferencingStrings);
+    derivatives.push_back(Slope);
+  }
+  else
+  {
+    derivatives.push_back(VOID);
+  }
+  if (do_aspect)
+  {
+    LSDRaster Aspect(NRows,NCols,XMinimum,YMinimum,DataResolution,NoDataValue,
+                     aspect_data,GeoReferencingStrings);
+    derivatives.push_back(Aspect);
+  }
+  else
+  {
+    derivatives.push_back(VOID);
+  }
+  if (do_curvature)
+  {
+    LSDRaster Curvature(NRows,NCols,XMinimum,YMinimum,DataResolution,NoDataValue,
+                        curvature_data,GeoReferencingStrings);
+    derivatives.push_back(Curvature);
+  }
+  else
+  {
+    derivatives.push_back(VOID);
+  }
+  for (int h = 0; h < N_illuminations; ++h)
+  {
+    if (do_hillshade)
+    {
+      LSDRaster Hillshade(NRows,NCols,XMinimum,YMinimum,DataResolution,NoDataValue,
+                          hillshade_data[h],GeoReferencingStrings);
+      derivatives.push_back(Hillshade);
+    }
+    else
+    {
+      derivatives.push_back(VOID);
+    }
+  }
 
-    return hillshade_raster;
+  return derivatives;
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 
@@ -2896,53 +3078,281 @@ Array2D<float> LSDRaster::Shadow(int theta, int phi)
 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-// This function generates a topographic sheilding raster using the algorithm outlined in
-// Codilean (2006), creating a raster of values between 0 and 1 which can be used as a
-// scaling factor in Cosmo analysis.
-//
-// Goes further than the original algorithm allowing a theoretical theta, phi pair of
-// 1,1 to be supplied and although this will increase the computatin time significantly,
-// it is much faster than the original Avenue and VBScript implementations.
-// Default parameters are 5 and 5 if no arguments supplied
+// This gets the slope of the horizon seen from each cell looking toward Azimuth
+// (degrees clockwise from north).
 //
-// Takes 2 ints, representing the Elevation/Zenith Angle, and Azimuth Angle step sizes
-// required. Codilean (2006) used 5,5 as the standard values, but in reality values of
-//10,15 are often preferred to save processing time. **steps must be a factor of 360**
+// The DEM is cut into parallel lines of cells running away from the azimuth.
+// Every cell lies on exactly one line. The cells are visited along each line
+// starting at the end nearest the source, and the upper convex hull of
+// (distance toward source, elevation) for the cells already passed is kept on a
+// stack. When a new cell is pushed, the vertex left below it on the stack is
+// the one with the steepest line of sight, so that vertex sets the horizon.
+// Each cell is pushed and popped at most once, so every line takes linear time.
 //
-// Outputs an LSDRaster
+// Distance toward the source uses the same projection as the transformed
+// coordinates in Shadows(). Edge cells neither cast nor receive shadows,
+// and a nodata cell resets the hull, as in Shadows().
 //
-// SWDG, 11/4/13
-// Updated and tested MDH, 24/2/2015
-//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-
-LSDRaster LSDRaster::TopographicShielding()
+// Returns the tangent of the horizon elevation angle, 0 if nothing rises
+// above the horizontal, and NoDataValue in nodata cells.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+Array2D<float> LSDRaster::HorizonSlopes(float Azimuth)
 {
-  //For default parameters
-  printf("LSDRaster::%s: No input argumments provided, defaulting to Azimuth/Zenith stepsize of 5 degrees\n",__func__);
-  int AzimuthStep = 5;
-  int PhiStep = 5;
-  return this->TopographicShielding(AzimuthStep,PhiStep);
-}
+  Array2D<float> Horizon(NRows,NCols,NoDataValue);
 
-LSDRaster LSDRaster::TopographicShielding(int AzimuthStep, int ZenithStep)
-{
-  //Function print to screen
-  printf("\nLSDRaster::%s: AzimuthStep: %d, ZenithStep: %d\n",__func__,AzimuthStep,ZenithStep);
+  // unit vector pointing toward the source in map coordinates
+  double AzimuthRadians = Azimuth*(M_PI/180.);
+  double SourceX = sin(AzimuthRadians);
+  double SourceY = cos(AzimuthRadians);
 
-  //declare constants
-  float m = 2.3;  //shielding constant
-  //float I0 = 1.;  //Max intensity (=1 for shielding factors)
-  //float MaxFactor = 0;  //Maximum Production Factor
-  //float f90 = 90.0;
+  // step away from the source in row and column space (rows increase to the south)
+  double StepRow = SourceY;
+  double StepCol = -SourceX;
 
-  //Max Production Factor following Codilean Eq2
-  //MaxFactor = (2.*M_PI*I0)/((m+1.));
-  //Array2D<float> MaxFactorArray(NRows,NCols,MaxFactor);
-  float MaxWeight = 0;
+  // Lines are indexed along the major axis (the one the sweep moves along by one
+  // cell each step) and offset along the minor axis
+  bool RowMajor = (fabs(StepRow) >= fabs(StepCol));
+  int NMajor = (RowMajor) ? NRows : NCols;
+  int NMinor = (RowMajor) ? NCols : NRows;
+  double MajorStep = (RowMajor) ? StepRow : StepCol;
+  double MinorStep = (RowMajor) ? StepCol : StepRow;
+  int MajorSign = (MajorStep >= 0) ? 1 : -1;
+  int MajorStart = (MajorSign == 1) ? 0 : NMajor-1;
+  double MinorPerMajor = MinorStep/fabs(MajorStep);
 
-  //Calculate first shadow with theta value of 90 and scale it
-  Array2D<float> Empty(NRows,NCols,0.);
+  // the range of minor offsets needed for the lines to cover the grid
+  int EndShift = int(floor((NMajor-1)*MinorPerMajor+0.5));
+  int MinShift = (EndShift < 0) ? EndShift : 0;
+  int MaxShift = (EndShift > 0) ? EndShift : 0;
+
+  // the hull of cells already passed on this line
+  vector<double> HullS;
+  vector<double> HullZ;
+  HullS.reserve(NMajor);
+  HullZ.reserve(NMajor);
+
+  int i,j,major,minor,top;
+  double s,z,slope_top,slope_next;
+  for (int offset = -MaxShift; offset < NMinor-MinShift; ++offset)
+  {
+    HullS.clear();
+    HullZ.clear();
+    for (int t = 0; t < NMajor; ++t)
+    {
+      major = MajorStart + MajorSign*t;
+      minor = offset + int(floor(t*MinorPerMajor+0.5));
+      if (minor < 0 || minor >= NMinor) continue;
+      if (RowMajor)
+      {
+        i = major;
+        j = minor;
+      }
+      else
+      {
+        i = minor;
+        j = major;
+      }
+
+      // nodata breaks the line of sight
+      if (RasterData[i][j] == NoDataValue)
+      {
+        HullS.clear();
+        HullZ.clear();
+        continue;
+      }
+
+      // edge cells are not shadowed and do not cast shadows
+      if (i == 0 || i == NRows-1 || j == 0 || j == NCols-1)
+      {
+        Horizon[i][j] = 0;
+        continue;
+      }
+
+      s = j*DataResolution*SourceX + (NRows-i)*DataResolution*SourceY;
+      z = RasterData[i][j];
+
+      // drop hull vertices that are hidden behind the one below them
+      top = int(HullS.size())-1;
+      while (top >= 1)
+      {
+        slope_top = (HullZ[top]-z)/(HullS[top]-s);
+        slope_next = (HullZ[top-1]-z)/(HullS[top-1]-s);
+        if (slope_top > slope_next) break;
+        HullS.pop_back();
+        HullZ.pop_back();
+        --top;
+      }
+
+      if (top >= 0)
+      {
+        slope_top = (HullZ[top]-z)/(HullS[top]-s);
+        Horizon[i][j] = (slope_top > 0) ? float(slope_top) : 0;
+      }
+      else
+      {
+        Horizon[i][j] = 0;
+      }
+
+      HullS.push_back(s);
+      HullZ.push_back(z);
+    }
+  }
+
+  return Horizon;
+}
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// This function generates a topographic sheilding raster following Codilean (2006),
+// creating a raster of values between 0 and 1 which can be used as a scaling
+// factor in Cosmo analysis.
+//
+// Instead of casting a shadow for every azimuth and zenith pair, one horizon
+// profile is computed for each azimuth with HorizonSlopes(). The flux is weighted
+// by cos(theta)sin^m(theta) in the elevation angle theta (Dunne et al., 1999).
+// The weight below the horizon integrates to sin^(m+1)(horizon)/(m+1) and the
+// full sky gives 1/(m+1), so the shielding factor is
+//   S = 1 - (1/N_azimuths) * sum over azimuths of sin^(m+1)(horizon)
+// The ZenithStep argument is no longer used.
+//
+// Azimuths are independent, so they are run in parallel when compiled with
+// OpenMP. Each thread accumulates into its own array.
+//
+// Default parameters are 5 and 5 if no arguments supplied
+//
+// SWDG, 11/4/13
+// Updated and tested MDH, 24/2/2015
+// Horizon sweep
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+LSDRaster LSDRaster::TopographicShielding()
+{
+  //For default parameters
+  printf("LSDRaster::%s: No input argumments provided, defaulting to Azimuth/Zenith stepsize of 5 degrees\n",__func__);
+  int AzimuthStep = 5;
+  int PhiStep = 5;
+  return this->TopographicShielding(AzimuthStep,PhiStep);
+}
+
+LSDRaster LSDRaster::TopographicShielding(int AzimuthStep, int ZenithStep)
+{
+  //Function print to screen
+  printf("\nLSDRaster::%s: AzimuthStep: %d\n",__func__,AzimuthStep);
+
+  if (AzimuthStep <= 0)
+  {
+    printf("LSDRaster:FATAL ERROR: AzimuthStep must be positive. In %s at line %d\n",__func__,__LINE__);
+    exit(EXIT_FAILURE);
+  }
+
+  //declare constants
+  float m = 2.3;  //shielding constant
+  int NAzimuths = 360/AzimuthStep;
+
+  // sum over the azimuths of sin^(m+1) of the horizon angle
+  Array2D<float> ShieldedSum(NRows,NCols,0.0);
+
+  // The horizons are swept in batches, one azimuth per thread, and then 
+  // added in azimuth order so the sum does not depend on the number of threads
+  int n_batch = 1;
+  #ifdef _OPENMP
+  n_batch = omp_get_max_threads();
+  #endif
+  vector< Array2D<float> > Horizons(n_batch);
+  for (int first = 0; first < NAzimuths; first += n_batch)
+  {
+    int n_this_batch = min(n_batch, NAzimuths-first);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int b = 0; b < n_this_batch; ++b)
+    {
+      Horizons[b] = HorizonSlopes(float((first+b+1)*AzimuthStep));
+    }
+
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < NRows; ++i)
+    {
+      float HorizonSlope, SinHorizon;
+      for (int b = 0; b < n_this_batch; ++b)
+      {
+        for (int j = 0; j < NCols; ++j)
+        {
+          HorizonSlope = Horizons[b][i][j];
+          if (HorizonSlope > 0 && HorizonSlope != NoDataValue)
+          {
+            SinHorizon = HorizonSlope/sqrt(1+HorizonSlope*HorizonSlope);
+            ShieldedSum[i][j] += pow(SinHorizon,m+1);
+          }
+        }
+      }
+    }
+
+    // release the horizons here, so the reference count of each one is only
+    // touched by the thread that made it
+    for (int b = 0; b < n_this_batch; ++b)
+    {
+      Horizons[b] = Array2D<float>();
+    }
+  }
+
+  //make sure there is no shielding value for NDV cells
+  Array2D<float> FinalShieldingFactor(NRows,NCols,NoDataValue);
+  for (int i = 0; i < NRows; ++i){
+    for (int j = 0; j < NCols; ++j){
+      if (RasterData[i][j] != NoDataValue){
+        FinalShieldingFactor[i][j] = 1-ShieldedSum[i][j]/NAzimuths;
+      }
+    }
+  }
+
+  //write LSDRaster
+  LSDRaster Shielding(NRows, NCols, XMinimum, YMinimum, DataResolution, NoDataValue,
+                      FinalShieldingFactor,GeoReferencingStrings);
+  return Shielding;
+}
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// This function generates a topographic sheilding raster using the algorithm outlined in
+// Codilean (2006), creating a raster of values between 0 and 1 which can be used as a
+// scaling factor in Cosmo analysis.
+//
+// Goes further than the original algorithm allowing a theoretical theta, phi pair of
+// 1,1 to be supplied and although this will increase the computatin time significantly,
+// it is much faster than the original Avenue and VBScript implementations.
+// This is the original version, which casts a shadow raster for every
+// (azimuth, zenith) pair. It is kept as a reference for TopographicShielding.
+//
+// Takes 2 ints, representing the Elevation/Zenith Angle, and Azimuth Angle step sizes
+// required. Codilean (2006) used 5,5 as the standard values, but in reality values of
+//10,15 are often preferred to save processing time. **steps must be a factor of 360**
+//
+// Outputs an LSDRaster
+//
+// SWDG, 11/4/13
+// Updated and tested MDH, 24/2/2015
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+LSDRaster LSDRaster::TopographicShieldingByShadowCasting(int AzimuthStep, int ZenithStep)
+{
+  //Function print to screen
+  printf("\nLSDRaster::%s: AzimuthStep: %d, ZenithStep: %d\n",__func__,AzimuthStep,ZenithStep);
+
+  //declare constants
+  float m = 2.3;  //shielding constant
+  //float I0 = 1.;  //Max intensity (=1 for shielding factors)
+  //float MaxFactor = 0;  //Maximum Production Factor
+  //float f90 = 90.0;
+
+  //Max Production Factor following Codilean Eq2
+  //MaxFactor = (2.*M_PI*I0)/((m+1.));
+  //Array2D<float> MaxFactorArray(NRows,NCols,MaxFactor);
+  float MaxWeight = 0;
+
+  //Calculate first shadow with theta value of 90 and scale it
+  Array2D<float> Empty(NRows,NCols,0.);
   Array2D<float> FinalArray = Empty; // = Shadow(0,90) * Scaler90;
 
   //loop through all the theta, phi pairs and increment the FinalArray with the scaled values
@@ -3995,6 +4405,8 @@ vector<LSDRaster> LSDRaster::calculate_polyfit_roughness_metrics(float window_ra
 //
 // Updated 15/07/2013 to use a circular mask for surface fitting. DTM
 // Updated 24/07/2013 to check window_radius size and correct values below data resolution. SWDG
+// Updated to build the right hand side from row prefix sums of the
+// elevation moments, so the cost per cell is O(kr) and not O(kr^2).
 //
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 void LSDRaster::calculate_polyfit_coefficient_matrices(float window_radius,
@@ -4016,7 +4428,6 @@ void LSDRaster::calculate_polyfit_coefficient_matrices(float window_radius,
   int kr = int(ceil(window_radius/DataResolution));           // Set radius of kernel
   int kw=2*kr+1;                                // width of kernel
 
-  Array2D<float> data_kernel(kw,kw,NoDataValue);
   Array2D<float> x_kernel(kw,kw,NoDataValue);
   Array2D<float> y_kernel(kw,kw,NoDataValue);
   Array2D<int> mask(kw,kw,0);
@@ -4032,7 +4443,7 @@ void LSDRaster::calculate_polyfit_coefficient_matrices(float window_radius,
 
   // scale kernel window to resolution of DEM, and translate coordinates to be
   // centred on cell of interest (the centre cell)
-  float x,y,zeta,radial_dist;
+  float x,y,radial_dist;
   for(int i=0;i<kw;++i)
   {
       for(int j=0;j<kw;++j)
@@ -4061,7 +4472,7 @@ void LSDRaster::calculate_polyfit_coefficient_matrices(float window_radius,
   // to compute this once, since the window size does not change.
   // For 2nd order surface fitting, there are 6 coefficients, therefore A is a
   // 6x6 matrix
-  Array2D<float> A(6,6);
+  Array2D<float> A(6,6,0.0);
   for (int i=0; i<kw; ++i)
   {
     for (int j=0; j<kw; ++j)
@@ -4114,17 +4525,76 @@ void LSDRaster::calculate_polyfit_coefficient_matrices(float window_radius,
 
   // Move window over DEM, fitting 2nd order polynomial surface to the
   // elevations within the window.
+  //
+  // The right hand side bb is a set of moments of the elevations in the
+  // window: sum(z), sum(z x), sum(z y), sum(z x^2), sum(z y^2), sum(z x y).
+  // The circular mask is a stack of kernel rows, and in each kernel row the
+  // mask covers a contiguous, symmetric run of columns. Each run is summed from
+  // row prefix sums of z, c*z and c^2*z (c is the column index), so the cost per
+  // cell grows with kr rather than kr^2. The prefix sums are kept in double in a
+  // ring buffer of kw rows. Elevations are taken relative to a reference
+  // elevation first to limit cancellation. This only shifts the constant
+  // coefficient f, so the reference is added back to f at the end.
   cout << "\n\tRunning 2nd order polynomial fitting" << endl;
   cout << "\t\tDEM size = " << NRows << " x " << NCols << endl;
-  int ndv_present = 0;
 
+  // the half width of the mask in each kernel row (-1 if the row is empty)
+  vector<int> half_width(kw,-1);
+  for (int i=0; i<kw; ++i)
+  {
+    for (int j=0; j<kw; ++j)
+    {
+      if (mask[i][j] == 1 && abs(j-kr) > half_width[i])
+      {
+        half_width[i] = abs(j-kr);
+      }
+    }
+  }
+
+  // The matrix A is the same for every cell so it only needs one LU decomposition
+  LU<float> sol_A(A);
+  if (!sol_A.isNonsingular())
+  {
+    cout << "LSDRaster::calculate_polyfit_coefficient_matrices: the window of radius "
+         << window_radius << " does not hold enough cells to fit a quadratic surface." << endl
+         << "Use a window radius of at least " << sqrt(2.0)*DataResolution << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  // reference elevation
+  double z_ref = 0;
+  bool found_ref = false;
+  for (int i=0; i<NRows && !found_ref; ++i)
+  {
+    for (int j=0; j<NCols && !found_ref; ++j)
+    {
+      if (RasterData[i][j] != NoDataValue)
+      {
+        z_ref = RasterData[i][j];
+        found_ref = true;
+      }
+    }
+  }
+
+  // ring buffers of row prefix sums. Slot r%kw holds row r.
+  vector< vector<double> > P0(kw, vector<double>(NCols+1,0.0));
+  vector< vector<double> > P1(kw, vector<double>(NCols+1,0.0));
+  vector< vector<double> > P2(kw, vector<double>(NCols+1,0.0));
+  vector< vector<int> > PNDV(kw, vector<int>(NCols+1,0));
+  int next_row_to_sum = 0;
+
+  double res = DataResolution;
+  double res2 = res*res;
+  double zc, S0, S1, S2, Sq, Sq2, px;
+  int slot, lo, hi, ndv_count;
   for(int i=0;i<NRows;++i)
   {
     cout << "\tRow = " << i+1 << " / " << NRows << "    \r";
-    for(int j=0;j<NCols;++j)
+
+    // rows too close to the edge have no fit
+    if((i-kr < 0) || (i+kr+1 > NRows))
     {
-      // Avoid edges
-      if((i-kr < 0) || (i+kr+1 > NRows) || (j-kr < 0) || (j+kr+1 > NCols))
+      for(int j=0;j<NCols;++j)
       {
         a[i][j] = NoDataValue;
         b[i][j] = NoDataValue;
@@ -4133,8 +4603,37 @@ void LSDRaster::calculate_polyfit_coefficient_matrices(float window_radius,
         e[i][j] = NoDataValue;
         f[i][j] = NoDataValue;
       }
-      // Avoid nodata values
-      else if(RasterData[i][j]==NoDataValue)
+      continue;
+    }
+
+    // bring the prefix sums up to row i+kr
+    while (next_row_to_sum <= i+kr)
+    {
+      slot = next_row_to_sum%kw;
+      for(int col=0; col<NCols; ++col)
+      {
+        zc = RasterData[next_row_to_sum][col];
+        if (zc == NoDataValue)
+        {
+          zc = 0;
+          PNDV[slot][col+1] = PNDV[slot][col]+1;
+        }
+        else
+        {
+          zc -= z_ref;
+          PNDV[slot][col+1] = PNDV[slot][col];
+        }
+        P0[slot][col+1] = P0[slot][col] + zc;
+        P1[slot][col+1] = P1[slot][col] + zc*col;
+        P2[slot][col+1] = P2[slot][col] + zc*col*col;
+      }
+      ++next_row_to_sum;
+    }
+
+    for(int j=0;j<NCols;++j)
+    {
+      // Avoid edges and nodata values
+      if((j-kr < 0) || (j+kr+1 > NCols) || RasterData[i][j]==NoDataValue)
       {
         a[i][j] = NoDataValue;
         b[i][j] = NoDataValue;
@@ -4142,63 +4641,64 @@ void LSDRaster::calculate_polyfit_coefficient_matrices(float window_radius,
         d[i][j] = NoDataValue;
         e[i][j] = NoDataValue;
         f[i][j] = NoDataValue;
+        continue;
       }
-      else
+
+      // check for nodata values anywhere in the square kernel. If there are
+      // any the coefficients are left at zero
+      ndv_count = 0;
+      for (int p = -kr; p <= kr; ++p)
       {
-        // clip DEM
-        //zeta_sampler=zeta.copy();
-        for(int i_kernel=0;i_kernel<kw;++i_kernel)
-        {
-            for(int j_kernel=0;j_kernel<kw;++j_kernel)
-            {
-            data_kernel[i_kernel][j_kernel] =
-                  RasterData[i-kr+i_kernel][j-kr+j_kernel];
-            // check for nodata values nearby
-            if(data_kernel[i_kernel][j_kernel]==NoDataValue)
-            {
-              ndv_present=1;
-            }
-            }
-        }
+        slot = (i+p)%kw;
+        ndv_count += PNDV[slot][j+kr+1]-PNDV[slot][j-kr];
+      }
+      if (ndv_count > 0)
+      {
+        continue;
+      }
 
-        // Fit polynomial surface, avoiding nodata values
-        if(ndv_present == 0)  // test for nodata values within the selection
-        {
-          Array1D<float> bb(6,0.0);
-          Array1D<float> coeffs(6);
-          for (int krow=0; krow<kw; ++krow)
-          {
-            for (int kcol=0; kcol<kw; ++kcol)
-            {
-              if (mask[krow][kcol] == 1)
-                      {
-                        x = x_kernel[krow][kcol];
-                    y = y_kernel[krow][kcol];
-                    zeta = data_kernel[krow][kcol];
-                    // Generate vector bb
-                    bb[0] += zeta*x*x;
-                    bb[1] += zeta*y*y;
-                    bb[2] += zeta*x*y;
-                    bb[3] += zeta*x;
-                    bb[4] += zeta*y;
-                    bb[5] += zeta;
-                  }    // end mask
-                  }      // end kernal column
-          }        // end kernal row
-          // Solve matrix equations using LU decomposition using the TNT JAMA package:
-          // A.coefs = b, where coefs is the coefficients vector.
-          LU<float> sol_A(A);  // Create LU object
-          coeffs = sol_A.solve(bb);
+      double bb0 = 0, bb1 = 0, bb2 = 0, bb3 = 0, bb4 = 0, bb5 = 0;
+      for (int p = -kr; p <= kr; ++p)
+      {
+        if (half_width[p+kr] < 0) continue;
+        slot = (i+p)%kw;
+        lo = j-half_width[p+kr];
+        hi = j+half_width[p+kr]+1;
 
-            a[i][j]=coeffs[0];
-            b[i][j]=coeffs[1];
-            c[i][j]=coeffs[2];
-            d[i][j]=coeffs[3];
-            e[i][j]=coeffs[4];
-            f[i][j]=coeffs[5];
-        }          // end if statement for no data value
-        ndv_present = 0;
+        // moments of the run in global column index, then shifted to the
+        // column offset q = col-j
+        S0 = P0[slot][hi]-P0[slot][lo];
+        S1 = P1[slot][hi]-P1[slot][lo];
+        S2 = P2[slot][hi]-P2[slot][lo];
+        Sq = S1 - j*S0;
+        Sq2 = S2 - 2.0*j*S1 + double(j)*double(j)*S0;
+
+        // x runs along the rows and y along the columns of the kernel
+        px = p*res;
+        bb0 += px*px*S0;
+        bb1 += res2*Sq2;
+        bb2 += px*res*Sq;
+        bb3 += px*S0;
+        bb4 += res*Sq;
+        bb5 += S0;
       }
+
+      // Solve matrix equations using the LU decomposition of A
+      Array1D<float> bb(6);
+      bb[0] = bb0;
+      bb[1] = bb1;
+      bb[2] = bb2;
+      bb[3] = bb3;
+      bb[4] = bb4;
+      bb[5] = bb5;
+      Array1D<float> coeffs = sol_A.solve(bb);
+
+      a[i][j]=coeffs[0];
+      b[i][j]=coeffs[1];
+      c[i][j]=coeffs[2];
+      d[i][j]=coeffs[3];
+      e[i][j]=coeffs[4];
+      f[i][j]=coeffs[5]+z_ref;
     }
   }
 }
@@ -5577,38 +6077,8 @@ void LSDRaster::mask_to_nodata_below_threshold(float threshold)
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 LSDRaster  LSDRaster::mask_to_nodata_using_threshold(float threshold,bool belowthresholdisnodata)
 {
-
-  Array2D<float> NewArray = RasterData.copy();
-
-  for(int row = 0; row<NRows; row++)
-  {
-    for(int col = 0; col<NCols; col++)
-    {
-      // only do anything if the value at the raster point is not nodata
-      if(NewArray[row][col] != NoDataValue)
-      {
-        // logic for testing below nodata
-        if(belowthresholdisnodata)
-        {
-          if(NewArray[row][col] <= threshold)
-          {
-            NewArray[row][col] = NoDataValue;
-          }
-        }
-        else  // this logic is for if you are changing to nodata if above threshold
-        {
-          if(NewArray[row][col] >= threshold)
-          {
-            NewArray[row][col] = NoDataValue;
-          }
-        }
-      }
-    }
-  }
-
-  LSDRaster NDR(NRows,NCols,XMinimum,YMinimum,DataResolution,
-                             NoDataValue,NewArray,GeoReferencingStrings);
-  return NDR;
+  LSDRasterExpression Expression(*this);
+  return Expression.mask_to_nodata_using_threshold(threshold,belowthresholdisnodata).evaluate();
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
@@ -5620,49 +6090,16 @@ LSDRaster  LSDRaster::mask_to_nodata_using_threshold(float threshold,bool belowt
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 LSDRaster  LSDRaster::mask_to_nodata_using_threshold_using_other_raster(float threshold,bool belowthresholdisnodata, LSDRaster& MaskingRaster)
 {
-
-  Array2D<float> NewArray;
-  NewArray = RasterData.copy();
+  LSDRasterExpression Expression(*this);
 
   // first check to see if the rasters are the same size
   int IR_NRows = MaskingRaster.get_NRows();
   int IR_NCols = MaskingRaster.get_NCols();
 
-  float this_mask_value;
-
   if(IR_NRows == NRows && IR_NCols == NCols)
   {
-    for(int row = 0; row<NRows; row++)
-    {
-      for(int col = 0; col<NCols; col++)
-      {
-
-        // only do anything if the value at the raster point is not nodata
-        if(NewArray[row][col] != NoDataValue)
-        {
-          this_mask_value = MaskingRaster.get_data_element(row,col);
-          if(this_mask_value != NoDataValue)
-          {
-
-            // logic for testing below nodata
-            if(belowthresholdisnodata)
-            {
-              if(this_mask_value <= threshold)
-              {
-                NewArray[row][col] = NoDataValue;
-              }
-            }
-            else  // this logic is for if you are changing to nodata if above threshold
-            {
-              if(this_mask_value >= threshold)
-              {
-                NewArray[row][col] = NoDataValue;
-              }
-            }
-          }
-        }
-      }
-    }
+    Expression.mask_to_nodata_using_threshold_using_other_raster(threshold,
+                                 belowthresholdisnodata, MaskingRaster);
   }
   else
   {
@@ -5670,9 +6107,7 @@ LSDRaster  LSDRaster::mask_to_nodata_using_threshold_using_other_raster(float th
          << " the dimensions of the raster" << endl;
   }
 
-  LSDRaster NDR(NRows,NCols,XMinimum,YMinimum,DataResolution,
-                             NoDataValue,NewArray,GeoReferencingStrings);
-  return NDR;
+  return Expression.evaluate();
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
@@ -6152,7 +6587,6 @@ LSDRaster LSDRaster::fill(float& MinSlope)
 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 // Main function for generating a D-infinity flow area raster after Tarboton (1997).
-// Calls the recurisve D_infAccum function to get flow area for each pixel.
 // Returns flow area in pixels.
 //
 // Code is ported and optimised from a Java implementation of the algorithm
@@ -6161,139 +6595,169 @@ LSDRaster LSDRaster::fill(float& MinSlope)
 // to the whitebox tool.
 //
 // SWDG - 26/07/13
+//
+// The recursion from each cell with no inflowing neighbours has been replaced
+// by a queue: a cell is processed once all the cells flowing into it have been
+// (Kahn's topological sort), so there is no risk of running out of stack on long
+// flow paths. The receivers and inflow counts are kept in flat arrays.
+// If there is more than one thread the grid is split into independent drainage
+// regions (cells joined by D-inf flow) which are accumulated in parallel. A
+// region is processed in the same order as in the serial queue, so the result
+// does not depend on the number of threads.
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-LSDRaster LSDRaster::D_inf_FlowArea(Array2D<float> FlowDir_array){
+LSDRaster LSDRaster::D_inf_FlowArea(Array2D<float>& FlowDir_array){
 
-  // Arrays of indexes of neighbour cells wrt target cell and their
-  //corresponding ranges of angles
-  int dX[] = {1, 1, 1, 0, -1, -1, -1, 0};
-  int dY[] = {-1, 0, 1, 1, 1, 0, -1, -1};
-  float startFD[] = {180, 225, 270, 315, 0, 45, 90, 135};
-  float endFD[] = {270, 315, 360, 45, 90, 135, 180, 225};
+  //tables of angles and indexes used to rotate around each neighbour
+  float FD_Low[] = {0, 45, 90, 135, 180, 225, 270, 315};
+  float FD_High_361[] = {45, 90, 135, 180, 225, 270, 315, 361};  //this array ends with 361 to catch angles up to 360
+  float FD_High[] = {45, 90, 135, 180, 225, 270, 315, 360};
+  int Di1[] = {-1, -1, 0, 1, 1, 1, 0, -1};
+  int Dj1[] = {0, 1, 1, 1, 0, -1, -1, -1};
+  int Di2[] = {-1, 0, 1, 1, 1, 0, -1, -1};
+  int Dj2[] = {1, 1, 1, 0, -1, -1, -1, 0};
 
-  Array2D<float> Flowarea_Raster(NRows,NCols,1);
-  Array2D<float> CountGrid(NRows,NCols,NoDataValue); //array to hold no of inflowing neighbours
+  int NCells = NRows*NCols;
 
-  int inflow_neighbours; //counter for number of inflowing neighbours
-  float flowDir; //temp variable to store the flowdir of a neighbour
+  // the two receivers of each cell (-1 for none), the proportion of flow to each
+  // and the number of inflowing neighbours
+  vector<int> Receiver1(NCells,-1);
+  vector<int> Receiver2(NCells,-1);
+  vector<float> Proportion1(NCells,0);
+  vector<float> Proportion2(NCells,0);
+  vector<int> InflowCount(NCells,0);
+  vector<float> FlowArea(NCells,1);
 
-  // Calculate the number of inflowing neighbours to each cell.
   for (int i = 0; i < NRows; ++i){
     for (int j = 0; j < NCols; ++j){
-      flowDir = FlowDir_array[i][j];
-      if (flowDir != NoDataValue){
-        inflow_neighbours = 0;
-
-        for (int c = 0; c < 8; ++c){ //loop through the 8 neighbours of the target cell
-          flowDir = FlowDir_array[i + dY[c]][j + dX[c]];
-          if (flowDir >= 0 && flowDir <= 360){
-            if (c != 3){  //handles the issue of 0,360 both pointing to North
-              if (flowDir > startFD[c] && flowDir < endFD[c]){
-                ++inflow_neighbours;
-              }
+      int cell = i*NCols+j;
+      float flowDir = FlowDir_array[i][j];
+      if (flowDir == NoDataValue){
+        FlowArea[cell] = NoDataValue;
+      }
+      else if (flowDir >= 0){  //avoids flagged pits
+
+        // find which two cells receive flow and the proportion to each
+        for (int q = 0; q < 8; ++q){
+          if (flowDir >= FD_Low[q] && flowDir < FD_High_361[q]){
+            float proportion1 = (FD_High[q] - flowDir) / 45;
+            float proportion2 = (flowDir - FD_Low[q]) / 45;
+            int a1 = i + Di1[q];
+            int b1 = j + Dj1[q];
+            int a2 = i + Di2[q];
+            int b2 = j + Dj2[q];
+            if (proportion1 > 0 && a1 >= 0 && a1 < NRows && b1 >= 0 && b1 < NCols
+                && FlowDir_array[a1][b1] != NoDataValue){
+              Receiver1[cell] = a1*NCols+b1;
+              Proportion1[cell] = proportion1;
+              ++InflowCount[Receiver1[cell]];
             }
-            else{
-              if (flowDir > startFD[c] || flowDir < endFD[c]){
-                ++inflow_neighbours;
-              }
+            if (proportion2 > 0 && a2 >= 0 && a2 < NRows && b2 >= 0 && b2 < NCols
+                && FlowDir_array[a2][b2] != NoDataValue){
+              Receiver2[cell] = a2*NCols+b2;
+              Proportion2[cell] = proportion2;
+              ++InflowCount[Receiver2[cell]];
             }
           }
         }
-        CountGrid[i][j] = inflow_neighbours;
-      }
-      else{
-        Flowarea_Raster[i][j] = NoDataValue;
       }
     }
   }
 
-  for (int i = 0; i < NRows; ++i){
-    for (int j = 0; j < NCols; ++j){
-      if (CountGrid[i][j] == 0){ //there are no inflowing neighbours
-        //call the flowarea function and travel downstream from it
-        D_infAccum(i, j, CountGrid, Flowarea_Raster, FlowDir_array);
-      }
+  // the cells with no inflowing neighbours start the queue
+  vector<int> Sources;
+  for (int cell = 0; cell < NCells; ++cell){
+    if (FlowArea[cell] != NoDataValue && InflowCount[cell] == 0){
+      Sources.push_back(cell);
     }
   }
 
-  LSDRaster FlowArea(NRows, NCols, XMinimum, YMinimum, DataResolution,
-                          NoDataValue, Flowarea_Raster,GeoReferencingStrings);
-
-  return FlowArea;
-}
-
-
-//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-// Recursive function to calculate accumulating area for a given pixel. Called
-// by the driver for every cell which has no contributing cells - eg the highest
-// points on the landscape. Avoids the need to flatten and sort the DEM as
-// required in the original Tarboton (1997) implementation. For more detail on the
-// recursive algorithm following channels see Mark (1998) "Network Models in
-// Geomorphology".
-//
-// Code is ported and optimised from a Java implementation of the algorithm
-// supplied under the GNU GPL licence through WhiteBox GAT:
-// http://www.uoguelph.ca/~hydrogeo/Whitebox/ and provides identical results
-// to the whitebox tool.
-//
-// SWDG - 26/07/13
-//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-void LSDRaster::D_infAccum(int i, int j, Array2D<float> CountGrid,
-              Array2D<float> Flowarea_Raster, Array2D<float> FlowDir)
-{
-
-  float flowAccumVal = Flowarea_Raster[i][j];
-  float flowDir = FlowDir[i][j];
-
-  //tables of angles and indexes used to rotate around each neighbour
-  float FD_Low[] = {0, 45, 90, 135, 180, 225, 270, 315};
-  float FD_High_361[] = {45, 90, 135, 180, 225, 270, 315, 361};  //this array ends with 361 to catch angles up to 360
-  float FD_High[] = {45, 90, 135, 180, 225, 270, 315, 360};
-  int Di1[] = {-1, -1, 0, 1, 1, 1, 0, -1};
-  int Dj1[] = {0, 1, 1, 1, 0, -1, -1, -1};
-  int Di2[] = {-1, 0, 1, 1, 1, 0, -1, -1};
-  int Dj2[] = {1, 1, 1, 0, -1, -1, -1, 0};
-
-  float proportion1 = 0; //proportion of flow to the lowest neighbour
-  float proportion2 = 0; //proportion of flow to the second lowest neighbour
-
-  // indexes to store the coordinates of the neighbours where flow is to be routed
-  int a1 = 0;
-  int b1 = 0;
-  int a2 = 0;
-  int b2 = 0;
-
-  CountGrid[i][j] = -1; // flags a visted cell
-
-  if (flowDir >= 0){  //avoids flagged pits
-
-    // find which two cells receive flow and the proportion to each
-    for (int q = 0; q < 8; ++q){
-      if (flowDir >= FD_Low[q] && flowDir < FD_High_361[q]){
-        proportion1 = (FD_High[q] - flowDir) / 45;
-        a1 = i + Di1[q];
-        b1 = j + Dj1[q];
-        proportion2 = (flowDir - FD_Low[q]) / 45;
-        a2 = i + Di2[q];
-        b2 = j + Dj2[q];
+  // group the sources by drainage region: union the cells along every flow link
+  // (only worth doing if the regions can be run on several threads)
+  vector< vector<int> > RegionSources;
+  bool group_by_region = false;
+#ifdef _OPENMP
+  group_by_region = (omp_get_max_threads() > 1);
+#endif
+  if (group_by_region){
+    vector<int> Parent(NCells);
+    for (int cell = 0; cell < NCells; ++cell){
+      Parent[cell] = cell;
+    }
+    for (int cell = 0; cell < NCells; ++cell){
+      for (int r = 0; r < 2; ++r){
+        int receiver = (r == 0) ? Receiver1[cell] : Receiver2[cell];
+        if (receiver >= 0){
+          int root1 = cell;
+          while (Parent[root1] != root1){
+            Parent[root1] = Parent[Parent[root1]];
+            root1 = Parent[root1];
+          }
+          int root2 = receiver;
+          while (Parent[root2] != root2){
+            Parent[root2] = Parent[Parent[root2]];
+            root2 = Parent[root2];
+          }
+          if (root1 != root2){
+            Parent[root1] = root2;
+          }
         }
+      }
+    }
+    vector<int> RegionOfRoot(NCells,-1);
+    for (int s = 0; s < int(Sources.size()); ++s){
+      int root = Sources[s];
+      while (Parent[root] != root){
+        root = Parent[root];
+      }
+      if (RegionOfRoot[root] == -1){
+        RegionOfRoot[root] = int(RegionSources.size());
+        RegionSources.push_back(vector<int>());
+      }
+      RegionSources[RegionOfRoot[root]].push_back(Sources[s]);
     }
+  }
+  else{
+    RegionSources.push_back(Sources);
+  }
 
-      if (proportion1 > 0 && Flowarea_Raster[a1][b1] != NoDataValue){
-        Flowarea_Raster[a1][b1] = Flowarea_Raster[a1][b1] + flowAccumVal * proportion1;
-        CountGrid[a1][b1] = CountGrid[a1][b1] - 1;
-        if (CountGrid[a1][b1] == 0){
-          D_infAccum(a1, b1, CountGrid, Flowarea_Raster, FlowDir); //recursive call
+  // accumulate each region from its sources
+  int NRegions = int(RegionSources.size());
+  #pragma omp parallel for schedule(dynamic)
+  for (int region = 0; region < NRegions; ++region){
+    vector<int> Queue = RegionSources[region];
+    size_t head = 0;
+    while (head < Queue.size()){
+      int cell = Queue[head];
+      ++head;
+      float flowAccumVal = FlowArea[cell];
+      int receiver = Receiver1[cell];
+      if (receiver >= 0){
+        FlowArea[receiver] = FlowArea[receiver] + flowAccumVal * Proportion1[cell];
+        if (--InflowCount[receiver] == 0){
+          Queue.push_back(receiver);
         }
       }
-      if (proportion2 > 0 && Flowarea_Raster[a2][b2] != NoDataValue){
-        Flowarea_Raster[a2][b2] = Flowarea_Raster[a2][b2] + flowAccumVal * proportion2;
-        CountGrid[a2][b2] = CountGrid[a2][b2] - 1;
-        if (CountGrid[a2][b2] == 0){
-          D_infAccum(a2, b2, CountGrid, Flowarea_Raster, FlowDir); //recursive call
+      receiver = Receiver2[cell];
+      if (receiver >= 0){
+        FlowArea[receiver] = FlowArea[receiver] + flowAccumVal * Proportion2[cell];
+        if (--InflowCount[receiver] == 0){
+          Queue.push_back(receiver);
+        }
       }
     }
   }
+
+  Array2D<float> Flowarea_Raster(NRows,NCols);
+  for (int i = 0; i < NRows; ++i){
+    for (int j = 0; j < NCols; ++j){
+      Flowarea_Raster[i][j] = FlowArea[i*NCols+j];
+    }
+  }
+
+  LSDRaster FlowAreaRaster(NRows, NCols, XMinimum, YMinimum, DataResolution,
+                          NoDataValue, Flowarea_Raster,GeoReferencingStrings);
+
+  return FlowAreaRaster;
 }
 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
@@ -6506,7 +6970,7 @@ LSDRaster LSDRaster::D_inf_ConvertFlowToArea()
 // MDH - 26/8/14
 //
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=--=-=-=-=-=-=--=-=-=-=-=--=-
-LSDIndexRaster LSDRaster::D_inf_watershed(LSDRaster D_inf_FlowDir, int PourRow, int PourCol)
+LSDIndexRaster LSDRaster::D_inf_watershed(LSDRaster& D_inf_FlowDir, int PourRow, int PourCol)
 {
   //Declare the priority Queue with greater than comparison
   priority_queue< FillNode, vector<FillNode>, greater<FillNode> > PriorityQueue;
@@ -6727,7 +7191,7 @@ pair<float,float> LSDRaster::Boomerang(LSDRaster& Slope, LSDRaster& Dinf, string
 // Updated 24/9/13 to return a vector of LSDRasters SWDG
 // SWDG 27/8/13
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-vector<LSDRaster> LSDRaster::BasinPuncher(vector<int> basin_ids, LSDIndexRaster BasinArray)
+vector<LSDRaster> LSDRaster::BasinPuncher(vector<int> basin_ids, LSDIndexRaster& BasinArray)
 {
 
   Array2D<int> BasinRaster = BasinArray.get_RasterData();
@@ -6765,10 +7229,10 @@ vector<LSDRaster> LSDRaster::BasinPuncher(vector<int> basin_ids, LSDIndexRaster
 //
 // SWDG 06/07/15
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-LSDRaster LSDRaster::CookieCutRaster(LSDRaster Cutter)
+LSDRaster LSDRaster::CookieCutRaster(LSDRaster& Cutter)
 {
 
-  Array2D<float> CutterData = Cutter.get_RasterData();
+  const Array2D<float>& CutterData = Cutter.get_RasterData_ref();
   Array2D<float> cookie(NRows, NCols, NoDataValue);
 
   for (int i=0; i<NRows; ++i){
@@ -7107,6 +7571,7 @@ LSDRaster LSDRaster::RidgeSample(Array2D<float>& Ridges){
 // Returns LSDRaster object containing the averaged data.
 //
 // SWDG 04/2013
+// The window is now centred on the cell and clipped at the raster edge
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=--=-=-=-=-=-=-=-=-=-=-=-=
 LSDRaster LSDRaster::RidgeSmoother(int WindowRadius){
 
@@ -7115,26 +7580,17 @@ LSDRaster LSDRaster::RidgeSmoother(int WindowRadius){
     WindowRadius = 2; //
   }
 
+  // square window centred on each ridge cell, clipped at the edge of the raster
+  Array2D<int> mask(2*WindowRadius+1,2*WindowRadius+1,1);
+  Array2D<float> WindowMean, WindowSD, WindowFraction;
+  calculate_window_moments(mask, -1, NoDataValue, WindowMean, WindowSD, WindowFraction);
+
   Array2D<float> Smoothed(NRows,NCols,NoDataValue);
 
   for (int i = 0; i < NRows; ++i){
     for (int j = 0; j < NCols; ++j){
-      float sum = 0;
-      int counter = 0;
       if (RasterData[i][j] != NoDataValue){
-          for (int a = (-1*WindowRadius); a <= WindowRadius; ++a){
-              for (int b = (-1*WindowRadius); b <= WindowRadius; ++b){
-                if(a >= 0 && a <= NRows){
-                  if(b >= 0 && b <= NCols){
-                    if (RasterData[i+a][j+b] != NoDataValue){
-                        sum += RasterData[i+a][j+b];
-                        ++counter;
-                    }
-                  }
-                }
-             }
-          }
-      Smoothed[i][j] = sum/counter;
+        Smoothed[i][j] = WindowMean[i][j];
       }
     }
   }
@@ -7278,7 +7734,7 @@ float LSDRaster::SingleBasinAverager(LSDIndexRaster& Basin){
 // Refactored to follow the drainage density calculations design pattern.
 // SWDG 20/11/2013
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=--=-=-=-=-=-=-=-=-=-=-=-=
-LSDRaster LSDRaster::BasinArea(LSDIndexRaster Basins){
+LSDRaster LSDRaster::BasinArea(LSDIndexRaster& Basins){
   //Declare all the variables needed in this method
   vector<int> IDs;
   vector<int> IDs_sorted;
@@ -7350,7 +7806,7 @@ LSDRaster LSDRaster::BasinArea(LSDIndexRaster Basins){
 // be loaded into arc.
 // SWDG 21/11/2013
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=--=-=-=-=-=-=-=-=-=-=-=-=
-void LSDRaster::GetBasinVector(LSDIndexRaster Basins, int BasinOfInterest){
+void LSDRaster::GetBasinVector(LSDIndexRaster& Basins, int BasinOfInterest){
 
   //convert Basin Raster to an Array
   Array2D<int> basin_ids = Basins.get_RasterData();
@@ -7632,8 +8088,7 @@ LSDRaster LSDRaster::MDFlow(vector<string> BoundaryConditions)
 
   //declare variables
   vector<float> flat;
-  vector<float> sorted;
-  vector<size_t> index_map;
+  vector<int> index_map;
   float one_ov_root_2 = 0.707106781187;
 
 
@@ -7679,16 +8134,16 @@ LSDRaster LSDRaster::MDFlow(vector<string> BoundaryConditions)
     }
   }
 
-  //sort the 1D elevation vector and produce an index
-  matlab_float_sort_descending(flat, sorted, index_map);
+  //sort the 1D elevation vector, skipping nodata, and produce an index
+  radix_sort_descending(flat, NoDataValue, index_map);
 
-  for(int q = 0 ;q < int(flat.size()); ++q){
+  for(int q = 0 ;q < int(index_map.size()); ++q){
 
-    if (sorted[q] != NoDataValue){
+    if (flat[index_map[q]] != NoDataValue){
 
       //use row major ordering to reconstruct each cell's i,j coordinates
       int i = index_map[q] / NCols;
-       int j = index_map[q] % NCols;
+      int j = index_map[q] % NCols;
 
       //skip edge cells
       if (i != 0 && j != 0 && i != NRows-1 && j != NCols-1){
@@ -7827,101 +8282,30 @@ LSDRaster LSDRaster::MDFlow(vector<string> BoundaryConditions)
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 LSDRaster LSDRaster::FreemanMDFlow(){
 
-  //create output array, populated with nodata
-  Array2D<float> area(NRows, NCols, NoDataValue);
+  vector<int> cell_order = get_descending_elevation_order();
+  return FreemanMDFlow(cell_order);
+}
 
-  //declare variables
-  vector<float> flat;
-  vector<float> sorted;
-  vector<size_t> index_map;
-  float one_ov_root_2 = 0.707106781187;
-  float p = 1.1; //value avoids preferential flow to diagonals
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// Overloaded FreemanMDFlow that takes the cells in descending order of elevation
+// from get_descending_elevation_order, so the sort can be reused by several
+// multiple flow direction routines on the same DEM.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+LSDRaster LSDRaster::FreemanMDFlow(vector<int>& cell_order){
 
-  //loop through the dem cells creating a row major 1D vector, flat, and
-  //setting the cell area to every npn ndv cell
+  //create output array, populated with nodata, and set the cell area of every
+  //non ndv cell
+  Array2D<float> area(NRows, NCols, NoDataValue);
   for (int i = 0; i < NRows; ++i){
     for (int j = 0; j < NCols; ++j){
-      flat.push_back(RasterData[i][j]);
       if (RasterData[i][j] != NoDataValue){
         area[i][j] = DataResolution*DataResolution;
       }
     }
   }
 
-  //sort the 1D elevation vector and produce an index
-  matlab_float_sort_descending(flat, sorted, index_map);
-
-  for(int q = 0 ;q < int(flat.size()); ++q){
-
-    if (sorted[q] != NoDataValue){
-
-      //use row major ordering to reconstruct each cell's i,j coordinates
-      int i = index_map[q] / NCols;
-       int j = index_map[q] % NCols;
-
-      //skip edge cells
-      if (i != 0 && j != 0 && i != NRows-1 && j != NCols-1){
-
-        //reset variables on each loop
-        float total = 0;
-        float slope1 = 0;
-        float slope2 = 0;
-        float slope3 = 0;
-        float slope4 = 0;
-        float slope5 = 0;
-        float slope6 = 0;
-        float slope7 = 0;
-        float slope8 = 0;
-
-        //Get sum of magnitude of downslope flow, total, and store the magnitude of
-        //each of the 8 downslope cells as slope1->8 *Avoids NDVs*
-        if (RasterData[i][j] > RasterData[i-1][j-1] && RasterData[i-1][j-1] != NoDataValue){
-          slope1 = pow(((RasterData[i][j] - RasterData[i-1][j-1]) * one_ov_root_2),p);
-          total += slope1;
-        }
-        if (RasterData[i][j] > RasterData[i-1][j] && RasterData[i-1][j] != NoDataValue){
-          slope2 = pow((RasterData[i][j] - RasterData[i-1][j]),p);
-          total += slope2;
-        }
-        if (RasterData[i][j] > RasterData[i-1][j+1] && RasterData[i-1][j+1] != NoDataValue){
-          slope3 = pow(((RasterData[i][j] - RasterData[i-1][j+1]) * one_ov_root_2),p);
-          total += slope3;
-        }
-        if (RasterData[i][j] > RasterData[i][j+1] && RasterData[i][j+1] != NoDataValue){
-          slope4 = pow((RasterData[i][j] - RasterData[i][j+1]),p);
-          total += slope4;
-        }
-        if (RasterData[i][j] > RasterData[i+1][j+1] && RasterData[i+1][j+1] != NoDataValue){
-          slope5 = pow(((RasterData[i][j] - RasterData[i+1][j+1]) * one_ov_root_2),p);
-          total += slope5;
-        }
-        if (RasterData[i][j] > RasterData[i+1][j] && RasterData[i+1][j] != NoDataValue){
-          slope6 = pow((RasterData[i][j] - RasterData[i+1][j]),p);
-          total += slope6;
-        }
-        if (RasterData[i][j] > RasterData[i+1][j-1] && RasterData[i+1][j-1] != NoDataValue){
-          slope7 = pow(((RasterData[i][j] - RasterData[i+1][j-1]) * one_ov_root_2),p);
-          total += slope7;
-        }
-        if (RasterData[i][j] > RasterData[i][j-1] && RasterData[i][j-1] != NoDataValue){
-          slope8 = pow((RasterData[i][j] - RasterData[i][j-1]),p);
-          total += slope8;
-        }
+  route_multiple_flow_directions(cell_order, 0, area);
 
-      //divide slope by total to get the proportion of flow directed to each cell
-      //and increment the downslope cells. If no downslope flow to a node, 0 is
-      //added, so no change is seen.
-      area[i-1][j-1] += area[i][j] * (slope1/total);
-      area[i-1][j] += area[i][j] * (slope2/total);
-      area[i-1][j+1] += area[i][j] * (slope3/total);
-      area[i][j+1] += area[i][j] * (slope4/total);
-      area[i+1][j+1] += area[i][j] * (slope5/total);
-      area[i+1][j] += area[i][j] * (slope6/total);
-      area[i+1][j-1] += area[i][j] * (slope7/total);
-      area[i][j-1] += area[i][j] * (slope8/total);
-      }
-    }
-  }
   //write output LSDRaster object
   LSDRaster FreemanMultiFlow(NRows, NCols, XMinimum, YMinimum, DataResolution,
                              NoDataValue, area,GeoReferencingStrings);
@@ -7938,43 +8322,78 @@ LSDRaster LSDRaster::FreemanMDFlow_SingleSource(int i_source,int j_source)
   //create output array, populated with nodata
   Array2D<float> area(NRows, NCols, NoDataValue);
 
+  //set the area of every non ndv cell to zero apart from the source.
+  //Cells above the source have no area, so they route nothing
+  for (int i = 0; i < NRows; ++i)
+  {
+    for (int j = 0; j < NCols; ++j)
+    {
+      if (RasterData[i][j] != NoDataValue)
+      {
+        area[i][j] = 0;
+      }
+    }
+  }
+  area[i_source][j_source] = DataResolution*DataResolution;
+
+  vector<int> cell_order = get_descending_elevation_order();
+  route_multiple_flow_directions(cell_order, 0, area);
+
+  //write output LSDRaster object
+  LSDRaster FreemanMultiFlowSingleSource(NRows, NCols, XMinimum, YMinimum,
+                 DataResolution, NoDataValue, area,GeoReferencingStrings);
+  return FreemanMultiFlowSingleSource;
+}
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// This extracts the valley network from previously idenified channel heads
+// using workflow outlined in Pelletier (2013)
+// DTM 27/06/2014
+LSDRaster LSDRaster::FMDChannelsFromChannelHeads(vector<int>& channel_heads_rows,
+                              vector<int>& channel_heads_cols, float R_threshold)
+{
+  int n_sources = channel_heads_rows.size();
+  //create output array, populated with nodata
+  Array2D<float> area(NRows, NCols, NoDataValue);
+  Array2D<int> upslope_channel_heads(NRows, NCols, int(NoDataValue));
   //declare variables
-  vector<float> flat;
-  vector<float> sorted;
-  vector<size_t> index_map;
   float one_ov_root_2 = 0.707106781187;
   float p = 1.1; //value avoids preferential flow to diagonals
 
-  //loop through the dem cells creating a row major 1D vector, flat, and
-  //setting the cell area to every npn ndv cell
+  //set the cell area to every non ndv cell
   for (int i = 0; i < NRows; ++i)
   {
     for (int j = 0; j < NCols; ++j)
     {
-      flat.push_back(RasterData[i][j]);
       if (RasterData[i][j] != NoDataValue)
       {
         area[i][j] = 0;
+        upslope_channel_heads[i][j] = 0;
       }
     }
   }
-  area[i_source][j_source] = DataResolution*DataResolution;
-  //sort the 1D elevation vector and produce an index
-  matlab_float_sort_descending(flat, sorted, index_map);
-  bool reached_source = false;
 
-  for(int q = 0 ;q < int(flat.size()); ++q)
+  int row,col;
+  for(int i = 0; i<n_sources; ++i)
+  {
+    row = channel_heads_rows[i];
+    col = channel_heads_cols[i];
+    area[row][col] = DataResolution*DataResolution;
+    upslope_channel_heads[row][col] = 1;
+  }
+  //get the cells in descending order of elevation
+  vector<int> cell_order = get_descending_elevation_order();
+  for(int q = 0 ;q < int(cell_order.size()); ++q)
   {
 
-    if (sorted[q] != NoDataValue)
+    if (RasterData[0][cell_order[q]] != NoDataValue)
     {
       //use row major ordering to reconstruct each cell's i,j coordinates
-      int i = index_map[q] / NCols;
-       int j = index_map[q] % NCols;
-      // test to see whether we have reached the source
-      if(i==i_source && j==j_source) reached_source=true;
+      int i = cell_order[q] / NCols;
+      int j = cell_order[q] % NCols;
+
       //skip edge cells and cells above the source pixel
-      if (i != 0 && j != 0 && i != NRows-1 && j != NCols-1 && reached_source == true){
+      if (i != 0 && j != 0 && i != NRows-1 && j != NCols-1){
 
         //reset variables on each loop
         float total = 0;
@@ -7992,163 +8411,42 @@ LSDRaster LSDRaster::FreemanMDFlow_SingleSource(int i_source,int j_source)
         if (RasterData[i][j] > RasterData[i-1][j-1] && RasterData[i-1][j-1] != NoDataValue){
           slope1 = pow(((RasterData[i][j] - RasterData[i-1][j-1]) * one_ov_root_2),p);
           total += slope1;
+          if(upslope_channel_heads[i][j] >=1) ++upslope_channel_heads[i-1][j-1];
         }
         if (RasterData[i][j] > RasterData[i-1][j] && RasterData[i-1][j] != NoDataValue){
           slope2 = pow((RasterData[i][j] - RasterData[i-1][j]),p);
           total += slope2;
+          if(upslope_channel_heads[i][j] >=1) ++upslope_channel_heads[i-1][j];
         }
         if (RasterData[i][j] > RasterData[i-1][j+1] && RasterData[i-1][j+1] != NoDataValue){
           slope3 = pow(((RasterData[i][j] - RasterData[i-1][j+1]) * one_ov_root_2),p);
           total += slope3;
+          if(upslope_channel_heads[i][j] >=1) ++upslope_channel_heads[i-1][j+1];
         }
         if (RasterData[i][j] > RasterData[i][j+1] && RasterData[i][j+1] != NoDataValue){
           slope4 = pow((RasterData[i][j] - RasterData[i][j+1]),p);
           total += slope4;
+          if(upslope_channel_heads[i][j] >=1) ++upslope_channel_heads[i][j+1];
         }
         if (RasterData[i][j] > RasterData[i+1][j+1] && RasterData[i+1][j+1] != NoDataValue){
           slope5 = pow(((RasterData[i][j] - RasterData[i+1][j+1]) * one_ov_root_2),p);
           total += slope5;
+          if(upslope_channel_heads[i][j] >=1) ++upslope_channel_heads[i+1][j+1];
         }
         if (RasterData[i][j] > RasterData[i+1][j] && RasterData[i+1][j] != NoDataValue){
           slope6 = pow((RasterData[i][j] - RasterData[i+1][j]),p);
           total += slope6;
+          if(upslope_channel_heads[i][j] >=1) ++upslope_channel_heads[i+1][j];
         }
         if (RasterData[i][j] > RasterData[i+1][j-1] && RasterData[i+1][j-1] != NoDataValue){
           slope7 = pow(((RasterData[i][j] - RasterData[i+1][j-1]) * one_ov_root_2),p);
           total += slope7;
+          if(upslope_channel_heads[i][j] >=1) ++upslope_channel_heads[i+1][j-1];
         }
         if (RasterData[i][j] > RasterData[i][j-1] && RasterData[i][j-1] != NoDataValue){
           slope8 = pow((RasterData[i][j] - RasterData[i][j-1]),p);
           total += slope8;
-        }
-
-      //divide slope by total to get the proportion of flow directed to each cell
-      //and increment the downslope cells. If no downslope flow to a node, 0 is
-      //added, so no change is seen.
-      area[i-1][j-1] += area[i][j] * (slope1/total);
-      area[i-1][j] += area[i][j] * (slope2/total);
-      area[i-1][j+1] += area[i][j] * (slope3/total);
-      area[i][j+1] += area[i][j] * (slope4/total);
-      area[i+1][j+1] += area[i][j] * (slope5/total);
-      area[i+1][j] += area[i][j] * (slope6/total);
-      area[i+1][j-1] += area[i][j] * (slope7/total);
-      area[i][j-1] += area[i][j] * (slope8/total);
-      }
-    }
-  }
-  //write output LSDRaster object
-  LSDRaster FreemanMultiFlowSingleSource(NRows, NCols, XMinimum, YMinimum,
-                 DataResolution, NoDataValue, area,GeoReferencingStrings);
-  return FreemanMultiFlowSingleSource;
-}
-
-//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-// This extracts the valley network from previously idenified channel heads
-// using workflow outlined in Pelletier (2013)
-// DTM 27/06/2014
-LSDRaster LSDRaster::FMDChannelsFromChannelHeads(vector<int>& channel_heads_rows,
-                              vector<int>& channel_heads_cols, float R_threshold)
-{
-  int n_sources = channel_heads_rows.size();
-  //create output array, populated with nodata
-  Array2D<float> area(NRows, NCols, NoDataValue);
-  Array2D<int> upslope_channel_heads(NRows, NCols, int(NoDataValue));
-  //declare variables
-  vector<float> flat;
-  vector<float> sorted;
-  vector<size_t> index_map;
-  float one_ov_root_2 = 0.707106781187;
-  float p = 1.1; //value avoids preferential flow to diagonals
-
-  //loop through the dem cells creating a row major 1D vector, flat, and
-  //setting the cell area to every npn ndv cell
-  for (int i = 0; i < NRows; ++i)
-  {
-    for (int j = 0; j < NCols; ++j)
-    {
-      flat.push_back(RasterData[i][j]);
-      if (RasterData[i][j] != NoDataValue)
-      {
-        area[i][j] = 0;
-        upslope_channel_heads[i][j] = 0;
-      }
-    }
-  }
-
-  int row,col;
-  for(int i = 0; i<n_sources; ++i)
-  {
-    row = channel_heads_rows[i];
-    col = channel_heads_cols[i];
-    area[row][col] = DataResolution*DataResolution;
-    upslope_channel_heads[row][col] = 1;
-  }
-  //sort the 1D elevation vector and produce an index
-  matlab_float_sort_descending(flat, sorted, index_map);
-  for(int q = 0 ;q < int(flat.size()); ++q)
-  {
-
-    if (sorted[q] != NoDataValue)
-    {
-      //use row major ordering to reconstruct each cell's i,j coordinates
-      int i = index_map[q] / NCols;
-       int j = index_map[q] % NCols;
-
-      //skip edge cells and cells above the source pixel
-      if (i != 0 && j != 0 && i != NRows-1 && j != NCols-1){
-
-        //reset variables on each loop
-        float total = 0;
-        float slope1 = 0;
-        float slope2 = 0;
-        float slope3 = 0;
-        float slope4 = 0;
-        float slope5 = 0;
-        float slope6 = 0;
-        float slope7 = 0;
-        float slope8 = 0;
-
-        //Get sum of magnitude of downslope flow, total, and store the magnitude of
-        //each of the 8 downslope cells as slope1->8 *Avoids NDVs*
-        if (RasterData[i][j] > RasterData[i-1][j-1] && RasterData[i-1][j-1] != NoDataValue){
-          slope1 = pow(((RasterData[i][j] - RasterData[i-1][j-1]) * one_ov_root_2),p);
-          total += slope1;
-          if(upslope_channel_heads[i][j] >=1) ++upslope_channel_heads[i-1][j-1];
-        }
-        if (RasterData[i][j] > RasterData[i-1][j] && RasterData[i-1][j] != NoDataValue){
-          slope2 = pow((RasterData[i][j] - RasterData[i-1][j]),p);
-          total += slope2;
-          if(upslope_channel_heads[i][j] >=1) ++upslope_channel_heads[i-1][j];
-        }
-        if (RasterData[i][j] > RasterData[i-1][j+1] && RasterData[i-1][j+1] != NoDataValue){
-          slope3 = pow(((RasterData[i][j] - RasterData[i-1][j+1]) * one_ov_root_2),p);
-          total += slope3;
-          if(upslope_channel_heads[i][j] >=1) ++upslope_channel_heads[i-1][j+1];
-        }
-        if (RasterData[i][j] > RasterData[i][j+1] && RasterData[i][j+1] != NoDataValue){
-          slope4 = pow((RasterData[i][j] - RasterData[i][j+1]),p);
-          total += slope4;
-          if(upslope_channel_heads[i][j] >=1) ++upslope_channel_heads[i][j+1];
-        }
-        if (RasterData[i][j] > RasterData[i+1][j+1] && RasterData[i+1][j+1] != NoDataValue){
-          slope5 = pow(((RasterData[i][j] - RasterData[i+1][j+1]) * one_ov_root_2),p);
-          total += slope5;
-          if(upslope_channel_heads[i][j] >=1) ++upslope_channel_heads[i+1][j+1];
-        }
-        if (RasterData[i][j] > RasterData[i+1][j] && RasterData[i+1][j] != NoDataValue){
-          slope6 = pow((RasterData[i][j] - RasterData[i+1][j]),p);
-          total += slope6;
-          if(upslope_channel_heads[i][j] >=1) ++upslope_channel_heads[i+1][j];
-        }
-        if (RasterData[i][j] > RasterData[i+1][j-1] && RasterData[i+1][j-1] != NoDataValue){
-          slope7 = pow(((RasterData[i][j] - RasterData[i+1][j-1]) * one_ov_root_2),p);
-          total += slope7;
-          if(upslope_channel_heads[i][j] >=1) ++upslope_channel_heads[i+1][j-1];
-        }
-        if (RasterData[i][j] > RasterData[i][j-1] && RasterData[i][j-1] != NoDataValue){
-          slope8 = pow((RasterData[i][j] - RasterData[i][j-1]),p);
-          total += slope8;
-          if(upslope_channel_heads[i][j] >=1) ++upslope_channel_heads[i][j-1];
+          if(upslope_channel_heads[i][j] >=1) ++upslope_channel_heads[i][j-1];
         }
 
         //divide slope by total to get the proportion of flow directed to each cell
@@ -8214,103 +8512,29 @@ LSDRaster LSDRaster::FMDChannelsFromChannelHeads(vector<int>& channel_heads_rows
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 LSDRaster LSDRaster::QuinnMDFlow(){
 
-  //create output array, populated with nodata
-  Array2D<float> area(NRows, NCols, NoDataValue);
-
-  //declare variables
-  vector<float> flat;
-  vector<float> sorted;
-  vector<size_t> index_map;
-  float one_ov_root_2 = 0.707106781187;
-  float Lc = DataResolution/2; //cardinal scaling factor
-  float Ld = DataResolution * 0.354; //diagonal scaling factor
+  vector<int> cell_order = get_descending_elevation_order();
+  return QuinnMDFlow(cell_order);
+}
 
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// Overloaded QuinnMDFlow that takes the cells in descending order of elevation
+// from get_descending_elevation_order.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+LSDRaster LSDRaster::QuinnMDFlow(vector<int>& cell_order){
 
-  //loop through the dem cells creating a row major 1D vector, flat, and
-  //setting the cell area to every npn ndv cell
+  //create output array, populated with nodata, and set the cell area of every
+  //non ndv cell
+  Array2D<float> area(NRows, NCols, NoDataValue);
   for (int i = 0; i < NRows; ++i){
     for (int j = 0; j < NCols; ++j){
-      flat.push_back(RasterData[i][j]);
       if (RasterData[i][j] != NoDataValue){
         area[i][j] = DataResolution*DataResolution;
       }
     }
   }
 
-  //sort the 1D elevation vector and produce an index
-  matlab_float_sort_descending(flat, sorted, index_map);
-
-  for(int q = 0 ;q < int(flat.size()); ++q){
-
-    if (sorted[q] != NoDataValue){
+  route_multiple_flow_directions(cell_order, 1, area);
 
-      //use row major ordering to reconstruct each cell's i,j coordinates
-      int i = index_map[q] / NCols;
-       int j = index_map[q] % NCols;
-
-      //skip edge cells
-      if (i != 0 && j != 0 && i != NRows-1 && j != NCols-1){
-
-        //reset variables on each loop
-        float total = 0;
-        float slope1 = 0;
-        float slope2 = 0;
-        float slope3 = 0;
-        float slope4 = 0;
-        float slope5 = 0;
-        float slope6 = 0;
-        float slope7 = 0;
-        float slope8 = 0;
-
-        //Get sum of magnitude of downslope flow, total, and store the magnitude of
-        //each of the 8 downslope cells as slope1->8 *Avoids NDVs*
-        if (RasterData[i][j] > RasterData[i-1][j-1] && RasterData[i-1][j-1] != NoDataValue){
-          slope1 = ((RasterData[i][j] - RasterData[i-1][j-1]) * one_ov_root_2) * Ld;
-          total += slope1;
-        }
-        if (RasterData[i][j] > RasterData[i-1][j] && RasterData[i-1][j] != NoDataValue){
-          slope2 = (RasterData[i][j] - RasterData[i-1][j]) * Lc;
-          total += slope2;
-        }
-        if (RasterData[i][j] > RasterData[i-1][j+1] && RasterData[i-1][j+1] != NoDataValue){
-          slope3 = ((RasterData[i][j] - RasterData[i-1][j+1]) * one_ov_root_2) * Ld;
-          total += slope3;
-        }
-        if (RasterData[i][j] > RasterData[i][j+1] && RasterData[i][j+1] != NoDataValue){
-          slope4 = (RasterData[i][j] - RasterData[i][j+1]) * Lc;
-          total += slope4;
-        }
-        if (RasterData[i][j] > RasterData[i+1][j+1] && RasterData[i+1][j+1] != NoDataValue){
-          slope5 = ((RasterData[i][j] - RasterData[i+1][j+1]) * one_ov_root_2) * Ld;
-          total += slope5;
-        }
-        if (RasterData[i][j] > RasterData[i+1][j] && RasterData[i+1][j] != NoDataValue){
-          slope6 = (RasterData[i][j] - RasterData[i+1][j]) * Lc;
-          total += slope6;
-        }
-        if (RasterData[i][j] > RasterData[i+1][j-1] && RasterData[i+1][j-1] != NoDataValue){
-          slope7 = ((RasterData[i][j] - RasterData[i+1][j-1]) * one_ov_root_2) * Ld;
-          total += slope7;
-        }
-        if (RasterData[i][j] > RasterData[i][j-1] && RasterData[i][j-1] != NoDataValue){
-          slope8 = (RasterData[i][j] - RasterData[i][j-1]) * Lc;
-          total += slope8;
-        }
-
-      //divide slope by total to get the proportion of flow directed to each cell
-      //and increment the downslope cells. If no downslope flow to a node, 0 is
-      //added, so no change is seen.
-      area[i-1][j-1] += area[i][j] * (slope1/total);
-      area[i-1][j] += area[i][j] * (slope2/total);
-      area[i-1][j+1] += area[i][j] * (slope3/total);
-      area[i][j+1] += area[i][j] * (slope4/total);
-      area[i+1][j+1] += area[i][j] * (slope5/total);
-      area[i+1][j] += area[i][j] * (slope6/total);
-      area[i+1][j-1] += area[i][j] * (slope7/total);
-      area[i][j-1] += area[i][j] * (slope8/total);
-      }
-    }
-  }
   //write output LSDRaster object
   LSDRaster QuinnMultiFlow(NRows, NCols, XMinimum, YMinimum, DataResolution,
                            NoDataValue, area,GeoReferencingStrings);
@@ -8339,387 +8563,207 @@ LSDRaster LSDRaster::QuinnMDFlow(){
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 LSDRaster LSDRaster::M2DFlow(){
 
-  //create output array, populated with nodata
-  Array2D<float> area(NRows, NCols, NoDataValue);
+  vector<int> cell_order = get_descending_elevation_order();
+  return M2DFlow(cell_order);
+}
 
-  //declare variables
-  vector<float> flat;
-  vector<float> sorted;
-  vector<size_t> index_map;
-  float one_ov_root_2 = 0.707106781187;
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// Overloaded M2DFlow that takes the cells in descending order of elevation
+// from get_descending_elevation_order.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+LSDRaster LSDRaster::M2DFlow(vector<int>& cell_order){
 
-  //loop through the dem cells creating a row major 1D vector, flat, and
-  //setting the cell area to every npn ndv cell
+  //create output array, populated with nodata, and set the cell area of every
+  //non ndv cell
+  Array2D<float> area(NRows, NCols, NoDataValue);
   for (int i = 0; i < NRows; ++i){
     for (int j = 0; j < NCols; ++j){
-      flat.push_back(RasterData[i][j]);
       if (RasterData[i][j] != NoDataValue){
         area[i][j] = DataResolution*DataResolution;
       }
     }
   }
 
-  //sort the 1D elevation vector and produce an index
-  matlab_float_sort_descending(flat, sorted, index_map);
+  route_multiple_flow_directions(cell_order, 2, area);
+
+  //write output LSDRaster object
+  LSDRaster Multi2Flow(NRows, NCols, XMinimum, YMinimum, DataResolution,
+                       NoDataValue, area,GeoReferencingStrings);
+  return Multi2Flow;
+}
 
-  for(int q = 0 ;q < int(flat.size()); ++q){
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// Gets the row major indices of the non nodata cells from highest to lowest
+// elevation using a parallel radix sort. Cells of equal elevation stay in row
+// major order. Sort once and pass the result to the multiple flow direction
+// routines to compare several of them on the same DEM.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+vector<int> LSDRaster::get_descending_elevation_order()
+{
+  vector<float> flat(RasterData[0],RasterData[0]+NRows*NCols);
+  vector<int> cell_order;
+  radix_sort_descending(flat, NoDataValue, cell_order);
+  return cell_order;
+}
 
-    if (sorted[q] != NoDataValue){
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// The multiple flow direction engine. Routes the area from each cell, in the
+// order given by cell_order, to its downslope neighbours. The area array must
+// hold the starting area of each cell (NoDataValue for nodata) and is updated
+// in place. Edge cells are not routed. Neighbours are reached with precomputed
+// offsets into the row major data.
+//
+// MFD_method:
+//  0 Freeman (1991): weights are (drop, or drop/root(2) on diagonals)^1.1
+//  1 Quinn et al. (1991): weights are drop*DataResolution/2 on cardinals and
+//    drop/root(2)*DataResolution*0.354 on diagonals
+//  2 M2D: flow is split between the steepest neighbour and one of the
+//    neighbours beside it, as in the original M2DFlow by SWDG
+// Cells with no downslope neighbour are not routed by Freeman or Quinn.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDRaster::route_multiple_flow_directions(vector<int>& cell_order, int MFD_method,
+                                               Array2D<float>& area)
+{
+  if (MFD_method < 0 || MFD_method > 2)
+  {
+    cout << "LSDRaster::route_multiple_flow_directions: the method must be" << endl
+         << "0 (Freeman), 1 (Quinn) or 2 (M2D)." << endl;
+    exit(EXIT_FAILURE);
+  }
+  if (area.dim1() != NRows || area.dim2() != NCols)
+  {
+    cout << "LSDRaster::route_multiple_flow_directions: the area array is not the" << endl
+         << "same size as the raster." << endl;
+    exit(EXIT_FAILURE);
+  }
 
-      //use row major ordering to reconstruct each cell's i,j coordinates
-      int i = index_map[q] / NCols;
-       int j = index_map[q] % NCols;
+  float one_ov_root_2 = 0.707106781187;
+  float p = 1.1; //value avoids preferential flow to diagonals
+  float Lc = DataResolution/2; //cardinal scaling factor
+  float Ld = DataResolution * 0.354; //diagonal scaling factor
 
-      //skip edge cells
-      if (i != 0 && j != 0 && i != NRows-1 && j != NCols-1){
+  // neighbours clockwise from the north west: NW, N, NE, E, SE, S, SW, W
+  int offsets[8] = {-NCols-1, -NCols, -NCols+1, 1, NCols+1, NCols, NCols-1, -1};
+  bool diagonal[8] = {true, false, true, false, true, false, true, false};
 
-        //reset variables on each loop
-        float slope0 = 0;
-        float slope1 = 0;
-        float slope2 = 0;
-        float slope3 = 0;
-        float slope4 = 0;
-        float slope5 = 0;
-        float slope6 = 0;
-        float slope7 = 0;
-        vector<float> slopes;
+  float* zeta = RasterData[0];
+  float* A = area[0];
+  float slopes[8];
 
-        float p1 = 0;
-        float p2 = 0;
-        int second_slope = -1; //initialized using value outside of range.
+  int n_cells = int(cell_order.size());
+  for (int q = 0; q < n_cells; ++q){
+    int cell = cell_order[q];
+    int i = cell / NCols;
+    int j = cell % NCols;
 
-        //Get magnitude of downslope flow slope0->7 *Avoids NDVs*
-        if (RasterData[i][j] > RasterData[i-1][j-1] && RasterData[i-1][j-1] != NoDataValue){
-          slope0 = ((RasterData[i][j] - RasterData[i-1][j-1]) * one_ov_root_2);
-          slopes.push_back(slope0);
-        }
-        else {
-          slopes.push_back(0);
-        }
+    //skip edge cells
+    if (i == 0 || j == 0 || i == NRows-1 || j == NCols-1){
+      continue;
+    }
 
-        if (RasterData[i][j] > RasterData[i-1][j] && RasterData[i-1][j] != NoDataValue){
-          slope1 = (RasterData[i][j] - RasterData[i-1][j]);
-          slopes.push_back(slope1);
+    //get the weight of each downslope neighbour *Avoids NDVs*
+    float z = zeta[cell];
+    float total = 0;
+    for (int k = 0; k < 8; ++k){
+      float zn = zeta[cell+offsets[k]];
+      slopes[k] = 0;
+      if (z > zn && zn != NoDataValue){
+        float drop = z - zn;
+        if (diagonal[k]){
+          drop = drop * one_ov_root_2;
         }
-        else {
-          slopes.push_back(0);
+        if (MFD_method == 0){
+          slopes[k] = pow(drop,p);
         }
-
-        if (RasterData[i][j] > RasterData[i-1][j+1] && RasterData[i-1][j+1] != NoDataValue){
-          slope2 = ((RasterData[i][j] - RasterData[i-1][j+1]) * one_ov_root_2);
-          slopes.push_back(slope2);
+        else if (MFD_method == 1){
+          slopes[k] = (diagonal[k]) ? drop * Ld : drop * Lc;
         }
-        else {
-          slopes.push_back(0);
+        else{
+          slopes[k] = drop;
         }
+        total += slopes[k];
+      }
+    }
 
-        if (RasterData[i][j] > RasterData[i][j+1] && RasterData[i][j+1] != NoDataValue){
-          slope3 = (RasterData[i][j] - RasterData[i][j+1]);
-          slopes.push_back(slope3);
+    float cell_area = A[cell];
+    if (MFD_method != 2){
+      //divide slope by total to get the proportion of flow directed to each cell
+      if (total > 0){
+        for (int k = 0; k < 8; ++k){
+          if (slopes[k] > 0){
+            A[cell+offsets[k]] += cell_area * (slopes[k]/total);
+          }
         }
-        else {
-          slopes.push_back(0);
+      }
+    }
+    else{
+      //find maximum slope & its index location
+      int S_max_index = 0;
+      for (int k = 1; k < 8; ++k){
+        if (slopes[k] > slopes[S_max_index]){
+          S_max_index = k;
         }
+      }
+      float S_max = slopes[S_max_index];
 
-        if (RasterData[i][j] > RasterData[i+1][j+1] && RasterData[i+1][j+1] != NoDataValue){
-          slope4 = ((RasterData[i][j] - RasterData[i+1][j+1]) * one_ov_root_2);
-          slopes.push_back(slope4);
-        }
-        else {
-          slopes.push_back(0);
-        }
+      //compare the neighbours either side of the steepest slope. The original
+      //code flags the result as 7 (left steeper), 1 (right steeper) or 0 (equal)
+      //and these flags are kept to reproduce its results
+      float left = slopes[(S_max_index+7)%8];
+      float right = slopes[(S_max_index+1)%8];
+      int second_slope = -1;
+      if (left > 0 && right == 0){
+        second_slope = 7;
+      }
+      if (left == 0 && right > 0){
+        second_slope = 1;
+      }
+      if (left > 0 && right > 0){
+        second_slope = (left > right) ? 7 : 1;
+      }
+      if (left == right){
+        second_slope = 0;
+      }
 
-        if (RasterData[i][j] > RasterData[i+1][j] && RasterData[i+1][j] != NoDataValue){
-          slope5 = (RasterData[i][j] - RasterData[i+1][j]);
-          slopes.push_back(slope5);
-        }
-        else {
-          slopes.push_back(0);
-        }
+      //get proportions p1 and p2
+      float p1, p2;
+      if (second_slope != S_max_index){
+        p1 = S_max/(S_max + slopes[second_slope]);
+        p2 = slopes[second_slope]/(S_max + slopes[second_slope]);
+      }
+      else{ //flow only in 1 direction
+        p1 = 1;
+        p2 = 0;
+      }
 
-        if (RasterData[i][j] > RasterData[i+1][j-1] && RasterData[i+1][j-1] != NoDataValue){
-          slope6 = ((RasterData[i][j] - RasterData[i+1][j-1]) * one_ov_root_2);
-          slopes.push_back(slope6);
-        }
-        else {
-          slopes.push_back(0);
+      //the neighbour that gets the p2 share for each flag
+      int second_neighbour = -1;
+      if (S_max_index < 7){
+        if (second_slope == S_max_index+1){
+          second_neighbour = S_max_index+1;
         }
-
-        if (RasterData[i][j] > RasterData[i][j-1] && RasterData[i][j-1] != NoDataValue){
-          slope7 = (RasterData[i][j] - RasterData[i][j-1]);
-          slopes.push_back(slope7);
+        if (second_slope == (S_max_index+7)%8){
+          second_neighbour = (S_max_index+7)%8;
         }
-        else {
-          slopes.push_back(0);
+      }
+      else{
+        if (second_slope == 0){
+          second_neighbour = 1;
         }
-
-        if (int(slopes.size()) > 0 ){   //catch outlets with no neighbours to drain to
-
-          //find maximum slope & its index location in the slopes vector
-          float S_max = *max_element(slopes.begin(), slopes.end());
-          int S_max_index = find(slopes.begin(), slopes.end(), S_max) - slopes.begin();
-
-          //find steepest neighbour
-          if (S_max_index == 0){
-            if (slope7 > 0 && slope1 == 0){
-              second_slope = 7;
-            }
-            if (slope7 == 0 && slope1 > 0){
-              second_slope = 1;
-            }
-            if (slope7 > 0 && slope1 > 0){
-              if (slope7 > slope1){
-                second_slope = 7;
-              }
-              else{
-                second_slope = 1;
-              }
-            }
-            if (slope7 == slope1){
-              second_slope = 0;
-            }
-          }
-
-          if (S_max_index == 1){
-            if (slope0 > 0 && slope2 == 0){
-              second_slope = 7;
-            }
-            if (slope0 == 0 && slope2 > 0){
-              second_slope = 1;
-            }
-            if (slope0 > 0 && slope2 > 0){
-              if (slope0 > slope2){
-                second_slope = 7;
-              }
-              else{
-                second_slope = 1;
-              }
-            }
-            if (slope0 == slope2){
-              second_slope = 0;
-            }
-          }
-
-          if (S_max_index == 2){
-            if (slope1 > 0 && slope3 == 0){
-              second_slope = 7;
-            }
-            if (slope1 == 0 && slope3 > 0){
-              second_slope = 1;
-            }
-            if (slope1 > 0 && slope3 > 0){
-              if (slope1 > slope3){
-                second_slope = 7;
-              }
-              else{
-                second_slope = 1;
-              }
-            }
-            if (slope1 == slope3){
-              second_slope = 0;
-            }
-          }
-
-          if (S_max_index == 3){
-            if (slope2 > 0 && slope4 == 0){
-              second_slope = 7;
-            }
-            if (slope2 == 0 && slope4 > 0){
-              second_slope = 1;
-            }
-            if (slope2 > 0 && slope4 > 0){
-              if (slope2 > slope4){
-                second_slope = 7;
-              }
-              else{
-                second_slope = 1;
-              }
-            }
-            if (slope2 == slope4){
-              second_slope = 0;
-            }
-          }
-
-          if (S_max_index == 4){
-            if (slope3 > 0 && slope5 == 0){
-              second_slope = 7;
-            }
-            if (slope3 == 0 && slope5 > 0){
-              second_slope = 1;
-            }
-            if (slope3 > 0 && slope5 > 0){
-              if (slope3 > slope5){
-                second_slope = 7;
-              }
-              else{
-                second_slope = 1;
-              }
-            }
-            if (slope3 == slope5){
-              second_slope = 0;
-            }
-          }
-
-          if (S_max_index == 5){
-            if (slope4 > 0 && slope6 == 0){
-              second_slope = 7;
-            }
-            if (slope4 == 0 && slope6 > 0){
-              second_slope = 1;
-            }
-            if (slope4 > 0 && slope6 > 0){
-              if (slope4 > slope6){
-                second_slope = 7;
-              }
-              else{
-                second_slope = 1;
-              }
-            }
-            if (slope4 == slope6){
-              second_slope = 0;
-            }
-          }
-
-
-          if (S_max_index == 6){
-            if (slope5 > 0 && slope7 == 0){
-              second_slope = 7;
-            }
-            if (slope5 == 0 && slope7 > 0){
-              second_slope = 1;
-            }
-            if (slope5 > 0 && slope7 > 0){
-              if (slope5 > slope7){
-                second_slope = 7;
-              }
-              else{
-                second_slope = 1;
-              }
-            }
-            if (slope5 == slope7){
-              second_slope = 0;
-            }
-          }
-
-          if (S_max_index == 7){
-            if (slope6 > 0 && slope0 == 0){
-              second_slope = 7;
-            }
-            if (slope6 == 0 && slope0 > 0){
-              second_slope = 1;
-            }
-            if (slope6 > 0 && slope0 > 0){
-              if (slope6 > slope0){
-                second_slope = 7;
-              }
-              else{
-                second_slope = 1;
-              }
-            }
-            if (slope6 == slope0){
-              second_slope = 0;
-            }
-          }
-
-          //get proportions p1 and p2
-          if (second_slope != S_max_index){
-            p1 = S_max/(S_max + slopes[second_slope]);
-            p2 = slopes[second_slope]/(S_max + slopes[second_slope]);
-          }
-          else{ //flow only in 1 direction
-            p1 = 1;
-            p2 = 0;
-          }
-
-          //partition flow following the steepest slope and it's steepest neighbour
-          if (S_max_index == 0 && area[i-1][j-1] != NoDataValue){
-            area[i-1][j-1] += area[i][j] * p1;
-            if (second_slope == 1){
-              area[i-1][j] += area[i][j] * p2;
-            }
-            if (second_slope == 7){
-              area[i][j-1] += area[i][j] * p2;
-            }
-          }
-
-          if (S_max_index == 1 && area[i-1][j] != NoDataValue){
-            area[i-1][j] += area[i][j] * p1;
-            if (second_slope == 2){
-              area[i-1][j+1] += area[i][j] * p2;
-            }
-            if (second_slope == 0){
-              area[i-1][j-1] += area[i][j] * p2;
-            }
-          }
-
-          if (S_max_index == 2 && area[i-1][j+1] != NoDataValue){
-            area[i-1][j+1] += area[i][j] * p1;
-            if (second_slope == 3){
-              area[i][j+1] += area[i][j] * p2;
-            }
-            if (second_slope == 1){
-              area[i-1][j] += area[i][j] * p2;
-            }
-          }
-
-          if (S_max_index == 3 && area[i][j+1] != NoDataValue){
-            area[i][j+1] += area[i][j] * p1;
-            if (second_slope == 4){
-              area[i+1][j+1] += area[i][j] * p2;
-            }
-            if (second_slope == 2){
-              area[i-1][j+1] += area[i][j] * p2;
-            }
-          }
-
-          if (S_max_index == 4 && area[i+1][j+1] != NoDataValue){
-            area[i+1][j+1] += area[i][j] * p1;
-            if (second_slope == 5){
-              area[i+1][j] += area[i][j] * p2;
-            }
-            if (second_slope == 3){
-              area[i][j+1] += area[i][j] * p2;
-            }
-          }
-
-          if (S_max_index == 5 && area[i+1][j] != NoDataValue){
-            area[i+1][j] += area[i][j] * p1;
-            if (second_slope == 6){
-              area[i+1][j-1] += area[i][j] * p2;
-            }
-            if (second_slope == 4){
-              area[i+1][j+1] += area[i][j] * p2;
-            }
-          }
-
-          if (S_max_index == 6 && area[i+1][j-1] != NoDataValue){
-            area[i+1][j-1] += area[i][j] * p1;
-            if (second_slope == 7){
-              area[i][j-1] += area[i][j] * p2;
-            }
-            if (second_slope == 5){
-              area[i+1][j] += area[i][j] * p2;
-            }
-          }
-
-          if (S_max_index == 7 && area[i][j-1] != NoDataValue){
-            area[i][j-1] += area[i][j] * p1;
-            if (second_slope == 0){
-              area[i-1][j] += area[i][j] * p2;
-            }
-            if (second_slope == 6){
-              area[i-1][j-1] += area[i][j] * p2;
-            }
-          }
+        if (second_slope == 6){
+          second_neighbour = 0;
         }
       }
-    }
-  }
 
-  //write output LSDRaster object
-  LSDRaster Multi2Flow(NRows, NCols, XMinimum, YMinimum, DataResolution,
-                       NoDataValue, area,GeoReferencingStrings);
-  return Multi2Flow;
+      //partition flow following the steepest slope and it's steepest neighbour
+      if (A[cell+offsets[S_max_index]] != NoDataValue){
+        A[cell+offsets[S_max_index]] += cell_area * p1;
+        if (second_neighbour >= 0){
+          A[cell+offsets[second_neighbour]] += cell_area * p2;
+        }
+      }
+    }
+  }
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 
@@ -9699,7 +9743,7 @@ LSDRaster LSDRaster::clip_to_smaller_raster(LSDIndexRaster& smaller_raster)
 // Data is written in the format "i j Magnitude Direction"
 // SWDG 20/1/14
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-void LSDRaster::GetVectors(LSDRaster Magnitude, LSDRaster Direction, string output_file, int step)
+void LSDRaster::GetVectors(LSDRaster& Magnitude, LSDRaster& Direction, string output_file, int step)
 {
 
   vector<string> OutputData;
@@ -9769,6 +9813,7 @@ void LSDRaster::GetVectors(LSDRaster Magnitude, LSDRaster Direction, string outp
 //
 //  Martin Hurst, February, 2012
 //  Modified by David Milodowski, May 2012- generates grid of recording filtered noise
+//  Loops over search offsets in bands of rows with a separable patch kernel
 //
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 LSDRaster LSDRaster::NonLocalMeansFilter(int WindowRadius, int SimilarityRadius, int DegreeFiltering, float Sigma)
@@ -9782,83 +9827,138 @@ LSDRaster LSDRaster::NonLocalMeansFilter(int WindowRadius, int SimilarityRadius,
   //as reflected values from the edge of RasterData
   Array2D<float> PaddedRasterData(NRows+2*SimilarityRadius, NCols+2*SimilarityRadius,0.0);
   PadRasterSymmetric(PaddedRasterData, SimilarityRadius);
+  int PaddedNCols = NCols+2*SimilarityRadius;
 
-  //initiate the local gaussian kernel and populate
+  //The gaussian kernel is separable, so the patch distance is a row of weights
+  //applied along the rows and then down the columns. These are the 1D factors
+  //of the kernel made by MakeGaussianKernel
   int KernelDimension = 2*SimilarityRadius+1;
-  Array2D<float> Kernel(KernelDimension,KernelDimension,0.0);
-  MakeGaussianKernel(Kernel, Sigma, SimilarityRadius);
+  vector<float> Kernel1D(KernelDimension);
+  float twosigma2 = 2.0*Sigma*Sigma;
+  float wgt = 0;
+  for (int a=0; a<KernelDimension; ++a)
+  {
+    Kernel1D[a] = exp(-float((a-SimilarityRadius)*(a-SimilarityRadius))/twosigma2);
+    wgt += Kernel1D[a];
+  }
+  for (int a=0; a<KernelDimension; ++a)
+  {
+    Kernel1D[a] = Kernel1D[a]/wgt;
+  }
+  float h2 = float(DegreeFiltering*DegreeFiltering);
 
-  //initiate temporary arrays
-  Array2D<float> W1(KernelDimension,KernelDimension);
-  Array2D<float> W2(KernelDimension,KernelDimension);
+  // The DEM is done in bands of rows. Within a band the outer loop is over the
+  // offsets of the search window: for each offset the squared differences
+  // between the padded DEM and its shifted copy are filtered with the separable
+  // kernel to get the patch distance of every cell in the band at once. Memory
+  // is bounded by the band size and bands are split among threads.
+  int BandRows = 32;
+  int NBands = (NRows+BandRows-1)/BandRows;
 
-  //initiate temp variables
-  float w, wmax, average, sweight, d;
+  #pragma omp parallel for schedule(dynamic)
+  for (int band=0; band<NBands; ++band)
+  {
+    int band_start = band*BandRows;
+    int band_end = min(band_start+BandRows,NRows);
+    int n_band = band_end-band_start;
+    int n_patch_rows = n_band+2*SimilarityRadius;
 
-  //loop through DEM
-  int i1, j1, rowmin, rowmax, colmin, colmax;
+    // squared differences, the distances after the row pass, and the accumulators
+    vector<float> SqDiff(n_patch_rows*PaddedNCols);
+    vector<float> RowPass(n_patch_rows*NCols);
+    vector<float> WMax(n_band*NCols,0.0);
+    vector<float> SWeight(n_band*NCols,0.0);
+    vector<float> Average(n_band*NCols,0.0);
 
-  for (int i=0; i<NRows; ++i)
-  {
-    i1 = i+SimilarityRadius;
-    for (int j=0; j<NCols; ++j)
+    for (int di=-WindowRadius; di<=WindowRadius; ++di)
+    {
+      // rows of the band whose comparison cell is on the DEM
+      int first_row = max(band_start,-di);
+      int last_row = min(band_end-1,NRows-1-di);
+      if (first_row > last_row)
+      {
+        continue;
+      }
+      for (int dj=-WindowRadius; dj<=WindowRadius; ++dj)
       {
-        j1 = j+SimilarityRadius;
-        //Get DEM sample  with size SimilarityRadius, centred on cell of interest
-        for (int a=0; a<(KernelDimension); ++a)
+        //If centre cell do nothing
+        if (di == 0 && dj == 0)
         {
-          for (int b=0; b<(KernelDimension); ++b)
+          continue;
+        }
+        int first_col = max(0,-dj);
+        int last_col = min(NCols-1,NCols-1-dj);
+        if (first_col > last_col)
+        {
+          continue;
+        }
+
+        // squared differences over the patches of the rows that are used.
+        // Patch row p of band row i is padded row i+p
+        for (int pr=first_row-band_start; pr<=last_row-band_start+2*SimilarityRadius; ++pr)
+        {
+          float* this_row = PaddedRasterData[band_start+pr];
+          float* shifted_row = PaddedRasterData[band_start+pr+di];
+          float* sq_row = &SqDiff[pr*PaddedNCols];
+          for (int pc=first_col; pc<=last_col+2*SimilarityRadius; ++pc)
           {
-            W1[a][b] = PaddedRasterData[i1-SimilarityRadius+a][j1-SimilarityRadius+b];
+            float diff = this_row[pc]-shifted_row[pc+dj];
+            sq_row[pc] = diff*diff;
           }
         }
 
-        wmax=0;
-        average=0;
-        sweight=0;
-
-        //get bounding conditions
-        rowmin = max(i1-WindowRadius,SimilarityRadius);
-        rowmax = min(i1+WindowRadius,NRows+SimilarityRadius-1);
-        colmin = max(j1-WindowRadius,SimilarityRadius);
-        colmax = min(j1+WindowRadius,NCols+SimilarityRadius-1);
-
-        //loop to calculate weigths for each cell
-        for (int row=rowmin; row<rowmax+1; ++row)
+        // weights along the rows
+        for (int pr=first_row-band_start; pr<=last_row-band_start+2*SimilarityRadius; ++pr)
         {
-          for (int col=colmin; col<colmax+1; ++col)
+          float* sq_row = &SqDiff[pr*PaddedNCols];
+          float* out_row = &RowPass[pr*NCols];
+          for (int col=first_col; col<=last_col; ++col)
           {
-            d=0;
-
-            //If centre cell do nothing
-            if (row!=i1 || col!=j1)
-            //Otherwise do the calculations
+            float sum = 0;
+            for (int b=0; b<KernelDimension; ++b)
             {
-              //Extract DEM centred around each point in kernel
-              for (int a=0; a<(KernelDimension); ++a)
-              {
-                for (int b=0; b<(KernelDimension); ++b)
-                {
-                  W2[a][b] = PaddedRasterData[row+a-SimilarityRadius][col+b-SimilarityRadius];
-                  d += Kernel[a][b]*(W1[a][b]-W2[a][b])*(W1[a][b]-W2[a][b]);
-                }
-              }
+              sum += Kernel1D[b]*sq_row[col+b];
+            }
+            out_row[col] = sum;
+          }
+        }
 
-              w = exp(-d/(DegreeFiltering*DegreeFiltering));
-              if (w>wmax) wmax=w;
-              sweight += w;
-              average += w*PaddedRasterData[row][col];
+        // weights down the columns, then update the weighted average
+        for (int i=first_row; i<=last_row; ++i)
+        {
+          int bi = i-band_start;
+          float* centre_row = PaddedRasterData[i+di+SimilarityRadius];
+          for (int col=first_col; col<=last_col; ++col)
+          {
+            float d = 0;
+            for (int a=0; a<KernelDimension; ++a)
+            {
+              d += Kernel1D[a]*RowPass[(bi+a)*NCols+col];
             }
-         }
+            float w = exp(-d/h2);
+            int index = bi*NCols+col;
+            if (w>WMax[index]) WMax[index]=w;
+            SWeight[index] += w;
+            Average[index] += w*centre_row[col+dj+SimilarityRadius];
+          }
+        }
       }
-      average += wmax*PaddedRasterData[i1][j1];
-      sweight += wmax;
+    }
+
+    for (int i=band_start; i<band_end; ++i)
+    {
+      for (int j=0; j<NCols; ++j)
+      {
+        int index = (i-band_start)*NCols+j;
+        float average = Average[index]+WMax[index]*PaddedRasterData[i+SimilarityRadius][j+SimilarityRadius];
+        float sweight = SWeight[index]+WMax[index];
 
-      if (sweight > 0) FilteredRasterData[i][j] = average/sweight;
-      else FilteredRasterData[i][j] = RasterData[i][j];
+        if (sweight > 0) FilteredRasterData[i][j] = average/sweight;
+        else FilteredRasterData[i][j] = RasterData[i][j];
 
-      // Also extract a record of the noise
-      //FilteredNoise[i][j]=RasterData[i][j]-FilteredRasterData[i][j];
+        // Also extract a record of the noise
+        //FilteredNoise[i][j]=RasterData[i][j]-FilteredRasterData[i][j];
+      }
     }
   }
 
@@ -9999,60 +10099,110 @@ LSDRaster LSDRaster::GaussianFilter(float sigma, int kr)
 {
   // This is the default setting
   if(kr==0) kr = int(ceil(3*sigma/DataResolution));  // Set radius of kernel (default if not specified)
-  int kw=2*kr+1;                                     // width of kernel
-  Array2D<float> filtered = RasterData.copy();
-  Array2D<float> gaussian_kernel_weights(kw,kw,0.0);
 
-  // gemerate kernel
-  float x,y;
-  for(int i=0;i<kw;++i)
+  Array2D<float> filtered(NRows,NCols);
+  Array2D<float> row_values(NRows,NCols);
+  Array2D<float> row_weights(NRows,NCols);
+  separable_gaussian_smooth(RasterData, sigma, kr, filtered, row_values, row_weights);
+
+  LSDRaster FilteredRaster(NRows,NCols,XMinimum,YMinimum,DataResolution,NoDataValue,filtered);
+//   FilteredRaster.write_raster("test_gauss","flt");
+  return FilteredRaster;
+}
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// The Gaussian smoothing engine behind GaussianFilter and PeronaMalikFilter.
+// The 2D weights exp(-(x*x+y*y)/(2*sigma*sigma)) are the product of a row and
+// a column weight, and nodata cells (and cells off the edge of the raster)
+// are simply left out of both the weighted sum of values and the sum of
+// weights. Both sums are therefore separable: a pass along the rows followed
+// by a pass down the columns gives the same result as the full kernel, with
+// 2*(2*kr+1) rather than (2*kr+1)^2 operations per cell. The filtered value is
+// the ratio of the two sums, so at edges this is the one sided gaussian.
+//
+// Data must be NRows x NCols. Smoothed, RowValues and RowWeights must be arrays
+// of the same size; they are overwritten, so callers that filter repeatedly
+// can reuse them. Rows are split between threads in both passes.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDRaster::separable_gaussian_smooth(Array2D<float>& Data, float sigma, int kr,
+                                          Array2D<float>& Smoothed,
+                                          Array2D<float>& RowValues,
+                                          Array2D<float>& RowWeights)
+{
+  int kw = 2*kr+1;                                     // width of kernel
+  float NDV = float(NoDataValue);
+
+  // generate the 1D kernel
+  vector<float> kernel(kw);
+  for(int k=0;k<kw;++k)
   {
-    for(int j=0;j<kw;++j)
-    {
-      x = (j-kr)*DataResolution;
-      y = (i-kr)*DataResolution;
-//       gaussian_kernel_weights[i][j]= (1/(2*M_PI*sigma*sigma)) * exp(-(x*x+y*y)/(2*sigma*sigma));
-      gaussian_kernel_weights[i][j]= exp(-(x*x+y*y)/(2*sigma*sigma));
-    }
+    float x = (k-kr)*DataResolution;
+    kernel[k] = exp(-(x*x)/(2*sigma*sigma));
   }
-  //  Now loop through dem filtering using the gaussian kernel
+
+  // pass along the rows
+  #pragma omp parallel for
   for(int i=0;i<NRows;++i)
   {
+    float* data_row = Data[i];
+    float* value_row = RowValues[i];
+    float* weight_row = RowWeights[i];
     for(int j=0;j<NCols;++j)
     {
-      // Avoid edges
-//       if((i-kr < 0) || (i+kr+1 > NRows) || (j-kr < 0) || (j+kr+1 > NCols) || RasterData[i][j]==NoDataValue)
-      if(RasterData[i][j]==NoDataValue)
+      int k_start = (j-kr < 0) ? kr-j : 0;
+      int k_end = (j+kr > NCols-1) ? kr+NCols-1-j : kw-1;
+      float summed_weights = 0;
+      float summed_values = 0;
+      for(int k=k_start;k<=k_end;++k)
       {
-        filtered[i][j] = NoDataValue;
+        float value = data_row[j-kr+k];
+        float weight = (value != NDV) ? kernel[k] : 0;
+        summed_weights += weight;
+        summed_values += weight*value;
       }
-      else
-      {
-        float summed_weights = 0;
-        float summed_values = 0;
+      value_row[j] = summed_values;
+      weight_row[j] = summed_weights;
+    }
+  }
 
-        for(int i_kernel=0;i_kernel<kw;++i_kernel)
+  // pass down the columns. Each row of the output adds whole rows of the
+  // first pass, which keeps the inner loop running along contiguous memory
+  #pragma omp parallel
+  {
+    vector<float> summed_values(NCols);
+    vector<float> summed_weights(NCols);
+
+    #pragma omp for
+    for(int i=0;i<NRows;++i)
+    {
+      for(int j=0;j<NCols;++j)
+      {
+        summed_values[j] = 0;
+        summed_weights[j] = 0;
+      }
+      int k_start = (i-kr < 0) ? kr-i : 0;
+      int k_end = (i+kr > NRows-1) ? kr+NRows-1-i : kw-1;
+      for(int k=k_start;k<=k_end;++k)
+      {
+        float weight = kernel[k];
+        float* value_row = RowValues[i-kr+k];
+        float* weight_row = RowWeights[i-kr+k];
+        for(int j=0;j<NCols;++j)
         {
-          for(int j_kernel=0;j_kernel<kw;++j_kernel)
-          {
-            if(i-kr+i_kernel>=0 && i-kr+i_kernel<NRows && j-kr+j_kernel>=0 && j-kr+j_kernel<NCols)
-            {
-              if(RasterData[i-kr+i_kernel][j-kr+j_kernel]!=NoDataValue)                   // at edges, this takes the one sided gaussian
-              {
-                summed_weights += gaussian_kernel_weights[i_kernel][j_kernel];
-                summed_values += RasterData[i-kr+i_kernel][j-kr+j_kernel]*gaussian_kernel_weights[i_kernel][j_kernel];
-              }
-            }
-          }
+          summed_values[j] += weight*value_row[j];
+          summed_weights[j] += weight*weight_row[j];
         }
-        // Get filtered value, ensuring that weights are normalised
-        filtered[i][j] = summed_values/summed_weights;
+      }
+
+      // Get filtered value, ensuring that weights are normalised
+      float* data_row = Data[i];
+      float* smoothed_row = Smoothed[i];
+      for(int j=0;j<NCols;++j)
+      {
+        smoothed_row[j] = (data_row[j] == NDV) ? NDV : summed_values[j]/summed_weights[j];
       }
     }
   }
-  LSDRaster FilteredRaster(NRows,NCols,XMinimum,YMinimum,DataResolution,NoDataValue,filtered);
-//   FilteredRaster.write_raster("test_gauss","flt");
-  return FilteredRaster;
 }
 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
@@ -10094,78 +10244,90 @@ LSDRaster LSDRaster::PeronaMalikFilter(int timesteps, float percentile_for_lambd
   int N_slopes = finite_difference_slopes.size();
   if(N_slopes>0)
   {
-    vector<size_t> index_map;
-    matlab_float_sort(finite_difference_slopes,finite_difference_slopes,index_map);
+    sort(finite_difference_slopes.begin(),finite_difference_slopes.end());
     lambda =  get_percentile(finite_difference_slopes, percentile_for_lambda);
   }
 //   lambda = 0.9;
   cout << "lambda " << lambda << endl;
-  // Now do the nonlinear filtering
-  Array2D<float> Topography = get_RasterData();
-  LSDRaster PM_FilteredTopo(NRows,NCols,XMinimum,YMinimum,DataResolution,NoDataValue,Topography.copy(),GeoReferencingStrings);
+
+  // Now do the nonlinear filtering. Each timestep reads the topography from
+  // one array and writes the result to the other, and the arrays then swap
+  // roles, so nothing is allocated inside the loop
+  Array2D<float> Topography = RasterData.copy();
+  Array2D<float> Updated(NRows,NCols);
+  Array2D<float> GaussianFilteredTopo(NRows,NCols);
+  Array2D<float> row_values(NRows,NCols);
+  Array2D<float> row_weights(NRows,NCols);
+  float NDV = float(NoDataValue);
+  float one_over_lambda = 1/lambda;
+  float one_over_res = 1/DataResolution;
 
   for(int t = 0; t<timesteps; ++t)
   {
     cout << flush << "\t\t\t Perona-Malik Filter; timestep " << t+1 << " of " << timesteps << "\r";
     // Gaussian filter
     int kr = 2;
-    LSDRaster GaussianFilteredTopo = PM_FilteredTopo.GaussianFilter(sqrt(sigma),kr);
-
-    // Now get slopes and diffusion coefficients
-    float p_n, p_s, p_e, p_w;
-    float dh;
-    //float slope_n, slope_s, slope_e, slope_w;
-    float slope_n_g, slope_s_g, slope_e_g, slope_w_g;
-    int count = 0;
-    int bad_count=0;
+    separable_gaussian_smooth(Topography, sqrt(sigma), kr, GaussianFilteredTopo,
+                              row_values, row_weights);
+
+    // Now get slopes and diffusion coefficients. The edges become nodata.
+    #pragma omp parallel for
     for (int i=0; i<NRows;++i)
     {
-      for (int j=0; j<NCols;++j)
+      float* z_new = Updated[i];
+      if (i == 0 || i == NRows-1)
       {
-        if(i-1>=0 && i+1<NRows && j-1>=0 && j+1<NCols)
+        for (int j=0; j<NCols;++j)
         {
-          if(PM_FilteredTopo.get_data_element(i,j)==NoDataValue || PM_FilteredTopo.get_data_element(i+1,j)==NoDataValue
-           || PM_FilteredTopo.get_data_element(i-1,j)==NoDataValue || PM_FilteredTopo.get_data_element(i,j+1)==NoDataValue
-           || PM_FilteredTopo.get_data_element(i,j-1)==NoDataValue)
-          {
-            Topography[i][j] = NoDataValue;
-            ++bad_count;
-          }
-          else
-          {
-            ++count;
-            // Calculate the diffusion coefficient
-            slope_n_g = (GaussianFilteredTopo.get_data_element(i-1,j)-GaussianFilteredTopo.get_data_element(i,j))/DataResolution;
-            slope_s_g = (GaussianFilteredTopo.get_data_element(i+1,j)-GaussianFilteredTopo.get_data_element(i,j))/DataResolution;
-            slope_e_g = (GaussianFilteredTopo.get_data_element(i,j+1)-GaussianFilteredTopo.get_data_element(i,j))/DataResolution;
-            slope_w_g = (GaussianFilteredTopo.get_data_element(i,j-1)-GaussianFilteredTopo.get_data_element(i,j))/DataResolution;
-
-            p_n = 1/( 1 + ( abs(slope_n_g)/lambda )*( abs(slope_n_g)/lambda ) );
-            p_s = 1/( 1 + ( abs(slope_s_g)/lambda )*( abs(slope_s_g)/lambda ) );
-            p_e = 1/( 1 + ( abs(slope_e_g)/lambda )*( abs(slope_e_g)/lambda ) );
-            p_w = 1/( 1 + ( abs(slope_w_g)/lambda )*( abs(slope_w_g)/lambda ) );
-//             p_n = exp(-((abs(slope_n_g)/lambda )*(abs(slope_n_g)/lambda)));
-//             p_s = exp(-((abs(slope_s_g)/lambda )*(abs(slope_s_g)/lambda)));
-//             p_e = exp(-((abs(slope_e_g)/lambda )*(abs(slope_e_g)/lambda)));
-//             p_w = exp(-((abs(slope_w_g)/lambda )*(abs(slope_w_g)/lambda)));
-
-            //slope_n = (PM_FilteredTopo.get_data_element(i-1,j)-PM_FilteredTopo.get_data_element(i,j))/DataResolution;
-            //slope_s = (PM_FilteredTopo.get_data_element(i+1,j)-PM_FilteredTopo.get_data_element(i,j))/DataResolution;
-            //slope_e = (PM_FilteredTopo.get_data_element(i,j+1)-PM_FilteredTopo.get_data_element(i,j))/DataResolution;
-            //slope_w = (PM_FilteredTopo.get_data_element(i,j-1)-PM_FilteredTopo.get_data_element(i,j))/DataResolution;
-
-            dh = dt*(p_n*slope_n_g + p_s*slope_s_g + p_e*slope_e_g + p_w*slope_w_g);
-            Topography[i][j]+=dh;
+          z_new[j] = NDV;
+        }
+        continue;
+      }
+      z_new[0] = NDV;
+      z_new[NCols-1] = NDV;
 
-          }
+      float* z = Topography[i];
+      float* z_n = Topography[i-1];
+      float* z_s = Topography[i+1];
+      float* g = GaussianFilteredTopo[i];
+      float* g_n = GaussianFilteredTopo[i-1];
+      float* g_s = GaussianFilteredTopo[i+1];
+      for (int j=1; j<NCols-1;++j)
+      {
+        if(z[j]==NDV || z_s[j]==NDV || z_n[j]==NDV || z[j+1]==NDV || z[j-1]==NDV)
+        {
+          z_new[j] = NDV;
+        }
+        else
+        {
+          // Calculate the diffusion coefficient
+          float slope_n_g = (g_n[j]-g[j])*one_over_res;
+          float slope_s_g = (g_s[j]-g[j])*one_over_res;
+          float slope_e_g = (g[j+1]-g[j])*one_over_res;
+          float slope_w_g = (g[j-1]-g[j])*one_over_res;
+
+          float r_n = slope_n_g*one_over_lambda;
+          float r_s = slope_s_g*one_over_lambda;
+          float r_e = slope_e_g*one_over_lambda;
+          float r_w = slope_w_g*one_over_lambda;
+          float p_n = 1/(1 + r_n*r_n);
+          float p_s = 1/(1 + r_s*r_s);
+          float p_e = 1/(1 + r_e*r_e);
+          float p_w = 1/(1 + r_w*r_w);
+
+          z_new[j] = z[j] + dt*(p_n*slope_n_g + p_s*slope_s_g + p_e*slope_e_g + p_w*slope_w_g);
         }
-        else Topography[i][j] = NoDataValue;
       }
     }
 
-    // Now update the LSDRaster
-    PM_FilteredTopo = PM_FilteredTopo.LSDRasterTemplate(Topography.copy());
+    // Now swap the arrays: the update becomes the topography for the next step
+    Array2D<float> temp = Topography;
+    Topography = Updated;
+    Updated = temp;
   }
+
+  LSDRaster PM_FilteredTopo(NRows,NCols,XMinimum,YMinimum,DataResolution,NoDataValue,
+                            Topography,GeoReferencingStrings);
   cout << endl;
   return PM_FilteredTopo;
 }
@@ -10351,155 +10513,379 @@ Array2D<int> LSDRaster::create_mask(float window_radius, int neighbourhood_switc
 }
 //---------------------------------------------------------------------------------------
 
-
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-// spatial_average
-// Calculates a spatial average using a specified moving window.  Uses a neighbourhood
-// switch to select circular (1) vs square window (0)
-// DTM 19/06/2014
+// Breaks a mask from create_mask (or any other square, odd width mask) into
+// rectangles. Consecutive mask rows with the same runs of 1s are merged, so a
+// square window is a single rectangle and a circular window has one rectangle
+// per change in the row half width. The rectangles do not overlap, and those that
+// share the same rows are next to each other. Offsets are relative to the centre
+// of the mask and are inclusive.
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-LSDRaster LSDRaster::neighbourhood_statistics_spatial_average(float window_radius, int neighbourhood_switch)
+void LSDRaster::get_mask_rectangles(Array2D<int>& mask, vector<int>& row_start,
+                                    vector<int>& row_end, vector<int>& col_start,
+                                    vector<int>& col_end)
 {
-  Array2D<float> SpatialAverageArray(NRows,NCols,NoDataValue);
-//   Array2D<float> StandardDeviationArray(NRows,NCols,NoDataValue);
+  row_start.clear();
+  row_end.clear();
+  col_start.clear();
+  col_end.clear();
 
-  // catch if the supplied window radius is less than the data resolution and
-  // set it to equal the data resolution - SWDG
-  if (window_radius < DataResolution)
+  int kw = mask.dim1();
+  int kr = (kw-1)/2;
+
+  // get the runs of each row of the mask
+  vector< vector<int> > run_starts(kw);
+  vector< vector<int> > run_ends(kw);
+  for (int i = 0; i<kw; i++)
   {
-    cout << "Supplied window radius: " << window_radius << " is less than the data resolution: " <<
-    DataResolution << ".\nWindow radius has been set to data resolution." << endl;
-    window_radius = DataResolution;
+    int j = 0;
+    while (j < kw)
+    {
+      if (mask[i][j] == 1)
+      {
+        int this_start = j;
+        while (j < kw && mask[i][j] == 1)
+        {
+          j++;
+        }
+        run_starts[i].push_back(this_start-kr);
+        run_ends[i].push_back(j-1-kr);
+      }
+      else
+      {
+        j++;
+      }
+    }
   }
 
-  // Prepare kernel
-  int kr = int(ceil(window_radius/DataResolution));  // Set radius of kernel
-  int kw=2*kr+1;                                     // width of kernel
-  Array2D<float> data_kernel(kw,kw,NoDataValue);
-  Array2D<int> mask = create_mask(window_radius, neighbourhood_switch);
+  // now merge rows with identical runs
+  int i = 0;
+  while (i < kw)
+  {
+    int group_end = i;
+    while (group_end+1 < kw && run_starts[group_end+1] == run_starts[i]
+                             && run_ends[group_end+1] == run_ends[i])
+    {
+      group_end++;
+    }
+    for (int r = 0; r< int(run_starts[i].size()); r++)
+    {
+      row_start.push_back(i-kr);
+      row_end.push_back(group_end-kr);
+      col_start.push_back(run_starts[i][r]);
+      col_end.push_back(run_ends[i][r]);
+    }
+    i = group_end+1;
+  }
+}
+//---------------------------------------------------------------------------------------
 
-  // Move window over DEM and extract neighbourhood pixels
-  cout << "\n\tRunning neighbourhood statistics..." << endl;
-  cout << "\t\tDEM size = " << NRows << " x " << NCols << endl;
-  float mean, value;
-  vector<float> data;
-  for(int i=0;i<NRows;++i)
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// Gets the minimum and maximum of the data in a moving window defined by a mask.
+// Each rectangle of the mask is done separably: a van Herk/Gil-Werman running
+// max down the columns and then along the rows, so the cost per cell does not
+// depend on the size of the window (a square window is one rectangle).
+// Nodata is ignored and windows are clipped at the edge of the raster. Cells
+// with no data in their window are NoDataValue.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+void LSDRaster::calculate_window_extrema(Array2D<int>& mask, Array2D<float>& WindowMin,
+                                         Array2D<float>& WindowMax)
+{
+  vector<int> row_start, row_end, col_start, col_end;
+  get_mask_rectangles(mask, row_start, row_end, col_start, col_end);
+  int N_rectangles = int(row_start.size());
+
+  // the minimum is got as the maximum of the negated data
+  float lowest = -numeric_limits<float>::max();
+  Array2D<float> Max(NRows,NCols,lowest);
+  Array2D<float> NegMin(NRows,NCols,lowest);
+  Array2D<float> ColMax(NRows,NCols,lowest);
+  Array2D<float> ColNegMin(NRows,NCols,lowest);
+
+  for (int rect = 0; rect<N_rectangles; rect++)
   {
-    cout << "\tRow = " << i+1 << " / " << NRows << "    \r";
-    for(int j=0;j<NCols;++j)
+    // rectangles sharing rows share the column pass
+    if (rect == 0 || row_start[rect] != row_start[rect-1] || row_end[rect] != row_end[rect-1])
     {
-      // Avoid edges
-      if((i-kr < 0) || (i+kr+1 > NRows) || (j-kr < 0) || (j+kr+1 > NCols) || RasterData[i][j]==NoDataValue)
+      #pragma omp parallel for
+      for (int col = 0; col<NCols; col++)
       {
-        SpatialAverageArray[i][j] = NoDataValue;
+        vector<float> column(NRows), neg_column(NRows), column_max, neg_column_max;
+        for (int row = 0; row<NRows; row++)
+        {
+          float value = RasterData[row][col];
+          column[row] = (value == NoDataValue) ? lowest : value;
+          neg_column[row] = (value == NoDataValue) ? lowest : -value;
+        }
+        sliding_window_max(column, row_start[rect], row_end[rect], column_max);
+        sliding_window_max(neg_column, row_start[rect], row_end[rect], neg_column_max);
+        for (int row = 0; row<NRows; row++)
+        {
+          ColMax[row][col] = column_max[row];
+          ColNegMin[row][col] = neg_column_max[row];
+        }
       }
-      else
+    }
+
+    #pragma omp parallel for
+    for (int row = 0; row<NRows; row++)
+    {
+      vector<float> this_row(ColMax[row],ColMax[row]+NCols);
+      vector<float> this_neg_row(ColNegMin[row],ColNegMin[row]+NCols);
+      vector<float> row_max, neg_row_max;
+      sliding_window_max(this_row, col_start[rect], col_end[rect], row_max);
+      sliding_window_max(this_neg_row, col_start[rect], col_end[rect], neg_row_max);
+      for (int col = 0; col<NCols; col++)
       {
-        // Sample DEM
-        for(int i_kernel=0;i_kernel<kw;++i_kernel)
+        if (row_max[col] > Max[row][col])
         {
-          for(int j_kernel=0;j_kernel<kw;++j_kernel)
-          {
-            value = RasterData[i-kr+i_kernel][j-kr+j_kernel];
-            if(value!=NoDataValue && mask[i_kernel][j_kernel]==1) data.push_back(value);
-          }
+          Max[row][col] = row_max[col];
+        }
+        if (neg_row_max[col] > NegMin[row][col])
+        {
+          NegMin[row][col] = neg_row_max[col];
         }
-        // Get stats
-        mean = get_mean(data);
-        SpatialAverageArray[i][j] = mean;
-        // StandardDeviationArray[i][j] = get_standard_deviation(data,mean);
-        data.clear();
       }
     }
   }
 
-  LSDRaster SpatialAverage(NRows,NCols,XMinimum,YMinimum,DataResolution,
-                      NoDataValue,SpatialAverageArray,GeoReferencingStrings);
-  return SpatialAverage;
+  Array2D<float> MinOut(NRows,NCols,NoDataValue);
+  Array2D<float> MaxOut(NRows,NCols,NoDataValue);
+  for (int row = 0; row<NRows; row++)
+  {
+    for (int col = 0; col<NCols; col++)
+    {
+      if (Max[row][col] != lowest)
+      {
+        MaxOut[row][col] = Max[row][col];
+        MinOut[row][col] = -NegMin[row][col];
+      }
+    }
+  }
+  WindowMin = MinOut.copy();
+  WindowMax = MaxOut.copy();
 }
+//---------------------------------------------------------------------------------------
 
-
-//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-// overloaded function to kick out 2 rasters -> local standard deviation & average
-//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
-vector<LSDRaster> LSDRaster::neighbourhood_statistics_spatial_average_and_SD(float window_radius, int neighbourhood_switch)
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// Gets the mean, standard deviation and fraction of cells meeting a condition in
+// a moving window defined by a mask. For each set of mask rows the column sums of
+// the count, data and squared data are updated as the window moves down one row
+// (add the new row, remove the old one), and then the sums along the row are got
+// from prefix sums of these. The cost per cell is proportional to the number of
+// rectangles in the mask (one for a square window) rather than its area.
+// The sums are kept in double precision relative to a reference elevation to
+// limit cancellation in the variance.
+// The condition_switch is as in neighbourhood_statistics_fraction_condition.
+// Nodata is ignored and windows are clipped at the edge of the raster. Cells
+// with no data in their window are NoDataValue.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+void LSDRaster::calculate_window_moments(Array2D<int>& mask, int condition_switch,
+                                         float test_value, Array2D<float>& WindowMean,
+                                         Array2D<float>& WindowSD,
+                                         Array2D<float>& WindowFraction)
 {
-  Array2D<float> SpatialAverageArray(NRows,NCols,NoDataValue);
-  Array2D<float> StandardDeviationArray(NRows,NCols,NoDataValue);
+  vector<int> row_start, row_end, col_start, col_end;
+  get_mask_rectangles(mask, row_start, row_end, col_start, col_end);
+  int N_rectangles = int(row_start.size());
 
-  // catch if the supplied window radius is less than the data resolution and
-  // set it to equal the data resolution - SWDG
-  if (window_radius < DataResolution)
+  // rectangles sharing the same rows share a band of column sums
+  vector<int> band_of_rectangle(N_rectangles);
+  vector<int> band_start, band_end;
+  for (int rect = 0; rect<N_rectangles; rect++)
   {
-    cout << "Supplied window radius: " << window_radius << " is less than the data resolution: " <<
-    DataResolution << ".\nWindow radius has been set to data resolution." << endl;
-    window_radius = DataResolution;
+    if (rect == 0 || row_start[rect] != row_start[rect-1] || row_end[rect] != row_end[rect-1])
+    {
+      band_start.push_back(row_start[rect]);
+      band_end.push_back(row_end[rect]);
+    }
+    band_of_rectangle[rect] = int(band_start.size())-1;
   }
-  // Prepare kernel
-  int kr = int(ceil(window_radius/DataResolution));  // Set radius of kernel
-  int kw=2*kr+1;                                     // width of kernel
-  Array2D<float> data_kernel(kw,kw,NoDataValue);
-  Array2D<int> mask = create_mask(window_radius, neighbourhood_switch);
+  int N_bands = int(band_start.size());
 
-  // Move window over DEM and extract neighbourhood pixels
-  cout << "\n\tRunning spatial statistics module..." << endl;
-  cout << "\t\tDEM size = " << NRows << " x " << NCols << endl;
-  float mean, value;
-  vector<float> data;
-  for(int i=0;i<NRows;++i)
+  // the reference value is the first data value
+  double z_ref = 0;
+  bool found_ref = false;
+  for (int row = 0; row<NRows && !found_ref; row++)
   {
-    cout << "\tRow = " << i+1 << " / " << NRows << "    \r";
-    for(int j=0;j<NCols;++j)
+    for (int col = 0; col<NCols && !found_ref; col++)
     {
-      // Avoid edges
-      if((i-kr < 0) || (i+kr+1 > NRows) || (j-kr < 0) || (j+kr+1 > NCols)
-                    || RasterData[i][j]==NoDataValue)
+      if (RasterData[row][col] != NoDataValue)
       {
-        SpatialAverageArray[i][j] = NoDataValue;
+        z_ref = RasterData[row][col];
+        found_ref = true;
       }
-      else
+    }
+  }
+
+  // count, number meeting the condition, sum and sum of squares down the
+  // columns of each band
+  vector< vector<int> > ColN(N_bands, vector<int>(NCols,0));
+  vector< vector<int> > ColTrue(N_bands, vector<int>(NCols,0));
+  vector< vector<double> > ColSum(N_bands, vector<double>(NCols,0.0));
+  vector< vector<double> > ColSumSq(N_bands, vector<double>(NCols,0.0));
+
+  // prefix sums along the row and the window totals
+  vector<int> PN(NCols+1), PTrue(NCols+1);
+  vector<double> PSum(NCols+1), PSumSq(NCols+1);
+  vector<int> WN(NCols), WTrue(NCols);
+  vector<double> WSum(NCols), WSumSq(NCols);
+
+  Array2D<float> MeanOut(NRows,NCols,NoDataValue);
+  Array2D<float> SDOut(NRows,NCols,NoDataValue);
+  Array2D<float> FractionOut(NRows,NCols,NoDataValue);
+
+  for (int row = 0; row<NRows; row++)
+  {
+    // update the column sums of each band. Row -1 is the starting point, where
+    // all the sums are zero, so the first row adds all the rows in the band
+    for (int band = 0; band<N_bands; band++)
+    {
+      int add_first = (row == 0) ? band_start[band] : row+band_end[band];
+      int add_last = row+band_end[band];
+      int remove_row = (row == 0) ? -1 : row-1+band_start[band];
+      for (int sign = -1; sign <= 1; sign += 2)
       {
-        // Sample DEM
-        for(int i_kernel=0;i_kernel<kw;++i_kernel)
+        int first = (sign == 1) ? add_first : remove_row;
+        int last = (sign == 1) ? add_last : remove_row;
+        if (first < 0)
         {
-          for(int j_kernel=0;j_kernel<kw;++j_kernel)
+          first = 0;
+        }
+        if (last > NRows-1)
+        {
+          last = NRows-1;
+        }
+        for (int r = first; r<=last; r++)
+        {
+          float* data_row = RasterData[r];
+          for (int col = 0; col<NCols; col++)
           {
-            value = RasterData[i-kr+i_kernel][j-kr+j_kernel];
-            if(value!=NoDataValue && mask[i_kernel][j_kernel]==1) data.push_back(value);
+            float value = data_row[col];
+            if (value != NoDataValue)
+            {
+              double dz = double(value)-z_ref;
+              bool is_true = false;
+              switch (condition_switch)
+              {
+                case 0: is_true = (value == test_value); break;
+                case 1: is_true = (value != test_value); break;
+                case 2: is_true = (value > test_value); break;
+                case 3: is_true = (value >= test_value); break;
+                case 4: is_true = (value < test_value); break;
+                case 5: is_true = (value <= test_value); break;
+              }
+              ColN[band][col] += sign;
+              ColSum[band][col] += sign*dz;
+              ColSumSq[band][col] += sign*dz*dz;
+              if (is_true)
+              {
+                ColTrue[band][col] += sign;
+              }
+            }
           }
         }
+      }
+    }
+
+    // add up the rectangles along the row
+    for (int col = 0; col<NCols; col++)
+    {
+      WN[col] = 0;
+      WTrue[col] = 0;
+      WSum[col] = 0;
+      WSumSq[col] = 0;
+    }
+    for (int rect = 0; rect<N_rectangles; rect++)
+    {
+      int band = band_of_rectangle[rect];
+      if (rect == 0 || band != band_of_rectangle[rect-1])
+      {
+        PN[0] = 0;
+        PTrue[0] = 0;
+        PSum[0] = 0;
+        PSumSq[0] = 0;
+        for (int col = 0; col<NCols; col++)
+        {
+          PN[col+1] = PN[col]+ColN[band][col];
+          PTrue[col+1] = PTrue[col]+ColTrue[band][col];
+          PSum[col+1] = PSum[col]+ColSum[band][col];
+          PSumSq[col+1] = PSumSq[col]+ColSumSq[band][col];
+        }
+      }
+      for (int col = 0; col<NCols; col++)
+      {
+        int first = col+col_start[rect];
+        int last = col+col_end[rect];
+        if (first < 0)
+        {
+          first = 0;
+        }
+        if (last > NCols-1)
+        {
+          last = NCols-1;
+        }
+        if (first <= last)
+        {
+          WN[col] += PN[last+1]-PN[first];
+          WTrue[col] += PTrue[last+1]-PTrue[first];
+          WSum[col] += PSum[last+1]-PSum[first];
+          WSumSq[col] += PSumSq[last+1]-PSumSq[first];
+        }
+      }
+    }
 
-        // Get stats
-        mean = get_mean(data);
-        SpatialAverageArray[i][j] = mean;
-        StandardDeviationArray[i][j] = get_standard_deviation(data,mean);
-        data.clear();
+    for (int col = 0; col<NCols; col++)
+    {
+      if (WN[col] > 0)
+      {
+        double n = double(WN[col]);
+        double mean_dz = WSum[col]/n;
+        double variance = WSumSq[col]/n-mean_dz*mean_dz;
+        if (variance < 0)
+        {
+          variance = 0;
+        }
+        MeanOut[row][col] = float(z_ref+mean_dz);
+        SDOut[row][col] = float(sqrt(variance));
+        FractionOut[row][col] = float(WTrue[col])/float(WN[col]);
       }
     }
   }
 
-  LSDRaster SpatialAverage(NRows,NCols,XMinimum,YMinimum,DataResolution,
-                         NoDataValue,SpatialAverageArray,GeoReferencingStrings);
-  LSDRaster SpatialSD(NRows,NCols,XMinimum,YMinimum,DataResolution,NoDataValue,
-                          StandardDeviationArray,GeoReferencingStrings);
-  vector<LSDRaster> output_rasters;
-  output_rasters.push_back(SpatialAverage);
-  output_rasters.push_back(SpatialSD);
-  return output_rasters;
+  WindowMean = MeanOut.copy();
+  WindowSD = SDOut.copy();
+  WindowFraction = FractionOut.copy();
 }
-//------------------------------------------------------------------------------
-
+//---------------------------------------------------------------------------------------
 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-// local relief
-// Calculates relief using a specified moving window.  Uses a neighbourhood
-// switch to select circular (1) vs square window (0)
-// SMM 15/11/2014
+// neighbourhood_statistics
+// Gets the neighbourhood statistics in one go. The raster_selection vector flags
+// the statistics wanted:
+//  0 mean
+//  1 standard deviation
+//  2 relief
+//  3 fraction of cells meeting the condition
+// Cells within a kernel radius of the edge of the DEM and nodata cells are
+// NoDataValue. Unselected statistics come back as a 1x1 blank raster.
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
-LSDRaster LSDRaster::neighbourhood_statistics_local_relief(float window_radius, int neighbourhood_switch)
+vector<LSDRaster> LSDRaster::neighbourhood_statistics(float window_radius,
+                     int neighbourhood_switch, vector<int> raster_selection,
+                     int condition_switch, float test_value)
 {
-  Array2D<float> SpatialReliefArray(NRows,NCols,NoDataValue);
-//   Array2D<float> StandardDeviationArray(NRows,NCols,NoDataValue);
+  Array2D<float> void_array(1,1,NoDataValue);
+  LSDRaster VOID(1,1,NoDataValue,NoDataValue,NoDataValue,NoDataValue,void_array,GeoReferencingStrings);
+
+  // missing entries in the selection are treated as not wanted
+  while (raster_selection.size() < 4)
+  {
+    raster_selection.push_back(0);
+  }
+  bool do_mean = (raster_selection[0] == 1);
+  bool do_SD = (raster_selection[1] == 1);
+  bool do_relief = (raster_selection[2] == 1);
+  bool do_fraction = (raster_selection[3] == 1);
 
   // catch if the supplied window radius is less than the data resolution and
   // set it to equal the data resolution - SWDG
@@ -10512,75 +10898,119 @@ LSDRaster LSDRaster::neighbourhood_statistics_local_relief(float window_radius,
 
   // Prepare kernel
   int kr = int(ceil(window_radius/DataResolution));  // Set radius of kernel
-  int kw=2*kr+1;                                     // width of kernel
-  Array2D<float> data_kernel(kw,kw,NoDataValue);
   Array2D<int> mask = create_mask(window_radius, neighbourhood_switch);
 
-  // Move window over DEM and extract neighbourhood pixels
   cout << "\n\tRunning neighbourhood statistics..." << endl;
   cout << "\t\tDEM size = " << NRows << " x " << NCols << endl;
 
-  float min_in_window;
-  float max_in_window;
-  float value;
-  float relief;
+  Array2D<float> Mean, SD, Fraction, Min, Max;
+  if (do_mean || do_SD || do_fraction)
+  {
+    calculate_window_moments(mask, condition_switch, test_value, Mean, SD, Fraction);
+  }
+  if (do_relief)
+  {
+    calculate_window_extrema(mask, Min, Max);
+  }
 
-  bool max_set, min_set;     // switches to state whether max and min have been set
+  // only keep cells whose whole window is on the DEM
+  Array2D<float> Relief((do_relief) ? NRows : 1, (do_relief) ? NCols : 1, NoDataValue);
   for(int i=0;i<NRows;++i)
   {
-    cout << "\tRow = " << i+1 << " / " << NRows << "    \r";
     for(int j=0;j<NCols;++j)
     {
-      // Avoid edges
-      if((i-kr < 0) || (i+kr+1 > NRows) || (j-kr < 0) || (j+kr+1 > NCols) || RasterData[i][j]==NoDataValue)
+      if((i-kr < 0) || (i+kr+1 > NRows) || (j-kr < 0) || (j+kr+1 > NCols)
+                    || RasterData[i][j]==NoDataValue)
       {
-        SpatialReliefArray[i][j] = NoDataValue;
+        if (do_mean || do_SD || do_fraction)
+        {
+          Mean[i][j] = NoDataValue;
+          SD[i][j] = NoDataValue;
+          Fraction[i][j] = NoDataValue;
+        }
       }
-      else
+      else if (do_relief)
       {
-        // reset max and min values
-        min_in_window = 100000;      // set to a large value to make sure it is reset lower
-        max_in_window = -100000;     // set to a small value
+        Relief[i][j] = Max[i][j]-Min[i][j];
+      }
+    }
+  }
 
-        // Sample DEM
-        for(int i_kernel=0;i_kernel<kw;++i_kernel)
-        {
-          for(int j_kernel=0;j_kernel<kw;++j_kernel)
-          {
-            value = RasterData[i-kr+i_kernel][j-kr+j_kernel];
-            // make sure it is in the mask and not nodata
-            if(value!=NoDataValue && mask[i_kernel][j_kernel]==1)
-            {
+  vector<LSDRaster> output_rasters(4,VOID);
+  if (do_mean)
+  {
+    output_rasters[0] = LSDRaster(NRows,NCols,XMinimum,YMinimum,DataResolution,
+                                  NoDataValue,Mean,GeoReferencingStrings);
+  }
+  if (do_SD)
+  {
+    output_rasters[1] = LSDRaster(NRows,NCols,XMinimum,YMinimum,DataResolution,
+                                  NoDataValue,SD,GeoReferencingStrings);
+  }
+  if (do_relief)
+  {
+    output_rasters[2] = LSDRaster(NRows,NCols,XMinimum,YMinimum,DataResolution,
+                                  NoDataValue,Relief,GeoReferencingStrings);
+  }
+  if (do_fraction)
+  {
+    output_rasters[3] = LSDRaster(NRows,NCols,XMinimum,YMinimum,DataResolution,
+                                  NoDataValue,Fraction,GeoReferencingStrings);
+  }
+  return output_rasters;
+}
+//---------------------------------------------------------------------------------------
 
-              // set min and max values
-              if (value > max_in_window)
-              {
-                max_in_window = value;
-                max_set = true;
-              }
-              if (value < min_in_window)
-              {
-                min_in_window = value;
-                min_set = true;
-              }
 
-            }
-          }
-        }
-        // Get relief
-        if(min_set && max_set)
-        {
-          relief = max_in_window-min_in_window;
-        }
-        SpatialReliefArray[i][j] = relief;
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// spatial_average
+// Calculates a spatial average using a specified moving window.  Uses a neighbourhood
+// switch to select circular (1) vs square window (0)
+// DTM 19/06/2014
+// Uses neighbourhood_statistics
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+LSDRaster LSDRaster::neighbourhood_statistics_spatial_average(float window_radius, int neighbourhood_switch)
+{
+  vector<int> raster_selection(4,0);
+  raster_selection[0] = 1;
+  vector<LSDRaster> stats = neighbourhood_statistics(window_radius, neighbourhood_switch,
+                                                     raster_selection, -1, NoDataValue);
+  return stats[0];
+}
 
-      }
-    }
-  }
 
-  LSDRaster SpatialRelief(NRows,NCols,XMinimum,YMinimum,DataResolution,
-                      NoDataValue,SpatialReliefArray,GeoReferencingStrings);
-  return SpatialRelief;
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// overloaded function to kick out 2 rasters -> local standard deviation & average
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+vector<LSDRaster> LSDRaster::neighbourhood_statistics_spatial_average_and_SD(float window_radius, int neighbourhood_switch)
+{
+  vector<int> raster_selection(4,0);
+  raster_selection[0] = 1;
+  raster_selection[1] = 1;
+  vector<LSDRaster> stats = neighbourhood_statistics(window_radius, neighbourhood_switch,
+                                                     raster_selection, -1, NoDataValue);
+  vector<LSDRaster> output_rasters;
+  output_rasters.push_back(stats[0]);
+  output_rasters.push_back(stats[1]);
+  return output_rasters;
+}
+//------------------------------------------------------------------------------
+
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// local relief
+// Calculates relief using a specified moving window.  Uses a neighbourhood
+// switch to select circular (1) vs square window (0)
+// SMM 15/11/2014
+// Uses neighbourhood_statistics
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+LSDRaster LSDRaster::neighbourhood_statistics_local_relief(float window_radius, int neighbourhood_switch)
+{
+  vector<int> raster_selection(4,0);
+  raster_selection[2] = 1;
+  vector<LSDRaster> stats = neighbourhood_statistics(window_radius, neighbourhood_switch,
+                                                     raster_selection, -1, NoDataValue);
+  return stats[2];
 }
 
 
@@ -10595,73 +11025,16 @@ LSDRaster LSDRaster::neighbourhood_statistics_local_relief(float window_radius,
 // 3 >=
 // 4 <
 // 5 <=
+// Uses neighbourhood_statistics
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 LSDRaster LSDRaster::neighbourhood_statistics_fraction_condition(float window_radius,
             int neighbourhood_switch, int condition_switch, float test_value)
 {
-  Array2D<float> FractionTrueArray(NRows,NCols,NoDataValue);
-
-  if (window_radius < DataResolution)
-  {
-    cout << "Supplied window radius: " << window_radius << " is less than the data resolution: " <<
-    DataResolution << ".\nWindow radius has been set to data resolution." << endl;
-    window_radius = DataResolution;
-  }
-
-  // Prepare kernel
-  int kr = int(ceil(window_radius/DataResolution));  // Set radius of kernel
-  int kw=2*kr+1;                                     // width of kernel
-  Array2D<float> data_kernel(kw,kw,NoDataValue);
-  Array2D<int> mask = create_mask(window_radius, neighbourhood_switch);
-
-  // Move window over DEM and extract neighbourhood pixels
-  cout << "\n\tRunning neighbourhood statistics..." << endl;
-  cout << "\t\tDEM size = " << NRows << " x " << NCols << endl;
-  float value;
-  float count = 0;
-  vector<float> data;
-
-  for(int i=0;i<NRows;++i)
-  {
-    cout << "\tRow = " << i+1 << " / " << NRows << "    \r";
-    for(int j=0;j<NCols;++j)
-    {
-      // Avoid edges
-      if((i-kr < 0) || (i+kr+1 > NRows) || (j-kr < 0) || (j+kr+1 > NCols)
-                    || RasterData[i][j]==NoDataValue)
-      {
-        FractionTrueArray[i][j] = NoDataValue;
-      }
-      else
-      {
-        // Sample DEM
-        for(int i_kernel=0;i_kernel<kw;++i_kernel)
-        {
-          for(int j_kernel=0;j_kernel<kw;++j_kernel)
-          {
-            value = RasterData[i-kr+i_kernel][j-kr+j_kernel];
-            if(value!=NoDataValue && mask[i_kernel][j_kernel]==1)
-            {
-              count = count + 1;
-              if(condition_switch == 0 && value == test_value) data.push_back(value);
-              if(condition_switch == 1 && value != test_value) data.push_back(value);
-              if(condition_switch == 2 && value > test_value) data.push_back(value);
-              if(condition_switch == 3 && value >= test_value) data.push_back(value);
-              if(condition_switch == 4 && value < test_value) data.push_back(value);
-              if(condition_switch == 5 && value <= test_value) data.push_back(value);
-            }
-          }
-        }
-        // Get stats
-        FractionTrueArray[i][j] = float(data.size())/count;
-        count = 0;
-        data.clear();
-      }
-    }
-  }
-  LSDRaster FractionTrue(NRows,NCols,XMinimum,YMinimum,DataResolution,
-                        NoDataValue,FractionTrueArray,GeoReferencingStrings);
-  return FractionTrue;
+  vector<int> raster_selection(4,0);
+  raster_selection[3] = 1;
+  vector<LSDRaster> stats = neighbourhood_statistics(window_radius, neighbourhood_switch,
+                                         raster_selection, condition_switch, test_value);
+  return stats[3];
 }
 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
@@ -10762,24 +11135,10 @@ LSDIndexRaster LSDRaster::Create_Mask(string Condition, float TestValue)
 //
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
-LSDRaster LSDRaster::ExtractByMask(LSDIndexRaster Mask)
+LSDRaster LSDRaster::ExtractByMask(LSDIndexRaster& Mask)
 {
-  // declare new array
-  Array2D<float> MaskedArray(NRows,NCols,NoDataValue);
-  Array2D<int> MaskArray = Mask.get_RasterData();
-
-  for (int i=0; i<NRows; ++i)
-  {
-    for (int j=0; j<NCols; ++j)
-    {
-      if (MaskArray[i][j] == 1)
-      {
-        MaskedArray[i][j] = RasterData[i][j];
-      }
-    }
-  }
-  LSDRaster MaskedRaster(NRows,NCols,XMinimum,YMinimum,DataResolution,NoDataValue,MaskedArray,GeoReferencingStrings);
-  return MaskedRaster;
+  LSDRasterExpression Expression(*this);
+  return Expression.extract_by_mask(Mask).evaluate();
 }
 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
@@ -12602,14 +12961,8 @@ LSDRaster LSDRaster::RemoveAbove(float Value){
 // values for the pixels that need to be converted to nodata
 // DTM 25/08/2015
 LSDRaster LSDRaster::apply_mask(LSDIndexRaster& mask){
-  Array2D<float> masked_data = RasterData.copy();
-  for(int i=0; i<NRows; ++i){
-    for(int j=0; j<NCols; ++j){
-  if(mask.get_data_element(i,j)==1) masked_data[i][j]=NoDataValue;
-    }
-  }
-  LSDRaster masked_raster(NRows,NCols,XMinimum,YMinimum,DataResolution,NoDataValue,masked_data,GeoReferencingStrings);
-  return masked_raster;
+  LSDRasterExpression Expression(*this);
+  return Expression.apply_mask(mask).evaluate();
 }
 
 
@@ -12641,7 +12994,7 @@ LSDIndexRaster LSDRaster::ConvertToBinary(int Value, int ndv){
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 LSDRaster LSDRaster::MergeRasters(LSDRaster& RasterToAdd)
 {
-	Array2D<float> SecondRasterData = RasterToAdd.get_RasterData();
+	const Array2D<float>& SecondRasterData = RasterToAdd.get_RasterData_ref();
 	Array2D<float> NewRasterData(NRows,NCols,NoDataValue);
 
 	for (int row = 0; row < NRows; row++)
@@ -12679,7 +13032,7 @@ LSDRaster LSDRaster::MergeRasters(LSDRaster& RasterToAdd)
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 void LSDRaster::OverwriteRaster(LSDRaster& RasterToAdd)
 {
-	Array2D<float> SecondRasterData = RasterToAdd.get_RasterData();
+	const Array2D<float>& SecondRasterData = RasterToAdd.get_RasterData_ref();
 
 	for (int row = 0; row < NRows; row++)
 	{
@@ -13089,4 +13442,302 @@ vector< vector<float> > LSDRaster::Sample_Along_Ridge(LSDRaster& Raster1, LSDRas
   return Vector_of_Samples;
 }
 
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// LSDRasterExpression
+// A lazy map algebra expression. The operations are stored when they are added
+// and carried out together, a row at a time, when the expression is evaluated.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// These add operations to the expression
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDRasterExpression::push_float_operation(int operation, LSDRaster& Other, float constant)
+{
+  if (Other.NRows != Source.NRows || Other.NCols != Source.NCols)
+  {
+    cout << "LSDRasterExpression: the raster operand does not have the same" << endl
+         << "dimensions as the source raster." << endl;
+    exit(EXIT_FAILURE);
+  }
+  Operations.push_back(operation);
+  OperandIndex.push_back(int(FloatOperands.size()));
+  Constants.push_back(constant);
+  FloatOperands.push_back(Other.RasterData);
+}
+
+void LSDRasterExpression::push_int_operation(int operation, LSDIndexRaster& Mask)
+{
+  if (Mask.get_NRows() != Source.NRows || Mask.get_NCols() != Source.NCols)
+  {
+    cout << "LSDRasterExpression: the mask does not have the same" << endl
+         << "dimensions as the source raster." << endl;
+    exit(EXIT_FAILURE);
+  }
+  Operations.push_back(operation);
+  OperandIndex.push_back(int(IntOperands.size()));
+  Constants.push_back(0);
+  IntOperands.push_back(Mask.get_RasterData());
+}
+
+LSDRasterExpression& LSDRasterExpression::multiply(LSDRaster& Other)
+{
+  push_float_operation(MULTIPLY, Other, 0);
+  return *this;
+}
+
+LSDRasterExpression& LSDRasterExpression::divide(LSDRaster& Other)
+{
+  push_float_operation(DIVIDE, Other, 0);
+  return *this;
+}
+
+LSDRasterExpression& LSDRasterExpression::add(LSDRaster& Other)
+{
+  push_float_operation(ADD, Other, 0);
+  return *this;
+}
+
+LSDRasterExpression& LSDRasterExpression::subtract(LSDRaster& Other)
+{
+  push_float_operation(SUBTRACT, Other, 0);
+  return *this;
+}
+
+LSDRasterExpression& LSDRasterExpression::scale(float multiplier)
+{
+  Operations.push_back(SCALE);
+  OperandIndex.push_back(-1);
+  Constants.push_back(multiplier);
+  return *this;
+}
+
+LSDRasterExpression& LSDRasterExpression::offset(float offset_value)
+{
+  Operations.push_back(OFFSET);
+  OperandIndex.push_back(-1);
+  Constants.push_back(offset_value);
+  return *this;
+}
+
+LSDRasterExpression& LSDRasterExpression::mask_to_nodata_using_threshold(float threshold,
+                                                       bool belowthresholdisnodata)
+{
+  Operations.push_back( (belowthresholdisnodata) ? THRESHOLD_BELOW : THRESHOLD_ABOVE);
+  OperandIndex.push_back(-1);
+  Constants.push_back(threshold);
+  return *this;
+}
+
+LSDRasterExpression& LSDRasterExpression::mask_to_nodata_using_threshold_using_other_raster(
+                   float threshold, bool belowthresholdisnodata, LSDRaster& MaskingRaster)
+{
+  int operation = (belowthresholdisnodata) ? OTHER_THRESHOLD_BELOW : OTHER_THRESHOLD_ABOVE;
+  push_float_operation(operation, MaskingRaster, threshold);
+  return *this;
+}
+
+LSDRasterExpression& LSDRasterExpression::apply_mask(LSDIndexRaster& Mask)
+{
+  push_int_operation(APPLY_MASK, Mask);
+  return *this;
+}
+
+LSDRasterExpression& LSDRasterExpression::extract_by_mask(LSDIndexRaster& Mask)
+{
+  push_int_operation(EXTRACT_BY_MASK, Mask);
+  return *this;
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// Applies the operations to a block of rows. Each row is loaded into a buffer
+// of values and a buffer of data flags, and every operation is a branch free
+// loop along the row, so the compiler can vectorise it. Cells that are already
+// nodata are still computed but are masked when the row is written, which is
+// cheaper than testing every cell in every operation.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDRasterExpression::evaluate_rows(int row_start, int row_end, Array2D<float>& out)
+{
+  int NCols = Source.NCols;
+  float NDV = float(Source.NoDataValue);
+  int n_operations = int(Operations.size());
+
+  vector<float> value_buffer(NCols);
+  vector<int> data_buffer(NCols);
+  float* value = &value_buffer[0];
+  int* is_data = &data_buffer[0];
+
+  for (int row = row_start; row < row_end; ++row)
+  {
+    const float* source_row = Source.RasterData[row];
+    #pragma omp simd
+    for (int col = 0; col < NCols; ++col)
+    {
+      value[col] = source_row[col];
+      is_data[col] = (source_row[col] != NDV);
+    }
+
+    for (int op = 0; op < n_operations; ++op)
+    {
+      float constant = Constants[op];
+      const float* other = NULL;
+      const int* mask = NULL;
+      if (Operations[op] == APPLY_MASK || Operations[op] == EXTRACT_BY_MASK)
+      {
+        mask = IntOperands[OperandIndex[op]][row];
+      }
+      else if (OperandIndex[op] >= 0)
+      {
+        other = FloatOperands[OperandIndex[op]][row];
+      }
+
+      switch (Operations[op])
+      {
+        case MULTIPLY:
+          #pragma omp simd
+          for (int col = 0; col < NCols; ++col)
+          {
+            is_data[col] &= (other[col] != NDV);
+            value[col] *= other[col];
+          }
+          break;
+        case DIVIDE:
+          #pragma omp simd
+          for (int col = 0; col < NCols; ++col)
+          {
+            int divisor_ok = (other[col] != NDV && other[col] != 0);
+            is_data[col] &= divisor_ok;
+            value[col] /= (divisor_ok) ? other[col] : 1.0f;
+          }
+          break;
+        case ADD:
+          #pragma omp simd
+          for (int col = 0; col < NCols; ++col)
+          {
+            is_data[col] &= (other[col] != NDV);
+            value[col] += other[col];
+          }
+          break;
+        case SUBTRACT:
+          #pragma omp simd
+          for (int col = 0; col < NCols; ++col)
+          {
+            is_data[col] &= (other[col] != NDV);
+            value[col] -= other[col];
+          }
+          break;
+        case SCALE:
+          #pragma omp simd
+          for (int col = 0; col < NCols; ++col)
+          {
+            value[col] *= constant;
+          }
+          break;
+        case OFFSET:
+          #pragma omp simd
+          for (int col = 0; col < NCols; ++col)
+          {
+            value[col] += constant;
+          }
+          break;
+        case THRESHOLD_BELOW:
+          #pragma omp simd
+          for (int col = 0; col < NCols; ++col)
+          {
+            is_data[col] &= !(value[col] <= constant);
+          }
+          break;
+        case THRESHOLD_ABOVE:
+          #pragma omp simd
+          for (int col = 0; col < NCols; ++col)
+          {
+            is_data[col] &= !(value[col] >= constant);
+          }
+          break;
+        case OTHER_THRESHOLD_BELOW:
+          #pragma omp simd
+          for (int col = 0; col < NCols; ++col)
+          {
+            is_data[col] &= !(other[col] != NDV && other[col] <= constant);
+          }
+          break;
+        case OTHER_THRESHOLD_ABOVE:
+          #pragma omp simd
+          for (int col = 0; col < NCols; ++col)
+          {
+            is_data[col] &= !(other[col] != NDV && other[col] >= constant);
+          }
+          break;
+        case APPLY_MASK:
+          #pragma omp simd
+          for (int col = 0; col < NCols; ++col)
+          {
+            is_data[col] &= (mask[col] != 1);
+          }
+          break;
+        case EXTRACT_BY_MASK:
+          #pragma omp simd
+          for (int col = 0; col < NCols; ++col)
+          {
+            is_data[col] &= (mask[col] == 1);
+          }
+          break;
+      }
+    }
+
+    float* out_row = out[row];
+    #pragma omp simd
+    for (int col = 0; col < NCols; ++col)
+    {
+      out_row[col] = (is_data[col]) ? value[col] : NDV;
+    }
+  }
+}
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// Evaluates the expression. Blocks of rows are spread over threads.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDRasterExpression::evaluate_into(LSDRaster& Target)
+{
+  if (Target.NRows != Source.NRows || Target.NCols != Source.NCols)
+  {
+    cout << "LSDRasterExpression::evaluate_into: the target raster does not have" << endl
+         << "the same dimensions as the source raster." << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  int NRows = Source.NRows;
+  int block_size = 32;
+  int n_blocks = (NRows + block_size - 1)/block_size;
+  Array2D<float>& out = Target.RasterData;
+
+  #pragma omp parallel for schedule(dynamic)
+  for (int block = 0; block < n_blocks; ++block)
+  {
+    int row_start = block*block_size;
+    int row_end = (row_start + block_size < NRows) ? row_start + block_size : NRows;
+    evaluate_rows(row_start, row_end, out);
+  }
+}
+
+LSDRaster LSDRasterExpression::evaluate()
+{
+  // The result takes the georeferencing of the source but gets its own data
+  // array. The copy constructor shares the source data until the new array is
+  // assigned, so nothing is copied.
+  LSDRaster Result(Source);
+  Result.RasterData = Array2D<float>(Source.NRows, Source.NCols);
+  evaluate_into(Result);
+  return Result;
+}
+
+void LSDRasterExpression::write_raster(string filename, string extension)
+{
+  LSDRaster Result = evaluate();
+  Result.write_raster(filename, extension);
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
 #endif
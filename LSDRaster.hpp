@@ -120,6 +120,8 @@ class LSDRaster
   // in the LSDRaster
   /// @brief Object to perform flow routing.
   friend class LSDFlowInfo;
+  /// @brief Object to evaluate map algebra expressions.
+  friend class LSDRasterExpression;
 
   /// @brief The create function. This is default and throws an error.
   LSDRaster()             { create(); }
@@ -188,6 +190,12 @@ class LSDRaster
   /// @return Raster values as a 2D Array.
   Array2D<float> get_RasterData() const { return RasterData.copy(); }
 
+  /// @brief Get a read only view of the raster values without copying them.
+  /// @details Use this rather than get_RasterData when the values are only
+  /// read: get_RasterData copies the whole array.
+  /// @return const reference to the raster values.
+  const Array2D<float>& get_RasterData_ref() const { return RasterData; }
+
   /// @brief Get the raw raster data, double format
   /// @author DAV
   Array2D<double> get_RasterData_dbl() const { return RasterData_dbl.copy(); }
@@ -205,7 +213,7 @@ class LSDRaster
   /// @return The raster value at the position (row, column).
   /// @author SMM
   /// @date 01/01/12
-  float get_data_element(int row, int column)  { return RasterData[row][column]; }
+  float get_data_element(int row, int column) const { return RasterData[row][column]; }
 
   /// @brief Sets the raster data at a specified location.
   /// @param row An integer, the X coordinate of the target cell.
@@ -218,6 +226,14 @@ class LSDRaster
   /// Assignment operator.
   LSDRaster& operator=(const LSDRaster& LSDR);
 
+  /// @brief Swaps the contents of this raster with another raster without
+  /// copying any data.
+  /// @details Assignment copies the whole raster. Use this when the raster
+  /// being assigned from is no longer needed, for example a result computed
+  /// into a local raster that should end up in one declared earlier.
+  /// @param Other the raster to swap with.
+  void swap(LSDRaster& Other);
+
   /// @brief Read a raster into memory from a file.
   ///
   /// The supported formats are .asc and .flt which are
@@ -413,6 +429,19 @@ class LSDRaster
   void get_lat_and_long_locations(int row, int col, double& lat,
                   double& longitude, LSDCoordinateConverterLLandUTM Converter);
 
+  /// @brief Gets the lat and long of many nodes at once
+  /// @detail The UTM information is parsed once and nodes that share a row
+  ///  are converted together, so this is much faster than calling
+  ///  get_lat_and_long_locations node by node. Nodes may come in any order.
+  /// @param rows the rows of the nodes
+  /// @param cols the cols of the nodes
+  /// @param lats the latitudes in decimal degrees (replaced by function)
+  /// @param longitudes the longitudes in decimal degrees (replaced by function)
+  /// @param Converter a converter object (from LSDShapeTools)
+  void get_lat_and_long_locations(vector<int>& rows, vector<int>& cols,
+                  vector<double>& lats, vector<double>& longitudes,
+                  LSDCoordinateConverterLLandUTM& Converter);
+
   /// @brief This returns vectors of all the easting and northing points in the raster
   ///  Used for interpolations
   /// @param Eastings a vector of easting coordinates. Will be replaced by method.
@@ -760,6 +789,35 @@ class LSDRaster
   LSDRaster hillshade();
   LSDRaster hillshade(float altitude, float azimuth, float z_factor);
 
+  /// @brief This computes several terrain derivatives from the 3x3 neighbourhood
+  /// in a single pass over the DEM.
+  ///
+  /// @details The first derivatives use the Horn (1981) 3x3 kernel, and the
+  /// curvature uses the Zevenbergen and Thorne (1987) second differences. Each
+  /// row is computed from three row pointers with no trig functions in the
+  /// inner loop. Rows are split among threads if the code is compiled with
+  /// OpenMP. Edge cells and nodata cells are NoDataValue.
+  ///
+  /// The raster_selection vector says which products you want (1 to compute, 0 to skip):
+  ///  - 0 -> Slope (gradient, m/m)
+  ///  - 1 -> Aspect (degrees clockwise from north)
+  ///  - 2 -> Curvature (Laplacian, 1/m)
+  ///  - 3 -> Hillshade, one raster for each altitude/azimuth pair
+  ///
+  /// The returned vector holds the slope, aspect and curvature at indices 0 to 2,
+  /// followed by one hillshade for each illumination. Products that are not
+  /// selected come back as a 1x1 blank raster.
+  /// @param raster_selection vector of ints flagging the products wanted
+  /// @param hs_altitudes altitudes of the illumination sources in degrees
+  /// @param hs_azimuths azimuths of the illumination sources in degrees. Must be the
+  ///  same length as hs_altitudes
+  /// @param z_factor Scaling factor between vertical and horizontal
+  /// @return vector of LSDRasters as described above
+  vector<LSDRaster> calculate_terrain_derivatives(vector<int> raster_selection,
+                                                  vector<float> hs_altitudes,
+                                                  vector<float> hs_azimuths,
+                                                  float z_factor);
+
   /// @brief This function generates a hillshade derivative raster using the
   /// algorithm outlined in Codilean (2006).
   ///
@@ -805,28 +863,62 @@ class LSDRaster
   /// @date Feb 2015
   Array2D<float> Shadows(int Azimuth, int ZenithAngle);
 
-  /// @brief This function generates a topographic shielding raster using the algorithm
-  /// outlined in Codilean (2006).
+  /// @brief This gets the slope (tangent of the elevation angle) of the horizon
+  /// seen from every cell when looking toward a given azimuth.
+  ///
+  /// @details The DEM is swept along parallel lines of cells running away from
+  /// the azimuth. Along each line an upper convex hull of the cells already passed
+  /// is kept on a stack: the hull vertex left on top after adding a cell is the
+  /// one that sets its horizon, so each line is done in linear time.
+  /// Following Shadows(), cells on the edge of the DEM neither cast nor receive
+  /// shadows, and nodata cells break the line.
+  /// @param Azimuth The azimuth of the line of sight in degrees (clockwise from north).
+  /// @return Array of horizon slopes. These are 0 where nothing rises above the
+  /// horizontal and NoDataValue in nodata cells.
+  Array2D<float> HorizonSlopes(float Azimuth);
+
+  /// @brief This function generates a topographic shielding raster following
+  /// Codilean (2006) and the angular weighting of Dunne et al. (1999).
   ///
   /// @details Creating a raster of values between 0 and 1 of shadowed cells which can
   /// be used as a scaling factor in Cosmo analysis.
   ///
-  /// Goes further than the original algorithm allowing a theoretical theta,
+  /// One horizon profile is computed for each azimuth with HorizonSlopes().
+  /// The cosmic ray flux is weighted by sin^m(theta)cos(theta) in the elevation
+  /// angle theta, which integrates to sin^(m+1)(horizon)/(m+1). The zenith
+  /// integral is therefore done analytically, not by casting a shadow for every
+  /// zenith angle. Azimuths are run in parallel if the code is compiled with
+  /// OpenMP.
+  ///
+  /// The result matches TopographicShieldingByShadowCasting() up to the error
+  /// of that function's zenith quadrature.
+  /// @param AzimuthStep Spacing of sampled azimuths in degrees.
+  /// @param ZenithStep Not used any more, since the zenith integral is analytic.
+  ///  It is kept so existing calls still work.
+  /// @pre AzimuthStep must be a factor of 360.
+  /// @author SWDG
+  /// @date 11/4/13
+  LSDRaster TopographicShielding(int AzimuthStep, int ZenithStep);
+  LSDRaster TopographicShielding();
+
+  /// @brief This is the original topographic shielding algorithm of Codilean (2006).
+  /// It casts a full shadow raster for every (azimuth, zenith) pair.
+  ///
+  /// @details Goes further than the original algorithm allowing a theoretical theta,
   /// phi pair of 1,1 to be supplied and although this will increase the
   /// computation time significantly, it is much faster than the original
   /// Avenue and VBScript implementations (This is probably no longer true
   /// now that we incorporate drop shadows (MDH, Feb 2015)).
   ///
-  /// Takes 2 ints, representing the theta, phi paring required.
   /// Codilean (2006) used 5,5 as the standard values, but in reality values of
-  /// 10,15 are often preferred to save processing time.
-  /// @param theta_step Spacing of sampled theta values.
-  /// @param phi_step Spacing of sampled phi values.
-  /// @pre phi_step must be a factor of 360.
+  /// 10,15 are often preferred to save processing time. It is much slower than
+  /// TopographicShielding() and is kept as a reference.
+  /// @param AzimuthStep Spacing of sampled azimuths.
+  /// @param ZenithStep Spacing of sampled zenith angles.
+  /// @pre AzimuthStep must be a factor of 360.
   /// @author SWDG
   /// @date 11/4/13
-  LSDRaster TopographicShielding(int theta_step, int phi_step);
-  LSDRaster TopographicShielding();
+  LSDRaster TopographicShieldingByShadowCasting(int AzimuthStep, int ZenithStep);
 
   /// @brief Surface polynomial fitting and extraction of topographic metrics
   ///
@@ -1409,6 +1501,12 @@ class LSDRaster
   /// @date 18/4/13
   LSDRaster FreemanMDFlow();
 
+  /// @brief Overloaded FreemanMDFlow that uses cells already sorted by
+  /// get_descending_elevation_order, so one sort can be shared between routines.
+  /// @param cell_order row major indices of the non nodata cells, highest first.
+  /// @return LSDRaster of flow area.
+  LSDRaster FreemanMDFlow(vector<int>& cell_order);
+
   /// @brief Route flow from one source pixel using FreemanMDFlow.  Adapted from SWDG's
   /// code above.
   /// @param i_source -> the row index of the source pixel
@@ -1451,6 +1549,12 @@ class LSDRaster
   /// @date 18/4/13
   LSDRaster QuinnMDFlow();
 
+  /// @brief Overloaded QuinnMDFlow that uses cells already sorted by
+  /// get_descending_elevation_order.
+  /// @param cell_order row major indices of the non nodata cells, highest first.
+  /// @return LSDRaster of flow area.
+  LSDRaster QuinnMDFlow(vector<int>& cell_order);
+
   /// @brief Generate a flow area raster using a multi 2-direction algorithm.
   ///
   /// @details Computes the proportion of all downslope flows for each cell in the input
@@ -1466,6 +1570,28 @@ class LSDRaster
   /// @date 02/08/13
   LSDRaster M2DFlow();
 
+  /// @brief Overloaded M2DFlow that uses cells already sorted by
+  /// get_descending_elevation_order.
+  /// @param cell_order row major indices of the non nodata cells, highest first.
+  /// @return LSDRaster of flow area.
+  LSDRaster M2DFlow(vector<int>& cell_order);
+
+  /// @brief Gets the row major indices of the non nodata cells sorted from
+  /// highest to lowest elevation, using a parallel radix sort.
+  /// @details Cells of equal elevation stay in row major order.
+  /// @return vector of row major cell indices.
+  vector<int> get_descending_elevation_order();
+
+  /// @brief The engine behind the multiple flow direction routines. Routes the
+  /// area of each cell in cell_order to its downslope neighbours.
+  /// @details Edge cells are not routed. Freeman and Quinn cells with no
+  /// downslope neighbour keep their area.
+  /// @param cell_order row major indices of cells, highest first.
+  /// @param MFD_method 0 Freeman, 1 Quinn, 2 M2D.
+  /// @param area the starting area of each cell, updated in place.
+  void route_multiple_flow_directions(vector<int>& cell_order, int MFD_method,
+                                      Array2D<float>& area);
+
 //  // channel head identification
 //  /// @brief This function is used to predict channel head locations based on the method proposed by Pelletier (2013).
 //  ///
@@ -1553,7 +1679,7 @@ class LSDRaster
   /// @return LSDRaster of basin areas.
   /// @author SWDG
   /// @date 20/11/2013
-  LSDRaster BasinArea(LSDIndexRaster Basins);
+  LSDRaster BasinArea(LSDIndexRaster& Basins);
 
   /// @brief Convert a basin, given by a basin ID, into a chain of xy coordinates for
   /// fast plotting of vector basin outlines.
@@ -1566,7 +1692,7 @@ class LSDRaster
   /// @param BasinOfInterest integer of the basin ID to be converted.
   /// @author SWDG
   /// @date 21/11/2013
-  void GetBasinVector(LSDIndexRaster Basins, int BasinOfInterest);
+  void GetBasinVector(LSDIndexRaster& Basins, int BasinOfInterest);
 
   /// @brief Punch basins out of an LSDRaster to create DEMs of a single catchment.
   ///
@@ -1578,7 +1704,7 @@ class LSDRaster
   /// @return Vector of output filenames.
   /// @author SWDG
   /// @date 27/8/13
-  vector<LSDRaster> BasinPuncher(vector<int> basin_ids, LSDIndexRaster BasinArray);
+  vector<LSDRaster> BasinPuncher(vector<int> basin_ids, LSDIndexRaster& BasinArray);
 
 
   /// @brief Cookie cut a raster using a smaller raster.
@@ -1588,7 +1714,7 @@ class LSDRaster
   /// @return LSDRaster of the data cut to the other ratser's shape.
   /// @author SWDG
   /// @date 06/07/15
-  LSDRaster CookieCutRaster(LSDRaster Cutter);
+  LSDRaster CookieCutRaster(LSDRaster& Cutter);
 
   /// @brief Collect all basin average metrics into a single file.
   ///
@@ -1698,7 +1824,7 @@ class LSDRaster
   /// @param step Integer value used to thin the data, 1 preserves all the data, 2 keeps every second point and so on.
   /// @author SWDG
   /// @date 20/1/14
-  void GetVectors(LSDRaster Magnitude, LSDRaster Direction, string output_file, int step);
+  void GetVectors(LSDRaster& Magnitude, LSDRaster& Direction, string output_file, int step);
 
   // Smoothing tools
   //Nonlocal Means Filtering - Default values following Baudes et al [2005]
@@ -1781,6 +1907,23 @@ class LSDRaster
   ///  @date Feb 2015
   LSDRaster PeronaMalikFilter(int timesteps, float percentile_for_lambda, float dt);
 
+  ///  @brief Smooths an array with a Gaussian kernel using two separable 1D
+  ///  passes, one along the rows and one down the columns.
+  ///
+  ///  @details Nodata cells and cells beyond the edge of the raster are left
+  ///  out of the weighted sums, so the result matches the full 2D kernel in
+  ///  GaussianFilter. The work arrays are overwritten, which lets repeated
+  ///  filtering reuse them rather than allocating new arrays.
+  ///  @param Data the array to smooth, NRows x NCols.
+  ///  @param sigma the standard deviation of the kernel.
+  ///  @param kr the halfwidth of the kernel in cells.
+  ///  @param Smoothed NRows x NCols array that gets the smoothed values.
+  ///  @param RowValues NRows x NCols work array.
+  ///  @param RowWeights NRows x NCols work array.
+  void separable_gaussian_smooth(Array2D<float>& Data, float sigma, int kr,
+                                 Array2D<float>& Smoothed, Array2D<float>& RowValues,
+                                 Array2D<float>& RowWeights);
+
 
   //D-infinity tools
 
@@ -1801,7 +1944,10 @@ class LSDRaster
 
   /// @brief Main function for generating a D-infinity flow area raster after Tarboton (1997).
   ///
-  /// @details Calls the recurisve D_infAccum function to get flow area for each pixel.
+  /// @details Cells are accumulated in topological order using a queue over the
+  /// inflow counts (Kahn's algorithm), so there is no recursion. With more than one
+  /// thread, independent drainage regions are accumulated in parallel; the result
+  /// does not depend on the number of threads.
   /// Returns flow area in pixels.
   ///
   /// Code is ported and optimised from a Java implementation of the algorithm
@@ -1812,30 +1958,7 @@ class LSDRaster
   /// @return LSDRaster of D-inf flow areas in pixels.
   /// @author SWDG
   /// @date 26/07/13
-  LSDRaster D_inf_FlowArea(Array2D<float> FlowDir_array);
-
-  /// @brief Recursive function to calculate accumulating area for a given pixel.
-  ///
-  /// @details Called by the driver for every cell which has no contributing
-  /// cells - eg the highest points on the landscape. Avoids the need to flatten
-  /// and sort the DEM as required in the original Tarboton (1997)
-  /// implementation. For more detail on the recursive algorithm following
-  /// channels see Mark (1998) "Network Models in Geomorphology".
-  ///
-  /// Code is ported and optimised from a Java implementation of the algorithm
-  /// supplied under the GNU GPL licence through WhiteBox GAT:
-  /// http://www.uoguelph.ca/~hydrogeo/Whitebox/ and provides identical results
-  /// to the whitebox tool.
-  ///
-  /// @param i Row index of the target cell.
-  /// @param j Column index of the target cell.
-  /// @param CountGrid Array showing the number of cells flowing into each cell.
-  /// @param Flowarea_Raster Array of the flow areas which is populated using this function.
-  /// @param FlowDir_array Array of Flowdirections generated by D_inf_FlowDir().
-  /// @author SWDG
-  /// @date 26/07/13
-  void D_infAccum(int i, int j, Array2D<float> CountGrid, Array2D<float> Flowarea_Raster,
-                  Array2D<float> FlowDir_array);
+  LSDRaster D_inf_FlowArea(Array2D<float>& FlowDir_array);
 
   /// @brief Wrapper Function to create a D-infinity flow area raster with one function call.
   /// @return LSDRaster of D-inf flow areas in pixels.
@@ -1868,7 +1991,7 @@ class LSDRaster
   /// @return LSDIndexRaster of catchment
   /// @author MDH (after SWDG)
   /// @date 26/08/14
-  LSDIndexRaster D_inf_watershed(LSDRaster D_inf_FlowDir, int PourRow, int PourCol);
+  LSDIndexRaster D_inf_watershed(LSDRaster& D_inf_FlowDir, int PourRow, int PourCol);
 
   /// @brief Function to calculate the topographic index, a moisture
   /// distribution indicator
@@ -1925,6 +2048,73 @@ class LSDRaster
   /// @date 20/06/2014
   Array2D<int> create_mask(float window_radius,  int neighbourhood_switch);
 
+  /// @brief Breaks a neighbourhood mask into non-overlapping rectangles.
+  ///
+  /// @details Consecutive mask rows with the same runs of 1s are merged, so a
+  /// square mask is one rectangle and a circular mask has one rectangle per change
+  /// in the row half width. Rectangles sharing the same rows are adjacent in the
+  /// output. All offsets are inclusive and relative to the centre of the mask.
+  /// @param mask a square mask of odd width, e.g. from create_mask
+  /// @param row_start the first row offset of each rectangle (replaced)
+  /// @param row_end the last row offset of each rectangle (replaced)
+  /// @param col_start the first column offset of each rectangle (replaced)
+  /// @param col_end the last column offset of each rectangle (replaced)
+  void get_mask_rectangles(Array2D<int>& mask, vector<int>& row_start, vector<int>& row_end,
+                           vector<int>& col_start, vector<int>& col_end);
+
+  /// @brief Gets the minimum and maximum of the data in a moving window.
+  ///
+  /// @details Each rectangle of the mask is done with a van Herk/Gil-Werman running
+  /// max down the columns and then along the rows, so the cost per cell does not
+  /// depend on the window size. Nodata is ignored and windows are clipped at the
+  /// edge of the raster; cells with no data in their window are NoDataValue.
+  /// @param mask a square mask of odd width, e.g. from create_mask
+  /// @param WindowMin the minimum in the window (replaced)
+  /// @param WindowMax the maximum in the window (replaced)
+  void calculate_window_extrema(Array2D<int>& mask, Array2D<float>& WindowMin,
+                                Array2D<float>& WindowMax);
+
+  /// @brief Gets the mean, standard deviation and fraction of cells meeting a
+  /// condition in a moving window.
+  ///
+  /// @details Column sums for each set of mask rows are updated as the window moves
+  /// down a row, and the row sums come from prefix sums of these, so the cost per
+  /// cell scales with the number of mask rectangles rather than the window area.
+  /// Nodata is ignored and windows are clipped at the edge of the raster; cells
+  /// with no data in their window are NoDataValue. The standard deviation is the
+  /// population standard deviation.
+  /// @param mask a square mask of odd width, e.g. from create_mask
+  /// @param condition_switch the condition, as in neighbourhood_statistics_fraction_condition.
+  ///  Any other value means no cells meet the condition.
+  /// @param test_value the value to test against in the condition
+  /// @param WindowMean the mean in the window (replaced)
+  /// @param WindowSD the standard deviation in the window (replaced)
+  /// @param WindowFraction the fraction of cells meeting the condition (replaced)
+  void calculate_window_moments(Array2D<int>& mask, int condition_switch, float test_value,
+                                Array2D<float>& WindowMean, Array2D<float>& WindowSD,
+                                Array2D<float>& WindowFraction);
+
+  /// @brief Gets several neighbourhood statistics in one go.
+  ///
+  /// @details The second argument (neighbourhood_switch) specifies the neighbourhood type:
+  ///   0 Square neighbourhood
+  ///   1 Circular window
+  /// The raster_selection vector says which statistics you want (1 to compute, 0 to skip):
+  ///  - 0 -> mean
+  ///  - 1 -> standard deviation
+  ///  - 2 -> relief
+  ///  - 3 -> fraction of cells meeting the condition
+  /// Cells within a kernel radius of the edge and nodata cells are NoDataValue.
+  /// Statistics that are not selected come back as a 1x1 blank raster.
+  /// @param float window_radius -> radius of neighbourhood
+  /// @param int neighbourhood_switch -> see above
+  /// @param raster_selection vector of ints flagging the statistics wanted
+  /// @param int condition_switch -> as in neighbourhood_statistics_fraction_condition
+  /// @param float test_value -> the value to test against in the conditional statement
+  /// @return vector of 4 LSDRasters as described above
+  vector<LSDRaster> neighbourhood_statistics(float window_radius, int neighbourhood_switch,
+                    vector<int> raster_selection, int condition_switch, float test_value);
+
   /// @brief gets mean value for specified circular neighbourhood
   ///
   /// @details The second argument (neighbourhood_switch) specifies the neighbourhood type:
@@ -2080,7 +2270,7 @@ class LSDRaster
   /// @return masked LSDRaster
   /// @author MDH
   /// @date 27/08/2014
-  LSDRaster ExtractByMask(LSDIndexRaster Mask);
+  LSDRaster ExtractByMask(LSDIndexRaster& Mask);
 
   /// @brief method to locate channel pixels outlined by Lashermes.
   ///
@@ -2323,4 +2513,131 @@ protected:
 
 };
 
+
+///@brief A lazy map algebra expression built from LSDRasters.
+///@details Operations are recorded as they are added and are only carried out
+/// when the expression is evaluated. All of the operations are then done in a
+/// single pass over the grid, a row at a time, so a chain of operations does
+/// not create a temporary raster for each step. Nodata follows the rules of the
+/// MapAlgebra and masking functions in LSDRaster: a cell becomes nodata as soon
+/// as any of its operands is nodata, and stays nodata.
+///
+/// The expression holds references to the data of the rasters it uses, so
+/// they must not be changed before the expression is evaluated.
+///
+/// For example, a discharge weighted erosion rate in m/yr from a slope
+/// raster, a discharge raster and a mask could be computed with:\n
+/// LSDRaster E = LSDRasterExpression(Slope).multiply(Discharge).scale(K)\n
+///              .apply_mask(Mask).evaluate();
+class LSDRasterExpression
+{
+  public:
+  /// @brief Start an expression with the values of a raster.
+  /// @details The copy constructor of LSDRaster is used so the expression
+  /// shares the data of the source raster rather than copying it.
+  /// @param SourceRaster the raster that gives the starting values and the
+  /// georeferencing of the result.
+  LSDRasterExpression(LSDRaster& SourceRaster) : Source(SourceRaster)  { }
+
+  /// @brief Multiply by another raster.
+  /// @param Other raster of the same dimensions.
+  /// @return this expression, so calls can be chained.
+  LSDRasterExpression& multiply(LSDRaster& Other);
+
+  /// @brief Divide by another raster. Cells where Other is zero become nodata.
+  /// @param Other raster of the same dimensions.
+  /// @return this expression, so calls can be chained.
+  LSDRasterExpression& divide(LSDRaster& Other);
+
+  /// @brief Add another raster.
+  /// @param Other raster of the same dimensions.
+  /// @return this expression, so calls can be chained.
+  LSDRasterExpression& add(LSDRaster& Other);
+
+  /// @brief Subtract another raster.
+  /// @param Other raster of the same dimensions.
+  /// @return this expression, so calls can be chained.
+  LSDRasterExpression& subtract(LSDRaster& Other);
+
+  /// @brief Multiply every data cell by a constant.
+  /// @param multiplier the constant.
+  /// @return this expression, so calls can be chained.
+  LSDRasterExpression& scale(float multiplier);
+
+  /// @brief Add a constant to every data cell.
+  /// @param offset_value the constant.
+  /// @return this expression, so calls can be chained.
+  LSDRasterExpression& offset(float offset_value);
+
+  /// @brief Set cells to nodata where the current value of the expression is
+  /// at or below (or at or above) a threshold.
+  /// @param threshold the threshold value.
+  /// @param belowthresholdisnodata true to remove values <= threshold, false
+  /// to remove values >= threshold.
+  /// @return this expression, so calls can be chained.
+  LSDRasterExpression& mask_to_nodata_using_threshold(float threshold, bool belowthresholdisnodata);
+
+  /// @brief Set cells to nodata where another raster is at or below (or at or
+  /// above) a threshold. Nodata in the other raster does not mask anything.
+  /// @param threshold the threshold value.
+  /// @param belowthresholdisnodata true to remove values <= threshold, false
+  /// to remove values >= threshold.
+  /// @param MaskingRaster raster of the same dimensions.
+  /// @return this expression, so calls can be chained.
+  LSDRasterExpression& mask_to_nodata_using_threshold_using_other_raster(float threshold,
+                                   bool belowthresholdisnodata, LSDRaster& MaskingRaster);
+
+  /// @brief Set cells to nodata where the mask is 1, as in LSDRaster::apply_mask.
+  /// @param Mask index raster of the same dimensions.
+  /// @return this expression, so calls can be chained.
+  LSDRasterExpression& apply_mask(LSDIndexRaster& Mask);
+
+  /// @brief Keep only the cells where the mask is 1, as in LSDRaster::ExtractByMask.
+  /// @param Mask index raster of the same dimensions.
+  /// @return this expression, so calls can be chained.
+  LSDRasterExpression& extract_by_mask(LSDIndexRaster& Mask);
+
+  /// @brief Evaluate the expression in one pass over the grid.
+  /// @return LSDRaster with the georeferencing of the source raster.
+  LSDRaster evaluate();
+
+  /// @brief Evaluate the expression into a raster that already has the same
+  /// dimensions, overwriting its data without allocating a new array. The
+  /// target may be one of the rasters in the expression.
+  /// @param Target the raster to overwrite.
+  void evaluate_into(LSDRaster& Target);
+
+  /// @brief Evaluate the expression and write the result to file.
+  /// @param filename the file prefix.
+  /// @param extension the file extension (bil, asc or flt).
+  void write_raster(string filename, string extension);
+
+  protected:
+  /// the operations in the order they are applied
+  enum expression_operation { MULTIPLY, DIVIDE, ADD, SUBTRACT, SCALE, OFFSET,
+                              THRESHOLD_BELOW, THRESHOLD_ABOVE, OTHER_THRESHOLD_BELOW,
+                              OTHER_THRESHOLD_ABOVE, APPLY_MASK, EXTRACT_BY_MASK };
+
+  /// The source raster.
+  LSDRaster Source;
+  /// The operations, in order.
+  vector<int> Operations;
+  /// The index of each operation's operand, either in FloatOperands or
+  /// IntOperands, or -1 if it has no raster operand.
+  vector<int> OperandIndex;
+  /// The constant used by each operation (0 if it does not use one).
+  vector<float> Constants;
+  /// The data of the raster operands. These share memory with the rasters.
+  vector< Array2D<float> > FloatOperands;
+  /// The data of the mask operands. These share memory with the masks.
+  vector< Array2D<int> > IntOperands;
+
+  /// @brief Adds an operation with a raster operand.
+  void push_float_operation(int operation, LSDRaster& Other, float constant);
+  /// @brief Adds an operation with a mask operand.
+  void push_int_operation(int operation, LSDIndexRaster& Mask);
+  /// @brief Applies all the operations to the rows row_start to row_end-1 of out.
+  void evaluate_rows(int row_start, int row_end, Array2D<float>& out);
+};
+
 #endif
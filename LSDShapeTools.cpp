@@ -1122,6 +1122,86 @@ void LSDCoordinateConverterLLandUTM::UTMtoLL(int eId, double UTMNorthing, double
 }
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// Converts a row of UTM points that share a northing to lat long.
+// Everything that depends only on the northing (the footpoint latitude,
+// the radii of curvature and the trig terms) is computed once for the row;
+// only the easting polynomial is evaluated per node. The expressions are
+// the same as in UTMtoLL so the results match it exactly.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+void LSDCoordinateConverterLLandUTM::UTMtoLL(int eId, double UTMNorthing,
+                                             vector<double>& UTMEastings,
+                                             int UTMZone, bool isNorth,
+                                             vector<double>& Lats, vector<double>& Longs)
+{
+  double k0 = UTM_K0;
+  double a = WGS84_A;
+  double eccSquared = UTM_E2;
+  double eccPrimeSquared;
+  double e1 = (1-sqrt(1-eccSquared))/(1+sqrt(1-eccSquared));
+  double N1, T1, C1, R1, D, M;
+  double LongOrigin;
+  double mu, phi1Rad;
+  double x, y;
+  double Lat, Long;
+
+  y = UTMNorthing;
+  if(not isNorth)
+  {
+    //remove 10,000,000 meter offset used for southern hemisphere
+    y -= 10000000.0;
+  }
+
+  //+3 puts origin in middle of zone
+  LongOrigin = (UTMZone - 1)*6 - 180 + 3;
+  eccPrimeSquared = (eccSquared)/(1-eccSquared);
+
+  // the terms that only depend on the northing
+  M = y / k0;
+  mu = M/(a*(1-eccSquared/4-3*eccSquared*eccSquared/64
+                   -5*eccSquared*eccSquared*eccSquared/256));
+
+  phi1Rad = mu + ((3*e1/2-27*e1*e1*e1/32)*sin(2*mu)
+                        + (21*e1*e1/16-55*e1*e1*e1*e1/32)*sin(4*mu)
+                        + (151*e1*e1*e1/96)*sin(6*mu));
+
+  double sin_phi1 = sin(phi1Rad);
+  double tan_phi1 = tan(phi1Rad);
+  double cos_phi1 = cos(phi1Rad);
+  N1 = a/sqrt(1-eccSquared*sin_phi1*sin_phi1);
+  T1 = tan_phi1*tan_phi1;
+  C1 = eccPrimeSquared*cos_phi1*cos_phi1;
+  R1 = a*(1-eccSquared)/pow(1-eccSquared*sin_phi1*sin_phi1, 1.5);
+
+  double lat_factor = N1*tan_phi1/R1;
+  double D4_coeff = 5+3*T1+10*C1-4*C1*C1-9*eccPrimeSquared;
+  double D6_coeff = 61+90*T1+298*C1+45*T1*T1-252*eccPrimeSquared-3*C1*C1;
+  double D3_coeff = 1+2*T1+C1;
+  double D5_coeff = 5-2*C1+28*T1-3*C1*C1+8*eccPrimeSquared+24*T1*T1;
+
+  int n_nodes = int(UTMEastings.size());
+  Lats.resize(n_nodes);
+  Longs.resize(n_nodes);
+  for(int i = 0; i<n_nodes; i++)
+  {
+    //remove 500,000 meter offset for longitude
+    x = UTMEastings[i] - 500000.0;
+    D = x/(N1*k0);
+
+    Lat = phi1Rad - (lat_factor
+                         *(D*D/2
+                           -D4_coeff*D*D*D*D/24
+                           +D6_coeff*D*D*D*D*D*D/720));
+    Lats[i] = Lat * DEGREES_PER_RADIAN;
+
+    Long = ((D-D3_coeff*D*D*D/6
+                 +D5_coeff*D*D*D*D*D/120)
+                / cos_phi1);
+    Longs[i] = LongOrigin + Long * DEGREES_PER_RADIAN;
+  }
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
 
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 // Converts from british national grid to lat long
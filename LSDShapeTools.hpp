@@ -328,6 +328,21 @@ class LSDCoordinateConverterLLandUTM
     void UTMtoLL(int eId, double Northing, double Easting, int Zone, bool isNorth,
              double& Lat, double& Long);
 
+    /// @brief converts a row of UTM coords sharing a single northing to lat-long
+    /// @detail The footpoint latitude and the terms that depend on it are
+    ///  computed once, so converting a whole raster row costs one set of
+    ///  trigonometric calls rather than one per node. Results are identical
+    ///  to calling UTMtoLL node by node.
+    /// @param eID the ellipsoid ID (see UTMtoLL)
+    /// @param Northing in metres, shared by every node.
+    /// @param Eastings vector of eastings in metres.
+    /// @param Zone the UTM zone.
+    /// @param isNorth is a boolean that states if the map is in the northern hemisphere
+    /// @param Lats the latitudes in decimal degrees. Replaced by the function
+    /// @param Longs the longitudes in decimal degrees. Replaced by the function
+    void UTMtoLL(int eId, double Northing, vector<double>& Eastings, int Zone,
+             bool isNorth, vector<double>& Lats, vector<double>& Longs);
+
 
     /// @brief converts British national grid to WGS84 lat-long
     void BNGtoLL(double Northing, double Easting, double& Lat, double& Long);
@@ -62,6 +62,11 @@
 #include <cmath>
 #include <ctime>
 #include <map>
+#include <limits>
+#include <cstring>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "TNT/tnt.h"
 #include "TNT/jama_lu.h"
 #include "LSDStatsTools.hpp"
@@ -140,6 +145,47 @@ float ran3(long *idum)
 #undef FAC
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// The minimal standard generator of Park and Miller, using Schrage's method
+// to avoid overflow. Unlike ran3 the whole state is in the seed, so each
+// stream is independent of the others. 
+// The seed must be between 1 and 2147483646. Returns a number in (0,1).
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+double park_miller_uniform(long& seed)
+{
+  const long IA = 16807;
+  const long IM = 2147483647;
+  const long IQ = 127773;
+  const long IR = 2836;
+  
+  long k = seed/IQ;
+  seed = IA*(seed-k*IQ)-IR*k;
+  if (seed < 0)
+  {
+    seed += IM;
+  }
+  return double(seed)/double(IM);
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+// A standard normal random number using the Marsaglia polar method on the
+// Park and Miller generator. Only one of the pair of numbers is used.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+double standard_normal_random(long& seed)
+{
+  double u,v,s;
+  do
+  {
+    u = 2.0*park_miller_uniform(seed)-1.0;
+    v = 2.0*park_miller_uniform(seed)-1.0;
+    s = u*u+v*v;
+  } while (s >= 1.0 || s == 0.0);
+  
+  return v*sqrt(-2.0*log(s)/s);
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
+
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-
 //These return the keys from a map
 vector<string> extract_keys(map<string, int> input_map)
@@ -609,6 +655,68 @@ float Get_Maximum(vector<float>& y_data, float ndv)
   }
   return max;
 }
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// Running maximum over the window [i+window_start, i+window_end] of each element
+// using the van Herk/Gil-Werman algorithm. The (padded) data is split into blocks
+// the length of the window; any window then straddles at most two blocks, so its
+// maximum is the larger of a suffix maximum of the first block and a prefix
+// maximum of the second.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+void sliding_window_max(vector<float>& data, int window_start, int window_end,
+                        vector<float>& window_max)
+{
+  int n_data = int(data.size());
+  window_max.resize(n_data);
+  if (n_data == 0)
+  {
+    return;
+  }
+  if (window_end < window_start)
+  {
+    cout << "sliding_window_max: the window end is before the window start" << endl;
+    exit(EXIT_FAILURE);
+  }
+
+  float lowest = -numeric_limits<float>::max();
+  int window_length = window_end-window_start+1;
+
+  // pad the data so every window lies inside the padded vector
+  int pad_left = (window_start < 0) ? -window_start : 0;
+  int pad_right = (window_end > 0) ? window_end : 0;
+  int n_padded = n_data+pad_left+pad_right;
+  vector<float> prefix_max(n_padded,lowest);
+  vector<float> suffix_max(n_padded,lowest);
+  for (int i = 0; i<n_data; i++)
+  {
+    prefix_max[i+pad_left] = data[i];
+    suffix_max[i+pad_left] = data[i];
+  }
+
+  // maxima from the start of each block and from the end of each block
+  for (int i = 1; i<n_padded; i++)
+  {
+    if (i%window_length != 0 && prefix_max[i-1] > prefix_max[i])
+    {
+      prefix_max[i] = prefix_max[i-1];
+    }
+  }
+  for (int i = n_padded-2; i>=0; i--)
+  {
+    if ((i+1)%window_length != 0 && suffix_max[i+1] > suffix_max[i])
+    {
+      suffix_max[i] = suffix_max[i+1];
+    }
+  }
+
+  for (int i = 0; i<n_data; i++)
+  {
+    float from_left = suffix_max[i+window_start+pad_left];
+    float from_right = prefix_max[i+window_end+pad_left];
+    window_max[i] = (from_left > from_right) ? from_left : from_right;
+  }
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
 // gets the standard deviation from a population of data
 //=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
@@ -4863,6 +4971,91 @@ void matlab_float_sort_descending(vector<float>& unsorted, vector<float>& sorted
   matlab_float_reorder(unsorted,index_map,sorted);
 }
 
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+// Gets the indices of the data sorted from highest to lowest value, skipping
+// nodata. The float bits are mapped to unsigned keys that sort in the same
+// order as the values (then flipped for descending order) and sorted with an
+// LSD radix sort of 3 passes of 11 bits. Each pass counts the digits of
+// contiguous chunks of the data in parallel and scatters each chunk to its own
+// offsets, so the sort is stable whatever the number of threads.
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+void radix_sort_descending(vector<float>& values, float ndv, vector<int>& index_map)
+{
+  int n_values = int(values.size());
+  vector<unsigned int> keys;
+  index_map.clear();
+  keys.reserve(n_values);
+  index_map.reserve(n_values);
+  for (int i = 0; i<n_values; i++)
+  {
+    if (values[i] != ndv)
+    {
+      unsigned int bits;
+      memcpy(&bits,&values[i],sizeof(float));
+      bits = (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+      keys.push_back(~bits);
+      index_map.push_back(i);
+    }
+  }
+
+  int n_keys = int(keys.size());
+  int n_buckets = 2048;
+  int n_chunks = 1;
+#ifdef _OPENMP
+  n_chunks = omp_get_max_threads();
+#endif
+  int chunk_size = (n_keys+n_chunks-1)/n_chunks;
+  vector<unsigned int> keys_buffer(n_keys);
+  vector<int> index_buffer(n_keys);
+
+  for (int pass = 0; pass<3; pass++)
+  {
+    int shift = 11*pass;
+    vector<int> offsets(n_chunks*n_buckets,0);
+
+    #pragma omp parallel for schedule(static,1)
+    for (int chunk = 0; chunk<n_chunks; chunk++)
+    {
+      int first = chunk*chunk_size;
+      int last = min(n_keys,first+chunk_size);
+      int* counts = &offsets[chunk*n_buckets];
+      for (int i = first; i<last; i++)
+      {
+        counts[(keys[i] >> shift) & 2047]++;
+      }
+    }
+
+    // each chunk writes its part of a bucket after the earlier chunks
+    int total = 0;
+    for (int bucket = 0; bucket<n_buckets; bucket++)
+    {
+      for (int chunk = 0; chunk<n_chunks; chunk++)
+      {
+        int count = offsets[chunk*n_buckets+bucket];
+        offsets[chunk*n_buckets+bucket] = total;
+        total += count;
+      }
+    }
+
+    #pragma omp parallel for schedule(static,1)
+    for (int chunk = 0; chunk<n_chunks; chunk++)
+    {
+      int first = chunk*chunk_size;
+      int last = min(n_keys,first+chunk_size);
+      int* positions = &offsets[chunk*n_buckets];
+      for (int i = first; i<last; i++)
+      {
+        int position = positions[(keys[i] >> shift) & 2047]++;
+        keys_buffer[position] = keys[i];
+        index_buffer[position] = index_map[i];
+      }
+    }
+    keys.swap(keys_buffer);
+    index_map.swap(index_buffer);
+  }
+}
+//=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=
+
 // This implementation is O(n), but also uses O(n) extra memory
 void matlab_int_reorder(std::vector<int> & unordered, std::vector<size_t> const & index_map, std::vector<int> & ordered)
 {
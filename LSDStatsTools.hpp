@@ -87,6 +87,14 @@ float get_range_ignore_ndv(Array2D<float>& data, float ndv);
 float get_range_from_vector(vector<float>& y_data, float ndv);
 float Get_Minimum(vector<float>& y_data, float ndv);
 float Get_Maximum(vector<float>& y_data, float ndv);
+
+// Running maximum over a window [i+window_start, i+window_end] for every element i
+// of data, using the van Herk/Gil-Werman algorithm (3 comparisons per element
+// regardless of window length). Parts of the window that fall off the ends of the
+// vector are ignored; if the whole window is off the vector the result is -FLT_MAX.
+// Get a running minimum by passing in the negated data.
+void sliding_window_max(vector<float>& data, int window_start, int window_end,
+                        vector<float>& window_max);
 float get_durbin_watson_statistic(vector<float> residuals);
 float get_standard_deviation(vector<float>& y_data, float mean);
 float get_standard_error(vector<float>& y_data, float standard_deviation);
@@ -335,6 +343,16 @@ float calculate_RMSE_from_residuals(vector<float>& residuals);
 
 // a random number generator
 float ran3( long *idum );
+
+// A random number generator that keeps its state in the seed rather than in
+// static variables, so independent streams can be used at the same time.
+// This is the minimal standard generator of Park and Miller. 
+// The seed must be between 1 and 2147483646. Returns a number in (0,1).
+double park_miller_uniform(long& seed);
+
+// A standard normal random number from the Park and Miller generator, 
+// using the Marsaglia polar method.
+double standard_normal_random(long& seed);
 // Randomly sample from a vector without replacement DTM 21/04/2014
 vector<float> sample_without_replacement(vector<float> population_vector, int N);
 vector<int> sample_without_replacement(vector<int> population_vector, int N);
@@ -421,6 +439,11 @@ void matlab_float_sort_descending(vector<float>& unsorted, vector<float>& sorted
 void matlab_int_sort(vector<int>& unsorted, vector<int>& sorted, vector<size_t>& index_map); // added 27/11/13 SWDG
 void matlab_int_reorder(std::vector<int> & unordered, std::vector<size_t> const & index_map, std::vector<int> & ordered);
 
+// Gets the indices of the data sorted from highest to lowest value, skipping
+// nodata, with a stable, parallel LSD radix sort on the float bits (3 passes of
+// 11 bits). Equal values keep their original order.
+void radix_sort_descending(vector<float>& values, float ndv, vector<int>& index_map);
+
 
 
 //Get vector of unique values in an input array of ints
@@ -252,15 +252,19 @@ int main (int nNumberofArgs,char *argv[])
     // now get rid of the low and high values
     float lower_threshold = this_float_map["minimum_elevation"];
     float upper_threshold = this_float_map["maximum_elevation"];
+    // both thresholds are applied in a single pass
+    LSDRasterExpression SeaMask(start_raster);
     bool belowthresholdisnodata = true;
-    LSDRaster Flooded = start_raster.mask_to_nodata_using_threshold(lower_threshold,belowthresholdisnodata);
+    SeaMask.mask_to_nodata_using_threshold(lower_threshold,belowthresholdisnodata);
     belowthresholdisnodata = false;
-    topography_raster = Flooded.mask_to_nodata_using_threshold(upper_threshold,belowthresholdisnodata);
+    SeaMask.mask_to_nodata_using_threshold(upper_threshold,belowthresholdisnodata);
+    LSDRaster Masked = SeaMask.evaluate();
+    topography_raster.swap(Masked);
   }
   else
   {
     LSDRaster start_raster((DATA_DIR+DEM_ID), raster_ext);
-    topography_raster = start_raster;
+    topography_raster.swap(start_raster);
   }
   cout << "Got the dem: " <<  DATA_DIR+DEM_ID << endl;
 
@@ -284,13 +288,16 @@ int main (int nNumberofArgs,char *argv[])
   if ( this_bool_map["raster_is_filled"] )
   {
     cout << "You have chosen to use a filled raster." << endl;
-    filled_topography = topography_raster;
+    // neither raster is changed, so they can share their data
+    LSDRaster Shared(topography_raster);
+    filled_topography.swap(Shared);
   }
   else
   {
     cout << "Let me fill that raster for you, the min slope is: "
          << this_float_map["min_slope_for_fill"] << endl;
-    filled_topography = topography_raster.fill(this_float_map["min_slope_for_fill"]);
+    LSDRaster Filled = topography_raster.fill(this_float_map["min_slope_for_fill"]);
+    filled_topography.swap(Filled);
   }
 
   if (this_bool_map["print_fill_raster"])
@@ -321,8 +328,16 @@ int main (int nNumberofArgs,char *argv[])
   cout << "\t Calculating flow accumulation (in pixels)..." << endl;
   LSDIndexRaster FlowAcc = FlowInfo.write_NContributingNodes_to_LSDIndexRaster();
 
-  cout << "\t Converting to flow area..." << endl;
-  LSDRaster DrainageArea = FlowInfo.write_DrainageArea_to_LSDRaster();
+  // the drainage area, flow distance and the chi coordinate (based on 
+  // drainage area) are calculated in a single pass through the stack
+  cout << "\t Calculating flow area, flow distance and chi..." << endl;
+  vector<int> flow_metric_selection(5,0);
+  flow_metric_selection[1] = 1;     // drainage area
+  flow_metric_selection[2] = 1;     // flow distance
+  flow_metric_selection[4] = 1;     // chi
+  vector<LSDRaster> flow_metrics = FlowInfo.calculate_flow_metric_rasters(filled_topography,
+                                       movern, A_0, thresh_area_for_chi, flow_metric_selection);
+  LSDRaster DrainageArea = flow_metrics[1];
 
   if (this_bool_map["print_DrainageArea_raster"])
   {
@@ -330,9 +345,8 @@ int main (int nNumberofArgs,char *argv[])
     DrainageArea.write_raster(DA_raster_name,raster_ext);
   }
 
-  // calcualte the distance from outlet
-  cout << "\t Calculating flow distance..." << endl;
-  LSDRaster DistanceFromOutlet = FlowInfo.distance_from_outlet();
+  // the distance from outlet
+  LSDRaster DistanceFromOutlet = flow_metrics[2];
 
   cout << "\t Loading Sources..." << endl;
   cout << "\t Source file is... " << CHeads_file << endl;
@@ -538,8 +552,10 @@ int main (int nNumberofArgs,char *argv[])
     VolumePrecipitation.raster_multiplier(dx*dx);
 
     // discharge accumulates this precipitation
-    Discharge = FlowInfo.upslope_variable_accumulator(VolumePrecipitation);
-    chi_coordinate = FlowInfo.get_upslope_chi_from_all_baselevel_nodes(movern,A_0,thresh_area_for_chi,Discharge);
+    LSDRaster Accumulated = FlowInfo.upslope_variable_accumulator(VolumePrecipitation);
+    Discharge.swap(Accumulated);
+    LSDRaster Chi = FlowInfo.get_upslope_chi_from_all_baselevel_nodes(movern,A_0,thresh_area_for_chi,Discharge);
+    chi_coordinate.swap(Chi);
 
     if(this_bool_map["print_discharge_raster"])
     {
@@ -557,7 +573,9 @@ int main (int nNumberofArgs,char *argv[])
   }
   else
   {
-    chi_coordinate = FlowInfo.get_upslope_chi_from_all_baselevel_nodes(movern,A_0,thresh_area_for_chi);
+    // flow_metrics is used again below, so share its data rather than swap it
+    LSDRaster Shared(flow_metrics[4]);
+    chi_coordinate.swap(Shared);
     // Print the chi raster
     if(this_bool_map["print_chi_coordinate_raster"])
     {
@@ -569,7 +587,7 @@ int main (int nNumberofArgs,char *argv[])
   // This bit prints a chi coordinate raster even if you are using precipitation
   if(this_bool_map["print_chi_coordinate_raster"] && this_bool_map["use_precipitation_raster_for_chi"] && this_bool_map["print_chi_no_discharge"])
   {
-    LSDRaster NoDischargeChi = FlowInfo.get_upslope_chi_from_all_baselevel_nodes(movern,A_0,thresh_area_for_chi);
+    LSDRaster NoDischargeChi = flow_metrics[4];
     string chi_coord_string = OUT_DIR+OUT_ID+"_chi_coord";
     NoDischargeChi.write_raster(chi_coord_string,raster_ext);
   }